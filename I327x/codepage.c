@@ -1102,3 +1102,29 @@ void set_codepage(char *name)
     */
 }
 
+
+/*--------------------------------------------------------------------------*/
+/* Look up a code page by name, NULL if there is no such code page          */
+/*--------------------------------------------------------------------------*/
+CPCONV *find_codepage(char *name)
+{
+    CPCONV *cp;
+
+    for(cp = cpconv; cp->name && strcasecmp(cp->name,name); cp++);
+
+    if( cp->name == NULL || (strcasecmp(cp->name,"user") == 0 && user_in_use == FALSE) )
+        return NULL;
+    return cp;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Bulk translation of a buffer through a 256 byte table (in may be out)    */
+/*--------------------------------------------------------------------------*/
+void translate_buffer(const unsigned char *tab, const unsigned char *in,
+                      unsigned char *out, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        out[i] = tab[in[i]];
+}
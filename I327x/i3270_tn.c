@@ -38,6 +38,8 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
 #include <ifaddrs.h>
 #include "i327x.h"
 #include "codepage.c"
@@ -61,7 +63,72 @@ extern FILE *T_trace;                      /* Terminal trace file fd */
 int write_socket( int fd, const void *_ptr, int nbytes );
 int send_packet (int csock, BYTE *buf, int len, char *caption);
 
-int double_up_iac (BYTE *buf, int len);
+
+__thread struct IO3270 *io_pool = NULL;    /* Free 3270 input blocks, per thread */
+
+/*-------------------------------------------------------------------*/
+/* Take a 3270 input block from the pool for a connecting LU         */
+/*-------------------------------------------------------------------*/
+struct IO3270 *io_get(void) {
+   struct IO3270 *io;
+
+   if ((io = io_pool) != NULL) {
+      io_pool = io->next;
+   } else {
+      io = malloc(sizeof(struct IO3270));
+      io->inpbuf = malloc(IOBUF_MIN);
+      io->inpbufsz = IOBUF_MIN;
+      io->outbuf = NULL;
+      io->outbufsz = 0;
+   }
+   io->next = NULL;
+   io->inpbufl = 0;
+   io->outbufl = 0;
+   return io;
+}
+
+/*-------------------------------------------------------------------*/
+/* Return the 3270 input block of a disconnected LU to the pool      */
+/*-------------------------------------------------------------------*/
+void io_put(struct IO3270 *io) {
+   if (io == NULL)
+      return;
+   io->next = io_pool;
+   io_pool = io;
+}
+
+/*-------------------------------------------------------------------*/
+/* Make room for len bytes in a 3270 input buffer                    */
+/* Returns the usable size, at most BUFLEN_3270.                     */
+/*-------------------------------------------------------------------*/
+uint32_t io_room(struct IO3270 *io, uint32_t len) {
+   uint32_t size = io->inpbufsz;
+   uint8_t *buf;
+
+   if (len > BUFLEN_3270)
+      len = BUFLEN_3270;
+   if (len <= size)
+      return size;
+   while (size < len)
+      size *= 2;
+   if (size > BUFLEN_3270)
+      size = BUFLEN_3270;
+   if ((buf = realloc(io->inpbuf, size)) == NULL)
+      return io->inpbufsz;
+   io->inpbuf = buf;
+   io->inpbufsz = size;
+   return size;
+}
+
+/*-------------------------------------------------------------------*/
+/* Monotonic time in usec, for the response time monitor             */
+/*-------------------------------------------------------------------*/
+uint64_t tn_usec(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 /*-------------------------------------------------------------------*/
 /* Check if there is read activiy on the socket                      */
@@ -106,39 +173,115 @@ void connect_message(int sfd, int na, int flag) {
 }
 
 /*-------------------------------------------------------------------*/
-/* Subroutine to double up any IAC bytes in the data stream.         */
-/* Returns the new length after inserting extra IAC bytes.           */
+/* Subroutine to send 3270 data to a TN3270 client.                  */
+/* IAC bytes are doubled while the data is copied into the output    */
+/* buffer of the LU, so every byte is looked at once. The segments   */
+/* of a chain are gathered there and go out in one write when the    */
+/* last one (eor) has been added, followed by IAC EOR. Should a      */
+/* chain grow beyond BUFLEN_3270, what is gathered is sent first.    */
+/* Returns 0, or -1 if the client could not be written to.           */
 /*-------------------------------------------------------------------*/
-int double_up_iac (BYTE *Dbuf, int len) {
-   int m, n, x, newlen;
+int send_3270 (struct LU327x *lu, BYTE *data, uint32_t len, int eor) {
+   struct IO3270 *io = lu->io;
+   uint32_t need, size, run, x = 0;
+   BYTE  *p, *q, *buf;
+   int    rc = 0;
 
-   /* Count the number of IAC bytes in the data */
-   for (x = 0, n = 0; n < len; n++)
-      if (Dbuf[n] == IAC) x++;
+   if ((lu->lu_fd < 1) || (io == NULL))
+      return -1;
 
-   /* Exit if nothing to do */
-   if (x == 0) return len;
+   /* Worst case every byte is an IAC, plus IAC EOR */
+   need = io->outbufl + 2 * len + 2;
+   if ((io->outbufl > 0) && (need > BUFLEN_3270)) {
+      if (write_socket(lu->lu_fd, io->outbuf, io->outbufl) <= 0)
+         rc = -1;
+      io->outbufl = 0;
+      need = 2 * len + 2;
+   }
+   if (need > io->outbufsz) {
+      for (size = (io->outbufsz ? io->outbufsz : IOBUF_MIN); size < need; size *= 2) ;
+      if ((buf = realloc(io->outbuf, size)) == NULL)
+         return -1;
+      io->outbuf = buf;
+      io->outbufsz = size;
+   }
 
-   /* Insert extra IAC bytes backwards from the end of the buffer */
-   newlen = len + x;
-   if (Tdbg_flag == ON) {
-      fprintf(T_trace, "CC1: %d IAC bytes added, newlen = %d\n",
-                      x, newlen);
+   /* Copy the runs between IAC bytes, doubling each IAC */
+   for (p = data; p < data + len; p += run) {
+      q = memchr(p, IAC, data + len - p);
+      run = (q != NULL) ? (uint32_t)(q - p + 1) : (uint32_t)(data + len - p);
+      memcpy(&io->outbuf[io->outbufl], p, run);
+      io->outbufl += run;
+      if (q != NULL) {
+         io->outbuf[io->outbufl++] = IAC;
+         x++;
+      }
    }
-   for (n = newlen, m = len; n > m; ) {
-      Dbuf[--n] = Dbuf[--m];
-      if (Dbuf[n] == IAC) Dbuf[--n] = IAC;
+   if ((x > 0) && (Tdbg_flag == ON))
+      fprintf(T_trace, "CC1: %d IAC bytes added, newlen = %d\n", x, io->outbufl);
+   if (!eor)
+      return rc;
+
+   io->outbuf[io->outbufl++] = IAC;
+   io->outbuf[io->outbufl++] = EOR_MARK;
+   if (write_socket(lu->lu_fd, io->outbuf, io->outbufl) <= 0) {
+      printf("\nsend to client failed");
+      rc = -1;
    }
-   return newlen;
-}  /* End of function double_up_iac */
+   io->outbufl = 0;
+   return rc;
+}  /* End of function send_3270 */
 
 unsigned char host_to_guest (unsigned char byte)
 {
     return (unsigned char)codepage_conv->h2g[(unsigned int)byte];
 }
 
+/*-------------------------------------------------------------------*/
+/* Code page per PU (or cluster) and LU number, NULL uses the        */
+/* controller's code page                                            */
+/*-------------------------------------------------------------------*/
+static CPCONV *lu_cpconv[MAXSNAPU][MAXLU];
+
+/*-------------------------------------------------------------------*/
+/* Select a code page, -cp [[{pp}.]{xx}=]{codepage}: of the          */
+/* controller, or of LU xx of PU pp (default 0) only. Returns 0, or  */
+/* -1 for an unknown code page, PU or LU number.                     */
+/*-------------------------------------------------------------------*/
+int tn_codepage(char *arg) {
+   char *eq = strchr(arg, '=');
+   char *dot = strchr(arg, '.');
+   CPCONV *cp = find_codepage((eq == NULL) ? arg : eq + 1);
+   int punum = 0, lunum;
+
+   if (cp == NULL)
+      return -1;
+   if (eq == NULL) {                                   /* {codepage}: all LU's   */
+      codepage_conv = cp;
+      return 0;
+   }
+   if ((dot != NULL) && (dot < eq)) {
+      punum = strtol(arg, NULL, 16);                   /* {pp}.{xx}={codepage}   */
+      lunum = strtol(dot + 1, NULL, 16);
+   } else
+      lunum = strtol(arg, NULL, 16);                   /* {xx}={codepage}, PU 0  */
+   if ((punum < 0) || (punum >= MAXSNAPU) || (lunum < 0) || (lunum >= MAXLU))
+      return -1;
+   lu_cpconv[punum][lunum] = cp;
+   return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/* Give LU lunum of PU punum its translate tables at IML             */
+/*-------------------------------------------------------------------*/
+void lu_codepage(struct LU327x *lu, int punum, int lunum) {
+   CPCONV *cp = (lu_cpconv[punum][lunum] != NULL) ? lu_cpconv[punum][lunum] : codepage_conv;
+
+   lu->h2g = cp->h2g;
+}
+
 uint8_t * prt_host_to_guest( const uint8_t *psinbuf, uint8_t *psoutbuf,
-                             const u_int ilength ) {
+                             const u_int ilength, const uint8_t *h2g ) {
    u_int count;
    int pad = FALSE;
 
@@ -147,10 +290,10 @@ uint8_t * prt_host_to_guest( const uint8_t *psinbuf, uint8_t *psoutbuf,
           pad = TRUE;
       if ( !pad ) {
           psoutbuf[count] = isprint      (psinbuf[count]) ?
-                            host_to_guest(psinbuf[count]) :
-                            host_to_guest('.');
+                            h2g[psinbuf[count]] :
+                            h2g['.'];
       } else {
-          psoutbuf[count] = host_to_guest(' ');
+          psoutbuf[count] = h2g[' '];
       }
    }
    return psoutbuf;
@@ -200,63 +343,43 @@ int  rc;                                /* Return code               */
 }  // end function send_packet */
 
 /*-------------------------------------------------------------------*/
-/* SUBROUTINE TO RECEIVE A DATA PACKET FROM THE CLIENT               */
-/* This subroutine receives bytes from the client.  It stops when    */
-/* the receive buffer is full, or when the last two bytes received   */
-/* consist of the IAC character followed by a specified delimiter.   */
-/* If zero bytes are received, this means the client has closed the  */
-/* connection, and this is treated as an error.                      */
+/* SUBROUTINE TO START TELNET NEGOTIATION WITH A NEW CLIENT          */
+/* Sends DO TERMINAL_TYPE; the rest of the negotiation is driven by  */
+/* tn_negotiate each time the client socket becomes readable, so a   */
+/* slow or silent client never holds up the other sessions.          */
 /* Input:                                                            */
-/*      csock is the socket number                                   */
-/*      buf points to area to receive data                           */
-/*      reqlen is the number of bytes requested                      */
-/*      delim is the delimiter character (0=no delimiter)            */
-/* Output:                                                           */
-/*      buf is updated with data received                            */
-/*      The return value is the number of bytes received, or         */
-/*      -1 if an error occurred.                                     */
+/*      csock   Socket number for client connection                  */
+/* Return value:                                                     */
+/*      Negotiation block, or NULL if the client could not be        */
+/*      started (the socket is then closed)                          */
 /*-------------------------------------------------------------------*/
-static int
-recv_packet (int csock, BYTE *buf, int reqlen, BYTE delim) {
-int   rc = 0;                           /* Return code               */
-int   rcvlen = 0;                       /* Length of data received   */
-
-   while (rcvlen < reqlen) {
-
-      rc = recv (csock, buf + rcvlen, reqlen - rcvlen, 0);
-
-      if (rc < 0) {
-         // WRMSG(HHC01034, "E", "recv()", strerror(HSO_errno));
-         return -1;
-      }
-
-      if (rc == 0) {
-         // TNSDEBUG1("console: DBG004: Connection closed by client\n");
-         return -1;
-      }
-
-      rcvlen += rc;
+struct TNNEG *tn_accept (int csock)
+{
+struct TNNEG *tn;                       /* Negotiation block         */
+static BYTE do_term[] = { IAC, DO, TERMINAL_TYPE };
 
-      if (delim != '\0' && rcvlen >= 2
-         && buf[rcvlen-2] == IAC && buf[rcvlen-1] == delim)
-      break;
+   tn = calloc (1, sizeof(struct TNNEG));
+   if (tn == NULL || send_packet (csock, do_term, sizeof(do_term),
+                                  "IAC DO TERMINAL_TYPE") < 0) {
+      free (tn);
+      close (csock);
+      return NULL;
    }
+   tn->fd = csock;
+   tn->state = TN_WILLTERM;
+   tn->deadline = time(NULL) + TN_TIMEOUT;
+   return tn;
 
-   // TNSDEBUG2("console: DBG005: Packet received length=%d\n", rcvlen);
-   // packet_trace (buf, rcvlen);
-
-   return rcvlen;
-
-}  // end function recv_packet
-
+}  // end function tn_accept
 
 /*-------------------------------------------------------------------*/
-/* SUBROUTINE TO RECEIVE A PACKET AND COMPARE WITH EXPECTED VALUE    */
+/* SUBROUTINE TO COMPARE RECEIVED BYTES WITH EXPECTED VALUE          */
+/* Return value:                                                     */
+/*      1=matched and removed from the buffer, 0=not all received    */
+/*      yet, -1=mismatch                                             */
 /*-------------------------------------------------------------------*/
 static int
-expect (int csock, BYTE *expected, int len, char *caption) {
-int     rc;                             /* Return code               */
-BYTE    buf[512];                       /* Receive buffer            */
+tn_expect (struct TNNEG *tn, BYTE *expected, int len) {
 
 #if defined( OPTION_MVS_TELNET_WORKAROUND )
 
@@ -268,38 +391,32 @@ BYTE    buf[512];                       /* Receive buffer            */
 
 #endif // defined( OPTION_MVS_TELNET_WORKAROUND )
 
-   // UNREFERENCED(caption);
-
-   rc = recv_packet (csock, buf, len, 0);
-   if (rc < 0)
-      return -1;
+   if (tn->len < len)
+      return 0;
 
 #if defined( OPTION_MVS_TELNET_WORKAROUND )
    /* BYPASS TCP/IP FOR MVS WHICH DOES NOT COMPLY TO RFC1576 */
    if (1
-      && memcmp(buf, expected, len) != 0
+      && memcmp(tn->buf, expected, len) != 0
       && !(len == sizeof(will_bin)
       && memcmp(expected, will_bin, len) == 0
-      && memcmp(buf, do_bin, len) == 0)
+      && memcmp(tn->buf, do_bin, len) == 0)
    )
 #else
-   if (memcmp(buf, expected, len) != 0)
+   if (memcmp(tn->buf, expected, len) != 0)
 #endif // defined( OPTION_MVS_TELNET_WORKAROUND )
-   {
-      // TNSDEBUG2("console: DBG006: Expected %s\n", caption);
       return -1;
-   }
-   // TNSDEBUG2("console: DBG007: Received %s\n", caption);
 
-   return 0;
+   tn->len -= len;
+   memmove (tn->buf, tn->buf + len, tn->len);
+   return 1;
 
-}  // end function expect
+}  // end function tn_expect
 
 /*-------------------------------------------------------------------*/
-/* SUBROUTINE TO NEGOTIATE TELNET PARAMETERS                         */
-/* This subroutine negotiates the terminal type with the client      */
-/* and uses the terminal type to determine whether the client        */
-/* is to be supported as a 3270 display console or as a 1052/3215    */
+/* SUBROUTINE TO PROCESS THE TERMINAL TYPE REPLY                     */
+/* The terminal type determines whether the client is to be          */
+/* supported as a 3270 display console or as a 1052/3215             */
 /* printer-keyboard console.                                         */
 /*                                                                   */
 /* Valid display terminal types are "IBM-NNNN", "IBM-NNNN-M", and    */
@@ -315,234 +432,214 @@ BYTE    buf[512];                       /* Receive buffer            */
 /* Terminal types whose first four characters are not "IBM-" are     */
 /* handled as printer-keyboard consoles using telnet line mode.      */
 /*                                                                   */
-/* Input:                                                            */
-/*      csock   Socket number for client connection                  */
-/* Output:                                                           */
-/*      class   D=3270 display console, K=printer-keyboard console   */
-/*              P=3270 printer                                       */
-/*      model   3270 model indicator (2,3,4,5,X)                     */
-/*      extatr  3270 extended attributes (Y,N)                       */
-/*      devn    Requested device number, or FF=any device number     */
 /* Return value:                                                     */
-/*      0=negotiation successful, -1=negotiation error               */
+/*      1=processed, 0=reply not complete yet, -1=negotiation error  */
 /*-------------------------------------------------------------------*/
-int negotiate(int csock, BYTE *class, BYTE *model, BYTE *extatr, BYTE *devn)
-{
-int    rc;                              /* Return code               */
+static int
+tn_termtype (struct TNNEG *tn) {
+int    rc;                              /* Length of the reply       */
+int    skip = 0;                        /* Length of WILL NAWS       */
 char  *termtype;                        /* Pointer to terminal type  */
 char  *s;                               /* String pointer            */
-BYTE   c;                               /* Trailing character        */
-BYTE   devnum;                          /* Requested device number   */
-BYTE   buf[512];                        /* Telnet negotiation buffer */
-static BYTE do_term[] = { IAC, DO, TERMINAL_TYPE };
-static BYTE will_term[] = { IAC, WILL, TERMINAL_TYPE };
-static BYTE req_type[] = { IAC, SB, TERMINAL_TYPE, SEND, IAC, SE };
+unsigned int devnum;                    /* Requested device number   */
+BYTE  *reply = NULL;                    /* Next negotiation packet   */
+int    replyl = 0;                      /* Length of next packet     */
 static BYTE type_is[] = { IAC, SB, TERMINAL_TYPE, IS };
 static BYTE do_eor[] = { IAC, DO, EOR, IAC, WILL, EOR };
-static BYTE will_eor[] = { IAC, WILL, EOR, IAC, DO, EOR };
-static BYTE do_bin[] = { IAC, DO, BINARY, IAC, WILL, BINARY };
-static BYTE will_bin[] = { IAC, WILL, BINARY, IAC, DO, BINARY };
-#if 0
-static BYTE do_tmark[] = { IAC, DO, TIMING_MARK };
-static BYTE will_tmark[] = { IAC, WILL, TIMING_MARK };
-static BYTE wont_sga[] = { IAC, WONT, SUPPRESS_GA };
-static BYTE dont_sga[] = { IAC, DONT, SUPPRESS_GA };
-#endif
 static BYTE wont_echo[] = { IAC, WONT, ECHO_OPTION };
-static BYTE dont_echo[] = { IAC, DONT, ECHO_OPTION };
 static BYTE will_naws[] = { IAC, WILL, NAWS };
 
-   /* Perform terminal-type negotiation */
-   rc = send_packet (csock, do_term, sizeof(do_term),
-                       "IAC DO TERMINAL_TYPE");
-   if (rc < 0) return -1;
-
-   rc = expect (csock, will_term, sizeof(will_term),
-                       "IAC WILL TERMINAL_TYPE");
-   if (rc < 0) return -1;
-
-   /* Request terminal type */
-   rc = send_packet (csock, req_type, sizeof(req_type),
-                       "IAC SB TERMINAL_TYPE SEND IAC SE");
-   if (rc < 0) return -1;
-
-   rc = recv_packet (csock, buf, sizeof(buf)-2, SE);
-   if (rc < 0) return -1;
+   /* Wait until the reply up to IAC SE has been received */
+   for (rc = 2; rc <= tn->len; rc++)
+      if (tn->buf[rc-2] == IAC && tn->buf[rc-1] == SE)
+         break;
+   if (rc > tn->len)
+      return 0;
 
    /* Ignore Negotiate About Window Size */
    if (rc >= (int)sizeof(will_naws) &&
-      memcmp (buf, will_naws, sizeof(will_naws)) == 0)
-   {
-      memmove(buf, &buf[sizeof(will_naws)], (rc - sizeof(will_naws)));
-      rc -= sizeof(will_naws);
-   }
+      memcmp (tn->buf, will_naws, sizeof(will_naws)) == 0)
+      skip = sizeof(will_naws);
 
-   if (rc < (int)(sizeof(type_is) + 2)
-         || memcmp(buf, type_is, sizeof(type_is)) != 0
-         || buf[rc-2] != IAC || buf[rc-1] != SE) {
-//    TNSDEBUG2("console: DBG008: Expected IAC SB TERMINAL_TYPE IS\n");
+   if (rc - skip < (int)(sizeof(type_is) + 2)
+         || memcmp(tn->buf + skip, type_is, sizeof(type_is)) != 0)
       return -1;
-   }
-   buf[rc-2] = '\0';
-   termtype = (char *)(buf + sizeof(type_is));
-// TNSDEBUG2("console: DBG009: Received IAC SB TERMINAL_TYPE IS %s IAC SE\n",
-// termtype);
+   tn->buf[rc-2] = '\0';
+   termtype = (char *)(tn->buf + skip + sizeof(type_is));
 
    /* Check terminal type string for device name suffix */
    s = strchr (termtype, '@');
 
    if (s != NULL && sscanf (s, "@%02x", &devnum) == 1) {
-      *devn = devnum;
+      tn->devn = devnum;
    }
    else {
-      *devn = 0xFF;
+      tn->devn = 0xFF;
    }
 
    // Test for non-display terminal type
    if (memcmp(termtype, "IBM-", 4) != 0) {
-#if 0
-      /* Perform line mode negotiation */
-      rc = send_packet (csock, do_tmark, sizeof(do_tmark),
-                          "IAC DO TIMING_MARK");
-      if (rc < 0) return -1;
-
-      rc = expect (csock, will_tmark, sizeof(will_tmark),
-                          "IAC WILL TIMING_MARK");
-      if (rc < 0) return 0;
-
-      rc = send_packet (csock, wont_sga, sizeof(wont_sga),
-                          "IAC WONT SUPPRESS_GA");
-      if (rc < 0) return -1;
-
-      rc = expect (csock, dont_sga, sizeof(dont_sga),
-                          "IAC DONT SUPPRESS_GA");
-      if (rc < 0) return -1;
-#endif
+      /* Printer-keyboard terminal class */
+      tn->class = 'K';
+      tn->model = '-';
+      tn->extatr = '-';
+      tn->state = TN_DONE;
 
       if (memcmp(termtype, "ANSI", 4) == 0) {
-         rc = send_packet (csock, wont_echo, sizeof(wont_echo),
-                           "IAC WONT ECHO");
-         if (rc < 0) return -1;
-
-         rc = expect (csock, dont_echo, sizeof(dont_echo),
-                           "IAC DONT ECHO");
-         if (rc < 0) return -1;
+         reply = wont_echo;
+         replyl = sizeof(wont_echo);
+         tn->state = TN_DONTECHO;
       }
-
-      /* Return printer-keyboard terminal class */
-      *class = 'K';
-      *model = '-';
-      *extatr = '-';
-      return 0;
-   }
-
-   /* Determine display terminal model */
-   if (memcmp(termtype+4,"DYNAMIC",7) == 0) {
-       *model = 'X';
-       *extatr = 'Y';
    } else {
-      if (!(memcmp(termtype+4, "3277", 4) == 0
-         || memcmp(termtype+4, "3270", 4) == 0
-         || memcmp(termtype+4, "3178", 4) == 0
-         || memcmp(termtype+4, "3278", 4) == 0
-         || memcmp(termtype+4, "3179", 4) == 0
-         || memcmp(termtype+4, "3180", 4) == 0
-         || memcmp(termtype+4, "3287", 4) == 0
-         || memcmp(termtype+4, "3279", 4) == 0))
-         return -1;
-
-      *model = '2';
-      *extatr = 'N';
-
-      if (termtype[8]=='-') {
-         if (termtype[9] < '1' || termtype[9] > '5')
-             return -1;
-         *model = termtype[9];
-         if (memcmp(termtype+4, "328",3) == 0)
-            *model = '2';
-         if (memcmp(termtype+10, "-E", 2) == 0)
-            *extatr = 'Y';
+      /* Determine display terminal model */
+      if (memcmp(termtype+4,"DYNAMIC",7) == 0) {
+          tn->model = 'X';
+          tn->extatr = 'Y';
+      } else {
+         if (!(memcmp(termtype+4, "3277", 4) == 0
+            || memcmp(termtype+4, "3270", 4) == 0
+            || memcmp(termtype+4, "3178", 4) == 0
+            || memcmp(termtype+4, "3278", 4) == 0
+            || memcmp(termtype+4, "3179", 4) == 0
+            || memcmp(termtype+4, "3180", 4) == 0
+            || memcmp(termtype+4, "3287", 4) == 0
+            || memcmp(termtype+4, "3279", 4) == 0))
+            return -1;
+
+         tn->model = '2';
+         tn->extatr = 'N';
+
+         if (termtype[8]=='-') {
+            if (termtype[9] < '1' || termtype[9] > '5')
+                return -1;
+            tn->model = termtype[9];
+            if (memcmp(termtype+4, "328",3) == 0)
+               tn->model = '2';
+            if (memcmp(termtype+10, "-E", 2) == 0)
+               tn->extatr = 'Y';
+         }
       }
+      /* Display terminal class */
+      if (memcmp(termtype+4,"3287",4)==0) tn->class='P';
+      else tn->class = 'D';
+
+      /* Perform end-of-record negotiation */
+      reply = do_eor;
+      replyl = sizeof(do_eor);
+      tn->state = TN_WILLEOR;
    }
 
-   /* Perform end-of-record negotiation */
-   rc = send_packet (csock, do_eor, sizeof(do_eor),
-                       "IAC DO EOR IAC WILL EOR");
-   if (rc < 0) return -1;
+   tn->len -= rc;
+   memmove (tn->buf, tn->buf + rc, tn->len);
 
-   rc = expect (csock, will_eor, sizeof(will_eor),
-                       "IAC WILL EOR IAC DO EOR");
-   if (rc < 0) return -1;
+   if (reply != NULL && send_packet (tn->fd, reply, replyl, "NEGOTIATION") < 0)
+      return -1;
+   return 1;
 
-   /* Perform binary negotiation */
-   rc = send_packet (csock, do_bin, sizeof(do_bin),
-                       "IAC DO BINARY IAC WILL BINARY");
-   if (rc < 0) return -1;
+}  // end function tn_termtype
 
-   rc = expect (csock, will_bin, sizeof(will_bin),
-                       "IAC WILL BINARY IAC DO BINARY");
-   if (rc < 0) return -1;
+/*-------------------------------------------------------------------*/
+/* SUBROUTINE TO NEGOTIATE TELNET PARAMETERS                         */
+/* Called when the client socket is readable. Takes what the client  */
+/* has sent without waiting for more and advances the negotiation    */
+/* as far as the received data allows.                               */
+/* Input:                                                            */
+/*      tn      Negotiation block from tn_accept                     */
+/* Output:                                                           */
+/*      tn->class, model, extatr and devn once TN_DONE is returned.  */
+/*      Bytes the client sent after the negotiation are left in      */
+/*      tn->buf for tn->len bytes.                                   */
+/* Return value:                                                     */
+/*      TN_DONE, TN_FAILED, or the state still waiting for input     */
+/*-------------------------------------------------------------------*/
+int tn_negotiate (struct TNNEG *tn)
+{
+int    rc;                              /* Return code               */
+static BYTE will_term[] = { IAC, WILL, TERMINAL_TYPE };
+static BYTE req_type[] = { IAC, SB, TERMINAL_TYPE, SEND, IAC, SE };
+static BYTE will_eor[] = { IAC, WILL, EOR, IAC, DO, EOR };
+static BYTE do_bin[] = { IAC, DO, BINARY, IAC, WILL, BINARY };
+static BYTE will_bin[] = { IAC, WILL, BINARY, IAC, DO, BINARY };
+static BYTE dont_echo[] = { IAC, DONT, ECHO_OPTION };
 
-   /* Return display terminal class */
-   if (memcmp(termtype+4,"3287",4)==0) *class='P';
-   else *class = 'D';
-   return 0;
+   rc = recv (tn->fd, tn->buf + tn->len, sizeof(tn->buf) - 1 - tn->len, MSG_DONTWAIT);
+   if ((rc == 0) || ((rc < 0) && (errno != EAGAIN) && (errno != EINTR)))
+      return tn->state = TN_FAILED;        /* Connection closed by client */
+   if (rc > 0)
+      tn->len += rc;
+
+   for (rc = 1; (rc > 0) && (tn->state != TN_DONE); ) {
+      switch (tn->state) {
+         case TN_WILLTERM:
+            rc = tn_expect (tn, will_term, sizeof(will_term));
+            if (rc > 0) {
+               /* Request terminal type */
+               if (send_packet (tn->fd, req_type, sizeof(req_type),
+                                "IAC SB TERMINAL_TYPE SEND IAC SE") < 0)
+                  rc = -1;
+               tn->state = TN_TERMTYPE;
+            }
+            break;
+         case TN_TERMTYPE:
+            rc = tn_termtype (tn);
+            break;
+         case TN_DONTECHO:
+            rc = tn_expect (tn, dont_echo, sizeof(dont_echo));
+            if (rc > 0)
+               tn->state = TN_DONE;
+            break;
+         case TN_WILLEOR:
+            rc = tn_expect (tn, will_eor, sizeof(will_eor));
+            if (rc > 0) {
+               /* Perform binary negotiation */
+               if (send_packet (tn->fd, do_bin, sizeof(do_bin),
+                                "IAC DO BINARY IAC WILL BINARY") < 0)
+                  rc = -1;
+               tn->state = TN_WILLBIN;
+            }
+            break;
+         case TN_WILLBIN:
+            rc = tn_expect (tn, will_bin, sizeof(will_bin));
+            if (rc > 0)
+               tn->state = TN_DONE;
+            break;
+         default:
+            rc = -1;
+      }  // End switch tn->state
+   }  // End for rc
+
+   /* Wrong reply, or a full buffer without the expected reply */
+   if ((rc < 0) || ((tn->state != TN_DONE) && (tn->len >= (int)sizeof(tn->buf) - 1)))
+      tn->state = TN_FAILED;
+   return tn->state;
 
-}  // End function negotiate
+}  // End function tn_negotiate
 
 
 /*-------------------------------------------------------------------*/
 /* NEW CLIENT CONNECTION                                             */
+/* Called once tn_negotiate has returned TN_DONE.                    */
 /*-------------------------------------------------------------------*/
-int connect_client (int *csockp, BYTE i327xnump, BYTE *portnump, BYTE *portnumr)
+int connect_client (struct TNNEG *tn, BYTE i327xnump, BYTE portnum)
 /* returns 1 if 3270, else 0 */
 {
-int                     rc;             /* Return code               */
 size_t                  len;            /* Data length               */
-int                     csock;          /* Socket for conversation   */
-BYTE                    portnum;        /* Proposed port number      */
-struct sockaddr_in      client;         /* Client address structure  */
-socklen_t               namelen;        /* Length of client structure*/
-char                   *clientip;       /* Addr of client ip address */
-BYTE                    devnum;         /* Requested device number   */
-BYTE                    class;          /* D=3270, P=3287, K=3215/1052 */
-BYTE                    model;          /* 3270 model (2,3,4,5,X)    */
-BYTE                    extended;       /* Extended attributes (Y,N) */
 char                    buf[256];       /* Message buffer            */
-char                    conmsg[256];    /* Connection message        */
+char                    conmsg[256] = "";  /* Connection message     */
 char                    devmsg[40];     /* Device message            */
-char                    hostmsg[256];   /* Host ID message           */
-char                    num_procs[16];  /* #of processors string     */
-
-   /* Load the socket address from the thread parameter */
-   csock = *csockp;
-
-   /* Obtain the client's IP address */
-   namelen = sizeof(client);
-   rc = getpeername (csock, (struct sockaddr *)&client, &namelen);
-
-   /* Log the client's IP address and hostname */
-   clientip = strdup(inet_ntoa(client.sin_addr));
-
-
-   /* Negotiate telnet parameters */
-   rc = negotiate (csock, &class, &model, &extended, portnumr);
-   if (*portnumr == 0xFF) *portnumr = *portnump;
-
-   if (rc != 0) {
-      close (csock);
-      if (clientip) free(clientip);
-      return 0;
-   }
+char                    hostmsg[256] = ""; /* Host ID message        */
+CPCONV                 *cp;             /* Code page of this LU      */
 
    /* Build connection message for client */
-       snprintf (devmsg, sizeof(devmsg)-1, "Connecting to 327x-%01X port %02X  ", i327xnump, *portnumr);
+       snprintf (devmsg, sizeof(devmsg)-1, "Connecting to 327x-%01X port %02X  ", i327xnump, portnum);
 
-   /* Send connection message to client */
-   if (class != 'K') {
+   /* Send connection message to client, in the LU's code page */
+   cp = ((i327xnump < MAXSNAPU) && (portnum < MAXLU) && (lu_cpconv[i327xnump][portnum] != NULL)) ?
+        lu_cpconv[i327xnump][portnum] : codepage_conv;
+   if (tn->class != 'K') {
       len = snprintf (buf, sizeof(buf)-1,
                "\xF5\x40\x11\x40\x40\x1D\x60%s",
-               prt_host_to_guest( (BYTE*) devmsg,  (BYTE*) devmsg,  strlen( devmsg  )));
+               prt_host_to_guest( (BYTE*) devmsg,  (BYTE*) devmsg,  strlen( devmsg  ), cp->h2g));
 
       if (len < sizeof(buf)) {
          buf[len++] = IAC;
@@ -563,10 +660,10 @@ char                    num_procs[16];  /* #of processors string     */
                       conmsg, hostmsg, devmsg);
    }
 
-   if (class != 'P') {  /* do not write connection resp on 3287 */
-      rc = send_packet (csock, (BYTE *)buf, (int)len, "CONNECTION RESPONSE");
+   if (tn->class != 'P') {  /* do not write connection resp on 3287 */
+      send_packet (tn->fd, (BYTE *)buf, (int)len, "CONNECTION RESPONSE");
    }
-   return (class == 'D') ? 1 : 0;   /* return 1 if 3270 */
+   return (tn->class == 'D') ? 1 : 0;   /* return 1 if 3270 */
 }  // End function connect_client */
 
 /********************************************************************/
@@ -578,88 +675,118 @@ void commadpt_read_tty(struct CB327x *i327x, struct IO3270 *ioblk, BYTE * bfr, B
 {
    BYTE        bfr3[3];
    BYTE        c;
+   BYTE       *p;
    int i1;
    int eor=0;
+   uint32_t room, n, m;
 // logdump("RECV",i327x->dev, bfr,len);
    /* If there is a complete data record already in the buffer
       then discard it before reading more data
       For TTY, allow data to accumulate until CR is received */
 
-   if (i327x->is_3270[lunum]) {
+   if (i327x->lu[lunum].is_3270) {
       if (ioblk->inpbufl) {
-         i327x->rlen3270[lunum] = 0;
+         i327x->lu[lunum].rlen3270 = 0;
          ioblk->inpbufl = 0;
       }
    }
 
 
+   // Each byte read adds at most one byte to the input buffer
+   room = io_room(ioblk, i327x->lu[lunum].rlen3270 + len);
    for (i1 = 0; i1 < len; i1++) {
+      /* Outside a telnet command, move the whole run of data bytes
+         up to the next IAC at once instead of byte by byte          */
+      if (!i327x->lu[lunum].telnet_opt && !i327x->lu[lunum].telnet_iac) {
+         p = memchr(&bfr[i1], IAC, len - i1);
+         n = (p != NULL) ? (uint32_t)(p - &bfr[i1]) : (uint32_t)(len - i1);
+         if (n > 0) {
+            m = min(n, room - i327x->lu[lunum].rlen3270);
+            if (i327x->lu[lunum].is_3270) {
+               memcpy(&ioblk->inpbuf[i327x->lu[lunum].rlen3270], &bfr[i1], m);
+            } else {
+               if (memchr(&bfr[i1], 0x0D, n) != NULL) // CR in TTY mode ?
+                  i327x->lu[lunum].eol_flag = 1;
+               translate_buffer(i327x->lu[lunum].h2g, &bfr[i1], &ioblk->inpbuf[i327x->lu[lunum].rlen3270], m);
+            }
+            i327x->lu[lunum].rlen3270 += m;
+            i1 += n;
+            if (i1 >= len)
+               break;
+         }
+      }
       c = (unsigned char) bfr[i1];
 
-      if (i327x->telnet_opt[lunum]) {
-         i327x->telnet_opt[lunum] = 0;
+      if (i327x->lu[lunum].telnet_opt) {
+         i327x->lu[lunum].telnet_opt = 0;
          bfr3[0] = 0xff;  /* IAC */
          /* set won't/don't for all received commands */
-         bfr3[1] = (i327x->telnet_cmd[lunum] == 0xfd) ? 0xfc : 0xfe;
+         bfr3[1] = (i327x->lu[lunum].telnet_cmd == 0xfd) ? 0xfc : 0xfe;
          bfr3[2] = c;
-         if (i327x->lu_fd[lunum] > 0) {
-            write_socket(i327x->lu_fd[lunum],bfr3,3);
+         if (i327x->lu[lunum].lu_fd > 0) {
+            write_socket(i327x->lu[lunum].lu_fd,bfr3,3);
          }
 
          continue;
       }
-      if (i327x->telnet_iac[lunum]) {
-         i327x->telnet_iac[lunum] = 0;
+      if (i327x->lu[lunum].telnet_iac) {
+         i327x->lu[lunum].telnet_iac = 0;
 
          switch (c) {
             case 0xFB:  /* TELNET WILL option cmd */
             case 0xFD:  /* TELNET DO option cmd */
-               i327x->telnet_opt[lunum] = 1;
-               i327x->telnet_cmd[lunum] = c;
+               i327x->lu[lunum].telnet_opt = 1;
+               i327x->lu[lunum].telnet_cmd = c;
                break;
             case 0xF4:  /* TELNET interrupt */
-               if (!i327x->telnet_int[lunum]) {
-                   i327x->telnet_int[lunum] = 1;
+               if (!i327x->lu[lunum].telnet_int) {
+                   i327x->lu[lunum].telnet_int = 1;
                }
                break;
             case EOR_MARK:
                                 eor = 1;
                break;
             case 0xFF:  /* IAC IAC */
-                        ioblk->inpbuf[i327x->rlen3270[lunum]++] = 0xFF;
+                        if (i327x->lu[lunum].rlen3270 < room)
+                           ioblk->inpbuf[i327x->lu[lunum].rlen3270++] = 0xFF;
                break;
             }
             continue;
          }
          if (c == 0xFF) {  /* TELNET IAC */
-            i327x->telnet_iac[lunum] = 1;
+            i327x->lu[lunum].telnet_iac = 1;
             continue;
          } else {
-            i327x->telnet_iac[lunum] = 0;
+            i327x->lu[lunum].telnet_iac = 0;
          }
-         if (!i327x->is_3270[lunum]) {
+         if (!i327x->lu[lunum].is_3270) {
             if (c == 0x0D) // CR in TTY mode ?
-                i327x->eol_flag[lunum] = 1;
-            c = host_to_guest(c);   // translate ASCII to EBCDIC for tty
+                i327x->lu[lunum].eol_flag = 1;
+            c = i327x->lu[lunum].h2g[c];   // translate ASCII to EBCDIC for tty
          }
-         ioblk->inpbuf[i327x->rlen3270[lunum]++] = c;
+         if (i327x->lu[lunum].rlen3270 < room)
+            ioblk->inpbuf[i327x->lu[lunum].rlen3270++] = c;
 
    }
    /* received data (rlen3270 > 0) is sufficient for 3270,
       but for TTY, eol_flag must also be set */
 // printf("\n");
 
-   if ((i327x->eol_flag[lunum] || i327x->is_3270[lunum]) && i327x->rlen3270[lunum]) {
-      i327x->eol_flag[lunum] = 0;
-      if (i327x->is_3270[lunum]) {
+   if ((i327x->lu[lunum].eol_flag || i327x->lu[lunum].is_3270) && i327x->lu[lunum].rlen3270) {
+      i327x->lu[lunum].eol_flag = 0;
+      if (i327x->lu[lunum].is_3270) {
          if (eor) {
-            ioblk->inpbufl = i327x->rlen3270[lunum];
-            i327x->rlen3270[lunum] = 0; /* for next msg */
+            ioblk->inpbufl = i327x->lu[lunum].rlen3270;
+            i327x->lu[lunum].rlen3270 = 0; /* for next msg */
+            /* An AID (not a read reply or query reply) starts a host response time */
+            if ((ioblk->inpbuf[0] != 0x60) && (ioblk->inpbuf[0] != 0x61) && (ioblk->inpbuf[0] != 0x88) &&
+                (i327x->lu[lunum].rtm_t0 == 0))
+               i327x->lu[lunum].rtm_t0 = tn_usec();
          } // End if eor
       } else {
-         ioblk->inpbufl = i327x->rlen3270[lunum];
-         i327x->rlen3270[lunum] = 0; /* for next msg */
-      }  // End if (i327x->is_3270[lunum])
-   }  // End i327x->eol_flag[lunum]
+         ioblk->inpbufl = i327x->lu[lunum].rlen3270;
+         i327x->lu[lunum].rlen3270 = 0; /* for next msg */
+      }  // End if (i327x->lu[lunum].is_3270)
+   }  // End i327x->lu[lunum].eol_flag
 }
 
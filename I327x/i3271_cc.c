@@ -27,6 +27,10 @@
    the desired 3271 by selecting the approriate telnet port number.
    The TCP ports are defined as 32711 for the first IBM3271, 32712 for
    the 2nd, etc.
+   Several 3271's can share a multipoint BSC line, each with its own
+   control unit address (-cua n). Their TCP ports then start at
+   32711 - (line * 32 + n) * MAXCLSTR, counting down so that they
+   stay clear of the 3274 ports from 32741 up.
 */
 
 #include <inttypes.h>
@@ -39,6 +43,7 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <ifaddrs.h>
 #include "i327x.h"
 #include "ebcdic.h"
@@ -75,12 +80,20 @@ int        sockopt;                /* Used for setsocketoption          */
 int        pendingrcv;             /* pending data on the socket        */
 int        event_count;            /* # events received                 */
 char       *ipaddr;
-uint8_t     bfr[256];
+uint8_t     bfr[TTYBUF];
 
 struct CB327x *clu[MAXCLSTR];          /* 3271 control block */
-struct IO3270 *ioblk[MAXCLSTR][MAXLU]; /* 3270 data buffer   */
 
 uint8_t CLSTR_config[MAXCLSTR][4] = {{0x20,0x40, 0x40,0x40}};
+int     bsc_line = 0;                  /* BSC line of the 3705              */
+int     bsc_cua = 0;                   /* Control unit address (0-31)       */
+int     num_lu = DEFLU;                /* Number of terminals per 3271      */
+// Poll address character of control units 0-31
+uint8_t CU_addr[32] = {
+      0x40, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7,
+      0xC8, 0xC9, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+      0x50, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7,
+      0xD8, 0xD9, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F};
 
 uint8_t BSC_rbuf[65536];
 uint8_t BSC_tbuf[65536];
@@ -88,8 +101,12 @@ uint8_t BSC_tbuf[65536];
 // void *PU2_thread(void *arg);
 void commadpt_read_tty(struct CB327x *i327x, struct IO3270 *ioblk, uint8_t * bfr, int lunum, int len);
 int send_packet(int csock, uint8_t *buf, int len, char *caption);
-int connect_client (int *csockp, BYTE i327xnump, BYTE *lunump, BYTE *lunumr);
+int connect_client (struct TNNEG *tn, BYTE i327xnump, BYTE portnum);
+struct TNNEG *tn_accept (int csock);
+int tn_negotiate (struct TNNEG *tn);
 int SocketReadAct (int fd);
+struct IO3270 *io_get(void);
+void io_put(struct IO3270 *io);
 
 uint8_t  ACKreq = 0;
 uint8_t  NAKreq = 0;
@@ -121,13 +138,19 @@ uint8_t STX_addr[] = {
       SYN, SYN, STX, 0x40, 0x40};           // STX + CU addr
 uint8_t SOH_stat[] = {
       SYN, SYN, SOH, 0x6C, 0xD9, STX, 0x40, 0x40}; // SOH (status) + STX
+uint8_t CU_hello[] = {
+      0x00, 0x00};                          // Identification: 00 + CU addr (0-31)
+uint8_t NOREPLY[] = {
+      0x00, PAD};                           // No reply to this transmission
 // Sense and Status uint8_ts
 uint8_t SS_IR[] = { 0x40, 0x50 };        // Sense/Status : Intervention Required (Not Ready)
 uint8_t SS_DE[] = { 0xC2, 0x40 };        // Sense/Status : Device End (Ready)
 //int write_socket( int fd, const void *_ptr, int nuint8_ts );
 //int send_packet (int csock, uint8_t *buf, int len, char *caption);
 
-int double_up_iac (uint8_t *buf, int len);
+int send_3270 (struct LU327x *lu, BYTE *data, uint32_t len, int eor);
+int tn_codepage (char *arg);
+void lu_codepage (struct LU327x *lu, int punum, int lunum);
 
 /*-------------------------------------------------------------------*/
 /* Function to calculate The Cyclic Redundancy Check                 */
@@ -236,7 +259,7 @@ int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen) {
             case SELECT:
                if (Tdbg_flag == ON)
                   fprintf(T_trace, "\r===> Received Select...\n\r");
-               if (clu[0]->lu_fd[0] > 0) {                         // ...and if terminal connected
+               if (clu[0]->lu[0].lu_fd > 0) {                      // ...and if terminal connected
                   lastACK = 1;                                     // A select should always responds with ACK0
                   ACKreq = 1;                                      // ...send ACK
                } else {                                            // If terminal not connected...
@@ -251,7 +274,7 @@ int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen) {
             case SPOLL:
                if (Tdbg_flag == ON)
                   fprintf(T_trace, "\r===> Received SPOLL...\n\r");
-               if (clu[0]->lu_fd[0] > 0) {                         // ...and if terminal connected
+               if (clu[0]->lu[0].lu_fd > 0) {                      // ...and if terminal connected
                   ACKreq = 1;                                      // ...send ACK
                } else {                                            // If terminal not connected...
                   memcpy(BSC_rbuf, SOH_stat, sizeof(SOH_stat));    // ...then begin with SYN SYN SOH
@@ -267,10 +290,10 @@ int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen) {
                   BSC_rbuf[BSCrlen++] = CRCck & 0x00FF;            // Second CRC 16 byte
                   BSC_rbuf[BSCrlen++] = PAD;                       // Line turnaround
                   EOTreq = 1;                                      // Send EOT after receiving an ACK,
-                  clu[0]->not_ready[0] = 1;
+                  clu[0]->lu[0].not_ready = 1;
                   if (Tdbg_flag == ON)
                     fprintf(T_trace, "\r===> Sending Sense data %02X %02X...\n\r", BSC_rbuf[8], BSC_rbuf[9] );
-               }  // End if (clu[0]->lu_fd[0] > 0)
+               }  // End if (clu[0]->lu[0].lu_fd > 0)
                break;
 
             //***********************************************************
@@ -279,12 +302,12 @@ int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen) {
             case GPOLL:
                if (Tdbg_flag == ON)
                   fprintf(T_trace, "\r===> Received GPOLL...\n\r");
-               if (clu[0]->lu_fd[0] > 0) {                         // If terminal connected
-                  if ((ioblk[0][0]->inpbufl > 0) && !(clu[0]->not_ready[0])) {  // Do we have data to transmit and terminal is ready... ?
+               if (clu[0]->lu[0].lu_fd > 0) {                      // If terminal connected
+                  if ((clu[0]->lu[0].io->inpbufl > 0) && !(clu[0]->lu[0].not_ready)) { // Do we have data to transmit and terminal is ready... ?
                      memcpy(BSC_rbuf, STX_addr, sizeof(STX_addr)); // ...then begin with SYN SYN STX
                      BSCrlen = sizeof(STX_addr);
-                     memcpy(&BSC_rbuf[BSCrlen], ioblk[0][0]->inpbuf, ioblk[0][0]->inpbufl);  // ...add the 3270 buffer content
-                     BSCrlen = BSCrlen + ioblk[0][0]->inpbufl;
+                     memcpy(&BSC_rbuf[BSCrlen], clu[0]->lu[0].io->inpbuf, clu[0]->lu[0].io->inpbufl); // ...add the 3270 buffer content
+                     BSCrlen = BSCrlen + clu[0]->lu[0].io->inpbufl;
                      BSC_rbuf[BSCrlen++] = ETX;                    // add ETX
                      //***********************************************************
                      //* Calculate CRC
@@ -295,12 +318,12 @@ int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen) {
                      BSC_rbuf[BSCrlen++] = PAD;                    // Line turnaround
                      if (Tdbg_flag == ON) {
                         fprintf(T_trace, "\r3270 Output Buffer: ");
-                        for (int i = 0; i < ioblk[0][0]->inpbufl; i++) {
-                           fprintf(T_trace, "%02X ", ioblk[0][0]->inpbuf[i]);
+                        for (int i = 0; i < clu[0]->lu[0].io->inpbufl; i++) {
+                           fprintf(T_trace, "%02X ", clu[0]->lu[0].io->inpbuf[i]);
                         }
                         fprintf(T_trace, "\n\r");
                      }  // End if Debug
-                     ioblk[0][0]->inpbufl = 0;
+                     clu[0]->lu[0].io->inpbufl = 0;
                      EOTreq = 1;                                   // Send EOT after receiving an ACK,
                   } else {
                      memcpy(&BSC_rbuf, EOT_dlc, sizeof(EOT_dlc));  // ... send EOT (nothing to send)
@@ -308,7 +331,7 @@ int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen) {
                      if (Tdbg_flag == ON)
                         fprintf(T_trace, "\r===> Returning EOT (a)...\n\r");
                   }  // End if ioblk
-                  if (clu[0]->not_ready[0]) {                      // If previous Not Ready state....
+                  if (clu[0]->lu[0].not_ready) {                   // If previous Not Ready state....
                      memcpy(BSC_rbuf, SOH_stat, sizeof(SOH_stat));   //...then begin with SYN SYN SOH
                      BSCrlen = sizeof(SOH_stat);
                      memcpy(&BSC_rbuf[BSCrlen], SS_DE, sizeof(SS_DE ));  //...and add DE sense
@@ -322,16 +345,16 @@ int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen) {
                      BSC_rbuf[BSCrlen++] = CRCck & 0x00FF;         // Second CRC 16 byte
                      BSC_rbuf[BSCrlen++] = PAD;                    // Line turnaround
                      EOTreq = 1;                                   // Send EOT after receiving an ACK,
-                     clu[0]->not_ready[0] = 0;                     // Reset not_ready state
+                     clu[0]->lu[0].not_ready = 0;                  // Reset not_ready state
                      if (Tdbg_flag == ON)
                         fprintf(T_trace, "\r===> Sending Sense data %02X %02X...\n\r", BSC_rbuf[8], BSC_rbuf[9] );
-                  }  // End if (clu[0]->not_ready[0])
+                  }  // End if (clu[0]->lu[0].not_ready)
                } else {
                   memcpy(&BSC_rbuf, EOT_dlc, sizeof(EOT_dlc));     // ... send EOT (nothing to send)
                   BSCrlen = sizeof(EOT_dlc);
                   if (Tdbg_flag == ON)
                      fprintf(T_trace, "\r===> Returning EOT (b)...\n\r");
-               }  // End if clu[0]->lu_fd[0]
+               }  // End if clu[0]->lu[0].lu_fd
             break;
          }  // End switch ENQ_type
       }  // End if BSCtlen == 8
@@ -357,23 +380,19 @@ int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen) {
             //***********************************************************
             // CRCck = crc16(Dbuf, Dlen);                          // Calculate CRC, Exclude IAC
             CRCck = crc16(BSC_tbuf+3, BSCtlen-6);                  // Calculate CRC, Exclude SOT header
-            // Dbuf[Dlen++] = IAC;
-            // Dbuf[Dlen++] = 0xEF;
-            BSC_tbuf[BSCtlen-4] = IAC;
-            BSC_tbuf[BSCtlen-3] = 0xEF;
 
             ckesc = 0;                                             // preset to not preceeded by ESC
             if (BSC_tbuf[3+ckesc] == 0x27) ckesc=1;                // If data begins with ESC exclude it
             if (Tdbg_flag == ON) {
                fprintf(T_trace, "\r3270 Input Buffer: ");
-               for (int i = 0; i < BSCtlen-5-ckesc; i ++) {
+               for (int i = 0; i < BSCtlen-7-ckesc; i ++) {
                   fprintf(T_trace, "%02X ", BSC_tbuf[i+3+ckesc]);
                }
                fprintf(T_trace, "\n\r");
             }
             if ((CRCds ^ CRCck) == 0x0000) {
                //************************************************************
-               rc = send_packet (clu[0]->lu_fd[0], (uint8_t *) BSC_tbuf+3+ckesc, BSCtlen-5-ckesc, "3270 BSC Data");
+               rc = send_3270 (&clu[0]->lu[0], (uint8_t *) BSC_tbuf+3+ckesc, BSCtlen-7-ckesc, 1);   // Data between STX and ETX + IAC EOR
                //************************************************************
                if (rc == 0) ACKreq = 1;
                   else NAKreq = 1;
@@ -432,9 +451,10 @@ int proc_CLUiml() {
    for (BYTE j = 0; j < MAXCLSTR; j++) {
       clu[j] =  malloc(sizeof(struct CB327x));
       // Init sockets for LU's
-      for (BYTE i = 0; i < MAXLU; i++) {
-         clu[j]->lu_fd[i] = 0;
-         clu[j]->not_ready[i] = 1;
+      clu[j]->lu = calloc(num_lu, sizeof(struct LU327x));
+      for (BYTE i = 0; i < num_lu; i++) {
+         clu[j]->lu[i].not_ready = 1;
+         lu_codepage(&clu[j]->lu[i], j, i);
       }
       clu[j]->lunum = 0;
       clu[j]->last_lu = 0;
@@ -461,7 +481,7 @@ int proc_CLUiml() {
       /* Bind the socket */
       sin1.sin_family=AF_INET;
       sin1.sin_addr.s_addr = inet_addr(ipaddr);
-      sin1.sin_port=htons(32711+j);
+      sin1.sin_port=htons(32711 - (bsc_line * 32 + bsc_cua) * MAXCLSTR + j);
       if (bind(clu[j]->pu_fd, (struct sockaddr *)&sin1, sizeof(sin1)) < 0) {
           printf("\rCLU: Bind 3271-%01X socket failed\n\r", j);
           free(clu[j]);
@@ -488,84 +508,111 @@ int proc_CLUiml() {
          free(clu[j]);
          return -4;
       }
-      printf("\rCLU: 3271-%01X IML ready. TN3270 can connect to port %d \n\r)", j,32711+j);
+      printf("\rCLU: 3271-%01X IML ready. TN3270 can connect to port %d \n\r)", j, 32711 - (bsc_line * 32 + bsc_cua) * MAXCLSTR + j);
    }  // End for j=0
    return 0;
 }
 
+/********************************************************************/
+/* Procedure to find the next free terminal of a cluster            */
+/********************************************************************/
+void next_lu(BYTE k) {
+   clu[k]->lunum = 0xFF;                                                  /* preset to no LU's availble         */
+   for (BYTE j = 0; j < num_lu; j++) {
+      if ((clu[k]->lu[j].lu_fd < 1) && (clu[k]->lu[j].tn == NULL)) clu[k]->lunum = j;
+   } // end for BYTE j
+   if (clu[k]->lunum == 0xFF) printf("\rCLU: No more terminal ports available. New connections rejected until a terminal port is released;\n");
+}
+
+/********************************************************************/
+/* Procedure to advance the telnet negotiation of a reserved        */
+/* terminal. When done the client gets its terminal (the requested  */
+/* one if it is free) and its connection message. A client that has */
+/* not finished within TN_TIMEOUT seconds is dropped.               */
+/********************************************************************/
+void negotiate_lu(BYTE k, BYTE j) {
+   struct TNNEG *tn = clu[k]->lu[j].tn;
+   BYTE   r = j;                                                          /* Terminal the client is connected to */
+   int    expired = (time(NULL) >= tn->deadline);
+
+   if (!expired && (tn_negotiate(tn) > TN_DONE))                          /* Wait for more replies from the client */
+      return;
+   clu[k]->lu[j].tn = NULL;                                               /* Release the reserved terminal       */
+   if (expired || (tn->state == TN_FAILED)) {
+      printf("\rCLU: telnet negotiation %s on 3271-%01X, connection closed\n", expired ? "timed out" : "failed", k);
+      close(tn->fd);
+      free(tn);
+      next_lu(k);
+      return;
+   }
+   if ((tn->devn != 0xFF) && (tn->devn != j)) {                           /* Client requested a specific terminal */
+      if ((tn->devn < num_lu) && (clu[k]->lu[tn->devn].lu_fd < 1) && (clu[k]->lu[tn->devn].tn == NULL))
+         r = tn->devn;
+      else
+         printf("\rCLU: requested terminal port %02X is not available, request denied\n", tn->devn);
+   }  // End if tn->devn
+   clu[k]->lu[r].lu_fd = tn->fd;
+   clu[k]->lu[r].is_3270 = connect_client(tn, clu[k]->punum, r);
+   clu[k]->lu[r].io = io_get();                                           /* 3270 input buffer from the pool  */
+   clu[k]->lu[r].daf_addr1 = 0;                                           /* make sure the initial value is 0 */
+   clu[k]->lu[r].bindflag = 0;                                            /* make sure the initial value is 0 */
+   clu[k]->lu[r].initselfflag = 0;                                        /* make sure the initial value is 0 */
+   clu[k]->lu[r].not_ready = 0;                                           /* Reset not-ready state            */
+   printf("\rCLU: terminal %d connected to 3271-%01X\n", r, k);
+   if (tn->len > 0)                                                       /* Input sent right after negotiation */
+      commadpt_read_tty(clu[k], clu[k]->lu[r].io, tn->buf, r, tn->len);
+   free(tn);
+   next_lu(k);
+}
+
 /********************************************************************/
 /* Procedure to check for 3270 connection or data requests          */
 /********************************************************************/
 int proc_3270 () {
-   int    rc;
+   int    rc, fd;
    //
    // Poll briefly for connect requests. If a connect request is received,
-   // proceed with connect/accept the request.
+   // accept it and start the telnet negotiation on the next free terminal.
    // Next, check all active connection for input data.
    //
    for (BYTE k = 0; k < MAXCLSTR; k++) {
-      event_count = epoll_wait(clu[k]->epoll_fd, events, MAXLU, 50);
+      event_count = epoll_wait(clu[k]->epoll_fd, events, MAXCLSTR, 50);
 
       for (int i = 0; i < event_count; i++) {
          if (clu[k]->lunum != 0xFF) {                                            /* if avail LU pool not exhausted      */
-            clu[k]->lu_fd[clu[k]->lunum]=accept(clu[k]->pu_fd, NULL, 0);
-            if (clu[k]->lu_fd[clu[k]->lunum] < 1) {
+            fd = accept(clu[k]->pu_fd, NULL, 0);
+            if (fd < 1) {
                printf("\rCLU: accept failed for 3171-%01X %s\n", k, strerror(errno));
             } else {
-               if (connect_client(&clu[k]->lu_fd[clu[k]->lunum], clu[k]->punum, &clu[k]->lunum, &clu[k]->lunumr))  {
-                  clu[k]->is_3270[clu[k]->lunum] = 1;
-               } else {
-                  clu[k]->is_3270[clu[k]->lunum] = 0;
-               }  // End if connect_client
-
-               if (clu[k]->lunumr != clu[k]->lunum)  {                                 /* Requested terminal number is not the proposed terminal number   */
-                  if (clu[k]->lu_fd[clu[k]->lunumr] < 1) {
-                     clu[k]->lu_fd[clu[k]->lunumr] = clu[k]->lu_fd[clu[k]->lunum];     /* Copy fd to request lu                               */
-                     clu[k]->is_3270[clu[k]->lunumr] = clu[k]->is_3270[clu[k]->lunum]; /* copy 3270 indicator                                 */
-                     clu[k]->lu_fd[clu[k]->lunum] = 0;                                 /* clear fd in proposed lu number                      */
-                     clu[k]->is_3270[clu[k]->lunum] = 0;                               /* clear 3270 indicator for proposed lu number         */
-                     clu[k]->lunum = clu[k]->lunumr;                                   /* replace proposed lu number with requested lu number */
-                  } else {
-                     printf("\rCLU: requested terminal port %02X is not available, request denied\n", clu[k]->lunumr);
-                  }  // End  if (pu2[k]->lu_fd[pu2[k]->lunumr]
-               }  // End if pu[k]->lunumr
-
-               ioblk[k][clu[k]->lunum] =  malloc(sizeof(struct IO3270));
-               ioblk[k][clu[k]->lunum]->inpbufl = 0;                             /* make sure the initial length is 0 */
-               clu[k]->daf_addr1[clu[k]->lunum] = 0;                             /* make sure the initial value is 0 */
-               clu[k]->bindflag[clu[k]->lunum] = 0;                              /* make sure the initial value is 0 */
-               clu[k]->initselfflag[clu[k]->lunum] = 0;                          /* make sure the initial value is 0 */
-               clu[k]->not_ready[clu[k]->lunum] = 0;                             /* Reset not-ready state            */
-               printf("\rCLU: terminal %d connected to 3271-%01X\n", clu[k]->lunum, k);
-               // Next available terminal
-               clu[k]->lunum = clu[k]->lunum + 1;
-               // Find first available LU
-               clu[k]->lunum = 0xFF;                                              /* preset to no LU's availble         */
-               for (BYTE j = 0; j < MAXLU; j++) {
-                  if (clu[k]->lu_fd[j] < 1) clu[k]->lunum = j;
-               } // end for BYTE j
-               if (clu[k]->lunum == 0xFF) printf("\rCLU: No more terminal ports available. New connections rejected until a terminal port is released;\n");
-            }  // End if clu[j]->lu_fd
+               clu[k]->lu[clu[k]->lunum].tn = tn_accept(fd);                     /* Send DO TERMINAL_TYPE               */
+               if (clu[k]->lu[clu[k]->lunum].tn == NULL)
+                  printf("\rCLU: telnet negotiation failed to start on 3271-%01X\n", k);
+               else
+                  next_lu(k);
+            }  // End if fd
          }  // End if (pu2[k] != 0xFF)
       }  // End for int i
 
-      for (BYTE j = 0; j < MAXLU; j++) {
-         if (clu[k]->lu_fd[j] > 0) {
-            rc = ioctl(clu[k]->lu_fd[j], FIONREAD, &pendingrcv);
-            if ((pendingrcv < 1) && (SocketReadAct(clu[k]->lu_fd[j]))) rc = -1;
+      for (BYTE j = 0; j < num_lu; j++) {
+         if (clu[k]->lu[j].tn != NULL)                                        /* Telnet negotiation in progress      */
+            negotiate_lu(k, j);
+         if (clu[k]->lu[j].lu_fd > 0) {
+            rc = ioctl(clu[k]->lu[j].lu_fd, FIONREAD, &pendingrcv);
+            if ((pendingrcv < 1) && (SocketReadAct(clu[k]->lu[j].lu_fd))) rc = -1;
 
             if (rc < 0) {
-               clu[k]->not_ready[j] = 1;
-               free(ioblk[k][j]);
-               clu[k]->actlu[j] = 0;
-               close (clu[k]->lu_fd[j]);
-               clu[k]->lu_fd[j] = 0;
+               clu[k]->lu[j].not_ready = 1;
+               io_put(clu[k]->lu[j].io);
+               clu[k]->lu[j].io = NULL;
+               clu[k]->lu[j].actlu = 0;
+               close (clu[k]->lu[j].lu_fd);
+               clu[k]->lu[j].lu_fd = 0;
                printf("\rCLU: terminal %d disconnected from 3271-%01X\n", j, k);
                if ((clu[k]->lunum > j) || (clu[k]->lunum == 0xFF))  /* If next available terminal greater or no terminals availble ... */
                    clu[k]->lunum = j;                               /* ...replace with the just released terminal number          */
             } else {
                if (pendingrcv > 0) {
-                  rc=read(clu[k]->lu_fd[j], bfr, 256-BUFPD);
+                  rc=read(clu[k]->lu[j].lu_fd, bfr, sizeof(bfr));
                   //******
                   if (Tdbg_flag == ON) {
                      fprintf(T_trace, "\n3270 Read Buffer: ");
@@ -575,7 +622,7 @@ int proc_3270 () {
                      fprintf(T_trace, "\n\r");
                   } // End if debug
                   //******
-                  commadpt_read_tty(clu[k], ioblk[k][j], bfr, j, rc);
+                  commadpt_read_tty(clu[k], clu[k]->lu[j].io, bfr, j, rc);
                }  // End if pendingrcv
             }  // End if rc < 0
          }  // End if bsc-lu_fd
@@ -598,7 +645,7 @@ void main(int argc, char *argv[]) {
    if (argc == 1) {
       printf("\rCLU: Error - arguments missing(s)!\n");
       printf("\r     Usage: i3271 [-cchn hostname | -ccip ipaddr]\n");
-      printf("\r                  [-d]\n\n");
+      printf("\r                  [-line n] [-cua n] [-cp [[pp.]xx=]codepage] [-d]\n\n");
       return;
    }
    Tdbg_flag = OFF;
@@ -626,10 +673,35 @@ void main(int argc, char *argv[]) {
          printf("\rCLU: Connection to be established with 3705 BSC line at ip address %s\n", argv[i+1]);
          i = i + 2;
          continue;
+      } else if ((strcmp(argv[i], "-line") == 0) && (i + 1 < argc)) {
+         bsc_line = atoi(argv[i+1]);
+         if ((bsc_line < 0) || (bsc_line >= BSCLINES_3705)) {
+            printf("\rCLU: BSC line %s out of range 0-%d\n", argv[i+1], BSCLINES_3705 - 1);
+            return;
+         }
+         printf("\rCLU: Connecting to BSC line-%d\n", bsc_line);
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-cua") == 0) && (i + 1 < argc)) {
+         bsc_cua = atoi(argv[i+1]);
+         if ((bsc_cua < 0) || (bsc_cua > 31)) {
+            printf("\rCLU: Control unit address %s out of range 0-31\n", argv[i+1]);
+            return;
+         }
+         printf("\rCLU: Control unit address %d, poll address %02X\n", bsc_cua, CU_addr[bsc_cua]);
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-cp") == 0) && (i + 1 < argc)) {
+         if (tn_codepage(argv[i+1])) {
+            printf("\rCLU: Unknown code page or terminal in %s\n", argv[i+1]);
+            return;
+         }
+         i = i + 2;
+         continue;
       } else {
          printf("\rCLU: Error - invalid argument %s!\n", argv[i]);
          printf("\r     Usage: i3271 [-cchn hostname | -ccip ipaddr]\n");
-         printf("\r                  [-d]\n\n");
+         printf("\r                  [-line n] [-cua n] [-cp [[pp.]xx=]codepage] [-d]\n\n");
          return;
       }  // End else
    }  // End while
@@ -652,12 +724,15 @@ void main(int argc, char *argv[]) {
    // Assign IP addr and PORT number
    servaddr.sin_family = AF_INET;
    memcpy(&servaddr.sin_addr, lineent->h_addr_list[0], lineent->h_length);
-   servaddr.sin_port = htons(BSCLBASE);
+   servaddr.sin_port = htons(BSCLBASE + bsc_line);
+   STX_addr[3] = SOH_stat[6] = CU_addr[bsc_cua];     // Replies carry our CU address
+   CU_hello[1] = bsc_cua;
    // Connect to the BSC line socket
    printf("\rCLU: Waiting for BSC line connection to be established\n");
    while (connect(clubsc_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) != 0) {
       sleep(1);
    }
+   send(clubsc_fd, CU_hello, sizeof(CU_hello), 0);  // Identify on a multipoint line
    printf("\rCLU: BSC line connection has been established\n");
    // Now 'start' the 3271
    rc = proc_CLUiml();
@@ -680,6 +755,7 @@ void main(int argc, char *argv[]) {
          while (connect(clubsc_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) != 0) {
             sleep(1);
          }  // End while
+         send(clubsc_fd, CU_hello, sizeof(CU_hello), 0);
       } else {
          if (pendingrcv > 0) {
             BSCtlen = read(clubsc_fd, BSC_tbuf, sizeof(BSC_tbuf));
@@ -691,7 +767,10 @@ void main(int argc, char *argv[]) {
                fprintf(T_trace, "\n");
             } // End if debug
             BSCrlen = proc_BSC(BSC_tbuf, BSCtlen);
-            if (BSCrlen == 0) BSCrlen = 1;     // If no response needed, send 1 byte
+            if (BSCrlen == 0) {                // If no response needed, say so
+               memcpy(BSC_rbuf, NOREPLY, sizeof(NOREPLY));
+               BSCrlen = sizeof(NOREPLY);
+            }
             rc = send(clubsc_fd, BSC_rbuf, BSCrlen, 0);
             if (Tdbg_flag == ON) {
                fprintf(T_trace, "\r3271 Send Buffer: ");
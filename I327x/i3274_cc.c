@@ -29,6 +29,18 @@
    3274 by selecting the approriate teLnet port number.
    The ports are defined as 32741 for the first 3274, 32742 for
    the 2nd, etc.
+   Several 3274 emulators can share the 3705, each on its own SDLC
+   line (-line n). The telnet ports then start at 32741 + n * MAXSNAPU.
+   The number of 3274's (-pus n, up to MAXSNAPU) and of LU's per 3274
+   (-lus n, up to MAXLU) is set at startup. The 3274's answer to
+   consecutive SDLC station addresses from -addr (default C1).
+   An LU given with -prt is a 3287 printer without a TN3270 client:
+   it is powered on at IML and its print data stream is written to a
+   spool file or pipe.
+   With -wrk n the 3274's are shared out over n worker threads. The
+   main thread then only reads the SDLC line and queues each frame to
+   the worker of its station; a worker runs proc_PIU, answers polls
+   and does all TN3270 I/O for its own 3274's.
 */
 
 #include <inttypes.h>
@@ -41,11 +53,13 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <ifaddrs.h>
 #include "i327x_327x.h"
-#include "../Include/i327x_sdlc.h"
+#include "../i327x_sdlc.h"
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
@@ -58,23 +72,43 @@
 #endif
 
 #define BUFPD 0x1C
+#define EV_LINE  0x10000            /* epoll tag: SDLC line              */
+#define EV_PU    0x20000            /* epoll tag: PU port, k << 8        */
+#define EV_LU    0x40000            /* epoll tag: LU socket, k << 8 | j  */
 
 uint16_t Tdbg_flag = OFF;           /* 1 when Ttrace.log open */
 FILE *T_trace;                      /* Terminal trace file fd */
 
+/* Variables declared __thread are per worker thread (-wrk n); each  */
+/* worker polls, processes and answers for its own 3274's only.      */
 struct sockaddr_in servaddr;
 struct sockaddr_in sin1, *sin2;
-struct epoll_event event, events[MAXSNAPU*2];
+__thread struct epoll_event event, events[MAXSNAPU * (MAXLU + 1) + 1];
 struct ifaddrs *nwaddr, *ifa;       /* interface address structure       */
 in_addr_t  lineip;                  /* SDLC line listening address       */
 uint16_t   lineport;                /* SDLC line listening port          */
 int        pusdlc_fd;
-int        station;                 /* Station number based on station address */
+__thread int pu_epfd;              /* Polls the line, PU ports and LUs  */
+int        sdlc_line = 0;           /* 3705 SDLC line to connect to      */
+__thread int sdlc_attn = OFF;      /* New work: send an attention record */
+int        num_pu = DEFSNAPU;       /* Number of 3274's IML-ed           */
+int        num_lu = DEFLU;          /* Number of LU's per 3274           */
+int        sdlc_addr = 0xC1;        /* SDLC station address of 3274-0    */
+__thread int tn_pending = 0;       /* Telnet negotiations in progress   */
+int        hold_secs = 0;           /* Session hold time (s) after a client drop, 0 = off */
+__thread int lu_held = 0;          /* LU's with a held session          */
+__thread int pu_first = 0;         /* First 3274 of this thread         */
+__thread int pu_step = 1;          /* Next 3274 of this thread          */
+int        num_wrk = 0;             /* Worker threads (-wrk), 0 = none   */
+char       *prt_path[MAXSNAPU][MAXLU];  /* Spool file or |command of a printer LU (-prt) */
+pthread_mutex_t line_lock = PTHREAD_MUTEX_INITIALIZER;  /* Serializes line writes */
+int        rtm_interval = 0;        /* Response time dump interval (s), 0 = off */
+time_t     rtm_next;                /* Time of the next response time dump */
 int        sockopt;                 /* Used for setsocketoption          */
 int        pendingrcv;              /* pending data on the socket        */
-int        event_count;             /* # events received                 */
+__thread int event_count;          /* # events received                 */
 char       *ipaddr;
-BYTE       bfr[256];
+__thread BYTE bfr[TTYBUF];
 
 // Host ---> PU request buffer
 uint8_t BLU_req_buf[BUFLEN_3274];   // DLC header + TH + RH + RU + DLC trailer
@@ -83,30 +117,89 @@ int     BLU_req_len;                // Length of BLU request
 int     LU_req_stat;                // BLU buffer state
 // PU ---> Host response buffer
 uint8_t BLU_rsp_buf[BUFLEN_3274];   // DLC header + TH + RH + RU + DLC trailer
-int     BLU_rsp_ptr;                // Offset pointer to BLU
-int     BLU_rsp_len;                // Length of BLU response
-int     BLU_rsp_stat;               // BLU buffer state
+__thread int BLU_rsp_ptr;           // Offset pointer to BLU
+__thread int BLU_rsp_len;           // Length of BLU response
+__thread int BLU_rsp_stat;          // BLU buffer state
 // Saved RH
-uint8_t  saved_FD2_RH_0;
-uint8_t  saved_FD2_RH_1;
-int THRH_type;                      // TH / RH type processed
+__thread uint8_t saved_FD2_RH_0;
+__thread uint8_t saved_FD2_RH_1;
+__thread int THRH_type;             // TH / RH type processed
 
 uint8_t Rsp_buf = EMPTY;
 uint8_t RSP_buf[BUFLEN_3270];       // Status Response buffer
 int Plen;                           // Length of PIU response
 
 struct CB327x* pu2[MAXSNAPU];          /* 3274 data structure */
-struct IO3270 *ioblk[MAXSNAPU][MAXLU]; /* 3270 data buffer */
 
-uint8_t SDLCrspb[BUFLEN_3274];
+__thread uint8_t SDLCrspb[BUFLEN_3274];  // Response frames to send when polled
+__thread int     SDLCrsptl = 0;        // Total size of response frames
+__thread int     Fptr2[16] = {0};      // Offsets of the response frames
+__thread int     FptrI = 0;            // Response frames
 uint8_t SDLCreqb[BUFLEN_3274];
+uint8_t SDLCinb[BUFLEN_3274];          // Line input, may hold several link records
+int     SDLCinl = 0;                   // Length of line input
+__thread uint8_t SDLCoutb[2 * BUFLEN_3274];  // Line output, link records
+
+// Frame queue of a worker thread (-wrk n). The line thread is the
+// only producer and the worker the only consumer, so only head and
+// tail are shared and neither side takes a lock. The queue holds
+// an SDLC window (modulo 8: 7 I-frames and the poll) for each 3274
+// of the worker, more than the 3705 sends before it gets a response.
+#define PUFRM_WIN    8                 // Queued frames per 3274
+struct PUFRAME {
+   int      len;                       // Frame length
+   int      station;                   // 3274 the frame is for
+   uint8_t  data[BUFLEN_3274];         // SDLC frame
+};
+struct PUWRK {
+   pthread_t tid;
+   int      id;                        // Worker number
+   int      efd;                       // eventfd, signalled for each queued frame
+   uint32_t head;                      // Frames put, written by the line thread only
+   uint32_t tail;                      // Frames got, written by the worker only
+   uint32_t mask;                      // Queue size - 1, size is a power of 2
+   uint32_t overrun;                   // Frames dropped, queue full
+   struct PUFRAME *frm;
+};
+struct PUWRK *wrk;                     // num_wrk workers
+
+// Spool output of a printer LU (-prt)
+#define SPOOL_BUFLEN (1024 * 1024)     // stdio buffer, written out at the end of each chain
+
+// Screen log of a held session (-hold n)
+#define SCRN_BUFLEN  BUFLEN_3270       // Writes kept to rebuild a screen
+#define SCRN_LOST    0xFFFFFFFF        // Screen log overflowed
+
+// Response time monitor histograms (-rtm n)
+#define RTM_NBKT   140                 // 4 buckets per power of 2, up to 2^35 usec
+struct RTMHIST {
+   uint64_t cnt;                       // Responses measured
+   uint64_t sum;                       // Total response time (usec)
+   uint64_t max;                       // Longest response time (usec)
+   uint32_t bkt[RTM_NBKT];             // Response time histogram
+};
+struct RTMHIST *rtm_pu;                // Per 3274
+struct RTMHIST *rtm_lu;                // Per LU, [3274 * num_lu + LU]
 
 void commadpt_read_tty(struct CB327x *i327x, struct IO3270 *ioblk, BYTE * bfr, BYTE lunum, int len);
 int send_packet(int csock, BYTE *buf, int len, char *caption);
-int connect_client (int *csockp, BYTE i327xnump, BYTE *lunump, BYTE *lunumr);
+int connect_client (struct TNNEG *tn, BYTE i327xnump, BYTE portnum);
+struct TNNEG *tn_accept (int csock);
+int tn_negotiate (struct TNNEG *tn);
 int SocketReadAct (int fd);
+struct IO3270 *io_get(void);
+int pu_station(int addr);
+void io_put(struct IO3270 *io);
 
 void make_seq (struct CB327x *pu2, BYTE *bufptr, int lunum);
+uint64_t tn_usec(void);
+void rtm_done(BYTE k, BYTE j);
+void scrn_keep(BYTE k, BYTE j, BYTE *data, uint32_t len, int eor);
+void scrn_replay(BYTE k, BYTE j);
+void release_lu(BYTE k, BYTE j);
+void spool_open(BYTE k, BYTE j);
+void spool_write(BYTE k, BYTE j, BYTE *data, uint32_t len, int eoc);
+int pacing_rsp(unsigned char BLU_req_buf[], unsigned char BLU_rsp_buf[]);
 
 /*-------------------------------------------------------------------*/
 /* Supported FMD NS Headers                                          */
@@ -186,7 +279,9 @@ uint8_t F2_REQCONT_Req[] = {
       0x01, 0x02, 0x84, 0x18, 0x00, 0x02, 0x00, 0x01, 0x70, 0x00, 0x17 };  // Request Contact
 
 // uint8_t PLU_rsp_buf[BUFLEN_3270]; /* PIU response buffer: TH + RH + RU  */
-int double_up_iac (BYTE *buf, int len);
+int send_3270 (struct LU327x *lu, BYTE *data, uint32_t len, int eor);
+int tn_codepage (char *arg);
+void lu_codepage (struct LU327x *lu, int punum, int lunum);
 
 /*-------------------------------------------------------------------*/
 /* Process FID2 PIU (TH + RH + RU (Req)                              */
@@ -202,7 +297,7 @@ int double_up_iac (BYTE *buf, int len);
 int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rsp_buf[]) {
    // BLU_req_buf[FD2_TH_0] must point to byte 0 of the TH.
    // Fcntl: RR / IFRAME / IFRAME + Cpoll
-   BYTE  Dbuf[BUFLEN_3270];            // Data buffer
+   BYTE  *RU_req;                      // RU request data
    int   RU_req_len;                   // RU request length
    int   RU_rsp_len;                   // RU response length
    int   RH_req_len;                   // RH request length
@@ -217,9 +312,10 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
    // Load Frame Control Field
    Fcntl = BLU_req_buf[FCntl];
    // Set the 3274 to the provided station address.
-   // If it is a broadcast (FF) the station address will be set to C1) (has to be improved)
-   if (BLU_req_buf[FAddr] == 0xFF) BLU_req_buf[FAddr] = 0xC1;
-   station = (BLU_req_buf[FAddr] & 0x0F) - 1;
+   // If it is a broadcast (FF) the station address will be set to the first 3274 (has to be improved)
+   if (BLU_req_buf[FAddr] == 0xFF) BLU_req_buf[FAddr] = sdlc_addr;
+   if ((station = pu_station(BLU_req_buf[FAddr])) < 0)
+      return 0;                                          // Not one of our 3274's
 
    if (Tdbg_flag == ON) {  // Trace Terminal Controller ?
       if ((Fcntl & 0x03) == SUPRV) {                     // Supervisory format ?
@@ -306,12 +402,12 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          if (BLU_rsp_stat == EMPTY) {         // Empty ?
             // RR received and no response pending.
             // SCAN all active LU's for any new input.
-            for (int k = pu2[station]->last_lu; k < MAXLU; k++) {
-               if ((pu2[station]->lu_fd[k] > 0) && (pu2[station]->readylu[k] == 1)) {
-                  if ((pu2[station]->actlu[k] == 1) && (ioblk[pu2[station]->punum][k]->inpbufl > 0)) {
+            for (int k = pu2[station]->last_lu; k < num_lu; k++) {
+               if ((pu2[station]->lu[k].lu_fd > 0) && (pu2[station]->lu[k].readylu == 1)) {
+                  if ((pu2[station]->lu[k].actlu == 1) && (pu2[station]->lu[k].io->inpbufl > 0)) {
 
                      // TN3270 input found. Build FID2 & Rsp RU
-                     RU_rsp_len = ioblk[pu2[station]->punum][k]->inpbufl;
+                     RU_rsp_len = pu2[station]->lu[k].io->inpbufl;
 
                      /* Construct 3 byte LH */
                      BLU_rsp_ptr = 0;                    // Reset pointer
@@ -324,7 +420,7 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
                      /* Construct 6 byte FID2 TH */
                      BLU_rsp_buf[FD2_TH_0] = 0x2E;       // FID2
                      BLU_rsp_buf[FD2_TH_1] = 0x00;       // Reserved
-                     BLU_rsp_buf[FD2_TH_daf] = pu2[station]->daf_addr1[k]; //  daf
+                     BLU_rsp_buf[FD2_TH_daf] = pu2[station]->lu[k].daf_addr1; //  daf
                      BLU_rsp_buf[FD2_TH_oaf] = k+2;      // oaf
                      BLU_rsp_buf[FD2_TH_scf0] = 0x00;    // seq #
                      BLU_rsp_buf[FD2_TH_scf1] = 0x00;
@@ -334,13 +430,13 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
                      BLU_rsp_buf[FD2_RH_0] = 0x00;
                      BLU_rsp_buf[FD2_RH_0] |= 0x03;      // Indicate this is first and last in chain
                      BLU_rsp_buf[FD2_RH_1] = 0x80;       // We need a response...
-                     pu2[station]->dri[k] = ON;          // ...so remember this
+                     pu2[station]->lu[k].dri = ON;       // ...so remember this
                      BLU_rsp_buf[FD2_RH_2] = 0x20;       // Indicate Change Direction
                      BLU_rsp_ptr = BLU_rsp_ptr + 6 + 3;  // Update BLU pointer
 
                      /* Copy 3270 input buffer as RU (Rsp) after TH and RH */
                      for (int j = 0; j < RU_rsp_len; j++)
-                        BLU_rsp_buf[BLU_rsp_ptr++] = ioblk[pu2[station]->punum][k]->inpbuf[j];
+                        BLU_rsp_buf[BLU_rsp_ptr++] = pu2[station]->lu[k].io->inpbuf[j];
 
                      /* Construct 3 byte LT */
                      BLU_rsp_buf[BLU_rsp_ptr++] = 0x47;  // FCS High
@@ -351,7 +447,7 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
                         //BLU_rsp_buf[FCntl] = CFinal;   // Set final bit
                         BLU_rsp_stat = FILLED;           // ...Indicate there is data to send.
                      }
-                     ioblk[pu2[station]->punum][k]->inpbufl = 0; // 3270 input buffer has been processed, so reset length.
+                     pu2[station]->lu[k].io->inpbufl = 0; // 3270 input buffer has been processed, so reset length.
 
                      if (Tdbg_flag == ON) {              // Trace Terminal Controller ?
                         fprintf(T_trace, "PIU4: <= 3270 Data [%d]: \nPIU4: ", BLU_rsp_len);
@@ -367,13 +463,13 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
                         The next RR will start with the one following the last
                         If all LU's have been scanned, start again with the first LU */
                      pu2[station]->last_lu = k + 1;
-                     if (pu2[station]->last_lu == MAXLU)
+                     if (pu2[station]->last_lu == num_lu)
                         pu2[station]->last_lu = 0;
                      /* Send 3270 data response to host */
                      return(BLU_rsp_len);                // Send 3270 response BLU to host
-                  } // End if pu2[station]->actlu[k] == 1
-               } else if (((pu2[station]->lu_fd[k] > 0) && (pu2[station]->readylu[k] == 2)) ||
-                           (pu2[station]->readylu[k] > 2)) { // End if pu2[station]->lu_fd[k] > 0
+                  } // End if pu2[station]->lu[k].actlu == 1
+               } else if (((pu2[station]->lu[k].lu_fd > 0) && (pu2[station]->lu[k].readylu == 2)) ||
+                           (pu2[station]->lu[k].readylu > 2)) { // End if pu2[station]->lu[k].lu_fd > 0
                   /* This section handles a LU "power on" (i.e. 3270 terminal connect) or           */
                   /*  a LU "power off" (i.e. 3270 terminal disconnect)                              */
                   /* A SNA Nofify command with LU "powered on" is send to VTAM if readylu=2         */
@@ -392,7 +488,7 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
                   /* Construct 6 byte FID2 TH */
                   BLU_rsp_buf[FD2_TH_0] = 0x2E;          // FID2
                   BLU_rsp_buf[FD2_TH_1] = 0x00;          // Reserved
-                  BLU_rsp_buf[FD2_TH_daf] = pu2[station]->daf_addr1[k]; //  daf
+                  BLU_rsp_buf[FD2_TH_daf] = pu2[station]->lu[k].daf_addr1; //  daf
                   BLU_rsp_buf[FD2_TH_oaf] = k+2;         // oaf
                   BLU_rsp_buf[FD2_TH_scf0] = 0x00;       // seq #
                   BLU_rsp_buf[FD2_TH_scf1] = 0x00;
@@ -404,28 +500,28 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
                   BLU_rsp_buf[FD2_RH_0] |= 0x03;         // Indicate this is first and last in chain
                   BLU_rsp_buf[FD2_RH_1] = 0x00;          // We do not need a response...
                   //BLU_rsp_buf[FD2_RH_1] = 0x80;          // We need a response...
-                  //pu2[station]->dri[k] = ON;             // ...so remember this
+                  //pu2[station]->lu[k].dri = ON;          // ...so remember this
                   BLU_rsp_buf[FD2_RH_2] = 0x20;          // Indicate Change Direction
                   BLU_rsp_ptr = BLU_rsp_ptr + 6 + 3;     // Update BLU pointer
 
                   /* This section handles LU Power On and LU Power off     */
-                  if (pu2[station]->readylu[k] == 4) {  // There is still an activer BIND, so prepare UNBIND
-                    //BLU_rsp_buf[FD2_TH_daf] = pu2[station]->bindflag[k];      //  copy DAF of LU at the other end
+                  if (pu2[station]->lu[k].readylu == 4) { // There is still an activer BIND, so prepare UNBIND
+                    //BLU_rsp_buf[FD2_TH_daf] = pu2[station]->lu[k].bindflag;   //  copy DAF of LU at the other end
                     BLU_rsp_buf[FD2_TH_daf] = 0x00;                             //  SSCP
                     memcpy(&BLU_rsp_buf[BLU_rsp_ptr], F2_TERMSELF_Req, sizeof(F2_TERMSELF_Req));
-                    pu2[station]->bindflag[k] = 0;     //  reset bindflag
+                    pu2[station]->lu[k].bindflag = 0;  //  reset bindflag
                     BLU_rsp_ptr = BLU_rsp_ptr + sizeof(F2_TERMSELF_Req);
-                  } // End  if (pu2[station]->readylu[k] == 4)
-                  if (pu2[station]->readylu[k] == 3)  {  // Power off, no BIND active, so sent NOTIFY for power off
+                  } // End  if (pu2[station]->lu[k].readylu == 4)
+                  if (pu2[station]->lu[k].readylu == 3)  { // Power off, no BIND active, so sent NOTIFY for power off
                     memcpy(&BLU_rsp_buf[BLU_rsp_ptr], F2_NOTIFY_Req, sizeof(F2_NOTIFY_Req)); //
                     BLU_rsp_buf[FD2_RU_0 + 5] = 0x01;        // indicate Power off.
                     BLU_rsp_ptr = BLU_rsp_ptr + sizeof(F2_NOTIFY_Req);
-                  } // End if (pu2[station]->readylu[k] == 3)
-                  if (pu2[station]->readylu[k] == 2)  {  // Power on after ACTLU, send NOTIFY for power on
+                  } // End if (pu2[station]->lu[k].readylu == 3)
+                  if (pu2[station]->lu[k].readylu == 2)  { // Power on after ACTLU, send NOTIFY for power on
                     memcpy(&BLU_rsp_buf[BLU_rsp_ptr], F2_NOTIFY_Req, sizeof(F2_NOTIFY_Req)); //
                     BLU_rsp_buf[FD2_RU_0 + 5] = 0x03;        // indicate Power on.
                     BLU_rsp_ptr = BLU_rsp_ptr + sizeof(F2_NOTIFY_Req);
-                  } // End if (pu2[station]->readylu[k] == 2)
+                  } // End if (pu2[station]->lu[k].readylu == 2)
                   /*                                      */
                   /* Construct 3 byte LT */
                   BLU_rsp_buf[BLU_rsp_ptr++] = 0x47;     // FCS High
@@ -435,16 +531,16 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
                   if (!(BLU_req_buf[FCntl] & CPoll)) {   // No polling? - Unlikely since this is RR, but just in case...
                      BLU_rsp_stat = FILLED;              // ...Indicate there is data to send.
                   }
-                  if (pu2[station]->readylu[k] > 1)
-                     pu2[station]->readylu[k]--;          // Indicate next phase (1 = active, 2 powering on, 3 = powering off, 4 = unbind)
+                  if (pu2[station]->lu[k].readylu > 1)
+                     pu2[station]->lu[k].readylu--;       // Indicate next phase (1 = active, 2 powering on, 3 = powering off, 4 = unbind)
                   /* Cycle through all LU's 1 by 1 to check if there is input. */
                   /* Keep a pointer to the last lu that has been scanned. */
                   /* The next RR will start with the one following the last */
                   /* If all LU's have been scanned, start again with the first LU */
                   pu2[station]->last_lu = k + 1;
-                  if (pu2[station]->last_lu == MAXLU) pu2[station]->last_lu = 0;
+                  if (pu2[station]->last_lu == num_lu) pu2[station]->last_lu = 0;
                   return(BLU_rsp_len);                   // Send 3270 response BLU to host
-               }  // End if ((pu2[station]->lu_fd[k] > 0)
+               }  // End if ((pu2[station]->lu[k].lu_fd > 0)
             }  // End for int k=0
 
             // No pending TN3270 input found, just send a RR + CFinal.
@@ -497,6 +593,10 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
    //================================================================
    pu2[station]->lu_addr0 = 0x00;
    pu2[station]->lu_addr1 = BLU_req_buf[FD2_TH_daf];
+   if (((Fcntl & 0x01) == IFRAME) && (pu2[station]->lu_addr1 >= num_lu + 2)) {
+      printf("\rPU2: PIU for LU %02X ignored, 3274-%02X has %d LU's\n", pu2[station]->lu_addr1, station, num_lu);
+      return 0;
+   }
 
    if ((Fcntl & 0x01) == IFRAME) {
       // Determine THRH type
@@ -524,14 +624,14 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
       /**********************************************************/
       /*** PROCESS IFRAME as SNA cmd, Resp or as TN3270 DATA STREAM ***/
       /**********************************************************/
-      if (Tdbg_flag == ON)                                          // Trace Terminal Controller ?
-         fprintf(T_trace, "DRI %d  \n", pu2[station]->dri[pu2[station]->lu_addr1 - 2]);
-      if ((THRH_type == DATA_ONLY) &&
-          (pu2[station]->dri[pu2[station]->lu_addr1 - 2] == ON)) {  // Response?
+      if ((Tdbg_flag == ON) && (pu2[station]->lu_addr1 >= 2))      // Trace Terminal Controller ?
+         fprintf(T_trace, "DRI %d  \n", pu2[station]->lu[pu2[station]->lu_addr1 - 2].dri);
+      if ((THRH_type == DATA_ONLY) && (pu2[station]->lu_addr1 >= 2) &&
+          (pu2[station]->lu[pu2[station]->lu_addr1 - 2].dri == ON)) { // Response?
          if (((BLU_req_buf[FD2_RH_0] & 0x80) == 0x80) &&            // Should be a Response PIU ...
             ((BLU_req_buf[FD2_RH_1] & 0x80) == 0x80)) {             // ...with DRI on
             // Reset the pending response.
-            pu2[station]->dri[pu2[station]->lu_addr1 - 2] = OFF;    // Indicate Response received
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].dri = OFF; // Indicate Response received
             return 0;
          }
       }
@@ -562,18 +662,18 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          chainrh = 3;                                    // Chaining includes a RH for middle and last chains (segments do not).
          if (BLU_req_buf[FD2_RH_0] & 0x02) {
             THRH_type = DATA_FIRST;
-            pu2[station]->chaining[pu2[station]->lu_addr1 - 2] = ON;  // Remember we are in a chain
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].chaining = ON; // Remember we are in a chain
             if (Tdbg_flag == ON)                         // Trace Terminal Controller ?
                fprintf(T_trace, "PIU0: => THRH type changed to %d because of chaining. \n", THRH_type);
          }
          if (BLU_req_buf[FD2_RH_0] & 0x01) {
             THRH_type = DATA_LAST;
-            pu2[station]->chaining[pu2[station]->lu_addr1 - 2] = OFF;    // No longer in a chain
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].chaining = OFF; // No longer in a chain
             if (Tdbg_flag == ON)                         // Trace Terminal Controller ?
                fprintf(T_trace, "PIU0: => THRH type changed to %d because of chaining. \n", THRH_type);
          }
          if (((BLU_req_buf[FD2_RH_0] & 03) == 0x00) &&
-              (pu2[station]->chaining[pu2[station]->lu_addr1 - 2] == ON)) {
+              (pu2[station]->lu[pu2[station]->lu_addr1 - 2].chaining == ON)) {
             THRH_type = DATA_MIDDLE;
             if (Tdbg_flag == ON)                         // Trace Terminal Controller ?
                fprintf(T_trace, "PIU0: => THRH type changed to %d because of chaining. \n", THRH_type);
@@ -586,48 +686,33 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
       // ****************************************************
       // ****************************************************
       // RU is type DATA.
-      // Get RU_req_len by searching for x'470F7E'. (CRC + EFlag)
-      // and copy data to the Dbuf.
+      // The RU runs up to the 3 byte LT (FCS + EFlag) that ends the frame;
+      // pass it to the terminal straight from the BLU.
       if ((THRH_type == DATA_ONLY) || (THRH_type == DATA_FIRST) ||
           (THRH_type == DATA_MIDDLE) || (THRH_type == DATA_LAST)) {
          if (Tdbg_flag == ON)                            // Trace Terminal Controller ?
             fprintf(T_trace, "PIU0: => IFRAME data type received. \n");
          if ((THRH_type == DATA_ONLY) || (THRH_type == DATA_FIRST)) {  // only or first segment ?
-            i = 0;
             // TH & RH when first or only segment
-            while (!((BLU_req_buf[PIU + FD2_TH_len + FD2_RH_len + i+0] == 0x47) &&
-                     (BLU_req_buf[PIU + FD2_TH_len + FD2_RH_len + i+1] == 0x0F) &&
-                     (BLU_req_buf[PIU + FD2_TH_len + FD2_RH_len + i+2] == 0x7E))) {
-               Dbuf[i] = BLU_req_buf[PIU + FD2_TH_len + FD2_RH_len + i];
-               i++;
-               // Save RH for building a response RH later
-               saved_FD2_RH_0 = BLU_req_buf[FD2_RH_0];
-               saved_FD2_RH_1 = BLU_req_buf[FD2_RH_1];
-            }
-            RU_req_len = i;
+            RU_req = &BLU_req_buf[PIU + FD2_TH_len + FD2_RH_len];
+            RU_req_len = BLU_req_len - (PIU + FD2_TH_len + FD2_RH_len) - 3;
+            // Save RH for building a response RH later
+            saved_FD2_RH_0 = BLU_req_buf[FD2_RH_0];
+            saved_FD2_RH_1 = BLU_req_buf[FD2_RH_1];
          }  // End if ((THRH_type == DATA_ONLY)
 
          if ((THRH_type == DATA_MIDDLE) || (THRH_type == DATA_LAST)) {  // middle or last segment ?
-            i = 0;
             // Only a TH when middle or last segment, but if chaining: There will also be a RH.
-            while (!((BLU_req_buf[PIU + FD2_TH_len + chainrh + i+0] == 0x47) &&
-                     (BLU_req_buf[PIU + FD2_TH_len + chainrh + i+1] == 0x0F) &&
-                     (BLU_req_buf[PIU + FD2_TH_len + chainrh + i+2] == 0x7E))) {
-               Dbuf[i] = BLU_req_buf[PIU + FD2_TH_len + chainrh + i];
-               i++;
-            }
-            RU_req_len = i;
+            RU_req = &BLU_req_buf[PIU + FD2_TH_len + chainrh];
+            RU_req_len = BLU_req_len - (PIU + FD2_TH_len + chainrh) - 3;
          }  // End if THRH type = DATA_MIDDLE || THRH_type = DATA_LAST
-
-         if ((THRH_type == DATA_ONLY) || (THRH_type == DATA_LAST)) {   // only or last seg ?
-            Dbuf[RU_req_len++] = IAC;
-            Dbuf[RU_req_len++] = EOR_MARK;
-         }
+         if (RU_req_len < 0)                             // Frame shorter than its headers
+            RU_req_len = 0;
 
          if (Tdbg_flag == ON) {                          // Trace Terminal Controller ?
             fprintf(T_trace, "PIU5: 3270 Data => [%d]: \nPIU5: ", RU_req_len);
             for ( i = 0; i < RU_req_len; i++) {
-               fprintf(T_trace, "%02X ", (int) Dbuf[i] & 0xFF);
+               fprintf(T_trace, "%02X ", (int) RU_req[i] & 0xFF);
                if ((i + 1) % 16 == 0)
                   fprintf(T_trace, " \nPIU5: ");
             }
@@ -635,8 +720,18 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
             fflush(T_trace);
          }
          //************************************************************
-         if   (pu2[station]->lu_fd[pu2[station]->lu_addr1 - 2] > 0)
-            send_packet (pu2[station]->lu_fd[pu2[station]->lu_addr1 - 2], (BYTE *) Dbuf, RU_req_len, "3270 Data");
+         // Segments are gathered until the only or last one, which ends the record with IAC EOR
+         if   (pu2[station]->lu[pu2[station]->lu_addr1 - 2].rtm_t0 != 0)  // First PIU since the terminal's AID
+            rtm_done(station, pu2[station]->lu_addr1 - 2);
+         if   (hold_secs > 0)                            // Keep the screen for a reconnecting client
+            scrn_keep(station, pu2[station]->lu_addr1 - 2, RU_req, RU_req_len,
+                      (THRH_type == DATA_ONLY) || (THRH_type == DATA_LAST));
+         if   (pu2[station]->lu[pu2[station]->lu_addr1 - 2].lu_fd > 0)
+            send_3270 (&pu2[station]->lu[pu2[station]->lu_addr1 - 2], RU_req, RU_req_len,
+                       (THRH_type == DATA_ONLY) || (THRH_type == DATA_LAST));
+         else if (pu2[station]->lu[pu2[station]->lu_addr1 - 2].spool != NULL)  // Printer LU (-prt)
+            spool_write(station, pu2[station]->lu_addr1 - 2, RU_req, RU_req_len,
+                        (THRH_type == DATA_ONLY) || (THRH_type == DATA_LAST));
          //************************************************************
 
          //*******************************************************************************************************
@@ -649,11 +744,15 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
 
          if (((chainrh == 3) && (THRH_type == DATA_LAST)) || (THRH_type == DATA_ONLY)) {  // If last or only segment check for DR1
             if ((BLU_req_buf[FD2_RH_1] & 0x80) != 0x80) {   // Disregard if not DR1 requested
-               return 0;
+               return pacing_rsp(BLU_req_buf, BLU_rsp_buf);  // ...but answer a pacing request
             }
          }
-         if (((chainrh == 3) && (THRH_type == DATA_FIRST)) || (THRH_type == DATA_MIDDLE))
-            return 0;                                       // Disregard if 1st in chain or middle segment/chain
+         if (((chainrh == 3) && (THRH_type == DATA_FIRST)) || (THRH_type == DATA_MIDDLE)) {
+            if (chainrh != 3)
+               return 0;                                    // Disregard if middle segment
+            saved_FD2_RH_1 &= 0xFE;                         // Pacing is answered now, not again at the end of the chain
+            return pacing_rsp(BLU_req_buf, BLU_rsp_buf);    // Disregard if 1st or middle in chain, but answer a pacing request
+         }
 
          if ((chainrh != 3) && (THRH_type == DATA_LAST)) {  // A last segment will flag that there is a response
             BLU_rsp_stat = FILLED;                          // Update BLU buf status
@@ -741,21 +840,22 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
             /* Save daf as our own net addr */
             //pu2[station]->lu_addr0 = 0x00;
             //pu2[station]->lu_addr1 = BLU_req_buf[FD2_TH_daf];
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
             /* Save oaf as our sscp net addr */
             pu2[station]->sscp_addr0 = 0x00;
             pu2[station]->sscp_addr1 = BLU_req_buf[FD2_TH_oaf];
             /*            */
             // pu2[station]->lu_sscp_seqn = 0;
-            pu2[station]->bindflag[pu2[station]->lu_addr1 - 2] = 0;
-            pu2[station]->initselfflag[pu2[station]->lu_addr1 - 2] = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].bindflag = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].initselfflag = 0;
             // Send +Rsp.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_ACTLU_Rsp, sizeof(F2_ACTLU_Rsp));
-            if (pu2[station]->lu_fd[pu2[station]->lu_addr1 - 2] > 0)     // If LU connected (i.e. x3270 telnet)
+            if ((pu2[station]->lu[pu2[station]->lu_addr1 - 2].lu_fd > 0) ||   // If LU connected (i.e. x3270 telnet)
+                (pu2[station]->lu[pu2[station]->lu_addr1 - 2].spool != NULL))  // or a printer LU
                BLU_rsp_buf[FD2_RU_0 + 10] = 0x03;        // indicate Power on
             else                                         // else
                BLU_rsp_buf[FD2_RU_0 + 10] = 0x01;        // indicate Power off
-            pu2[station]->actlu[pu2[station]->lu_addr1 - 2] = 1;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].actlu = 1;
             BLU_rsp_ptr = BLU_rsp_ptr + sizeof(F2_ACTLU_Rsp);    // Update pointer
          }  // End if BLU_buf (ACTLU)
 
@@ -763,15 +863,15 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          /*** BIND            ***/
          /***********************/
          if (BLU_req_buf[FD2_RU_0] == 0x31) {
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
-            pu2[station]->lu_lu_seqn[pu2[station]->lu_addr1 - 2] = 0;
-            pu2[station]->bindflag[pu2[station]->lu_addr1 - 2] = 1;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].lu_lu_seqn = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].bindflag = 1;
             // If not FM3 profile or cols < 24 or rows < 80, respond with -BIND
             if ((BLU_req_buf[FD2_RU_0 + 2] != 0x03) ||
                 (BLU_req_buf[FD2_RU_0 + 20] < 0x18) ||
                 (BLU_req_buf[FD2_RU_0 + 21] < 0x50 )) {
                    BLU_rsp_buf[FD2_RH_1] = BLU_req_buf[FD2_RH_1] | 0x10;  // -Rsp
-                   pu2[station]->bindflag[pu2[station]->lu_addr1 - 2] = 0;
+                   pu2[station]->lu[pu2[station]->lu_addr1 - 2].bindflag = 0;
                }
             // Copy BIND to RU.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_BIND_Rsp, sizeof(F2_BIND_Rsp));
@@ -784,8 +884,8 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          /********************************/
          if (BLU_req_buf[FD2_RU_0] == 0xA0) {
             /* Save oaf from SDT request */
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
-            pu2[station]->lu_lu_seqn[pu2[station]->lu_addr1 - 2] = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].lu_lu_seqn = 0;
             // Copy +SDT to RU.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_SDT_Rsp, sizeof(F2_SDT_Rsp));
 
@@ -797,8 +897,8 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          /*******************************/
          if (BLU_req_buf[FD2_RU_0] == 0xA1) {
             /* Save oaf from request */
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
-            pu2[station]->lu_lu_seqn[pu2[station]->lu_addr1 - 2] = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].lu_lu_seqn = 0;
             // Copy +CLEAR to RU.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_CLEAR_Rsp, sizeof(F2_CLEAR_Rsp));
 
@@ -810,7 +910,7 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          /*******************************/
          if (BLU_req_buf[FD2_RU_0] == 0xC9) {
             /* Save oaf from request */
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
             // Copy +SIGNAL to RU.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_SIGNAL_Rsp, sizeof(F2_SIGNAL_Rsp));
 
@@ -822,7 +922,7 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          /*******************************/
          if (BLU_req_buf[FD2_RU_0] == 0x80) {
             /* Save oaf from request */
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
             // Copy +QEC to RU.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_QEC_Rsp, sizeof(F2_QEC_Rsp));
             BLU_rsp_buf[FD2_RH_0] &= 0xFB;                   // Reset SDI bit
@@ -836,7 +936,7 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          /*******************************/
          if (BLU_req_buf[FD2_RU_0] == 0x81) {
             /* Save oaf from request */
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
             // Copy +QC to RU.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_QC_Rsp, sizeof(F2_QC_Rsp));
             BLU_rsp_buf[FD2_RH_0] &= 0xFB;                   // Reset SDI bit
@@ -859,13 +959,13 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          /*******************************/
          if (BLU_req_buf[FD2_RU_0] == 0x0E) {
             /* Save oaf from request */
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
-            pu2[station]->lu_lu_seqn[pu2[station]->lu_addr1 - 2] = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].lu_lu_seqn = 0;
             // Copy +DACTLU to RU.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_DACTLU_Rsp, sizeof(F2_DACTLU_Rsp));
 
             BLU_rsp_ptr = BLU_rsp_ptr + sizeof(F2_DACTLU_Rsp);   // Update pointer
-            pu2[station]->actlu[pu2[station]->lu_addr1 - 2] = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].actlu = 0;
          }
 
          /**************************************/
@@ -873,15 +973,15 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
          /**************************************/
          //if (BLU_req_buf[FD2_RU_0] == 0x32 && BLU_req_buf[FD2_RU_1] != 0x02) {
          if (BLU_req_buf[FD2_RU_0] == 0x32) {
-            pu2[station]->bindflag[pu2[station]->lu_addr1 - 2 ] = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2 ].bindflag = 0;
             /* Save oaf from UNBIND request */
-            pu2[station]->daf_addr1[pu2[station]->lu_addr1 - 2] = BLU_req_buf[FD2_TH_oaf];
-            pu2[station]->lu_lu_seqn[pu2[station]->lu_addr1 - 2] = 0;
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].daf_addr1 = BLU_req_buf[FD2_TH_oaf];
+            pu2[station]->lu[pu2[station]->lu_addr1 - 2].lu_lu_seqn = 0;
             // Copy +UNBIND to RU.
             memcpy(&BLU_rsp_buf[FD2_RU_0], F2_UNBIND_Rsp, sizeof(F2_UNBIND_Rsp));
 
             BLU_rsp_ptr = BLU_rsp_ptr + sizeof(F2_UNBIND_Rsp);   // Update pointer
-            //pu2[station]->readylu[pu2[station]->lunum] = 2;      // Set LU in power off state to force a NOTIFY command.
+            //pu2[station]->lu[pu2[station]->lunum].readylu = 2;   // Set LU in power off state to force a NOTIFY command.
          }
       }  // End if ((BLU_req_buf[FD2_RH_0] & (unsigned char)0xFC) != 0x00)
 
@@ -919,31 +1019,66 @@ int proc_PIU (unsigned char BLU_req_buf[], int BLU_req_len, unsigned char BLU_rs
 }
 //#####################################################################
 
+/*-------------------------------------------------------------------*/
+/* Isolated pacing response (IPR) to a request that asks for pacing  */
+/* (PI in the RH) but gets no other response. Without it VTAM stops  */
+/* sending once the pacing window is used up.                        */
+/* Returns the length of the response frame, 0 if none is due.       */
+/*-------------------------------------------------------------------*/
+int pacing_rsp(unsigned char BLU_req_buf[], unsigned char BLU_rsp_buf[]) {
+   if ((BLU_req_buf[FD2_RH_1] & 0x01) == 0)           // No pacing indicator
+      return 0;
+   /* Construct 3 byte SDLC LH */
+   BLU_rsp_buf[BFlag] = 0x7E;                         // Bflag
+   BLU_rsp_buf[FAddr] = BLU_req_buf[FAddr];           // Sec Station Addr
+   BLU_rsp_buf[FCntl] = BLU_req_buf[FCntl];           // Control byte
+   /* Construct 6 byte FID2 TH */
+   BLU_rsp_buf[FD2_TH_0]    = BLU_req_buf[FD2_TH_0] | 0x0C;  // FID2 & only segment
+   BLU_rsp_buf[FD2_TH_1]    = BLU_req_buf[FD2_TH_1];     // Reserved
+   BLU_rsp_buf[FD2_TH_daf]  = BLU_req_buf[FD2_TH_oaf];   // oaf -> daf
+   BLU_rsp_buf[FD2_TH_oaf]  = BLU_req_buf[FD2_TH_daf];   // daf -> oaf
+   BLU_rsp_buf[FD2_TH_scf0] = BLU_req_buf[FD2_TH_scf0];  // seq #
+   BLU_rsp_buf[FD2_TH_scf1] = BLU_req_buf[FD2_TH_scf1];
+   /* Construct 3 byte FID2 RH, no RU */
+   BLU_rsp_buf[FD2_RH_0] = 0x83;                      // Response, FMD, only in chain
+   BLU_rsp_buf[FD2_RH_1] = 0x01;                      // Pacing indicator
+   BLU_rsp_buf[FD2_RH_2] = 0x00;
+   /* Construct 3 byte SDLC LT */
+   BLU_rsp_buf[FD2_RU_0]     = 0x47;                  // FCS High
+   BLU_rsp_buf[FD2_RU_0 + 1] = 0x0F;                  // FCS Low
+   BLU_rsp_buf[FD2_RU_0 + 2] = 0x7E;                  // Eflag
+   if (Tdbg_flag == ON)    // Trace Terminal Controller ?
+      fprintf(T_trace, "PIU3: <= Isolated pacing response to LU %02X\n", BLU_req_buf[FD2_TH_daf]);
+   return FD2_RU_0 + 3;
+}
+
 
 /*-------------------------------------------------------------------*/
 /* Subroutine to create unique PIU sequence numbers.                 */
 /*-------------------------------------------------------------------*/
 void make_seq (struct CB327x * pu2, BYTE * bufptr, int lunum) {
-   bufptr[FD2_TH_scf0] = (unsigned char)(++pu2->lu_lu_seqn[lunum] >> 8) & 0xff;
-   bufptr[FD2_TH_scf1] = (unsigned char)(  pu2->lu_lu_seqn[lunum]     ) & 0xff;
+   bufptr[FD2_TH_scf0] = (unsigned char)(++pu2->lu[lunum].lu_lu_seqn >> 8) & 0xff;
+   bufptr[FD2_TH_scf1] = (unsigned char)(  pu2->lu[lunum].lu_lu_seqn     ) & 0xff;
 }
 
 /********************************************************************/
 /* Procedure to 'iml' the 3274                                      */
 /********************************************************************/
 int proc_PU2iml() {
-   for (BYTE j = 0; j < MAXSNAPU; j++) {
+   for (BYTE j = 0; j < num_pu; j++) {
       pu2[j] =  malloc(sizeof(struct CB327x));
       //Init sockets for LU's
-      for (BYTE i = 0; i < MAXLU; i++) {
-         pu2[j]->lu_fd[i] = 0;
-         pu2[j]->readylu[i] = 0;
-      } // End for i = 0
+      pu2[j]->lu = calloc(num_lu, sizeof(struct LU327x));
+      for (BYTE i = 0; i < num_lu; i++)
+         lu_codepage(&pu2[j]->lu[i], j, i);
       pu2[j]->lunum = 0;
       pu2[j]->last_lu = 0;
       pu2[j]->punum = j;
       pu2[j]->seq_Nr = 0;    /* Intitialize sequence receive number */
       pu2[j]->seq_Ns = 0;    /* Intitialize sequence send number    */
+      for (BYTE i = 0; i < num_lu; i++)
+         if (prt_path[j][i] != NULL)
+            spool_open(j, i);
    } // End for j = 0
 
    getifaddrs(&nwaddr);      /* get network address */
@@ -956,7 +1091,7 @@ int proc_PU2iml() {
    } // End   for ifa = nwaddr
    printf("\nPU2: Using network Address %s on %s for 3270 connections\n", ipaddr, ifa->ifa_name);
 
-   for (BYTE j = 0; j < MAXSNAPU; j++) {
+   for (BYTE j = 0; j < num_pu; j++) {
       if ((pu2[j]->pu_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
          printf("\nPU2: Endpoint creation for 3274 failed with error %s ", strerror(errno));
       /* Reuse the address regardless of any */
@@ -966,7 +1101,7 @@ int proc_PU2iml() {
       /* Bind the socket */
       sin1.sin_family=AF_INET;
       sin1.sin_addr.s_addr = inet_addr(ipaddr);
-      sin1.sin_port=htons(32741+j);
+      sin1.sin_port=htons(32741 + sdlc_line * MAXSNAPU + j);
       if (bind(pu2[j]->pu_fd, (struct sockaddr *)&sin1, sizeof(sin1)) < 0) {
           printf("\nPU2: Bind 3274-%01X socket failed\n\r", j);
           free(pu2[j]);
@@ -978,141 +1113,689 @@ int proc_PU2iml() {
           free(pu2[j]);
           return -2;
       }
-      // Add polling events for the port
-      pu2[j]->epoll_fd = epoll_create(1);
-      if (pu2[j]->epoll_fd == -1) {
-         printf("\nPU2: failed to created the 3274-%01X epoll file descriptor\n\r", j);
-         free(pu2[j]);
-         return -3;
-      }
+      // Add polling events for the port, the worker of the 3274 does that with -wrk
       event.events = EPOLLIN;
-      event.data.fd = pu2[j]->pu_fd;
-      if (epoll_ctl(pu2[j]->epoll_fd, EPOLL_CTL_ADD, pu2[j]->pu_fd, &event) == -1) {
+      event.data.u32 = EV_PU | (j << 8);
+      if ((num_wrk == 0) && (epoll_ctl(pu_epfd, EPOLL_CTL_ADD, pu2[j]->pu_fd, &event) == -1)) {
          printf("\nPU2: Add polling event failed for 3274-%01X with error %s \n\r", j, strerror(errno));
-         close(pu2[j]->epoll_fd);
          free(pu2[j]);
          return -4;
       }
-      printf("\rPU2: 3274-%01X IML ready. TN3270 can connect to port %d \n\r", j,32741+j);
+      printf("\rPU2: 3274-%02X IML ready. SDLC address %02X, TN3270 can connect to port %d \n\r", j, sdlc_addr + j, 32741 + sdlc_line * MAXSNAPU + j);
    }  // End for j=0
    return 0;
  }
+/********************************************************************/
+/* Printer LU's (-prt)                                              */
+/* A printer LU has no TN3270 client. It is powered on from IML and */
+/* the RU's the host sends it, the SCS or 3270 print data stream,   */
+/* are appended to its spool file, or written to a command when the */
+/* name starts with '|'. Output is buffered and written at the end  */
+/* of each chain, so the host gets its responses without waiting    */
+/* on a terminal.                                                   */
+/********************************************************************/
+void spool_open(BYTE k, BYTE j) {
+   struct LU327x *lu = &pu2[k]->lu[j];
+
+   lu->spool_pipe = (prt_path[k][j][0] == '|');
+   if (lu->spool_pipe) {
+      signal(SIGPIPE, SIG_IGN);                            /* A failing command must not stop us      */
+      lu->spool = popen(prt_path[k][j] + 1, "w");
+   } else
+      lu->spool = fopen(prt_path[k][j], "ab");
+   if (lu->spool == NULL) {
+      printf("\rPU2: Cannot open spool %s for LU %02X of 3274-%01X: %s\n", prt_path[k][j], j, k, strerror(errno));
+      return;
+   }
+   setvbuf(lu->spool, NULL, _IOFBF, SPOOL_BUFLEN);
+   lu->readylu = 1;                                        /* Powered on, ACTLU will report it        */
+   printf("\rPU2: LU %02X of 3274-%01X is a printer, spooled to %s\n", j, k, prt_path[k][j]);
+}
+
+/* Append print data for LU j; eoc is set on the last RU of a chain  */
+void spool_write(BYTE k, BYTE j, BYTE *data, uint32_t len, int eoc) {
+   struct LU327x *lu = &pu2[k]->lu[j];
+
+   fwrite(data, 1, len, lu->spool);
+   if (eoc)
+      fflush(lu->spool);
+   if (ferror(lu->spool)) {
+      printf("\rPU2: Writing spool %s of LU %02X failed, printer powered off\n", prt_path[k][j], j);
+      if (lu->spool_pipe)
+         pclose(lu->spool);
+      else
+         fclose(lu->spool);
+      lu->spool = NULL;
+      release_lu(k, j);
+   }
+}
+
+/********************************************************************/
+/* Procedure to find the next free LU of a PU for a new connection  */
+/* and to stop or resume polling the PU port accordingly.           */
+/********************************************************************/
+void next_lu(BYTE k) {
+   pu2[k]->lunum = 0xFF;                                   /* preset to no LU's availble          */
+   for (BYTE j = 0; j < num_lu; j++) {
+      if ((pu2[k]->lu[j].lu_fd < 1) && (pu2[k]->lu[j].tn == NULL) && (pu2[k]->lu[j].held == 0) &&
+          (pu2[k]->lu[j].spool == NULL)) pu2[k]->lunum = j;
+   }  // end for BYTE j
+   if (pu2[k]->lunum == 0xFF) {
+      printf("\rPU2: No more LU ports available. New connections rejected until a LU port is released;\n");
+      event.events = 0;                                    /* Stop polling the PU port until then */
+   } else
+      event.events = EPOLLIN;
+   event.data.u32 = EV_PU | (k << 8);
+   epoll_ctl(pu_epfd, EPOLL_CTL_MOD, pu2[k]->pu_fd, &event);
+}
+
+/********************************************************************/
+/* Procedure to accept a TN3270 connection on the port of a PU      */
+/* The next free LU is reserved for it while the telnet options are */
+/* negotiated by negotiate_lu, as the client's replies come in.     */
+/********************************************************************/
+void accept_lu(BYTE k) {
+   int    fd;
+   BYTE   j = pu2[k]->lunum;
+
+   if (j == 0xFF)                                          /* LU pool exhausted, leave it queued      */
+      return;
+   fd = accept(pu2[k]->pu_fd, NULL, 0);                    /* accept connection request               */
+   if (fd < 1) {
+      printf("\rPU2: accept failed for 3174-%01X %s\n", k, strerror(errno));
+      return;
+   }
+   pu2[k]->lu[j].tn = tn_accept(fd);                       /* Send DO TERMINAL_TYPE                   */
+   if (pu2[k]->lu[j].tn == NULL) {
+      printf("\rPU2: telnet negotiation failed to start on 3174-%01X\n", k);
+      return;
+   }
+   tn_pending++;
+   event.events = EPOLLIN | EPOLLRDHUP;                    /* Client replies wake the main loop       */
+   event.data.u32 = EV_LU | (k << 8) | j;
+   epoll_ctl(pu_epfd, EPOLL_CTL_ADD, fd, &event);
+   next_lu(k);
+}
+
+/********************************************************************/
+/* Procedure to advance the telnet negotiation of a reserved LU.    */
+/* When done the terminal gets its LU (the requested one if it is   */
+/* free), is reported to the host and gets its connection message.  */
+/* expired is set when the client did not finish within TN_TIMEOUT. */
+/********************************************************************/
+void negotiate_lu(BYTE k, BYTE j, int expired) {
+   struct TNNEG *tn = pu2[k]->lu[j].tn;
+   BYTE   r = j;                                           /* LU the terminal is connected to         */
+
+   if (!expired && (tn_negotiate(tn) > TN_DONE))           /* Wait for more replies from the client   */
+      return;
+   pu2[k]->lu[j].tn = NULL;                                /* Release the reserved LU                 */
+   tn_pending--;
+   if (expired || (tn->state == TN_FAILED)) {
+      printf("\rPU2: telnet negotiation %s on 3174-%01X, connection closed\n", expired ? "timed out" : "failed", k);
+      close(tn->fd);                                       /* Also removes it from the epoll set      */
+      free(tn);
+      next_lu(k);
+      return;
+   }
+   if ((tn->devn < num_lu) && (pu2[k]->lu[tn->devn].held != 0)) {  /* Client returns to its held session */
+      r = tn->devn;
+      pu2[k]->lu[r].held = 0;
+      lu_held--;
+      pu2[k]->lu[r].lu_fd = tn->fd;
+      pu2[k]->lu[r].is_3270 = connect_client(tn, pu2[k]->punum, r);
+      pu2[k]->lu[r].io = io_get();
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.u32 = EV_LU | (k << 8) | r;
+      epoll_ctl(pu_epfd, EPOLL_CTL_MOD, tn->fd, &event);
+      if (Tdbg_flag == ON)    // Trace Terminal Controller ?
+         fprintf(T_trace, "3274: LU %02X reconnected to its held session\n", r);
+      printf("\rPU2: LU %02X reconnected to 3274-%01X, session resumed\n", r, k);
+      if (pu2[k]->lu[r].is_3270)
+         scrn_replay(k, r);                                /* Give the terminal its screen back       */
+      if (tn->len > 0)
+         commadpt_read_tty(pu2[k], pu2[k]->lu[r].io, tn->buf, r, tn->len);
+      free(tn);
+      next_lu(k);
+      return;
+   }  // End if held
+   if ((tn->devn != 0xFF) && (tn->devn != j)) {            /* Terminal requested a specific LU        */
+      if ((tn->devn < num_lu) && (pu2[k]->lu[tn->devn].lu_fd < 1) && (pu2[k]->lu[tn->devn].tn == NULL) &&
+          (pu2[k]->lu[tn->devn].spool == NULL))
+         r = tn->devn;
+      else
+         printf("\rPU2: requested lu port %02X is not available, request denied\n", tn->devn);
+   }  // End if tn->devn
+   pu2[k]->lu[r].lu_fd = tn->fd;
+   pu2[k]->lu[r].is_3270 = connect_client(tn, pu2[k]->punum, r);
+   pu2[k]->lu[r].io = io_get();                            /* 3270 input buffer from the pool    */
+   pu2[k]->lu[r].daf_addr1 = 0;                            /* make sure the initial value is 0   */
+   pu2[k]->lu[r].bindflag = 0;                             /* make sure the initial value is 0   */
+   pu2[k]->lu[r].reqcont = 0;                              /* make sure the initial value is 0   */
+   pu2[k]->lu[r].initselfflag = 0;                         /* make sure the initial value is 0   */
+   pu2[k]->lu[r].dri = OFF;                                /* make sure the initial value is OFF */
+   pu2[k]->lu[r].chaining = OFF;                           /* make sure the initial value is OFF */
+   pu2[k]->lu[r].rtm_t0 = 0;                               /* no host response pending           */
+   if (pu2[k]->lu[r].actlu == 1)                           /* Is actlu already done?             */
+      pu2[k]->lu[r].readylu = 2;                           /* Indicate LU is in power off state  */
+   else
+      pu2[k]->lu[r].readylu = 1;                           /* Indicate LU is ready to go         */
+   event.events = EPOLLIN | EPOLLRDHUP;                    /* Terminal input wakes the main loop */
+   event.data.u32 = EV_LU | (k << 8) | r;
+   epoll_ctl(pu_epfd, EPOLL_CTL_MOD, tn->fd, &event);
+   if (Tdbg_flag == ON)    // Trace Terminal Controller ?
+      fprintf(T_trace, "3274: LU %02X connected, readylu=%d \n", r, pu2[k]->lu[r].readylu);
+   printf("\rPU2: LU %02X connected to 3274-%01X\n", r, k);
+   sdlc_attn = ON;                                         /* LU power on to report to the host  */
+   if (tn->len > 0)                                        /* Input sent right after negotiation */
+      commadpt_read_tty(pu2[k], pu2[k]->lu[r].io, tn->buf, r, tn->len);
+   free(tn);
+   next_lu(k);
+}
+
+/********************************************************************/
+/* Screen log of a held session (-hold)                             */
+/* The outbound 3270 writes since the last Erase/Write are kept per */
+/* LU, so that a reconnecting client can be given its screen back.  */
+/* Each record is stored as a 4 byte length followed by the data.   */
+/* Read and WSF commands are not kept; replaying them would make    */
+/* the terminal send unsolicited replies to the host.               */
+/********************************************************************/
+void scrn_keep(BYTE k, BYTE j, BYTE *data, uint32_t len, int eor) {
+   struct LU327x *lu = &pu2[k]->lu[j];
+   uint32_t rl;
+
+   if (lu->scrn == NULL) {
+      lu->scrn = malloc(SCRN_BUFLEN);
+      lu->scrn_bor = 1;
+   }
+   if (lu->scrn_bor && (len > 0)) {                        /* 3270 command of a new record           */
+      lu->scrn_bor = 0;
+      switch (data[0]) {
+         case 0xF5: case 0x05:                             /* Erase/Write                            */
+         case 0x7E: case 0x0D:                             /* Erase/Write Alternate                  */
+            lu->scrnl = 0;                                 /* Older writes are overwritten           */
+            /* fall through */
+         case 0xF1: case 0x01:                             /* Write                                  */
+         case 0x6F: case 0x0F:                             /* Erase All Unprotected                  */
+            lu->scrn_rec = (lu->scrnl != SCRN_LOST);
+            break;
+         default:
+            lu->scrn_rec = 0;
+      }  // End switch
+      if (lu->scrn_rec && (lu->scrnl + 4 <= SCRN_BUFLEN)) {
+         lu->scrnr = lu->scrnl;                            /* Start the record with length 0         */
+         memset(&lu->scrn[lu->scrnr], 0, 4);
+         lu->scrnl += 4;
+      } else if (lu->scrn_rec)
+         lu->scrnl = SCRN_LOST;
+   }  // End if scrn_bor
+   if (lu->scrn_rec && (lu->scrnl != SCRN_LOST)) {
+      if (lu->scrnl + len > SCRN_BUFLEN)
+         lu->scrnl = SCRN_LOST;                            /* Screen can no longer be rebuilt        */
+      else {
+         memcpy(&lu->scrn[lu->scrnl], data, len);
+         lu->scrnl += len;
+         memcpy(&rl, &lu->scrn[lu->scrnr], 4);
+         rl += len;
+         memcpy(&lu->scrn[lu->scrnr], &rl, 4);
+      }
+   }
+   if (eor)
+      lu->scrn_bor = 1;
+}
+
+/* Send the kept screen of LU j to its reconnected client           */
+void scrn_replay(BYTE k, BYTE j) {
+   struct LU327x *lu = &pu2[k]->lu[j];
+   uint32_t rl;
+
+   if ((lu->scrn == NULL) || (lu->scrnl == 0))
+      return;
+   if (lu->scrnl == SCRN_LOST) {
+      printf("\rPU2: screen of LU %02X too large to restore, clear the screen to refresh it\n", j);
+      return;
+   }
+   for (uint32_t i = 0; i + 4 <= lu->scrnl; i += 4 + rl) {
+      memcpy(&rl, &lu->scrn[i], 4);                        /* The last record may still be chained   */
+      send_3270(lu, &lu->scrn[i + 4], rl, (lu->scrn_bor == 1) || (i != lu->scrnr));
+   }
+}
+
+/********************************************************************/
+/* Procedure to drop a TN3270 connection. With -hold an active LU   */
+/* keeps its session for hold_secs, waiting for the client to come  */
+/* back; otherwise, or when that time is up, release_lu powers the  */
+/* LU off.                                                          */
+/********************************************************************/
+void close_lu(BYTE k, BYTE j) {
+   pu2[k]->lu[j].rtm_t0 = 0;                               /* No host response to measure anymore                    */
+   io_put(pu2[k]->lu[j].io);
+   pu2[k]->lu[j].io = NULL;
+   close (pu2[k]->lu[j].lu_fd);                            /* Also removes it from the epoll set                     */
+   pu2[k]->lu[j].lu_fd = 0;
+   if ((hold_secs > 0) && (pu2[k]->lu[j].actlu == 1) && (pu2[k]->lu[j].readylu == 1)) {
+      pu2[k]->lu[j].held = time(NULL);                     /* Keep the session, client may reconnect                 */
+      lu_held++;
+      if (Tdbg_flag == ON)    // Trace Terminal Controller ?
+         fprintf(T_trace, "3274: LU %02X disconnected, session held\n", j);
+      printf("\rPU2: LU %02X disconnected from 3174-%01X, session held for %d seconds\n\r", j, k, hold_secs);
+      return;
+   }
+   release_lu(k, j);
+}
+
+/********************************************************************/
+/* Procedure to release the LU of a dropped TN3270 connection       */
+/********************************************************************/
+void release_lu(BYTE k, BYTE j) {
+   if (pu2[k]->lu[j].held != 0) {                          /* Hold time is up                                        */
+      pu2[k]->lu[j].held = 0;
+      lu_held--;
+   }
+   if (pu2[k]->lu[j].scrn != NULL)
+      pu2[k]->lu[j].scrnl = 0;                             /* A new client starts with a new screen                  */
+   if (pu2[k]->lu[j].actlu == 1)  {                        /* Is actlu already done?                                 */
+       if (pu2[k]->lu[j].bindflag == 0)                    /* LU has no active BIND                                  */
+         pu2[k]->lu[j].readylu = 3;                        /* Indicate LU is in power off state (triggers a NOTIFY)  */
+      else                                                 /* LU has an active BIND                                  */
+         pu2[k]->lu[j].readylu =  4;                       /* Indicate LU is in power off state (triggers an UNBIND) */
+      }
+   else {
+      pu2[k]->lu[j].readylu = 0;                           /* Indicate LU is not ready for action anymore            */
+      pu2[k]->lu[j].actlu = 0;                             /* Indicate ACTLU has not been sent                       */
+   }
+   if (Tdbg_flag == ON)    // Trace Terminal Controller ?
+      fprintf(T_trace, "3274: LU %02X disconnected, readylu=%d \n", j, pu2[k]->lu[j].readylu);
+   pu2[k]->lu[j].reqcont = 0;                              /* Indicate LU has not requested contact                  */
+   printf("\rPU2: LU %02X disconnected from 3174-%01X\n\r", j, k);
+   sdlc_attn = ON;                                         /* LU power off to report to the host     */
+   if (pu2[k]->lunum == 0xFF) {                            /* PU port was not polled, resume it      */
+      event.events = EPOLLIN;
+      event.data.u32 = EV_PU | (k << 8);
+      epoll_ctl(pu_epfd, EPOLL_CTL_MOD, pu2[k]->pu_fd, &event);
+   }
+   if ((pu2[k]->lunum > j) || (pu2[k]->lunum == 0xFF))     /* If next available lu greater or no LU's availble...    */
+      pu2[k]->lunum = j;                                   /* ...replace with the just released LU number            */
+}
+
+/********************************************************************/
+/* Response Time Monitor                                            */
+/* Host response time is measured from an AID read from a terminal  */
+/* to the first outbound PIU for its LU. The histograms have four   */
+/* buckets per power of 2 usec; bucket b < 4 holds b usec, above    */
+/* that b covers [(4 + b%4) << (b/4 - 1), (5 + b%4) << (b/4 - 1)).  */
+/********************************************************************/
+int rtm_bucket(uint64_t us) {
+   int msb;
+
+   if (us < 4)
+      return us;
+   msb = 63 - __builtin_clzll(us);
+   if (msb > RTM_NBKT / 4)
+      return RTM_NBKT - 1;
+   return 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+}
+
+uint64_t rtm_upper(int b) {                                // Largest usec value of bucket b
+   if (b < 4)
+      return b;
+   return ((uint64_t)(5 + b % 4) << (b / 4 - 1)) - 1;
+}
+
+/* A PIU for LU j of 3274 k: the host has answered the pending AID  */
+void rtm_done(BYTE k, BYTE j) {
+   uint64_t us = tn_usec() - pu2[k]->lu[j].rtm_t0;
+   struct RTMHIST *h[2];
+
+   pu2[k]->lu[j].rtm_t0 = 0;
+   if (rtm_interval == 0)                                  // Monitor not enabled
+      return;
+   h[0] = &rtm_pu[k];
+   h[1] = &rtm_lu[k * num_lu + j];
+   for (int i = 0; i < 2; i++) {
+      h[i]->cnt++;
+      h[i]->sum += us;
+      if (us > h[i]->max)
+         h[i]->max = us;
+      h[i]->bkt[rtm_bucket(us)]++;
+   }
+}
+
+/* Response time (usec) that pct percent of the responses did not exceed */
+uint64_t rtm_pct(struct RTMHIST *h, int pct) {
+   uint64_t n = 0, target = (h->cnt * pct + 99) / 100;
+   int b;
+
+   for (b = 0; (b < RTM_NBKT - 1) && ((n += h->bkt[b]) < target); b++) ;
+   return (rtm_upper(b) < h->max) ? rtm_upper(b) : h->max;
+}
+
+void rtm_json(FILE *f, struct RTMHIST *h) {
+   fprintf(f, "\"count\": %llu, \"avg_us\": %llu, \"p50_us\": %llu, \"p95_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu",
+           (unsigned long long) h->cnt, (unsigned long long) (h->cnt ? h->sum / h->cnt : 0),
+           (unsigned long long) rtm_pct(h, 50), (unsigned long long) rtm_pct(h, 95),
+           (unsigned long long) rtm_pct(h, 99), (unsigned long long) h->max);
+}
+
+/* Write the histograms since startup to rtm_3274.json               */
+void rtm_dump(void) {
+   FILE *f;
+
+   rtm_next = time(NULL) + rtm_interval;
+   if ((f = fopen("rtm_3274.json.tmp", "w")) == NULL)
+      return;
+   fprintf(f, "{\"time\": %ld, \"interval\": %d, \"pus\": [", (long) time(NULL), rtm_interval);
+   for (int k = 0; k < num_pu; k++) {
+      fprintf(f, "%s\n {\"pu\": \"%02X\", ", (k > 0) ? "," : "", k);
+      rtm_json(f, &rtm_pu[k]);
+      fprintf(f, ", \"lus\": [");
+      for (int j = 0, n = 0; j < num_lu; j++) {
+         if (rtm_lu[k * num_lu + j].cnt == 0)
+            continue;
+         fprintf(f, "%s\n  {\"lu\": \"%02X\", ", (n++ > 0) ? "," : "", j);
+         rtm_json(f, &rtm_lu[k * num_lu + j]);
+         fprintf(f, "}");
+      }  // End for j
+      fprintf(f, "]}");
+   }  // End for k
+   fprintf(f, "\n]}\n");
+   fclose(f);
+   rename("rtm_3274.json.tmp", "rtm_3274.json");             // Readers never see a partial file
+}
+
 /********************************************************************/
 /* Procedure to handle 3270 connections and data requests           */
+/* Waits up to timeout ms for an event on the SDLC line, a PU port  */
+/* or an LU socket. Connect requests and terminal input are handled */
+/* here; returns 1 if the SDLC line has data or was dropped.        */
 /********************************************************************/
-int proc_3270 () {
-
-   int    rc;
-   //
-   // Poll briefly for connect requests. If a connect request is received,
-   // proceed with connect/accept the request.
-   // Next, check all active connection for input data.
-   //
-      for (BYTE k = 0; k < MAXSNAPU; k++) {
-         event_count = epoll_wait(pu2[k]->epoll_fd, events, MAXLU, 50);
-         for (int i = 0; i < event_count; i++) {
-            if (pu2[k]->lunum != 0xFF) {                                   /* if available LU pool not exhausted      */
-               //pu2[k]->readylu[pu2[k]->lunum] = 0;                         /* Indicate LU is not yet ready for action */
-               pu2[k]->lu_fd[pu2[k]->lunum]=accept(pu2[k]->pu_fd, NULL, 0);  /* accept connection request               */
-               if (pu2[k]->lu_fd[pu2[k]->lunum] < 1) {
-                  printf("\rPU2: accept failed for 3174-%01X %s\n", k, strerror(errno));
-               } else {
-                  if (connect_client(&pu2[k]->lu_fd[pu2[k]->lunum], pu2[k]->punum, &pu2[k]->lunum, &pu2[k]->lunumr))  {
-                     pu2[k]->is_3270[pu2[k]->lunum] = 1;
-                  } else {
-                     pu2[k]->is_3270[pu2[k]->lunum] = 0;
-                  }  // End if connect_client
-
-                  if (pu2[k]->lunumr != pu2[k]->lunum) {                                  /* Requested LU number is not the proposed lu number   */
-                     if (pu2[k]->lu_fd[pu2[k]->lunumr] < 1) {
-                        pu2[k]->lu_fd[pu2[k]->lunumr]  = pu2[k]->lu_fd[pu2[k]->lunum];    /* Copy fd to request lu                               */
-                        pu2[k]->is_3270[pu2[k]->lunumr] = pu2[k]->is_3270[pu2[k]->lunum]; /* copy 3270 indicator                                 */
-                        pu2[k]->lu_fd[pu2[k]->lunum] = 0;                                 /* clear fd in proposed lu number                      */
-                        pu2[k]->is_3270[pu2[k]->lunum] = 0;                               /* clear 3270 indicator for proposed lu number         */
-                        pu2[k]->lunum = pu2[k]->lunumr;                                   /* replace proposed lu number with requested lu number */
-                     } else {
-                        printf("\rPU2: requested lu port %02X is not available, request denied\n", pu2[k]->lunumr);
-                     }  // End  if (pu2[k]->lu_fd[pu2[k]->lunumr]
-                  }  // End if pu[k]->lunumr
-                  ioblk[k][pu2[k]->lunum] =  malloc(sizeof(struct IO3270));
-                  ioblk[k][pu2[k]->lunum]->inpbufl = 0;                   /* make sure the initial length is 0  */
-                  pu2[k]->daf_addr1[pu2[k]->lunum] = 0;                   /* make sure the initial value is 0   */
-                  pu2[k]->bindflag[pu2[k]->lunum] = 0;                    /* make sure the initial value is 0   */
-                  pu2[k]->reqcont[pu2[k]->lunum] = 0;                     /* make sure the initial value is 0   */
-                  pu2[k]->initselfflag[pu2[k]->lunum] = 0;                /* make sure the initial value is 0   */
-                  pu2[k]->dri[pu2[k]->lunum] = OFF;                       /* make sure the initial value is OFF */
-                  pu2[k]->chaining[pu2[k]->lunum] = OFF;                  /* make sure the initial value is OFF */
-                  if (pu2[k]->actlu[pu2[k]->lunum] == 1)                  /* Is actlu already done?             */
-                     pu2[k]->readylu[pu2[k]->lunum] = 2;                  /* Indicate LU is in power off state  */
-                  else
-                     pu2[k]->readylu[pu2[k]->lunum] = 1;                  /* Indicate LU is ready to go         */
-                  if (Tdbg_flag == ON)    // Trace Terminal Controller ?
-                     fprintf(T_trace, "3274: LU %02X connected, readylu=%d \n", pu2[k]->lunum, pu2[k]->readylu[pu2[k]->lunum]);
-                  printf("\rPU2: LU %02X connected to 3274-%01X\n", pu2[k]->lunum, k);
-                  //  Find first available LU
-                  pu2[k]->lunum = 0xFF;                                   /* preset to no LU's availble         */
-                  for (BYTE j = 0; j < MAXLU; j++) {
-                     if (pu2[k]->lu_fd[j] < 1) pu2[k]->lunum = j;
-                  }  // end for BYTE j
-                  if (pu2[k]->lunum == 0xFF) printf("\rPU2: No more LU ports available. New connections rejected until a LU port is released;\n");
-               }  // End if pu2[j]->lu_fd
-            }  // End if (pu2[k] != 0xFF)
-         }  // End for int i
-         for (BYTE j = 0; j < MAXLU; j++) {
-            if (pu2[k]->lu_fd[j] > 0) {
-               rc = ioctl(pu2[k]->lu_fd[j], FIONREAD, &pendingrcv);
-               if ((pendingrcv < 1) && (SocketReadAct(pu2[k]->lu_fd[j]))) rc = -1;
-               if (rc < 0) {
-                  if (pu2[k]->actlu[j] == 1)  {                           /* Is actlu already done?                                 */
-                      if (pu2[k]->bindflag[j] == 0)                       /* LU has no active BIND                                  */
-                        pu2[k]->readylu[j] = 3;                           /* Indicate LU is in power off state (triggers a NOTIFY)  */
-                     else                                                 /* LU has an active BIND                                  */
-                        pu2[k]->readylu[j] =  4;                          /* Indicate LU is in power off state (triggers an UNBIND) */
-                     }
-                  else {
-                     pu2[k]->readylu[j] = 0;                              /* Indicate LU is not ready for action anymore            */
-                     pu2[k]->actlu[j] = 0;                                /* Indicate ACTLU has not been sent                       */
-                  }
-                  if (Tdbg_flag == ON)    // Trace Terminal Controller ?
-                     fprintf(T_trace, "3274: LU %02X disconnected, readylu=%d \n", j, pu2[k]->readylu[j]);
-                  pu2[k]->reqcont[j] = 0;                                 /* Indicate LU has not requested contact                  */
-                  free(ioblk[k][j]);
-                  close (pu2[k]->lu_fd[j]);
-                  pu2[k]->lu_fd[j] = 0;
-                  printf("\rPU2: LU %02X disconnected from 3174-%01X\n\r", j, k);
-                  if ((pu2[k]->lunum > j) || (pu2[k]->lunum == 0xFF))     /* If next available lu greater or no LU's availble...    */
-                     pu2[k]->lunum = j;                                   /* ...replace with the just released LU number            */
-               } else {
-                  if (pendingrcv > 0) {
-                     rc = read(pu2[k]->lu_fd[j], bfr, 256-BUFPD);
-                     //******
-                     if (Tdbg_flag == ON) {              // Trace
-                        fprintf(T_trace, "\n3270 Read Buffer: ");
-                        for (int i=0; i < rc; i ++) {
-                           fprintf(T_trace, "%02X ", bfr[i]);
-                        }
-                        fprintf(T_trace, "\n\r");
-                     }  // End if Tdbg_flag == ON
-                     //******
-                     commadpt_read_tty(pu2[k], ioblk[k][j], bfr, j, rc);
-                  }  // End if pendingrcv
-               }  // End if rc < 0
-            }  // End if pu2-lu_fd
-         }  // End for int j
-      }  // End for int k
+int proc_3270 (int timeout) {
+   int    rc, line = 0;
+   uint32_t tag;
+   BYTE   k, j;
+
+   if (((tn_pending > 0) || (lu_held > 0) || (rtm_interval > 0)) && ((timeout < 0) || (timeout > 1000)))
+      timeout = 1000;                                     // Check negotiation and hold timeouts and RTM dump each second
+   event_count = epoll_wait(pu_epfd, events, MAXSNAPU * (MAXLU + 1) + 1, timeout);
+   for (int i = 0; i < event_count; i++) {
+      tag = events[i].data.u32;
+      if (tag == EV_LINE) {
+         line = 1;
+         continue;
+      }
+      k = (tag >> 8) & 0xFF;
+      j = tag & 0xFF;
+      if (tag & EV_PU) {                                  // Connect request
+         accept_lu(k);
+         continue;
+      }
+      if (pu2[k]->lu[j].tn != NULL) {                     // Telnet negotiation reply
+         negotiate_lu(k, j, 0);
+         continue;
+      }
+      if (pu2[k]->lu[j].lu_fd < 1)                        // Closed by an earlier event
+         continue;
+      rc = recv(pu2[k]->lu[j].lu_fd, bfr, sizeof(bfr), MSG_DONTWAIT);
+      if ((rc < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+         continue;
+      if (rc <= 0) {
+         close_lu(k, j);
+         continue;
+      }
+      //******
+      if (Tdbg_flag == ON) {              // Trace
+         fprintf(T_trace, "\n3270 Read Buffer: ");
+         for (int i=0; i < rc; i ++) {
+            fprintf(T_trace, "%02X ", bfr[i]);
+         }
+         fprintf(T_trace, "\n\r");
+      }  // End if Tdbg_flag == ON
+      //******
+      commadpt_read_tty(pu2[k], pu2[k]->lu[j].io, bfr, j, rc);
+      sdlc_attn = ON;                                      /* Possibly input for the host            */
+   }  // End for int i
+   if (tn_pending > 0) {                                  // Drop clients that stopped negotiating
+      time_t now = time(NULL);
+      for (k = pu_first; k < num_pu; k += pu_step)
+         for (j = 0; j < num_lu; j++)
+            if ((pu2[k]->lu[j].tn != NULL) && (now >= pu2[k]->lu[j].tn->deadline))
+               negotiate_lu(k, j, 1);
+   }  // End if tn_pending
+   if (lu_held > 0) {                                     // Release sessions whose client did not return
+      time_t now = time(NULL);
+      for (k = pu_first; k < num_pu; k += pu_step)
+         for (j = 0; j < num_lu; j++)
+            if ((pu2[k]->lu[j].held != 0) && (now >= pu2[k]->lu[j].held + hold_secs)) {
+               printf("\rPU2: LU %02X of 3274-%01X not reconnected in time, session ended\n", j, k);
+               release_lu(k, j);
+               next_lu(k);
+            }
+   }  // End if lu_held
+   return line;
+}
+
+//*********************************************************************
+//   Map an SDLC station address to its 3274, -1 if it is not ours.   *
+//*********************************************************************
+int pu_station(int addr) {
+   if ((addr < sdlc_addr) || (addr >= sdlc_addr + num_pu))
+      return -1;
+   return addr - sdlc_addr;
+}
+
+//*********************************************************************
+//   Check if any PU still has work that an RR poll would pick up.    *
+//   This mirrors the LU scan of the RR handler in proc_PIU, which    *
+//   serves one LU per poll. Only the 3274's of this thread are seen. *
+//*********************************************************************
+int pu_busy() {
+   if (BLU_rsp_stat == FILLED)
+      return 1;
+   for (int j = pu_first; j < num_pu; j += pu_step) {
+      for (int k = 0; k < num_lu; k++) {
+         if ((pu2[j]->lu[k].lu_fd > 0) && (pu2[j]->lu[k].readylu == 1) &&
+             (pu2[j]->lu[k].actlu == 1) && (pu2[j]->lu[k].io->inpbufl > 0))
+            return 1;                           // Terminal input
+         if (((pu2[j]->lu[k].lu_fd > 0) && (pu2[j]->lu[k].readylu == 2)) || (pu2[j]->lu[k].readylu > 2))
+            return 1;                           // LU power on or off
+      }  // End for k
+   }  // End for j
    return 0;
 }
 
+//*********************************************************************
+//   Take the first complete link record from the line input and      *
+//   rebuild its SDLC frame (7E ... 470F7E) in frame. The 3705 sends  *
+//   frames back-to-back, so one read may hold several records or     *
+//   part of one. Records with an FCS error are dropped.              *
+//   Returns the frame length, 0 if no complete record is present or  *
+//   -1 if the line is out of sync.                                   *
+//*********************************************************************
+int get_frame(uint8_t *frame) {
+   int Rptr = 0, Rlen, Flen;
+
+   do {
+      Flen = slnk_get(&SDLCinb[Rptr], SDLCinl - Rptr, frame, &Rlen);
+      if (Flen == SLNK_GOTATTN)
+         Flen = SLNK_BADHDR;                    // Only sent by a secondary
+      if (Flen == SLNK_BADHDR) {
+         printf("\rPU2: SDLC link protocol error, record header %02X %02X\n", SDLCinb[Rptr], SDLCinb[Rptr + 1]);
+         return -1;
+      }
+      if (Flen == SLNK_BADFCS) {
+         if (Tdbg_flag == ON)
+            fprintf(T_trace, "\r3274 FCS error, frame of %d bytes dropped\n", Rlen);
+         Rptr += Rlen;
+      }
+   } while (Flen == SLNK_BADFCS);
+   if (Flen == SLNK_SHORT) {                    // Rest of record still underway
+      if (SDLCinl - Rptr == BUFLEN_3274)
+         return -1;                             // Record does not fit the buffer
+      Flen = 0;
+   } else
+      Rptr += Rlen;
+   memmove(SDLCinb, &SDLCinb[Rptr], SDLCinl - Rptr);
+   SDLCinl -= Rptr;
+   return Flen;
+}
+
+//*********************************************************************
+//   Write to the SDLC line. Workers answer polls and send attention  *
+//   records themselves, so writes are serialized by line_lock.       *
+//*********************************************************************
+void line_send(uint8_t *buf, int len) {
+   pthread_mutex_lock(&line_lock);
+   if (pusdlc_fd > 0)                                    // Not while the line is re-established
+      send(pusdlc_fd, buf, len, 0);
+   pthread_mutex_unlock(&line_lock);
+}
+
+// Tell a spoofing 3705 we have work
+void line_attn() {
+   uint8_t attn[SLNK_HDR] = { SLNK_VER, SLNK_ATTN, 0, 0 };
+
+   if (sdlc_attn == ON) {
+      line_send(attn, SLNK_HDR);
+      sdlc_attn = OFF;
+   }
+}
+
+//*********************************************************************
+//   Process an SDLC frame for 3274 station. Responses are gathered   *
+//   and sent when the station is polled.                             *
+//*********************************************************************
+void proc_frame(uint8_t *frame, int len, int station) {
+   uint16_t SDLCrspl;               /* Size of response frame        */
+   int i, Fptr, Olen;
+
+   if ((frame[FCntl] & 0x01) == IFRAME) {
+      pu2[station]->seq_Nr++;                   // Update receive sequence number
+      if (pu2[station]->seq_Nr == 8) pu2[station]->seq_Nr = 0;
+      if (Tdbg_flag == ON)
+         fprintf(T_trace, "\r3274 LH receive sequence count=%d, Fcntl=%02X\n", pu2[station]->seq_Nr, frame[FCntl]);
+   }  //End if frame[FCntl]
+   SDLCrspl = proc_PIU(frame, len, &SDLCrspb[SDLCrsptl]);
+   if (SDLCrspl > 0) {
+      Fptr2[FptrI] =  SDLCrsptl;
+      if (Tdbg_flag == ON)
+         fprintf(T_trace, "\r3274 Frame pointer index %d contains %d", FptrI, Fptr2[FptrI]);
+      FptrI++;
+      Fptr2[FptrI] =  0;
+   }  // End if SDLCrspl
+   SDLCrsptl = SDLCrsptl + SDLCrspl;
+   if (Tdbg_flag == ON)
+      fprintf(T_trace, "\r3274 Total response length: %d\n", SDLCrsptl);
+   if (frame[FCntl] & CPoll) {               // Poll command ?
+      // Make sure the receive count is up-to-date before sending the repsonse.
+      // First get the station address and replace the receive count in the Link Header
+      FptrI = 0;
+      Fptr = Fptr2[FptrI];                                //  First frame located at offset 0.
+      do {
+         station = pu_station(SDLCrspb[Fptr+FAddr]);
+         if ((SDLCrspb[Fptr+FCntl] & 0x03) == SUPRV) {      // Supervisory format ?
+            SDLCrspb[Fptr+FCntl] = (SDLCrspb[Fptr+FCntl] & 0x1F) | (pu2[station]->seq_Nr << 5);  // Insert receive sequence
+         }
+         if  ((SDLCrspb[Fptr+FCntl] & 0x01) == IFRAME) {
+            // Insert receive and send sequence numbers into the Frame Control byte of the response
+            SDLCrspb[Fptr+FCntl] = (SDLCrspb[Fptr+FCntl] & 0x1F) | (pu2[station]->seq_Nr << 5);  // Insert receive sequence
+            SDLCrspb[Fptr+FCntl] = (SDLCrspb[Fptr+FCntl] & 0xF1) | (pu2[station]->seq_Ns << 1);  // Insert send sequence
+            pu2[station]->seq_Ns++;             // Update send sequence number
+            if (pu2[station]->seq_Ns == 8) pu2[station]->seq_Ns = 0;
+         }  // End if (SDLCrspb[Fptr+FCntl] & 0x01)
+         if (Tdbg_flag == ON)
+            fprintf(T_trace, "\r3274 LH  Receive sequence=%d, Next send Sequence=%d, Fcntl=%02X\n",
+            pu2[station]->seq_Nr, pu2[station]->seq_Ns, SDLCrspb[Fptr+FCntl]);
+            FptrI++;                            // Move to next Frame pointer in the array
+            Fptr = Fptr2[FptrI];                // Get it
+         }  // End do
+      while (Fptr != 0);                        // If the frame pointer is zero, there are no more frames
+      // Now set the final bit in the last Frame.
+      Fptr = Fptr2[FptrI-1];                    // Get the pointer to the last frame
+      SDLCrspb[Fptr+FCntl] |= CFinal;           // Set the final bit;
+      for (i = 0, Olen = 0; i < FptrI; i++)     // Frames to link records
+         Olen += slnk_put(&SDLCoutb[Olen], &SDLCrspb[Fptr2[i]],
+                          ((i + 1 < FptrI) ? Fptr2[i + 1] : SDLCrsptl) - Fptr2[i]);
+      line_send(SDLCoutb, Olen);
+      if (Tdbg_flag == ON) {
+         fprintf(T_trace, "\r3274 Response Buffer (%d): ", SDLCrsptl);
+         for (int i=0; i < SDLCrsptl; i ++) {
+            fprintf(T_trace, "%02X ", SDLCrspb[i]);
+         }
+         fprintf(T_trace, "\n");
+         fflush(T_trace);
+      }  // End if debug
+      SDLCrsptl = 0;                            // Reset response total length
+      FptrI = 0;
+      if (pu_busy())                            // More to send than one poll picks up ?
+         sdlc_attn = ON;
+   }  // End frame[FCntl] & CPoll
+}
+
+//*********************************************************************
+//   Queue a frame for the worker thread of 3274 station (-wrk n).    *
+//   A full queue drops the frame, SDLC recovery resends it.          *
+//*********************************************************************
+void pu_queue(uint8_t *frame, int len, int station) {
+   struct PUWRK *w = &wrk[station % num_wrk];
+   struct PUFRAME *f;
+   uint64_t one = 1;
+
+   if (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) > w->mask) {
+      w->overrun++;                                      // Worker is behind, never stall the line
+      printf("\rPU2: Worker %d queue full, frame for 3274 %d dropped (%u)\n",
+             w->id, station, w->overrun);
+      return;
+   }
+   f = &w->frm[w->head & w->mask];
+   memcpy(f->data, frame, len);
+   f->len = len;
+   f->station = station;
+   __atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+   write(w->efd, &one, sizeof(one));
+}
+
+//*********************************************************************
+//   Worker thread: the 3274's station % num_wrk == id, their TN3270  *
+//   ports and LU sockets and the frames queued for them.             *
+//*********************************************************************
+void *pu_worker(void *arg) {
+   struct PUWRK *w = arg;
+   struct PUFRAME *f;
+   uint64_t n;
+
+   pu_first = w->id;                                     // This worker's 3274's
+   pu_step = num_wrk;
+   pu_epfd = epoll_create(1);
+   event.events = EPOLLIN;
+   event.data.u32 = EV_LINE;                             // Frames queued
+   epoll_ctl(pu_epfd, EPOLL_CTL_ADD, w->efd, &event);
+   for (int k = pu_first; k < num_pu; k += pu_step) {
+      event.events = EPOLLIN;
+      event.data.u32 = EV_PU | (k << 8);
+      epoll_ctl(pu_epfd, EPOLL_CTL_ADD, pu2[k]->pu_fd, &event);
+   }
+   while (1) {
+      line_attn();
+      if (proc_3270(-1) == 0)                            // Wait for the next event
+         continue;
+      read(w->efd, &n, sizeof(n));
+      while (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) != w->tail) {
+         f = &w->frm[w->tail & w->mask];
+         proc_frame(f->data, f->len, f->station);
+         __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+      }
+   }  // End while
+   return NULL;
+}
+
 void main(int argc, char *argv[]) {
    unsigned long inaddr;
    struct hostent *lineent;
-   uint16_t SDLCrspl;               /* Size of response frame        */
-   uint16_t SDLCreql;               /* Size of request fram          */
-   int SDLCrsptl = 0;               /* Total size of response frames */
-   int FptrI = 0;
-   int    pendingrcv;               /* pending data on the socket    */
-   int i, rc, Fptr;
-   int Fptr2[16] = {0};
+   int SDLCreql;                    /* Size of request fram          */
+   int    line;                     /* SDLC line has an event        */
+   int    station;                  /* 3274 of a received frame      */
+   int i, rc, fd;
    char ipv4addr[sizeof(struct in_addr)];
 
    //pthread_t thread;
@@ -1122,6 +1805,15 @@ void main(int argc, char *argv[]) {
       printf("\r   Valid arguments are:\n");
       printf("\r   -cchn {hostname}  : hostname of host running the 3705\n");
       printf("\r   -ccip {ipaddress} : ipaddress of host running the 3705 \n");
+      printf("\r   -line {n} : connect to SDLC line n of the 3705 (default 0)\n");
+      printf("\r   -pus {n} : number of 3274's (default %d, max %d)\n", DEFSNAPU, MAXSNAPU);
+      printf("\r   -lus {n} : number of LU's per 3274 (default %d, max %d)\n", DEFLU, MAXLU);
+      printf("\r   -addr {xx} : SDLC station address of the first 3274 (default C1)\n");
+      printf("\r   -cp [[{pp}.]{xx}=]{codepage} : code page, of LU xx of 3274 pp only if given (default 'default')\n");
+      printf("\r   -prt [{pp}.]{xx}={file} : LU xx of 3274 pp is a printer spooling to file, or |command\n");
+      printf("\r   -wrk {n} : serve the 3274's with n worker threads (default 0, all in one thread)\n");
+      printf("\r   -hold {n} : keep the session of a dropped client n seconds for it to reconnect\n");
+      printf("\r   -rtm {n} : write host response times to rtm_3274.json every n seconds\n");
       printf("\r   -d : switch debug on  \n");
    return;
    }
@@ -1150,15 +1842,116 @@ void main(int argc, char *argv[]) {
          printf("\rPU2: Connection to be established with 3705 SDLC line at ip address %s\n", argv[i+1]);
          i = i + 2;
          continue;
+      } else if ((strcmp(argv[i], "-line") == 0) && (i + 1 < argc)) {
+         sdlc_line = atoi(argv[i+1]);
+         if ((sdlc_line < 0) || (sdlc_line >= SDLCLINES)) {
+            printf("\rPU2: SDLC line %s out of range 0-%d\n", argv[i+1], SDLCLINES - 1);
+            return;
+         }
+         printf("\rPU2: Connecting to SDLC line-%d\n", sdlc_line);
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-pus") == 0) && (i + 1 < argc)) {
+         num_pu = atoi(argv[i+1]);
+         if ((num_pu < 1) || (num_pu > MAXSNAPU)) {
+            printf("\rPU2: Number of 3274's %s out of range 1-%d\n", argv[i+1], MAXSNAPU);
+            return;
+         }
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-lus") == 0) && (i + 1 < argc)) {
+         num_lu = atoi(argv[i+1]);
+         if ((num_lu < 1) || (num_lu > MAXLU)) {
+            printf("\rPU2: Number of LU's %s out of range 1-%d\n", argv[i+1], MAXLU);
+            return;
+         }
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-addr") == 0) && (i + 1 < argc)) {
+         sdlc_addr = strtol(argv[i+1], NULL, 16);
+         if ((sdlc_addr < 0x01) || (sdlc_addr > 0xFE)) {
+            printf("\rPU2: SDLC station address %s out of range 01-FE\n", argv[i+1]);
+            return;
+         }
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-prt") == 0) && (i + 1 < argc)) {
+         char *cp = strchr(argv[i+1], '=');
+         char *dot = strchr(argv[i+1], '.');
+         int pu = 0, lu;
+         if ((dot != NULL) && ((cp == NULL) || (dot < cp))) {
+            pu = strtol(argv[i+1], NULL, 16);              /* {pp}.{xx}={file}                        */
+            lu = strtol(dot + 1, NULL, 16);
+         } else
+            lu = strtol(argv[i+1], NULL, 16);              /* {xx}={file}, on 3274-0                  */
+         if ((cp == NULL) || (cp[1] == 0) || (pu < 0) || (pu >= MAXSNAPU) || (lu < 0) || (lu >= MAXLU)) {
+            printf("\rPU2: Invalid printer LU %s, use [{pp}.]{xx}={file}\n", argv[i+1]);
+            return;
+         }
+         prt_path[pu][lu] = cp + 1;
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-wrk") == 0) && (i + 1 < argc)) {
+         num_wrk = atoi(argv[i+1]);
+         if ((num_wrk < 0) || (num_wrk > MAXSNAPU)) {
+            printf("\rPU2: Number of worker threads %s must be 0 to %d\n", argv[i+1], MAXSNAPU);
+            return;
+         }
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-hold") == 0) && (i + 1 < argc)) {
+         hold_secs = atoi(argv[i+1]);
+         if (hold_secs < 1) {
+            printf("\rPU2: Session hold time %s must be at least 1 second\n", argv[i+1]);
+            return;
+         }
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-rtm") == 0) && (i + 1 < argc)) {
+         rtm_interval = atoi(argv[i+1]);
+         if (rtm_interval < 1) {
+            printf("\rPU2: Response time dump interval %s must be at least 1 second\n", argv[i+1]);
+            return;
+         }
+         i = i + 2;
+         continue;
+      } else if ((strcmp(argv[i], "-cp") == 0) && (i + 1 < argc)) {
+         if (tn_codepage(argv[i+1])) {
+            printf("\rPU2: Unknown code page or LU in %s\n", argv[i+1]);
+            return;
+         }
+         i = i + 2;
+         continue;
       } else {
          printf("\rPU2: invalid argument %s\n",argv[i]);
          printf("\r     Valid arguments are:\n");
          printf("\r      -cchn {hostname}  : hostname of host running the 3705\n");
          printf("\r      -ccip {ipaddress} : ipaddress of host running the 3705 \n");
+         printf("\r      -line {n} : connect to SDLC line n of the 3705 (default 0)\n");
+         printf("\r      -pus {n} : number of 3274's (default %d, max %d)\n", DEFSNAPU, MAXSNAPU);
+         printf("\r      -lus {n} : number of LU's per 3274 (default %d, max %d)\n", DEFLU, MAXLU);
+         printf("\r      -addr {xx} : SDLC station address of the first 3274 (default C1)\n");
+         printf("\r      -cp [[{pp}.]{xx}=]{codepage} : code page, of LU xx of 3274 pp only if given (default 'default')\n");
+         printf("\r      -prt [{pp}.]{xx}={file} : LU xx of 3274 pp is a printer spooling to file, or |command\n");
+         printf("\r      -wrk {n} : serve the 3274's with n worker threads (default 0, all in one thread)\n");
+         printf("\r      -hold {n} : keep the session of a dropped client n seconds for it to reconnect\n");
+         printf("\r      -rtm {n} : write host response times to rtm_3274.json every n seconds\n");
          printf("\r      -d : switch debug on  \n");
          return;
       }  // End else
    }  // End while
+   if (sdlc_addr + num_pu - 1 > 0xFE) {
+      printf("\rPU2: SDLC station addresses %02X-%02X of %d 3274's run past FE\n",
+             sdlc_addr, sdlc_addr + num_pu - 1, num_pu);
+      return;
+   }
+   for (int k = 0; k < MAXSNAPU; k++)          /* -pus and -lus may follow -prt */
+      for (int j = 0; j < MAXLU; j++)
+         if ((prt_path[k][j] != NULL) && ((k >= num_pu) || (j >= num_lu))) {
+            printf("\rPU2: Printer LU %02X of 3274-%02X out of range, %d 3274's with %d LU's\n",
+                   j, k, num_pu, num_lu);
+            return;
+         }
 
    // ********************************************************************
    //  Terminal controller debug trace facility
@@ -1179,39 +1972,88 @@ void main(int argc, char *argv[]) {
    servaddr.sin_family = AF_INET;
    memcpy(&servaddr.sin_addr, lineent->h_addr_list[0], lineent->h_length);
    // servaddr.sin_addr.s_addr = lineip;
-   servaddr.sin_port = htons(SDLCLBASE);
+   servaddr.sin_port = htons(SDLCLBASE + sdlc_line);
    // Connect to the SDLC line socket
    printf("\rPU2: Waiting for SDLC line connection to be established\n");
    while (connect(pusdlc_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) != 0) {
       sleep(1);
    }
    printf("\rPU2: SDLC line connection has been established\n");
+   // One epoll set wakes the main loop for the SDLC line, connect requests and terminal input
+   pu_epfd = epoll_create(1);
+   if (pu_epfd == -1) {
+      printf("\rPU2: failed to create the epoll file descriptor\n");
+      return;
+   }
+   event.events = EPOLLIN | EPOLLRDHUP;
+   event.data.u32 = EV_LINE;
+   epoll_ctl(pu_epfd, EPOLL_CTL_ADD, pusdlc_fd, &event);
+   if (rtm_interval > 0) {                               // Response time monitor
+      rtm_pu = calloc(num_pu, sizeof(struct RTMHIST));
+      rtm_lu = calloc(num_pu * num_lu, sizeof(struct RTMHIST));
+      rtm_next = time(NULL) + rtm_interval;
+      printf("\rPU2: Response times written to rtm_3274.json every %d seconds\n", rtm_interval);
+   }
+   if (num_wrk > num_pu)                                 // No more workers than 3274's
+      num_wrk = num_pu;
    // Now 'IML' the 3274
    rc = proc_PU2iml();
-   FptrI = 0;
+   if (num_wrk > 0) {                                    // Hand the 3274's to the workers
+      pu_first = num_pu;                                 // The line thread keeps none
+      wrk = calloc(num_wrk, sizeof(struct PUWRK));
+      for (rc = 1; rc < PUFRM_WIN * ((num_pu + num_wrk - 1) / num_wrk); rc <<= 1);
+      for (i = 0; i < num_wrk; i++) {
+         wrk[i].id = i;
+         wrk[i].mask = rc - 1;
+         wrk[i].frm = malloc(rc * sizeof(struct PUFRAME));
+         wrk[i].efd = eventfd(0, EFD_NONBLOCK);
+         pthread_create(&wrk[i].tid, NULL, pu_worker, &wrk[i]);
+      }
+      printf("\rPU2: 3274's served by %d worker threads\n", num_wrk);
+   }  // End if num_wrk
    while (1) {
-      rc = proc_3270();
-      rc = ioctl(pusdlc_fd, FIONREAD, &pendingrcv);
-      if ((pendingrcv < 1) && (SocketReadAct(pusdlc_fd))) rc = -1;
-      if (rc < 0) {                                      // Retry once to account for timing delays in TCP.
-         if ((pendingrcv < 1) && (SocketReadAct(pusdlc_fd))) rc = -1;
+      line = proc_3270(-1);                              // Wait for the next event
+      if ((rtm_interval > 0) && (time(NULL) >= rtm_next))
+         rtm_dump();                                     // Response time histograms
+      line_attn();
+      if (line == 0)                                     // Nothing from the line
+         continue;
+      rc = 0;
+      if (SDLCinl < BUFLEN_3274) {                       // Append to the line input
+         rc = recv(pusdlc_fd, &SDLCinb[SDLCinl], BUFLEN_3274 - SDLCinl, MSG_DONTWAIT);
+         if ((rc < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            rc = 0;
+         else if (rc <= 0)
+            rc = -1;                                     // Line dropped
+         else
+            SDLCinl += rc;
       }
       if (rc < 0) {
          printf("\rPU2: SDLC line dropped, trying to re-establish connection\n");
          // SDLC line socket recreation
+         pthread_mutex_lock(&line_lock);                 // Workers stop writing to the line
          close(pusdlc_fd);
-         pusdlc_fd = socket(AF_INET, SOCK_STREAM, 0);
-         if (pusdlc_fd <= 0) {
+         pusdlc_fd = 0;
+         pthread_mutex_unlock(&line_lock);
+         fd = socket(AF_INET, SOCK_STREAM, 0);
+         if (fd <= 0) {
             printf("\rPU2: Cannot create line socket\n");
             return;
          }
-         while (connect(pusdlc_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) != 0) {
+         while (connect(fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) != 0) {
             sleep(1);
          }  // End while
+         pthread_mutex_lock(&line_lock);
+         pusdlc_fd = fd;
+         pthread_mutex_unlock(&line_lock);
          printf("\rPU2: SDLC line connection has been re-established\n");
+         event.events = EPOLLIN | EPOLLRDHUP;
+         event.data.u32 = EV_LINE;
+         epoll_ctl(pu_epfd, EPOLL_CTL_ADD, pusdlc_fd, &event);
+         SDLCinl = 0;
       } else {
-         if (pendingrcv > 0) {
-            SDLCreql = read(pusdlc_fd, SDLCreqb, pendingrcv);
+         // Process every complete frame received. Responses are only sent when polled.
+         while ((SDLCreql = get_frame(SDLCreqb)) > 0) {
             if (Tdbg_flag == ON) {
                fprintf(T_trace, "\r3274 Request Buffer (%d): ", SDLCreql);
                for (int i=0; i < SDLCreql; i ++) {
@@ -1220,69 +2062,17 @@ void main(int argc, char *argv[]) {
                fprintf(T_trace, "\n");
                fflush(T_trace);
             }  // End if debug
-            if ((SDLCreqb[FCntl] & 0x01) == IFRAME) {
-               pu2[station]->seq_Nr++;                   // Update receive sequence number
-               if (pu2[station]->seq_Nr == 8) pu2[station]->seq_Nr = 0;
-               if (Tdbg_flag == ON)
-                  fprintf(T_trace, "\r3274 LH receive sequence count=%d, Fcntl=%02X\n", pu2[station]->seq_Nr, SDLCreqb[FCntl]);
-            }  //End if SDLCreqb[FCntl]
-            SDLCrspl = proc_PIU(SDLCreqb, SDLCreql, &SDLCrspb[SDLCrsptl]);
-            if (SDLCrspl > 0) {
-               Fptr2[FptrI] =  SDLCrsptl;
-               if (Tdbg_flag == ON)
-                  fprintf(T_trace, "\r3274 Frame pointer index %d contains %d", FptrI, Fptr2[FptrI]);
-               FptrI++;
-               Fptr2[FptrI] =  0;
-            }  // End if SDLCrspl
-            SDLCrsptl = SDLCrsptl + SDLCrspl;
-            if (Tdbg_flag == ON)
-               fprintf(T_trace, "\r3274 Total response length: %d\n", SDLCrsptl);
-            if (SDLCreqb[FCntl] & CPoll) {               // Poll command ?
-               // Make sure the receive count is up-to-date before sending the repsonse.
-               // First get the station address and replace the receive count in the Link Header
-               FptrI = 0;
-               Fptr = Fptr2[FptrI];                                //  First frame located at offset 0.
-               do {
-                  station =  (SDLCrspb[Fptr+FAddr] & 0x0F) - 1;
-                  if ((SDLCrspb[Fptr+FCntl] & 0x03) == SUPRV) {      // Supervisory format ?
-                     SDLCrspb[Fptr+FCntl] = (SDLCrspb[Fptr+FCntl] & 0x1F) | (pu2[station]->seq_Nr << 5);  // Insert receive sequence
-                  }
-                  if  ((SDLCrspb[Fptr+FCntl] & 0x01) == IFRAME) {
-                     // Insert receive and send sequence numbers into the Frame Control byte of the response
-                     SDLCrspb[Fptr+FCntl] = (SDLCrspb[Fptr+FCntl] & 0x1F) | (pu2[station]->seq_Nr << 5);  // Insert receive sequence
-                     SDLCrspb[Fptr+FCntl] = (SDLCrspb[Fptr+FCntl] & 0xF1) | (pu2[station]->seq_Ns << 1);  // Insert send sequence
-                     pu2[station]->seq_Ns++;             // Update send sequence number
-                     if (pu2[station]->seq_Ns == 8) pu2[station]->seq_Ns = 0;
-                  }  // End if (SDLCrspb[Fptr+FCntl] & 0x01)
-                  if (Tdbg_flag == ON)
-                     fprintf(T_trace, "\r3274 LH  Receive sequence=%d, Next send Sequence=%d, Fcntl=%02X\n",
-                     pu2[station]->seq_Nr, pu2[station]->seq_Ns, SDLCrspb[Fptr+FCntl]);
-                     FptrI++;                            // Move to next Frame pointer in the array
-                     Fptr = Fptr2[FptrI];                // Get it
-                  }  // End do
-               while (Fptr != 0);                        // If the frame pointer is zero, there are no more frames
-               // Now set the final bit in the last Frame.
-               Fptr = Fptr2[FptrI-1];                    // Get the pointer to the last frame
-               SDLCrspb[Fptr+FCntl] |= CFinal;           // Set the final bit;
-               rc = send(pusdlc_fd, SDLCrspb, SDLCrsptl, 0);
-               if (Tdbg_flag == ON) {
-                  fprintf(T_trace, "\r3274 Response Buffer (%d): ", SDLCrsptl);
-                  for (int i=0; i < SDLCrsptl; i ++) {
-                     fprintf(T_trace, "%02X ", SDLCrspb[i]);
-                  }
-                  fprintf(T_trace, "\n");
-                  fflush(T_trace);
-               }  // End if debug
-               SDLCrsptl = 0;                            // Reset response total length
-               FptrI = 0;
-            } else {
-               // This part is required to avoid multiple frames being stacked into the tcp buffer,
-               // which might happen because the sdlc code delivers frames faster than 3274 can process.
-               rc = send(pusdlc_fd, SDLCrspb, 1, 0);     // Just send a single byte
-               if (Tdbg_flag == ON)
-                  fprintf(T_trace, "\r3274 No poll bit, sending one byte for sync purposes");
-            }  // End SDLCreqb[FCntl] & CPoll
-         }  // End if (pendingrcv > 0)
+            if (SDLCreqb[FAddr] == 0xFF)
+               station = 0;                              // Broadcast, see proc_PIU
+            else if ((station = pu_station(SDLCreqb[FAddr])) < 0)
+               continue;                                 // Not one of our 3274's
+            if (num_wrk == 0)
+               proc_frame(SDLCreqb, SDLCreql, station);
+            else
+               pu_queue(SDLCreqb, SDLCreql, station);    // To the worker of the 3274
+         }  // End while get_frame
+         if (SDLCreql < 0)                               // Link out of sync, drop the line
+            shutdown(pusdlc_fd, SHUT_RDWR);
       }  // End if (rc < 0)
    }  // End while (1)
    return;
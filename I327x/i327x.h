@@ -25,11 +25,19 @@
 /*-------------------------------------------------------------------*/
 /* IBM 3271/3274 common definitions                                  */
 /*-------------------------------------------------------------------*/
-#define MAXSNAPU       2         /* Maximum number of SNA PU's           */
+#define MAXSNAPU      64         /* Maximum number of SNA PU's           */
 #define MAXCLSTR       2         /* Maximum number of BSC clusters's     */
-#define MAXLU          4         /* Maximum nr of LU's per PU or cluster */
+#define MAXLU         32         /* Maximum nr of LU's per PU or cluster */
+#define DEFSNAPU       2         /* Default number of SNA PU's (-pus)    */
+#define DEFLU          4         /* Default nr of LU's per PU (-lus)     */
+#define IOBUF_MIN     4096       /* Initial 3270 input buffer size       */
+#define TTYBUF       16384       /* Terminal socket read size            */
+#define TN_TIMEOUT      30       /* Seconds allowed for telnet negotiation */
 #define SDLCLBASE    37520       /* Port number of first SDLC line       */
+#define SDLCLINES       10       /* SDLC line ports up to BSCLBASE       */
 #define BSCLBASE     37530       /* Port number of first BSC line        */
+#define BSCLINES        10       /* BSC line ports from BSCLBASE         */
+#define BSCLINES_3705    2       /* BSC lines of the 3705 (MAXBSCLINES)  */
 
 #define BUFLEN_3270  65536       /* 3270 Send/Receive buffer  */
 #define BUFLEN_1052    150       /* 1052 Send/Receive buffer  */
@@ -59,33 +67,78 @@ typedef  uint64_t    U64;        /* unsigned 64-bits  */
 #define FILLED         1
 #define EMPTY          0
 
+/*-------------------------------------------------------------------*/
+/* 3271 / 3274 LU Data Structure, one per LU of a PU or cluster      */
+/*-------------------------------------------------------------------*/
+struct LU327x {
+   int      lu_fd;                     /* TN3270 socket, 0 if not connected     */
+   uint32_t rlen3270;                  /* size of data in 3270 receive buffer   */
+   struct IO3270 *io;                  /* 3270 input buffer while connected     */
+   struct TNNEG *tn;                   /* Telnet negotiation, while in progress */
+   uint8_t  *h2g;                      /* ASCII to EBCDIC table of the terminal */
+   uint64_t rtm_t0;                    /* AID read (usec), 0 if none pending    */
+   time_t   held;                      /* Client dropped, session held (-hold)  */
+   uint8_t  *scrn;                     /* 3270 writes since the last erase      */
+   uint32_t scrnl;                     /* length of scrn, SCRN_LOST if too long */
+   uint32_t scrnr;                     /* offset in scrn of the current record  */
+   uint8_t  scrn_rec;                  /* current record is kept in scrn        */
+   uint8_t  scrn_bor;                  /* next data starts a new record         */
+   FILE     *spool;                    /* 3287 spool file or pipe (-prt)        */
+   uint8_t  spool_pipe;                /* spool is a pipe (popen)               */
+   int      lu_lu_seqn;
+   uint8_t  actlu;
+   uint8_t  readylu;
+   uint8_t  reqcont;
+   uint8_t  is_3270;
+   uint8_t  bindflag;
+   uint8_t  initselfflag;
+   uint8_t  telnet_opt;                /* expecting telnet option char          */
+   uint8_t  telnet_iac;                /* expecting telnet command char         */
+   uint8_t  telnet_int;                /* telnet intterupt received             */
+   uint8_t  telnet_cmd;                /* telnet command                        */
+   uint8_t  eol_flag;                  /* Carriage Return received              */
+   uint8_t  not_ready;                 /* Not Ready flag                        */
+   uint8_t  dri;                       /* Definitive Response Indicator         */
+   uint8_t  chaining;                  /* Chaining Indicator                    */
+   uint8_t  daf_addr1;
+};
+
+/*-------------------------------------------------------------------*/
+/* Telnet negotiation of a connecting TN3270 client                  */
+/* Started by tn_accept and advanced by tn_negotiate each time the   */
+/* client socket is readable. The LU slot is reserved (lu->tn) but   */
+/* lu_fd stays 0 until the negotiation is done.                      */
+/*-------------------------------------------------------------------*/
+#define TN_FAILED      -1        /* Negotiation failed, close the socket */
+#define TN_DONE         0        /* Negotiation complete                 */
+#define TN_WILLTERM     1        /* Sent DO TERMINAL_TYPE                */
+#define TN_TERMTYPE     2        /* Sent SB TERMINAL_TYPE SEND           */
+#define TN_DONTECHO     3        /* Sent WONT ECHO (ANSI line mode)      */
+#define TN_WILLEOR      4        /* Sent DO EOR WILL EOR                 */
+#define TN_WILLBIN      5        /* Sent DO BINARY WILL BINARY           */
+
+struct TNNEG {
+   int      fd;                        /* client socket                         */
+   int      state;                     /* TN_xxx                                */
+   time_t   deadline;                  /* give up if not done by then           */
+   BYTE     class;                     /* D=3270, P=3287, K=3215/1052           */
+   BYTE     model;                     /* 3270 model (2,3,4,5,X)                */
+   BYTE     extatr;                    /* Extended attributes (Y,N)             */
+   BYTE     devn;                      /* Requested device number, FF=any       */
+   int      len;                       /* bytes received, not yet processed     */
+   BYTE     buf[512];                  /* negotiation receive buffer            */
+};
+
 /*-------------------------------------------------------------------*/
 /*3271 / 3274 Data Structure                                         */
 /*-------------------------------------------------------------------*/
 struct CB327x {
-   int      lu_fd[MAXLU];
+   struct LU327x *lu;                  /* LU's of this PU or cluster            */
    BYTE     punum;
    BYTE     lunum;
-   BYTE     lunumr;
    int      pu_fd;
    int      epoll_fd;
-   uint32_t actlu[MAXLU];
-   uint32_t readylu[MAXLU];
-   uint32_t reqcont[MAXLU];
-   uint32_t is_3270[MAXLU];
-   uint32_t rlen3270[MAXLU];           /* size of data in 3270 receive buffer   */
-   uint32_t bindflag[MAXLU];
-   uint32_t initselfflag[MAXLU];
-   uint32_t telnet_opt[MAXLU];         /* expecting telnet option char          */
-   uint32_t telnet_iac[MAXLU];         /* expecting telnet command char         */
-   uint32_t telnet_int[MAXLU];         /* telnet intterupt received             */
-   uint32_t eol_flag[MAXLU];           /* Carriage Return received              */
    int      ncpa_sscp_seqn;
-   int      lu_lu_seqn[MAXLU];
-   uint8_t  telnet_cmd[MAXLU];         /* telnet command                        */
-   uint8_t  not_ready[MAXLU];          /* Not Ready flag                        */
-   uint8_t  dri[MAXLU];                /* Definitive Response Indicator         */
-   uint8_t  chaining[MAXLU];           /* Chaining Indicator                    */
    uint8_t  seq_Nr;                    /* Sequence Number Received              */
    uint8_t  seq_Ns;                    /* Sequence Number Send                  */
    uint8_t  sscp_addr0;
@@ -94,16 +147,24 @@ struct CB327x {
    uint8_t  pu_addr1;
    uint8_t  lu_addr0;
    uint8_t  lu_addr1;
-   uint8_t  daf_addr1[MAXLU];
    uint8_t  last_lu;
 };
 
 /*-------------------------------------------------------------------*/
 /* IBM 3270 Data Structure                                           */
+/* Taken from a pool on connect (io_get) and returned on disconnect  */
+/* (io_put). The input buffer grows with the input (io_room), up to  */
+/* BUFLEN_3270, and keeps its size in the pool, as does the output   */
+/* buffer in which send_3270 escapes and gathers outbound records.   */
 /*-------------------------------------------------------------------*/
 struct IO3270 {
-   uint8_t  inpbuf[65536];
+   struct IO3270 *next;                /* next free block in the pool           */
+   uint8_t  *inpbuf;
    uint32_t inpbufl;
+   uint32_t inpbufsz;                  /* size of inpbuf                        */
+   uint8_t  *outbuf;                   /* 3270 output gathered by send_3270     */
+   uint32_t outbufl;
+   uint32_t outbufsz;                  /* size of outbuf                        */
 };
 
 /*-------------------------------------------------------------------*/
@@ -37,190 +37,369 @@
 #include "i3705_defs.h"
 #include <ifaddrs.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#define MAXBSCLINES     2              /* Maximum of lines          */
-#define BUFLEN_3271     65536          /* 3271 Send/Receive buffer  */
+#define MAXBSCLINES     2              /* Maximum of lines, see also BSCLINES_3705 in i327x.h */
 #define LINEBASE        30             /* BSC lines start at 30     */
 
 #define SYN 0x32
+#define ENQ 0x2D
+#define ETX 0x03
+#define ETB 0x26
+#define PAD 0xFF
+#define BSC_RING   65536               /* Line receive ring, power of 2 */
+#define D3271_TAG  0x100               /* epoll tag of a 3271 socket    */
+#define MAXBSCCU   8                   /* 3271 clusters per line        */
+#define CU_HELLO   0x00                /* 3271 identification record    */
+#define CUA_NEW    -2                  /* 3271 has not identified yet   */
+#define CUA_ANY    -1                  /* 3271 answers every CU address */
+
+/* A multipoint BSC line can have several 3271 clusters. Each one sends
+   CU_HELLO and its control unit address (0-31) when it connects; polls
+   and selects are routed by the CU address in the text, the texts
+   that follow go to the cluster last polled or selected.              */
+struct BSCClu {
+   int      fd;                        // 3271 socket, 0 if not connected
+   int      cua;                       // Control unit address, CUA_NEW or CUA_ANY
+   uint32_t rhead;                     // Receive ring: bytes written
+   uint32_t rtail;                     // Receive ring: bytes taken
+   uint8_t  rbuf[BSC_RING];            // Receive ring
+};
 
 struct BSCLine {
    int      line_fd;
    int      linenum;
-   int      d3271_fd;
-   int      epoll_fd;
-   uint8_t  BSC_rbuf[BUFLEN_3271];     // Received data buffer
-   uint8_t  BSC_tbuf[BUFLEN_3271];     // Transmit data buffer
-   uint16_t BSCrlen;                   // Size of received data in buffer
-   uint16_t BSCtlen;                   // Size of transmit data in buffer
+   int8     BSCsync;                   // Track receive progress (scanner owned)
+   int      awaiting;                  // Text sent, waiting for the reply of cu[cur]
+   int      cur;                       // Cluster addressed by the last poll or select
+   struct BSCClu cu[MAXBSCCU];         // Clusters on the line
 } *bscline[MAXBSCLINES];
 
-int proc_BSC(char* BSC_tbuf, uint16_t BSCtlen);
-void proc_BSCtdata (unsigned char BSCchar, uint8_t state);    // BSC character handler
+int bsc_epfd;                          // Polls the line listen sockets and bsc_evfd
+int bsc_evfd = -1;                     // Scanner has queued a text
+
+void proc_BSCtdata (int line, unsigned char BSCchar, uint8_t state);    // BSC character handler
+void BSC_kick(void);                                                    // Wake the BSC thread
 
 extern FILE *trace;
 extern int8 debug_reg;
+extern struct LINEQ lineq[];           // Scanner line frame queues
+
+extern struct LFRAME *lq_slot(struct LRING *r);
+extern void lq_put(struct LRING *r);
+extern struct LFRAME *lq_peek(struct LRING *r);
+extern void lq_get(struct LRING *r);
+extern void CS2_wakeup(void);
 
-int8 BSCsync;                          // Track receive progress
 int8 station;                          // Station #
 
 //*********************************************************************
-//  Shift all chacters in an array yo the left.                       *
+//   Check if the bytes in the cluster ring form a complete 3271      *
+//   reply. Every reply ends with a PAD (line turnaround): control    *
+//   replies are at most 5 bytes, texts have ETX/ETB and the BCC      *
+//   before it. 00 PAD means the 3271 has no reply.                   *
+//*********************************************************************
+static int BSC_complete(struct BSCClu *c) {
+   uint32_t n = c->rhead - c->rtail;
+
+#define RB(i) c->rbuf[(c->rtail + (i)) & (BSC_RING - 1)]
+   if ((n < 2) || (RB(n - 1) != PAD))
+      return 0;
+   return (n <= 5) || (RB(n - 4) == ETX) || (RB(n - 4) == ETB);
+#undef RB
+}
+
+//*********************************************************************
+//   Hand the reply of the addressed cluster to the scanner. Returns  *
+//   1 if a reply was queued, 0 if none is complete or the queue is   *
+//   full.                                                            *
 //*********************************************************************
-int ShiftLeft(char *buffer, int len)  {
-   int i;
-   for (i = 1; i < len; i++) {
-      buffer[i - 1] = buffer[i];
+static int BSC_reply(int k) {
+   struct BSCLine *bl = bscline[k];
+   struct BSCClu *c;
+   struct LFRAME *r;
+   uint32_t n, first;
+
+   if ((bl->awaiting == OFF) || (bl->cur < 0))
+      return 0;
+   c = &bl->cu[bl->cur];
+   if (!BSC_complete(c))
+      return 0;
+   if ((r = lq_slot(&lineq[k].rx)) == NULL)
+      return 0;                                // Scanner still reading, retry on next kick
+   n = c->rhead - c->rtail;
+   if (n > LFRM_SIZE) {
+      printf("\rBSC: line-%d reply of %u bytes truncated\n", k, n);
+      n = LFRM_SIZE;
    }
-   len--;
-   return len;
+   first = BSC_RING - (c->rtail & (BSC_RING - 1));  // Bytes up to the end of the ring
+   if (first > n)
+      first = n;
+   memcpy(r->data, &c->rbuf[c->rtail & (BSC_RING - 1)], first);
+   memcpy(&r->data[first], c->rbuf, n - first);
+   r->len = ((n == 2) && (r->data[0] == 0x00)) ? 0 : n;   // 00 PAD means no reply
+   if ((debug_reg & 0x40) && (r->len > 0)) {
+      fprintf(trace, "\n3271 Read Buffer: ");
+      for (int i = 0; i < r->len; i ++) {
+         fprintf(trace, "%02X ", r->data[i]);
+      }
+      fprintf(trace, "\n\r");
+   }  // End if debug_reg
+   c->rtail = c->rhead;
+   bl->awaiting = OFF;
+   lq_put(&lineq[k].rx);
+   return 1;
 }
 
 //*********************************************************************
-// Check if there is read activiy on the socket                       *
-// This is used by the caller to detect a connection break            *
+//   Number of 3271 clusters connected to a line.                     *
 //*********************************************************************
-int SocketReadAct(int fd) {
-   int     rc;
-   fd_set  fdset;
-   struct  timeval timeout;
-   timeout.tv_sec = 0;
-   timeout.tv_usec = 0;
-   FD_ZERO(&fdset);
-   FD_SET(fd, &fdset);
-   return select(fd + 1, &fdset, NULL, NULL,  &timeout);
+static int BSC_clusters(struct BSCLine *bl) {
+   int j, n = 0;
+
+   for (j = 0; j < MAXBSCCU; j++)
+      if (bl->cu[j].fd > 0)
+         n++;
+   return n;
 }
 
 //*********************************************************************
-// Function to check if socket is (still) connected                   *
+//   3271 connection lost: stop polling it and, if the scanner waits  *
+//   for its reply, complete it as no reply, or as not connected if   *
+//   it was the last cluster on the line.                             *
 //*********************************************************************
-static bool IsSocketConnected(int sockfd) {
-   int rc;
-   struct sockaddr_in peer_addr;
-   int addrlen = sizeof(peer_addr);
-   if (sockfd < 1) {
-      return false;
-   }
-   rc = getpeername(sockfd, (struct sockaddr*)&peer_addr, &addrlen);
-   if (rc != 0) {
-      return false;
+static int BSC_close(int k, int j) {
+   struct BSCLine *bl = bscline[k];
+   struct BSCClu *c = &bl->cu[j];
+   struct LFRAME *r;
+   int n = 0;
+
+   epoll_ctl(bsc_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+   close(c->fd);
+   c->fd = 0;
+   c->rhead = c->rtail = 0;
+   if (bl->cur == j) {
+      if ((bl->awaiting == ON) && ((r = lq_slot(&lineq[k].rx)) != NULL)) {
+         r->len = (BSC_clusters(bl) > 0) ? 0 : -1;
+         lq_put(&lineq[k].rx);
+         n++;
+      }
+      bl->awaiting = OFF;
+      bl->cur = -1;
    }
-   return true;
+   if (c->cua >= 0)
+      printf("\rBSC: 3271 CU %02X disconnected from line-%d\n", c->cua, k);
+   else
+      printf("\rBSC: 3271 disconnected from line-%d\n", k);
+   return n;
 }
 
 //*********************************************************************
-// Receive data from the 3271                                         *
-// If an error occurs, the connection will be closed                  *
+//   The first bytes of a new connection: CU_HELLO and the control    *
+//   unit address. A 3271 that starts with anything else answers      *
+//   every address, as on a point to point line.                      *
 //*********************************************************************
-int  ReadBSC(int k) {
-   int rc;
-   if (IsSocketConnected(bscline[k]->d3271_fd)) {
-      bscline[k]->BSCrlen = read(bscline[k]->d3271_fd, bscline[k]->BSC_rbuf, BUFLEN_3271);
-      if (bscline[k]->BSCrlen == 1)
-         bscline[k]->BSCrlen = 0;    // Received 1 byte means Reset received data length.
-      if ((debug_reg & 0x40) && (bscline[k]->BSCrlen > 0)) {
-         fprintf(trace, "\n3271 Read Buffer: ");
-         for (int i = 0; i < bscline[k]->BSCrlen; i ++) {
-            fprintf(trace, "%02X ", bscline[k]->BSC_rbuf[i]);
-         }
-         fprintf(trace, "\n\r");
-      }  // End if debug_reg
-      return 0;
-   } else {
-      close (bscline[k]->d3271_fd);
-      bscline[k]->d3271_fd = 0;
-     printf("\rBSC: 3271 disconnected from line-%d\n", k);
-   }  // End if IsSocketConnected
-   return -1;
+static void BSC_hello(int k, struct BSCClu *c) {
+   uint32_t n = c->rhead - c->rtail;
+
+   if (c->rbuf[c->rtail & (BSC_RING - 1)] != CU_HELLO) {
+      c->cua = CUA_ANY;
+      return;
+   }
+   if (n < 2)
+      return;                                  // Address still to come
+   c->cua = c->rbuf[(c->rtail + 1) & (BSC_RING - 1)] & 0x1F;
+   c->rtail += 2;
+   printf("\rBSC: 3271 CU %02X connected to line-%d\n", c->cua, k);
 }
 
 //*********************************************************************
-// Receive data from the 3271                                         *
-// If an error occurs, the connection will be closed                  *
+//   Receive data from a 3271 into its ring. Called when the socket   *
+//   is readable; reads without blocking, wrapping around the end of  *
+//   the ring in one call. Returns the replies queued.                *
 //*********************************************************************
-int ReadBSC2(int k) {
-   int rc;
-   int pendingrcv;              /* pending data on the socket        */
-   if (bscline[k]->d3271_fd > 0) {
-      while(1) {
-         rc = ioctl(bscline[k]->d3271_fd, FIONREAD, &pendingrcv);
-         if ((pendingrcv < 1) && (SocketReadAct(bscline[k]->d3271_fd))) rc = -1;
-         if (rc < 0) {
-            close (bscline[k]->d3271_fd);
-            bscline[k]->d3271_fd = 0;
-            printf("\rBSC: 3271 disconnected from line-%d\n", k);
-            return -1;
-         } else {
-            if (pendingrcv > 0) {
-               bscline[k]->BSCrlen = read(bscline[k]->d3271_fd, bscline[k]->BSC_rbuf, BUFLEN_3271);
-               if ( bscline[k]->BSCrlen == 1)
-                  bscline[k]->BSCrlen = 0;    // Received 1 byte meansReset received data length.
-               if ((debug_reg & 0x40) && (bscline[k]->BSCrlen > 0)) {
-                  fprintf(trace, "\n3271 Read Buffer: ");
-                  for (int i = 0; i < bscline[k]->BSCrlen; i ++) {
-                     fprintf(trace, "%02X ", bscline[k]->BSC_rbuf[i]);
-                  }
-               fprintf(trace, "\n\r");
-               } // End if debug_reg
-               return 0;
-            }  // End if pendingrcv
-         }  // End if rc < 0
-      }  // End while(1)
-   }  // End if bsc-d3271_fd
-   return -1;
+static int ReadBSC(int k, int j) {
+   struct BSCClu *c = &bscline[k]->cu[j];
+   struct iovec iov[2];
+   struct msghdr msg;
+   uint32_t head = c->rhead & (BSC_RING - 1);
+   uint32_t room = BSC_RING - (c->rhead - c->rtail);
+   int len;
+
+   if (room == 0)                              // Full ring without a complete reply ?
+      return BSC_close(k, j);
+   iov[0].iov_base = &c->rbuf[head];
+   iov[0].iov_len  = (BSC_RING - head < room) ? BSC_RING - head : room;
+   iov[1].iov_base = c->rbuf;
+   iov[1].iov_len  = room - iov[0].iov_len;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = iov;
+   msg.msg_iovlen = (iov[1].iov_len > 0) ? 2 : 1;
+   len = recvmsg(c->fd, &msg, MSG_DONTWAIT);
+   if (len < 0 && (errno == EAGAIN || errno == EINTR))
+      return 0;
+   if (len <= 0)
+      return BSC_close(k, j);
+   c->rhead += len;
+   if (c->cua == CUA_NEW)
+      BSC_hello(k, c);
+   if ((bscline[k]->cur != j) && (c->cua != CUA_NEW))
+      c->rtail = c->rhead;                     // Not addressed, drop it
+   return BSC_reply(k);
 }
 
 //*********************************************************************
-//   Transmitted Character from scanner                               *
+//   Transmitted Character from scanner line                          *
+//   Runs in the scanner thread: the text is built in the tx frame of *
+//   the line queue and handed to the BSC thread at state C.          *
 //*********************************************************************
-void proc_BSCtdata (unsigned char BSCtchar, uint8_t state) {
-uint8 rc;
+void proc_BSCtdata (int line, unsigned char BSCtchar, uint8_t state) {
+struct BSCLine *bl;
+struct LFRAME *f;
+
+   if ((line >= MAXBSCLINES) || (bscline[line] == NULL))
+      return;                                  // No 3271 can be connected to this line
+   bl = bscline[line];
+   if ((f = lq_slot(&lineq[line].tx)) == NULL)
+      return;                                  // Previous texts not sent yet
 
    // State C means end of transmission, send buffer to cluster controller.
-   if ((BSCsync == 1) && (state == 0xC)) {
-      BSCsync = 0;                             // Reset SYNC.
-      rc = send(bscline[0]->d3271_fd, bscline[0]->BSC_tbuf, bscline[0]->BSCtlen, 0);
-      bscline[0]->BSCtlen = 0;                 // Reset transmitted data length.
-      rc = ReadBSC(0);
+   if ((bl->BSCsync == 1) && (state == 0xC)) {
+      bl->BSCsync = 0;                         // Reset SYNC.
+      f->drv = LDRV_BSC;
+      lq_put(&lineq[line].tx);                 // Hand the text to the BSC thread
+      BSC_kick();
+      return;
    }  // End if state
 
    // If we are in receive mode, append the character to the buffer
-   if (BSCsync == 1) {
-      bscline[0]->BSC_tbuf[bscline[0]->BSCtlen] = BSCtchar;            // Add character to buffer
-      bscline[0]->BSCtlen++;                               // Increment length
+   if ((bl->BSCsync == 1) && (f->len < LFRM_SIZE)) {
+      f->data[f->len] = BSCtchar;              // Add character to buffer
+      f->len++;                                // Increment length
    }  // End if BSCsync
 
    // Check if we received a synchronization character. This indicates the start of a transmission
    if ((BSCtchar == 0xAA) && (state == 0x8)) {
-      BSCsync = 1;                             // Indicate we are in receive mode
-      bscline[0]->BSCtlen = 0;                 // Ensure length is set to zero
+      bl->BSCsync = 1;                         // Indicate we are in receive mode
+      f->len = 0;                              // Ensure length is set to zero
    }  // End if BSCtchar == 0xAA
 
    // Check if we received two consequtive SYN characters in the text;...
    // ...these are time-fill sync and must be removed
-   if ((bscline[0]->BSCtlen > 3) && (BSCtchar == SYN) && (bscline[0]->BSC_tbuf[bscline[0]->BSCtlen-2] == SYN))  {
-      bscline[0]->BSCtlen = bscline[0]->BSCtlen - 2;
+   if ((f->len > 3) && (BSCtchar == SYN) && (f->data[f->len-2] == SYN))  {
+      f->len = f->len - 2;
    }  // End if BSCtlen
    return;                                     // back to schanner
 }
 
 //*********************************************************************
-//   Received Character for scanner                                   *
+//   Received Character for scanner line                              *
+//   Runs in the scanner thread: takes the next character of the     *
+//   oldest rx frame of the line queue.                               *
+//*********************************************************************
+int  proc_BSCrdata (int line, unsigned char *BSCrchar) {
+struct LFRAME *r;
+
+   if ((line >= MAXBSCLINES) || (bscline[line] == NULL))
+      return 0;                                // No 3271 can be connected to this line
+   while ((r = lq_peek(&lineq[line].rx)) != NULL) {
+      if ((r->len > 0) && (r->ptr < r->len)) {
+         *BSCrchar = r->data[r->ptr++];
+         if (r->ptr >= r->len) {               // Last character of the text ?
+            lq_get(&lineq[line].rx);
+            BSC_kick();
+         }
+         return 1;                             // One character to transmit
+      }
+      lq_get(&lineq[line].rx);                 // Empty frame, drop it
+      BSC_kick();
+   }
+   return 0;                                   // back to schanner
+}
+
+//*********************************************************************
+//   Ring the BSC thread: the scanner has queued a text or has taken  *
+//   a response off a line queue.                                     *
+//*********************************************************************
+void BSC_kick(void) {
+   uint64_t one = 1;
+   int rc;
+
+   if (bsc_evfd < 0)
+      return;
+   rc = write(bsc_evfd, &one, sizeof(one));
+   if ((rc < 0) && (errno != EAGAIN))          // EAGAIN: counter full, thread is awake anyway
+      printf("\nBSC: Scanner doorbell write failed with error %s \n\r", strerror(errno));
+}
+
+//*********************************************************************
+//   Select the cluster for a text. A poll or select (SYN SYN CU CU   *
+//   DV DV ENQ) addresses the cluster with that CU address, any other *
+//   text goes to the cluster addressed last. Returns the cluster or  *
+//   -1 if no cluster answers.                                        *
 //*********************************************************************
-int  proc_BSCrdata (unsigned char *BSCrchar) {
-uint8 rc;
-   rc = 0;                                     // preset to n o characters to transmit
-   if (bscline[0]->BSCrlen > 0) {
-      *BSCrchar = bscline[0]->BSC_rbuf[0];
-      bscline[0]->BSCrlen = ShiftLeft(bscline[0]->BSC_rbuf, bscline[0]->BSCrlen);
-      rc = 1;                                  // One character to transmit
+static int BSC_route(struct BSCLine *bl, struct LFRAME *f) {
+   int j, cua;
+
+   if ((f->len >= 7) && (f->data[0] == SYN) && (f->data[1] == SYN) && (f->data[6] == ENQ)) {
+      cua = f->data[2] & 0x1F;                 // Poll and select address of a CU differ in bit 2
+      bl->cur = -1;
+      for (j = 0; j < MAXBSCCU; j++)
+         if ((bl->cu[j].fd > 0) && (bl->cu[j].cua == cua))
+            bl->cur = j;
+      for (j = 0; (j < MAXBSCCU) && (bl->cur < 0); j++)
+         if ((bl->cu[j].fd > 0) && (bl->cu[j].cua < 0))
+            bl->cur = j;                       // Fall back to a 3271 that answers all
+      return bl->cur;
    }
-   return rc;                                  // back to schanner
+   if ((bl->cur >= 0) && (bl->cu[bl->cur].fd > 0))
+      return bl->cur;
+   if (BSC_clusters(bl) != 1)
+      return -1;                               // Multipoint: nobody addressed
+   for (j = 0; bl->cu[j].fd <= 0; j++);        // Point to point: the only cluster
+   return bl->cur = j;
+}
+
+//*********************************************************************
+//   Send the texts queued by the scanner to the 3271 they address.   *
+//   The reply is collected by the BSC thread when it arrives; the    *
+//   next text of the line waits for it.                              *
+//*********************************************************************
+static void BSC_drain(void) {
+   struct BSCLine *bl;
+   struct BSCClu *c;
+   struct LFRAME *f, *r;
+   int t, j, n = 0;
+
+   for (t = 0; t < MAXBSCLINES; t++) {
+      bl = bscline[t];
+      n += BSC_reply(t);                       // Reply held back by a full queue
+      while (((f = lq_peek(&lineq[t].tx)) != NULL) && (f->drv == LDRV_BSC)) {
+         if (bl->awaiting == ON)
+            break;                             // Wait for the 3271 reply
+         if ((j = BSC_route(bl, f)) >= 0) {
+            c = &bl->cu[j];
+            bl->awaiting = ON;
+            c->rtail = c->rhead;               // Drop anything not asked for
+            send(c->fd, f->data, f->len, 0);
+         } else {
+            if ((r = lq_slot(&lineq[t].rx)) == NULL)
+               break;                          // Scanner still reading, retry on next kick
+            // No 3271 with this address answers; none at all is not connected
+            r->len = (BSC_clusters(bl) > 0) ? 0 : -1;
+            lq_put(&lineq[t].rx);
+            n++;
+         }
+         lq_get(&lineq[t].tx);
+      }
+   }
+   if (n > 0)
+      CS2_wakeup();                            // Responses for the scanner
 }
 
 //*********************************************************************
@@ -233,18 +412,26 @@ void *BSC_thread(void *arg)
    int    pendingrcv;              /* pending data on the socket     */
    int    event_count;             /* # events received              */
    int    rc, rc1;                 /* return code from various rtns  */
+   int    j;                       /* cluster on the line            */
    struct sockaddr_in sin, *sin2;  /* bind socket address structure  */
    struct ifaddrs *nwaddr, *ifa;   /* interface address structure    */
    char   *ipaddr;
-   struct epoll_event event, events[MAXBSCLINES];
+   uint64_t kicks;
+   struct epoll_event event, events[(MAXBSCCU + 1) * MAXBSCLINES + 1];
 
    printf("\rBSC: Thread %ld started succesfully...\n", syscall(SYS_gettid));
 
    for (int j = 0; j < MAXBSCLINES; j++) {
       bscline[j] =  malloc(sizeof(struct BSCLine));
       bscline[j]->linenum = j;
-      bscline[j]->BSCrlen = 0;
-      bscline[j]->BSCtlen = 0;
+      bscline[j]->BSCsync = 0;
+      bscline[j]->awaiting = OFF;
+      bscline[j]->cur = -1;
+      for (int c = 0; c < MAXBSCCU; c++) {
+         bscline[j]->cu[c].fd = 0;
+         bscline[j]->cu[c].cua = CUA_NEW;
+         bscline[j]->cu[c].rhead = bscline[j]->cu[c].rtail = 0;
+      }
    }  // End for j = 0
    getifaddrs(&nwaddr);      /* get network address */
    for (ifa = nwaddr; ifa != NULL; ifa = ifa->ifa_next) {
@@ -256,6 +443,20 @@ void *BSC_thread(void *arg)
    }
    printf("\nBSC: Using network Address %s on %s for 3271 connections\n", ipaddr, ifa->ifa_name);
 
+   // All lines and the scanner doorbell are polled by one epoll set
+   bsc_epfd = epoll_create(1);
+   if (bsc_epfd == -1) {
+      printf("\nBSC: failed to created the epoll file descriptor\n\r");
+      exit(-2);
+   }
+   bsc_evfd = eventfd(0, EFD_NONBLOCK);
+   event.events = EPOLLIN;
+   event.data.u32 = MAXBSCLINES;       // Doorbell tag
+   if ((bsc_evfd == -1) || (epoll_ctl(bsc_epfd, EPOLL_CTL_ADD, bsc_evfd, &event) == -1)) {
+      printf("\nBSC: Scanner doorbell creation failed with error %s \n\r", strerror(errno));
+      exit(-3);
+   }
+
    for (int j = 0; j < MAXBSCLINES; j++) {
       if ((bscline[j]->line_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
          printf("\nBSC: Endpoint creation for 3271 failed with error %s ", strerror(errno));
@@ -279,38 +480,54 @@ void *BSC_thread(void *arg)
           exit(-1);
       }
       // Add polling events for the port
-      bscline[j]->epoll_fd = epoll_create(1);
-      if (bscline[j]->epoll_fd == -1) {
-         printf("\nBSC: failed to created the line-%d epoll file descriptor\n\r", j);
-         free(bscline[j]);
-         exit(-2);
-      }
       event.events = EPOLLIN;
-      event.data.fd = bscline[j]->line_fd;
-      if (epoll_ctl(bscline[j]->epoll_fd, EPOLL_CTL_ADD, bscline[j]->line_fd, &event) == -1) {
+      event.data.u32 = j;              // Line tag
+      if (epoll_ctl(bsc_epfd, EPOLL_CTL_ADD, bscline[j]->line_fd, &event) == -1) {
          printf("\nBSC: Add polling event failed for line-%d with error %s \n\r", j, strerror(errno));
-         close(bscline[j]->epoll_fd);
          free(bscline[j]);
          exit(-3);
       }
       printf("\rBSC: line-%d ready, waiting for connection on TCP port %d\n\r", j, 37500 + LINEBASE + j );
    }
    //
-   // Poll briefly for connect requests. If a connect request is received, proceed with connect/accept the request.
-   // Next, check all active connection for input data.
+   // Send the texts queued by the scanner, then wait for the scanner doorbell, 3271 data or a connect request.
+   // If a connect request is received, proceed with connect/accept the request.
    //
    while (1) {
-      for (int k = 0; k < MAXBSCLINES; k++) {
-         event_count = epoll_wait(bscline[k]->epoll_fd, events, 1, 50);
-         for (int i = 0; i < event_count; i++) {
-            bscline[k]->d3271_fd = accept(bscline[k]->line_fd, NULL, 0);
-            if (bscline[k]->d3271_fd < 1) {
-               printf("\nBSC: accept failed for line-%d %s\n", k, strerror(errno));
-            } else {
-               printf("\rBSC: 3271 connected to line-%d\n", k);
-            } // End if bscline[k]->d3271_fd
-         }  // End for int i
-      }  // End for int k
+      BSC_drain();
+      event_count = epoll_wait(bsc_epfd, events, (MAXBSCCU + 1) * MAXBSCLINES + 1, -1);
+      for (int i = 0; i < event_count; i++) {
+         int k = events[i].data.u32;
+         if (k == MAXBSCLINES) {       // Scanner doorbell ?
+            rc = read(bsc_evfd, &kicks, sizeof(kicks));
+            continue;
+         }
+         if (k & D3271_TAG) {          // Data from a 3271 ?
+            k &= ~D3271_TAG;
+            j = k % MAXBSCCU;
+            k = k / MAXBSCCU;
+            if ((bscline[k]->cu[j].fd > 0) && (ReadBSC(k, j) > 0))
+               CS2_wakeup();           // Reply for the scanner
+            continue;
+         }
+         rc = accept(bscline[k]->line_fd, NULL, 0);
+         if (rc < 1) {
+            printf("\nBSC: accept failed for line-%d %s\n", k, strerror(errno));
+            continue;
+         }
+         for (j = 0; (j < MAXBSCCU) && (bscline[k]->cu[j].fd > 0); j++);
+         if (j == MAXBSCCU) {
+            printf("\rBSC: line-%d has %d clusters, 3271 connection rejected\n", k, MAXBSCCU);
+            close(rc);
+            continue;
+         }
+         bscline[k]->cu[j].fd = rc;
+         bscline[k]->cu[j].cua = CUA_NEW;
+         bscline[k]->cu[j].rhead = bscline[k]->cu[j].rtail = 0;
+         event.events = EPOLLIN | EPOLLRDHUP;
+         event.data.u32 = D3271_TAG | (k * MAXBSCCU + j);  // 3271 tag
+         epoll_ctl(bsc_epfd, EPOLL_CTL_ADD, rc, &event);
+      }  // End for int i
    }  // End while(1)
 
     return NULL;
@@ -21,6 +21,10 @@
 
    3705_chan_T1.c  IBM 3705 Channel Adaptor Type 1 simulator
 
+   The type 1 CA is selected with SET CA1 TYPE=1.  It shares the host
+   connection handling, buffer pool and statistics of the type 2 CA
+   (i3705_chan_T2.c) and is run by the CA1 adapter thread.
+
    *** CA1 input (CCU output) Eregs ***
    Label      Ereg         Function
    --------------------------------------------------------------
@@ -60,14 +64,6 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 
-#define IMAX 4096          // Input buffer size Random. Need to define a more rational value
-#define RMAX 64            // Response buffer size Random. Need to define a more rational value
-
-#define PORT 3704          // TCP/IP port number.
-#define SA struct sockaddr_in
-#define TRUE  1
-#define FALSE 0
-
 // CSW Unit Status conditions.  Channel status conditions not defined (yet).
 #define CSW_ATTN 0x80      // Attention
 #define CSW_SMOD 0x40      // Status Modifier
@@ -78,601 +74,320 @@
 #define CSW_UCHK 0x02      // Unit check
 #define CSW_UEXC 0x01      // Unit Exception
 
-#define MAXHOSTS 4
+#define T1_IS    0x0008    // Reg 77: CA1 initial selection L3 request
+#define T1_DS    0x0010    // Reg 77: CA1 data/status service L3 request
 
 extern int32 Eregs_Inp[];
 extern int32 Eregs_Out[];
 extern int8  CA1_DS_req_L3;  /* Chan Adap Data/Status request flag */
 extern int8  CA1_IS_req_L3;  /* Chan Adap Initial/Sel request flag */
-char data_buffer[IMAX];
-char response_buffer[RMAX];
-int i;
-uint8_t nobytes, tcount;
-
-// Declaration of thread condition variable
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-
-// Declaring mutex
-pthread_mutex_t lock;
-
-int reg_bit(int reg, int bit_mask);
-int Ireg_bit(int reg, int bit_mask);
-void wait();
-
-struct CCW {  /* Channel Command Word */
-   uint8_t  code;
-   uint8_t  data_address[3];
-   uint8_t  flags;
-   uint8_t  chain;           // Format 0. Chain is not correct (yet), but aligned to Hercules
-   uint16_t count;
-} ccw;
-
-struct {  CSW   /* Channel Status Word */
-   uint8_t  key;
-   uint8_t  data_address[3];
-   uint8_t  unit_conditions;
-   uint8_t  channel_conditions;
-   uint16_t count;
-} csw;
-
-struct IO3705 {
-   int socket_3705;
-     int max_sd;
-     int addrlen;
-     int ccw_socket;
-     int tag_socket;
-     int activity;
-     int valred;
-     int rcvid;
-     uint16_t devnum;
-     uint8_t buffer[4096];   // Data buffer of 4K
-     uint32_t bufferl;       // Received data length
-   struct sockaddr_in address;
-   } iob;
-
-int wrkid, offset;
+extern uint16_t Adbg_reg;    // Channel adapter trace flags
+extern uint16_t Adbg_flag;
+extern FILE  *A_trace;
+extern pthread_mutex_t r77_lock;
+extern struct IO3705*  iobs[MAXCHAN];
+
+// Shared with the type 2 channel adapter (i3705_chan_T2.c)
+extern int  Ireg_bit(int reg, int bit_mask);
+extern void wait();
+extern void wait_L3(int CAid, int bit_mask);
+extern void print_hex(char *buffptr, int buf_len);
+extern uint64_t ca_usec(void);
+extern int  ca_send(int sockfd, void *buf, int len);
+extern void ca_stats_ccw(struct IO3705 *iob, uint8_t code, uint64_t t0, uint32_t bytes);
+extern void ca_stats_sock(struct IO3705 *iob, uint64_t t0);
+extern int  ca_hold(struct IO3705 *iob);
+extern void ca_release(struct IO3705 *iob);
+extern struct CABUF *ca_buf_get(uint32_t len);
+extern struct CABUF *ca_buf_grow(struct CABUF *buf, uint32_t len);
+extern void ca_buf_put(struct CABUF *buf);
+extern int  ca_wait_ccw(struct IO3705 *iob);
+extern void ca_ccw_done(struct IO3705 *iob);
 
 // ************************************************************
-// Function to format and display incomming data from host
+// This subroutine test for 1 bit in a External Output reg.
+// If '0' OFF is returned, if 1 'ON' returned.
 // ************************************************************
-void print_hex(char *buffptr, int buf_len) {
-   printf("\nRecord length: %X  (hex)\n\r", buf_len);
-      for (int i = 0; i < buf_len; i++) {
-         printf("%02X ", (unsigned char)buffptr[i]);
-         if ((i + 1) % 16 == 0)
-            printf("\n\r");
-      }
-      printf("\n\r");
-   return;
+static int reg_bit(int reg, int bit_mask) {
+   if ((Eregs_Out[reg] & bit_mask) == 0x00)
+      return(OFF);
+   else
+      return(ON);
 }
 
 // ************************************************************
-// Function to wait for TCP connection from host
+// Function to raise a CA1 level 3 interrupt request
 // ************************************************************
-int host_connect(struct IO3705 *iobptr, int *sockptr) {
-   // Listen and verify
-   if ((listen(iobptr->socket_3705, 5)) != 0) {
-      printf("\nCA1: Listen failed...\n\r");
-      exit(0);
-   }
-   else
-      printf("\nCA1: RPi 3705 waiting for host...\n\r");
-
-   // Accept the incoming connection
-   iobptr->addrlen = sizeof(iobptr->address);
-
-   *sockptr = accept(iobptr->socket_3705, (struct sockaddr *)&iobptr->address, (socklen_t*)&iobptr->addrlen);
-   if (iobptr->ccw_socket < 0) {
-      printf("\nCA1: Host accept failed...\n\r");
-      return -1;
-   }
-   else
-      printf("\nCA1: New connection, socket fd is %d, ip is : %s, port : %d \n\r",
-               *sockptr, inet_ntoa(iobptr->address.sin_addr), ntohs
-               (iobptr->address.sin_port));
-   return 0;
+static void t1_req_L3(int bit_mask) {
+   pthread_mutex_lock(&r77_lock);
+   Eregs_Inp[0x77] |= bit_mask;                  // Set L3 request
+   pthread_mutex_unlock(&r77_lock);
+   if (bit_mask & T1_IS)
+      CA1_IS_req_L3 = ON;                        // Chan Adap Initial Sel request flag
+   if (bit_mask & T1_DS)
+      CA1_DS_req_L3 = ON;                        // Chan Adap Data Service request flag
 }
 
 // ************************************************************
-// Function to send CA return status to the host
+// Function to present an initial selection to the CCU.
+// dtr are the data transfer request bits to set in reg 62.
 // ************************************************************
-void send_carnstat(int sockptr, char *carnstat, char *ackbuf) {
-   int rc;                      /* Return code */
-
-   // Send CA retun status to host
-   *carnstat = 0x00;
-   *carnstat = (Eregs_Out[0x66] & 0x00FF);
-   printf("CARNSTAT: %04X via socket %d\n\r", Eregs_Out[0x66], sockptr);
-   rc = send(sockptr, carnstat, 1, 0);
-   printf("CA1: Send %d bytes on socket %d\n\r", rc, sockptr);
-   if (rc < 0) {
-      printf("\nCA1: CA status send to host failed...\n\r");
-      return;
+static void t1_initial_sel(int dtr) {
+   if ((Eregs_Inp[0x67] & 0x0008) == 0x00) {     // If channel not enabled
+      while (reg_bit(0x67, 0x0008) == OFF) wait();  // Wait until channel enable is allowed
+      Eregs_Inp[0x67] |= 0x000C;                 // Enable channel and subchannel
    }
-   // Wait for the ACK from the host
-   rc = recv(sockptr, ackbuf, 1, 0);
-   printf("CA1: Ack received %02X on socket %d\n\r", *ackbuf, sockptr);
-   Eregs_Out[0x66] = 0x0000;                      // Reset CA status bytes
-
-   return;
-}  /* end function send_carnstat */
-
-// ************************************************************
-// Function to wait for an ACK from the host
-// ************************************************************
-void recv_ack(int sockptr) {
-   char ackbuf;
-   int rc;
-   rc = read(sockptr, &ackbuf, 1);
-   return;
+   wait_L3(0, T1_IS | T1_DS);                    // Wait for selection reset
+   Eregs_Inp[0x60] |= 0x8000;                    // Set initial selection
+   Eregs_Inp[0x62] |= dtr;                       // Set data transfer request
+   t1_req_L3(T1_IS);                             // Set Initial select lvl 3 interrupt
+   wait_L3(0, T1_IS);                            // Wait for initial selection reset
 }
 
 // ************************************************************
-// Function to send an ACK to the host
+// Function to send CA return status to the host.
+// A carnstat of -1 sends the NSC status set by the CCU.
 // ************************************************************
-void send_ack(int sockptr) {
-   char ackbuf;
+static void t1_send_carnstat(struct IO3705 *iob, int sockptr, int carnstat) {
+   uint8_t stat;
+   uint64_t t0;
    int rc;
-   rc = send(sockptr, &ackbuf, 1, 0);
-   return;
-}
-
-// ************************************************************
-// Function to read data from TCP socket
-// ************************************************************
-int read_socket(int sockptr, char *buffptr, int buffsize) {
-   int reclen;
-   int n;
-   bzero(buffptr, buffsize);
-   reclen = read(sockptr, buffptr, buffsize);
-   return reclen;
-}
-
-// ************************************************************
-// Function to send response data to the host
-// ************************************************************
-int send_socket(int sockptr, char *respp, int respsize) {
-   int rc;                      /* Return code */
-   rc = send (sockptr, respp, respsize, 0);
 
+   stat = (carnstat < 0) ? (Eregs_Out[0x66] & 0x00FF) : carnstat;
+   if ((Adbg_flag == ON) && (Adbg_reg & 0x01))    // Trace channel adapter activities ?
+      fprintf(A_trace, "CA1: CARNSTAT %02X via socket %d\n\r", stat, sockptr);
+   t0 = ca_usec();
+   rc = ca_send(sockptr, &stat, 1);
+   ca_stats_sock(iob, t0);
    if (rc < 0) {
-      printf("\nCA1: Send to host failed...\n\r");
-      return -1;
-   }
-   return 0;
-}  /* end function send_SIMH */
-
-// ************************************************************
-// Function to create and open TCP socket
-// ************************************************************
-int open_socket(int *sockfd) {
-   struct sockaddr_in servaddr, cli;
-   // SIMH socket creation
-   *sockfd = socket(AF_INET, SOCK_STREAM, 0);
-   if (*sockfd == -1) {
-      printf("\nCA1: TCP socket creation failed...\n\r");
-      return(-1);
-   }
-   else
-      printf("\nCA1: TCP socket successfully created...\n\r");
-   bzero(&servaddr, sizeof(servaddr));
-
-   // Assign IP addr and PORT number
-   servaddr.sin_family = AF_INET;
-   servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-   servaddr.sin_port = htons(3706);
-
-   // Connect the SIMH socket to host socket
-   while (connect(*sockfd, (SA*)&servaddr, sizeof(servaddr)) != 0) {
-      printf("\nCA1: SIMH --> HOST connection failed! Retrying in 10 sec...\n\r");
-      sleep(10);
+      printf("\nCA1: CA status send to host failed...\n\r");
+      return;
    }
-   printf("\nCA1: SIMH succesfully connected with HOST...\n\r");
-   return(0);
-}
+   Eregs_Out[0x66] = 0x0000;                     // Reset CA status bytes
+   return;
+}  /* end function t1_send_carnstat */
 
 // ************************************************************
-// Thread for sending Attention interrupts to the host
+// Function for sending Attention interrupts to the host
 // ************************************************************
-void *CA1_ATTN(void *arg) {
-   struct IO3705 *iob;
-   iob = arg;
-   int rc;
-   char carnstat, ackbuf;
-   ackbuf = 0x00;
-
-   while (1) {
-      if (((Eregs_Out[0x67] & 0x0040) == 0x0040) || ackbuf == 0xF8 ) {
-         // Grab the lock to avoid sync issues
-         pthread_mutex_lock(&lock);
-         printf("CA1: L3 register 67 %04X \n\r", Eregs_Out[0x67]);
-         Eregs_Inp[0x62] |= 0x0100;               // Set Program requested L3 interrupt
-         Eregs_Inp[0x77] |= 0x0010;               // Set L3 Data Service Request
-         CA1_DS_req_L3 = ON;                      // Chan Adap Data Service  request flag
-         while (Ireg_bit(0x77, 0x0010) == ON) wait();
-         Eregs_Out[0x67] &= ~0x0040;              // Reset L3 DS/ request
-         printf("CA1: Sending Return status\n\r");
-         // Send CA retun status to host
-         send_carnstat(iob->tag_socket, &carnstat, &ackbuf);
-         // Release the lock
-         pthread_mutex_unlock(&lock);
-      }
-      usleep(10);
+static void t1_attn(struct IO3705 *iob) {
+   if ((Adbg_flag == ON) && (Adbg_reg & 0x01))    // Trace channel adapter activities ?
+      fprintf(A_trace, "CA1: L3 register 67 %04X \n\r", Eregs_Out[0x67]);
+   Eregs_Inp[0x62] |= 0x0100;                    // Set Program requested L3 interrupt
+   t1_req_L3(T1_DS);                             // Set L3 Data Service Request
+   wait_L3(0, T1_DS);
+   Eregs_Out[0x67] &= ~0x0040;                   // Reset L3 DS/ request
+   if (ca_hold(iob) == TRUE) {                   // Channel active: reserve the tag socket
+      t1_send_carnstat(iob, iob->tag_socket[iob->abswitch], -1);
+      ca_release(iob);
+   } else {
+      printf("CA1: Channel not active, ATTN not send \n\r");
    }
-return 0;
+   return;
 }
 
 // ************************************************************
-// The channel adaptor handling thread starts here...
+// Function to execute Channel Command Words.
+// The type 1 CA moves 1 to 4 bytes per data service request
+// through registers 64 and 65.
 // ************************************************************
-/* Function to be run as a thread always must have the same
-   signature: it has one void* parameter and returns void    */
-void *CA1_thread(void *arg) {
-   int rc;
-   int cc = 0;
-   int sockfc = -1;
-   pthread_t id;
-   char carnstat, ackbuf;
-
-   // Init the lock
-   if (pthread_mutex_init(&lock, NULL) !=0)  {
-      printf("CA1: Lock initialization failed \n\r");
-      exit(EXIT_FAILURE);
-   }
-
-   // Create the 3705 socket and verify
-   while (reg_bit(0x67, 0x0008) == OFF) wait();  // Wait for miniROS to request Chan enable
-
-   if ((iob.socket_3705 = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-      perror("socket failed");
-      exit(EXIT_FAILURE);
-   }
-
-   // Type of socket created
-   iob.address.sin_family = AF_INET;
-   iob.address.sin_addr.s_addr = INADDR_ANY;
-   iob.address.sin_port = htons( PORT );
-
-   // Set SIMH 3705 socket to allow multiple connections
-   int flag = 1;
-   if (-1 == setsockopt(iob.socket_3705, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag))) {
-      printf("\nCA1: Setsockopt failed\n\r");
-   }
-
-   // Bind the socket to localhost port PORT
-   if (bind(iob.socket_3705, (struct sockaddr *)&iob.address, sizeof(iob.address)) < 0) {
-      perror("bind failed");
-      exit(EXIT_FAILURE);
-   }
-   // Now server is ready to listen
-   printf("CA1: TCP listener on port %d \n\r", PORT);
-
-   // Wait for ccw connection from host
-   rc = host_connect(&iob, &iob.ccw_socket);
-
-   if (rc == 0) {
-      // Get device number
-      rc = read_socket( iob.ccw_socket, iob.buffer, sizeof(iob.buffer));
-      iob.devnum = (iob.buffer[0] << 8) | iob.buffer[1];
-      printf("\nCA1: Connected to device %04X\n\r", iob.devnum);
-   }
-
-   // Wait for tag connection from host
-   rc = host_connect(&iob, &iob.tag_socket);
-
-   if (rc == 0) {
-      printf("CA1: Attention connection established with host on socket %d\n\r", iob.tag_socket);
-      pthread_create(&id, NULL, CA1_ATTN, &iob);
-      printf("CA1: Attention thread started succesfully... \n\r");
+static void t1_exec_ccw(struct IO3705 *iob) {
+   struct CABUF *buf, *nbuf;
+   uint64_t t0, ts;
+   int overrun = FALSE;
+   uint32_t i, tcount, nbytes = 0;
+   uint8_t code, nobytes;
+   int sockfd, rc;
+
+   t0 = ca_usec();
+   if (iob->CA_active == FALSE) {
+      printf("\nCA1: Aborting due to loss of active channel connection...\n\r");
+      return;
    }
-   Eregs_Inp[0x77] &= ~0x0018;           // Reset inital sel and  data/serv lvl3 interrupt
-   CA1_DS_req_L3 = OFF;                  // Chan Adap Data/Status request flag
-   CA1_IS_req_L3 = OFF;                  // Chan Adap Initial Sel request flag
-   Eregs_Inp[0x62] &= ~0x0400;           // Reset channel stop
-
-
-   while(1) {
-      // We do this for ever and ever...
-      /**************************************************************/
-      /*    Read channel command from host                          */
-      /*                                                            */
-      /*    This a a raw version: it assumes no pending operation   */
-      /*    Channel status tests need to be added                   */
-      /*                                                            */
-      /**************************************************************/
-      rc = read_socket( iob.ccw_socket, iob.buffer, sizeof(iob.buffer));
-      if (rc == 0) {
-         // Host disconnected, get details and print it
-         getpeername(iob.ccw_socket, (struct sockaddr*)&iob.address, \
-                (socklen_t*)&iob.addrlen);
-         printf("\nHost disconnected, IP: %s, port: %d \n\r",
-                inet_ntoa(iob.address.sin_addr), ntohs(iob.address.sin_port));
-
-         // Close the socket and mark as 0 in list for reuse
-         close(iob.ccw_socket);
-
-         iob.ccw_socket = -1;
-         // Wait for new connection from host
-         rc = host_connect(&iob, &iob.ccw_socket);
-      } else {
-
-      // Grab the lock to avoid sync issues
-      pthread_mutex_lock(&lock);
-
-      // All data transfers are preceded by a CCW.
-      ccw.code  =  0x00;
-      ccw.code  =  iob.buffer[0];
-      ccw.flags =  iob.buffer[4];
-      ccw.chain =  iob.buffer[5];
-      ccw.count = (iob.buffer[6] << 8) | iob.buffer[7];
-      Eregs_Inp[0x61] = ccw.code;           // Set Chan command in INSEADCM
-
-      printf("\nCA1: Channel Command: %02X, length: %d, Flags: %02X, Chained: %02X \n\r", ccw.code, ccw.count, ccw.flags, ccw.chain);
-      /* Send an ACK to the host */
-      send_ack(iob.ccw_socket);
-
-      // Check and process channel command.
-      switch (ccw.code) {
-         case 0x00:       // Test I/O ?
-            // Send channel end and device end to the host. Sufficient for now (might need to send x00).
-            // Send CA return status to host
-            send_carnstat(iob.ccw_socket, &carnstat, &ackbuf);
-            break;
-
-         case 0x02:       // Read ?
-            if ((Eregs_Inp[0x67] & 0x0008) == 0x00) {        // If channel not enabled
-               while (reg_bit(0x67, 0x0008) == OFF) wait();  // Wait until channel enable is allowed
-               Eregs_Inp[0x67] |= 0x000C;                    // Enable channel and subchannel
-            }
-
-            while (Ireg_bit(0x77, 0x0018) == ON) wait();     // Wait for initial/data selection reset
-            Eregs_Inp[0x60] |= 0x8000;                       // Set initial selection
-            Eregs_Inp[0x62] |= 0x8000;                       // Set outbound data transfer request
-            Eregs_Inp[0x77] |= 0x0008;                       // Set Initial select lvl 3 interrupt
-            CA1_IS_req_L3 = ON;                              // Chan Adap Initial Sel request flag
-
-            while (Ireg_bit(0x77, 0x008) == ON) wait();      // Wait for initial selection reset
-            i = 0;                                           // Data to be send counter
-
-            // Need to insert test for fault status condition
-            while ((Eregs_Out[0x62] & 0x8000) == 0x8000) {         // While data transfer request
-               nobytes = (Eregs_Out[0x62] & 0x0003);
-               switch (nobytes) {
-                  case 0x01:
-                     data_buffer[i] = Eregs_Out[0x64] >> 8;        // Load outbound data bytes 1
-                     i = i + 1;
-                     break;
-                  case 0x02:
-                     data_buffer[i] = Eregs_Out[0x64] >> 8;        // Load outbound data bytes 1
-                     data_buffer[i+1] = Eregs_Out[0x64] & 0x00FF;  // Load outbound data bytes 2
-                     i = i + 2;
-                     break;
-                  case 0x03:
-                     data_buffer[i] = Eregs_Out[0x64] >> 8;        // Load outbound data bytes 1
-                     data_buffer[i+1] = Eregs_Out[0x64] & 0x00FF;  // Load outbound data bytes 2
-                     data_buffer[i+2] = Eregs_Out[0x65] >> 8;      // Load outbound data bytes 3
-                     i = i + 3;
-                     break;
-                  case 0x00:
-                     data_buffer[i] = Eregs_Out[0x64] >> 8;        // Load outbound data bytes 1
-                     data_buffer[i+1] = Eregs_Out[0x64] & 0x00FF;  // Load outbound data bytes 2
-                     data_buffer[i+2] = Eregs_Out[0x65] >> 8;      // Load outbound data bytes 3
-                     data_buffer[i+3] = Eregs_Out[0x65] & 0x00FF;  // Load outbound data bytes 2
-                     i = i + 4;
-                     break;
+   sockfd = iob->bus_socket[iob->abswitch];
+
+   // All data transfers are preceded by a CCW.
+   code = iob->buffer[0];
+   Eregs_Inp[0x61] = code;                       // Set Chan command in INSEADCM
+   if ((Adbg_flag == ON) && (Adbg_reg & 0x01))   // Trace channel adapter activities ?
+      fprintf(A_trace, "\nCA1: Channel Command: %02X, length: %d, Flags: %02X, Chained: %02X \n\r",
+              code, (iob->buffer[6] << 8) | iob->buffer[7], iob->buffer[4], iob->buffer[5]);
+
+   // Check and process channel command.
+   switch (code) {
+      case 0x00:       // Test I/O ?
+         // Send CA return status to host
+         t1_send_carnstat(iob, sockfd, -1);
+         break;
+
+      case 0x02:       // Read ?
+         t1_initial_sel(0x8000);                 // Outbound data transfer request
+         buf = ca_buf_get(1024);
+
+         // Need to insert test for fault status condition
+         while ((Eregs_Out[0x62] & 0x8000) == 0x8000) {    // While data transfer request
+            nobytes = (Eregs_Out[0x62] & 0x0003);
+            tcount = (nobytes == 0) ? 4 : nobytes;         // 0x00 means 4 bytes to transfer
+            if ((buf->len + tcount > buf->size) && (overrun == FALSE)) {
+               if ((nbuf = ca_buf_grow(buf, buf->size * 4)) != NULL)
+                  buf = nbuf;
+               else {                                      // Largest buffer is full
+                  printf("\nCA1: Read data exceeds %d bytes, rest is dropped\n\r", buf->size);
+                  overrun = TRUE;
                }
-               Eregs_Inp[0x77] |= 0x0010;                    // Set L3 Data Service Request
-               CA1_DS_req_L3 = ON;                           // Chan Adap Data Service request flag
-               while (Ireg_bit(0x77, 0x0010) == ON) wait();  // Wait for reset of Data/Status interrupt
-            }
-
-            rc = send(iob.ccw_socket, (void*)&data_buffer, i, 0);
-            // Wait for the ACK from the host
-            recv_ack(iob.ccw_socket);
-
-            // Send CA return status to host
-            send_carnstat(iob.ccw_socket, &carnstat, &ackbuf);
-            Eregs_Inp[0x62] &= ~0x8000;                      // reset outbound data transfer
-            break;
-
-         case 0x03:       // NO-OP ?
-            // Send channel end and device end to host. Sufficient for now (might need to send x00).
-            carnstat = 0x00;
-            carnstat = (carnstat | CSW_CEND) | CSW_DEND;
-            rc = send(iob.ccw_socket, (void*)&carnstat, 1, 0);
-            // Wait for the ACK from the host
-            recv_ack(iob.ccw_socket);
-            printf("CARNSTAT: %04X via socket %d\n\r", carnstat, iob.ccw_socket);
-            break;
-
-         case 0x04:       // Sense ?
-            if ((Eregs_Inp[0x67] & 0x0008) == 0x00)    {     // If channel not enabled
-               while (reg_bit(0x67, 0x0008) == OFF) wait();  // Wait until channel enable is allowed
-               Eregs_Inp[0x67] |= 0x000C;                    // Enable channel and subchannel
-            }
-            while (Ireg_bit(0x77, 0x0018) == ON) wait();     // Wait for selection reset
-            Eregs_Inp[0x60] |= 0x8000;                       // Set initial selection
-            Eregs_Inp[0x77] |= 0x0008;                       // Set Initial select lvl 3 interrupt
-            CA1_IS_req_L3 = ON;                              // Chan Adap Initial Sel request flag
-            while (Ireg_bit(0x77, 0x0008) == ON) wait();     // Wait for initial selection reset
-
-            nobytes = (Eregs_Out[0x62] & 0x0003);            // Get nr of bytes
-            switch (nobytes) {
-               case 0x01:
-                  data_buffer[0] = Eregs_Out[0x64] >> 8;     // Load sense data byte 0
-                  printf("CA1: Sending sense Byte 0 %02X \n\r", data_buffer[0]);
-                  break;
-               case 0x02:
-                  data_buffer[0] = Eregs_Out[0x64] >> 8;     // Load sense data byte 0
-                  data_buffer[1] = Eregs_Out[0x64] & 0x00FF; // Load sense data byte 1
-                  printf("CA1: Sending sense Byte 0 %02X, Byte 1 %02X \n\r",
-                         data_buffer[0], data_buffer[1]);
-                  break;
-            }
-
-            rc = send_socket(iob.ccw_socket, (void*)&data_buffer, nobytes);
-            // Wait for the ACK from the host
-            recv_ack(iob.ccw_socket);
-
-            // Send CA return status to host
-            send_carnstat(iob.ccw_socket, &carnstat, &ackbuf);
-            break;
-
-         case 0x05:       // IPL command
-         case 0x01:       // Write
-         case 0x09:       // Write Break
-            //  Should return x'00'
-
-            if ((Eregs_Inp[0x67] & 0x0008) == 0x00) {        // If channel not enabled
-               while (reg_bit(0x67, 0x0008) == OFF) wait();  // Wait until channel enable is allowed
-               Eregs_Inp[0x67] |= 0x000C;                    // Enable channel and subchannel
-            }
-
-            while (Ireg_bit(0x77, 0x0018) == ON) wait();     // Wait for selection reset
-            Eregs_Inp[0x60] |= 0x8000;                       // Set initial selection
-            Eregs_Inp[0x77] |= 0x0008;                       // Set Initial select lvl 3 interrupt
-            CA1_IS_req_L3 = ON;                              /* Chan Adap Initial Sel request flag */
-            while (Ireg_bit(0x77, 0x0008) == ON) wait();     // Wait for initial selection reset
-
-            Eregs_Inp[0x62] &= ~0x0400;                      // Reset channel stop
-            Eregs_Inp[0x62] |= 0x4000;                       // Set inbound data transfer request
-
-            // Read data from host
-
-            rc = recv( iob.ccw_socket, iob.buffer, sizeof(iob.buffer), 0);
-            printf("CA1: received: %d  bytes from host\n\r", rc);
-            // Send an ACK to the host
-            send_ack(iob.ccw_socket);
-            iob.bufferl = rc;
-
-            // ************************************************************
-            // Data transfer loop starts here
-            // ************************************************************
-            print_hex(iob.buffer, iob.bufferl);
-            i = 0;
-            while (i < iob.bufferl) {
-               nobytes = (Eregs_Out[0x62] & 0x0003);
-               while (Ireg_bit(0x77, 0x0010) == ON) wait();  // MIROS07 (see miniROS listing)
-                  tcount = nobytes;                          // Set number of bytes to transfer
-                  if (tcount == 0)
-                     tcount = 0x0004;                        // 0x00 means 4 bytes to transfer
-                  if ((iob.bufferl - i) < tcount) {          // Remaining bytes < requested bytes
-                     nobytes = iob.bufferl - i;
-                     tcount = nobytes;
-                  }
-                  switch (nobytes) {
-                     case 0x01:
-                        Eregs_Inp[0x64] = iob.buffer[i];     // Load inbound data bytes 1
-                        i = i + 1;
-                     case 0x02:
-                        Eregs_Inp[0x64] = iob.buffer[i];     // Load inbound data bytes 1 and 2
-                        Eregs_Inp[0x64] = ((Eregs_Inp[0x64] << 8) | iob.buffer[i+1]) & 0xFFFF;
-                        i = i + 2;
-                        break;
-                     case 0x03:
-                        Eregs_Inp[0x64] = iob.buffer[i];     // Load inbound data bytes 1 and 2
-                        Eregs_Inp[0x64] = ((Eregs_Inp[0x64] << 8) | iob.buffer[i+1]) & 0xFFFF;
-                        Eregs_Inp[0x65] = iob.buffer[i+2];   // Load inbound data bytes 3 and 4
-                        i = i + 3;
-                        break;
-                     case 0x00:
-                        Eregs_Inp[0x64] = iob.buffer[i];     // Load inbound data bytes 1 and 2
-                        Eregs_Inp[0x64] = ((Eregs_Inp[0x64] << 8) | iob.buffer[i+1]) & 0xFFFF;
-                        Eregs_Inp[0x65] = iob.buffer[i+2];   // Load inbound data bytes 3 and 4
-                        Eregs_Inp[0x65] = ((Eregs_Inp[0x65] << 8) | iob.buffer[i+3]) & 0xFFFF;
-                        i = i + 4;
-                        tcount = 0x0004;
-                        break;
-                  }
-               Eregs_Out[0x62] &= ~0x0600;                   // Reset Reg 62 bits
-               Eregs_Inp[0X62] = (Eregs_Inp[0X62] & ~0x0007) | tcount;  // Set number of bytes transferred
-               Eregs_Inp[0x77] |= 0x0010;                    // Set L3 Data Service Request
-               CA1_DS_req_L3 = ON;                           // Chan Adap Data Service request flag */
-            }
-
-            printf("CA1: Data transfer complete...\n\r");
-            while (Ireg_bit(0x77, 0x0010) == ON) wait();     // MIROS07 (See miniROS listing)
-            Eregs_Inp[0x62] |= 0x0400;                       // Set channel stop
-            Eregs_Inp[0X62] &= ~0x0007;                      // Set number of bytes transferred to 0
-            Eregs_Inp[0x77] |= 0x0010;                       // Set data/serv lvl 3 interrupt
-            CA1_DS_req_L3 = ON;                              // Chan Adap Data Service request flag
-            printf("CA1: Channel Stop\n\r");
-
-            if (Eregs_Out[0x62] & 0x1000) {                  // Present Channel end
-               printf("CA1: Present NSC channel end status \n\r");
-               carnstat = (carnstat | CSW_CEND) | CSW_DEND;
-            }
-            else {
-               while (Ireg_bit(0x77, 0x0010) == ON) wait();  // Wait for reset Data/Serv l3
-               Eregs_Inp[0x62] &= ~0x4000;                   // Reset inbound data transfer
-               carnstat = (Eregs_Out[0x66] & 0x00FF);
             }
-            Eregs_Inp[0x62] &= ~0x04D0;                      // Reset chan stop, Sel Reset, Bus out check, Stacked status
-
-            // Send CA return status to host
-            send_carnstat(iob.ccw_socket, &carnstat, &ackbuf);
-            break;
-
-         case 0x31:         // Initial Write
-         case 0x51:         // Write start 1
-         case 0x32:         // Initial Read
-         case 0x52:         // Read start 1
-         case 0x93:         // Reset command
-            if ((Eregs_Inp[0x67] & 0x0008) == 0x00) {        // If channel not enabled
-               while (reg_bit(0x67, 0x0008) == OFF) wait();  // Wait until channel enable is allowed
-               Eregs_Inp[0x67] |= 0x000C;                    // Enable channel and subchannel
+            if (buf->len + tcount <= buf->size) {
+               buf->data[buf->len] = Eregs_Out[0x64] >> 8;              // Load outbound data byte 1
+               if (tcount > 1)
+                  buf->data[buf->len+1] = Eregs_Out[0x64] & 0x00FF;     // Load outbound data byte 2
+               if (tcount > 2)
+                  buf->data[buf->len+2] = Eregs_Out[0x65] >> 8;         // Load outbound data byte 3
+               if (tcount > 3)
+                  buf->data[buf->len+3] = Eregs_Out[0x65] & 0x00FF;     // Load outbound data byte 4
+               buf->len = buf->len + tcount;
             }
-
-            while (Ireg_bit(0x77, 0x0018) == ON) wait();     // Wait for selection reset
-            Eregs_Inp[0x60] |= 0x8000;                       // Set initial selection
-            Eregs_Inp[0x77] |= 0x0008;                       // Set Initial select lvl 3 interrupt
-            CA1_IS_req_L3 = ON;                              // Chan Adap Initial Sel request flag
-            while (Ireg_bit(0x77, 0x0008) == ON) wait();     // Wait for initial selection reset
-
-            // Send CA return status to host
-            send_carnstat(iob.ccw_socket, &carnstat, &ackbuf);
-            break;
-
-         default:
-            // Send CA return status to host
-            send_carnstat(iob.ccw_socket, &carnstat, &ackbuf);
-            break;
-      }  // End of switch (ccw.code)
-
-         /* Release the lock */
-         pthread_mutex_unlock(&lock);
-      }  // End of if - else
-   }  // End of while(1)...
-   return 0;
-}
-
-// ************************************************************
-// This subroutine test for 1 bit in a External Output reg.
-// If '0' OFF is returned, if 1 'ON' returned.
-// ************************************************************
-int reg_bit(int reg, int bit_mask) {
-   if ((Eregs_Out[reg] & bit_mask) == 0x00)
-      return(OFF);
-   else
-      return(ON);
-}
-
-// ************************************************************
-// This subroutine test for 1 bit in a External Input reg.
-// If '0' OFF is returned, if 1 'ON' returned.
-// ************************************************************
-int Ireg_bit(int reg, int bit_mask) {
-   if ((Eregs_Inp[reg] & bit_mask) == 0x00)
-      return(OFF);
-   else
-      return(ON);
+            t1_req_L3(T1_DS);                              // Set L3 Data Service Request
+            wait_L3(0, T1_DS);                             // Wait for reset of Data/Status interrupt
+         }
+
+         ts = ca_usec();
+         rc = ca_send(sockfd, buf->data, buf->len);
+         ca_stats_sock(iob, ts);
+         nbytes = buf->len;
+         ca_buf_put(buf);
+
+         // Send CA return status to host, unit check if data was dropped
+         t1_send_carnstat(iob, sockfd, (overrun == TRUE) ? (Eregs_Out[0x66] & 0x00FF) | CSW_UCHK : -1);
+         Eregs_Inp[0x62] &= ~0x8000;             // reset outbound data transfer
+         break;
+
+      case 0x03:       // NO-OP ?
+         // Send channel end and device end to host. Sufficient for now (might need to send x00).
+         t1_send_carnstat(iob, sockfd, CSW_CEND | CSW_DEND);
+         break;
+
+      case 0x04:       // Sense ?
+         t1_initial_sel(0);
+         nobytes = (Eregs_Out[0x62] & 0x0003);   // Get nr of bytes
+         iob->buffer[0] = Eregs_Out[0x64] >> 8;  // Load sense data byte 0
+         iob->buffer[1] = Eregs_Out[0x64] & 0x00FF;  // Load sense data byte 1
+         if (nobytes > 2)
+            nobytes = 0;
+         if ((Adbg_flag == ON) && (Adbg_reg & 0x01))   // Trace channel adapter activities ?
+            fprintf(A_trace, "CA1: Sending %d sense bytes %02X %02X \n\r", nobytes, iob->buffer[0], iob->buffer[1]);
+         ts = ca_usec();
+         rc = ca_send(sockfd, iob->buffer, nobytes);
+         ca_stats_sock(iob, ts);
+         nbytes = nobytes;
+
+         // Send CA return status to host
+         t1_send_carnstat(iob, sockfd, -1);
+         break;
+
+      case 0x05:       // IPL command
+      case 0x01:       // Write
+      case 0x09:       // Write Break
+         t1_initial_sel(0);
+         Eregs_Inp[0x62] &= ~0x0400;             // Reset channel stop
+         Eregs_Inp[0x62] |= 0x4000;              // Set inbound data transfer request
+
+         // The write data has been received with the CCW by the CA event loop
+         buf = iob->inbuf;
+         iob->inbuf = NULL;
+         if (buf == NULL)                        // Zero length write
+            buf = ca_buf_get(0);
+         nbytes = buf->len;
+         if ((Adbg_flag == ON) && (Adbg_reg & 0x01))   // Trace channel adapter activities ?
+            fprintf(A_trace, "CA1: received: %d  bytes from host\n\r", buf->len);
+         print_hex((char *)buf->data, buf->len);
+
+         // ************************************************************
+         // Data transfer loop starts here
+         // ************************************************************
+         i = 0;
+         while (i < buf->len) {
+            wait_L3(0, T1_DS);                   // MIROS07 (see miniROS listing)
+            nobytes = (Eregs_Out[0x62] & 0x0003);
+            tcount = (nobytes == 0) ? 4 : nobytes;         // 0x00 means 4 bytes to transfer
+            if ((buf->len - i) < tcount)                   // Remaining bytes < requested bytes
+               tcount = buf->len - i;
+            Eregs_Inp[0x64] = buf->data[i] << 8;                        // Load inbound data byte 1
+            if (tcount > 1)
+               Eregs_Inp[0x64] |= buf->data[i+1];                       // Load inbound data byte 2
+            if (tcount > 2)
+               Eregs_Inp[0x65] = buf->data[i+2] << 8;                   // Load inbound data byte 3
+            if (tcount > 3)
+               Eregs_Inp[0x65] |= buf->data[i+3];                       // Load inbound data byte 4
+            i = i + tcount;
+            Eregs_Out[0x62] &= ~0x0600;                    // Reset Reg 62 bits
+            Eregs_Inp[0X62] = (Eregs_Inp[0X62] & ~0x0007) | tcount;  // Set number of bytes transferred
+            t1_req_L3(T1_DS);                              // Set L3 Data Service Request
+         }
+         ca_buf_put(buf);
+
+         if ((Adbg_flag == ON) && (Adbg_reg & 0x01))   // Trace channel adapter activities ?
+            fprintf(A_trace, "CA1: Data transfer complete, Channel Stop\n\r");
+         wait_L3(0, T1_DS);                      // MIROS07 (See miniROS listing)
+         Eregs_Inp[0x62] |= 0x0400;              // Set channel stop
+         Eregs_Inp[0X62] &= ~0x0007;             // Set number of bytes transferred to 0
+         t1_req_L3(T1_DS);                       // Set data/serv lvl 3 interrupt
+
+         if (Eregs_Out[0x62] & 0x1000) {         // Present Channel end
+            rc = CSW_CEND | CSW_DEND;
+         } else {
+            wait_L3(0, T1_DS);                   // Wait for reset Data/Serv l3
+            Eregs_Inp[0x62] &= ~0x4000;          // Reset inbound data transfer
+            rc = -1;                             // NSC status from the CCU
+         }
+         Eregs_Inp[0x62] &= ~0x04D0;             // Reset chan stop, Sel Reset, Bus out check, Stacked status
+
+         // Send CA return status to host
+         t1_send_carnstat(iob, sockfd, rc);
+         break;
+
+      case 0x31:         // Initial Write
+      case 0x51:         // Write start 1
+      case 0x32:         // Initial Read
+      case 0x52:         // Read start 1
+      case 0x93:         // Reset command
+         t1_initial_sel(0);
+         // Send CA return status to host
+         t1_send_carnstat(iob, sockfd, -1);
+         break;
+
+      default:
+         // Send CA return status to host
+         t1_send_carnstat(iob, sockfd, -1);
+         break;
+   }  // End of switch (code)
+   ca_stats_ccw(iob, code, t0, nbytes);
+   return;
 }
 
 // ************************************************************
-// This subroutine waits 1 usec
+// Channel adaptor type 1 cycle, run by the CA1 adapter thread
+// when SET CA1 TYPE=1 is in effect.  The host connection is
+// handled by the CA event loop of i3705_chan_T2.c.
 // ************************************************************
-void wait() {
-   usleep(1);
+void ca_t1_cycle(struct IO3705 *iob) {
+   static int init = 0;
+
+   if (!init) {
+      pthread_mutex_lock(&r77_lock);
+      Eregs_Inp[0x77] &= ~(T1_IS | T1_DS);       // Reset inital sel and data/serv lvl3 interrupt
+      pthread_mutex_unlock(&r77_lock);
+      CA1_DS_req_L3 = OFF;                       // Chan Adap Data/Status request flag
+      CA1_IS_req_L3 = OFF;                       // Chan Adap Initial Sel request flag
+      Eregs_Inp[0x62] &= ~0x0400;                // Reset channel stop
+      init = 1;
+   }
+   // Check for ATTN request
+   if ((Eregs_Out[0x67] & 0x0040) == 0x0040)
+      t1_attn(iob);
+   // Wait for a CCW from the host or a CA register change by the CCU
+   if (ca_wait_ccw(iob) == TRUE) {
+      t1_exec_ccw(iob);
+      ca_ccw_done(iob);
+   }
    return;
 }
-
@@ -34,7 +34,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
@@ -49,6 +53,15 @@
 #define PORTCA2A 37053       // TCP/IP port number CA2 A
 #define PORTCA2B 37054       // TCP/IP port number CA2 B
 #define SA struct sockaddr_in
+#define CA_TICK   10         // CA event loop timer tick in msec
+#define CA_SNDTMO 5000       // Send timeout in msec for a host that stops reading
+
+// CA event loop: epoll data tag is event type | channel << 8 | port
+#define CAEV_TIMER  0x010000 // Timer tick
+#define CAEV_LISTEN 0x020000 // Host connect on the A or B port
+#define CAEV_BUS    0x030000 // BUS socket data or hang up
+#define CAEV_TAG    0x040000 // TAG socket hang up
+#define CAEV(type, j, k) ((type) | ((j) << 8) | (k))
 #define TRUE  1
 #define FALSE 0
 
@@ -105,6 +118,8 @@ void exec_ccw(struct IO3705 *iob, int CAid);
 int Oreg_bit(int reg, int bit_mask, int CAid);
 int Ireg_bit(int reg, int bit_mask);
 void wait();
+struct CABUF *ca_buf_get(uint32_t len);
+void ca_buf_put(struct CABUF *buf);
 
 //struct CSW {    /* Channel Status Word */
 //   uint8_t  key;
@@ -126,7 +141,60 @@ int CAready;
 
 char abswid[2] = {"AB"};
 int epoll_fd;
-struct epoll_event event, events[MAXCHAN*2];
+struct epoll_event event, events[MAXCHAN*4+1];   // Listen, bus and tag sockets plus timer
+
+// CCW classes used for the adapter statistics
+#define CAS_TIO   0          // Test I/O
+#define CAS_READ  1          // Read
+#define CAS_WRITE 2          // Write
+#define CAS_WBRK  3          // Write Break
+#define CAS_SENSE 4          // Sense
+#define CAS_IPL   5          // IPL
+#define CAS_NOP   6          // NO-OP
+#define CAS_OTHER 7          // Non-standard and rejected commands
+
+char *cas_name[CA_NCMD] = {"TIO", "READ", "WRITE", "WRTBRK", "SENSE", "IPL", "NOP", "OTHER"};
+
+// Channel adapter buffer pool, shared by all adapters
+struct CAPOOL {
+   struct CABUF *free;       // Free buffer list
+   uint32_t size;            // Buffer size of this class
+   uint32_t alloc;           // Buffers allocated
+   uint32_t nfree;           // Buffers on the free list
+} capool[CA_NBCLASS] = {
+   { .size = 1024 }, { .size = 4096 }, { .size = 16384 }, { .size = 65536 }
+};
+pthread_mutex_t capool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+t_stat ca_set_stats(UNIT *uptr, int32 val, char *cptr, void *desc);
+t_stat ca_show_stats(FILE *st, UNIT *uptr, int32 val, void *desc);
+t_stat ca_set_type(UNIT *uptr, int32 val, char *cptr, void *desc);
+t_stat ca_show_type(FILE *st, UNIT *uptr, int32 val, void *desc);
+void ca_t1_cycle(struct IO3705 *iob);
+void ca_wakeup(int j);
+
+int ca_type = 2;             // CA1 channel adapter type (1 or 2), SET CA1 TYPE=n
+
+// SCP devices giving access to the channel adapter statistics and options
+UNIT ca_unit[MAXCHAN];       // No unit data: all fields zero
+
+MTAB ca_mod[] = {
+   { .mask = MTAB_XTD | MTAB_VDV | MTAB_NMO | MTAB_SHP, .pstring = "STATS", .mstring = "STATS",
+     .valid = &ca_set_stats, .disp = &ca_show_stats },
+   { .mask = MTAB_XTD | MTAB_VDV, .pstring = "TYPE", .mstring = "TYPE",
+     .valid = &ca_set_type, .disp = &ca_show_type },
+   { 0 }
+};
+
+DEVICE ca1_dev = {
+   .name = "CA1", .units = &ca_unit[0], .modifiers = ca_mod,
+   .numunits = 1, .aradix = 16, .awidth = 16, .aincr = 1, .dradix = 16, .dwidth = 8
+};
+
+DEVICE ca2_dev = {
+   .name = "CA2", .units = &ca_unit[1], .modifiers = ca_mod,
+   .numunits = 1, .aradix = 16, .awidth = 16, .aincr = 1, .dradix = 16, .dwidth = 8
+};
 
 // ************************************************************
 // Function to format and display incomming data from host
@@ -171,98 +239,612 @@ void print_regs(struct IO3705 *iob, char *text) {
 }
 
 // ************************************************************
-// Function to check if socket is (still) connected
+// Function to return a monotonic time stamp in usec
 // ************************************************************
-static bool IsSocketConnected(int sockfd) {
-   int rc;
-   struct sockaddr_in *ccuptr;
-   socklen_t *addrlen;
-   ccuptr = (struct sockaddr_in*)malloc(sizeof(struct sockaddr_in));
-   addrlen = (socklen_t*)malloc(sizeof(socklen_t));
+uint64_t ca_usec(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// ************************************************************
+// Function to map a channel command to its statistics class
+// ************************************************************
+int ca_ccw_class(uint8_t code) {
+   switch (code) {
+      case 0x00: return CAS_TIO;
+      case 0x02: return CAS_READ;
+      case 0x01: return CAS_WRITE;
+      case 0x09: return CAS_WBRK;
+      case 0x04: return CAS_SENSE;
+      case 0x05: return CAS_IPL;
+      case 0x03: return CAS_NOP;
+      default:   return CAS_OTHER;
+   }
+}
+
+// ************************************************************
+// Function to account an executed CCW in the statistics
+// ************************************************************
+void ca_stats_ccw(struct IO3705 *iob, uint8_t code, uint64_t t0, uint32_t bytes) {
+   uint64_t usec;
+   int c, b;
+
+   c = ca_ccw_class(code);
+   usec = ca_usec() - t0;
+   for (b = 0; (b < CA_NHIST - 1) && ((usec >> (b + 1)) != 0); b++) ;
+   iob->stats.ccw_cnt[c]++;
+   iob->stats.ccw_bytes[c] += bytes;
+   iob->stats.ccw_usec[c] += usec;
+   iob->stats.ccw_hist[c][b]++;
+   if (usec > iob->stats.ccw_max[c])
+      iob->stats.ccw_max[c] = usec;
+}
+
+// ************************************************************
+// Function to account time blocked in socket I/O
+// ************************************************************
+void ca_stats_sock(struct IO3705 *iob, uint64_t t0) {
+   iob->stats.sock_cnt++;
+   iob->stats.sock_usec += ca_usec() - t0;
+}
+
+// ************************************************************
+// Function to wait for the CCU to reset a CA L3 interrupt request
+// ************************************************************
+void wait_L3(int CAid, int bit_mask) {
+   uint64_t t0;
+
+   if (Ireg_bit(0x77, bit_mask) == OFF)
+      return;
+   t0 = ca_usec();
+   while (Ireg_bit(0x77, bit_mask) == ON)
+      wait();
+   iobs[CAid]->stats.l3_cnt++;
+   iobs[CAid]->stats.l3_usec += ca_usec() - t0;
+}
+
+// ************************************************************
+// Function to take a buffer of at least len bytes from the pool.
+// A class only mallocs when its free list is empty; released
+// buffers are recycled, so in steady state no malloc is done.
+// ************************************************************
+struct CABUF *ca_buf_get(uint32_t len) {
+   struct CABUF *buf;
+   int c;
+
+   for (c = 0; (c < CA_NBCLASS - 1) && (capool[c].size < len); c++) ;
+   pthread_mutex_lock(&capool_lock);
+   buf = capool[c].free;
+   if (buf != NULL) {
+      capool[c].free = buf->next;
+      capool[c].nfree--;
+   } else
+      capool[c].alloc++;
+   pthread_mutex_unlock(&capool_lock);
+   if (buf == NULL) {
+      buf = malloc(sizeof(struct CABUF) + capool[c].size);
+      if (buf == NULL) {
+         printf("\nCA: Buffer pool allocation of %d bytes failed\n\r", capool[c].size);
+         exit(EXIT_FAILURE);
+      }
+      buf->size = capool[c].size;
+      buf->cls = c;
+   }
+   buf->next = NULL;
+   buf->len = 0;
+   return buf;
+}
 
-   rc = getpeername(sockfd, ccuptr, addrlen);
+// ************************************************************
+// Function to move the data of a buffer into a larger one.
+// Returns NULL, with buf unchanged, if len exceeds the largest
+// size class.
+// ************************************************************
+struct CABUF *ca_buf_grow(struct CABUF *buf, uint32_t len) {
+   struct CABUF *nbuf;
+
+   if (len <= buf->size)
+      return buf;
+   if (len > capool[CA_NBCLASS - 1].size)
+      return NULL;
+   nbuf = ca_buf_get(len);
+   memcpy(nbuf->data, buf->data, buf->len);
+   nbuf->len = buf->len;
+   ca_buf_put(buf);
+   return nbuf;
+}
 
-   free(ccuptr);
-   free(addrlen);
+// ************************************************************
+// Function to return a chain of buffers to the pool
+// ************************************************************
+void ca_buf_put(struct CABUF *buf) {
+   struct CABUF *next;
+
+   pthread_mutex_lock(&capool_lock);
+   while (buf != NULL) {
+      next = buf->next;
+      buf->next = capool[buf->cls].free;
+      capool[buf->cls].free = buf;
+      capool[buf->cls].nfree++;
+      buf = next;
+   }
+   pthread_mutex_unlock(&capool_lock);
+}
+
+// ************************************************************
+// Function to preallocate the buffer pool
+// ************************************************************
+void ca_buf_init(int count) {
+   struct CABUF *chain;
+
+   for (int c = 0; c < CA_NBCLASS; c++) {
+      chain = NULL;
+      for (int n = 0; n < count; n++) {
+         struct CABUF *buf = ca_buf_get(capool[c].size);
+         buf->next = chain;
+         chain = buf;
+      }
+      ca_buf_put(chain);
+   }
+}
+
+// ************************************************************
+// SET CAn STATS=RESET: clear the adapter statistics
+// ************************************************************
+t_stat ca_set_stats(UNIT *uptr, int32 val, char *cptr, void *desc) {
+   int j = (uptr == &ca_unit[1]) ? 1 : 0;
+
+   if ((cptr == NULL) || strcmp(cptr, "RESET"))
+      return SCPE_ARG;
+   if (iobs[j] != NULL)
+      memset(&iobs[j]->stats, 0, sizeof(iobs[j]->stats));
+   return SCPE_OK;
+}
 
-   if (rc == 0)
-      return true;
+// ************************************************************
+// SET CA1 TYPE=1|2: select the channel adapter type of CA1.
+// CA2 is always a type 2 adapter.
+// ************************************************************
+t_stat ca_set_type(UNIT *uptr, int32 val, char *cptr, void *desc) {
+   if (cptr == NULL)
+      return SCPE_ARG;
+   if (uptr != &ca_unit[0])
+      return SCPE_NOFNC;
+   if (strcmp(cptr, "1") == 0)
+      ca_type = 1;
+   else if (strcmp(cptr, "2") == 0)
+      ca_type = 2;
    else
-      return false;
+      return SCPE_ARG;
+   ca_wakeup(0);
+   return SCPE_OK;
+}
+
+t_stat ca_show_type(FILE *st, UNIT *uptr, int32 val, void *desc) {
+   fprintf(st, "type %d", (uptr == &ca_unit[0]) ? ca_type : 2);
+   return SCPE_OK;
+}
+
+// ************************************************************
+// SHOW CAn STATS[=JSON]: display the adapter statistics
+// ************************************************************
+t_stat ca_show_stats(FILE *st, UNIT *uptr, int32 val, void *desc) {
+   int j = (uptr == &ca_unit[1]) ? 1 : 0;
+   char *cptr = (char *)desc;
+   struct CASTATS *s;
+   int c, b;
+
+   if (iobs[j] == NULL) {
+      fprintf(st, "CA%d: Adapter not initialized\n", j + 1);
+      return SCPE_OK;
+   }
+   s = &iobs[j]->stats;
+
+   if ((cptr != NULL) && (strcmp(cptr, "JSON") == 0)) {
+      fprintf(st, "{\"ca\":%d,\"device\":\"%04X\",\"port\":\"%c\",\"active\":%d,\"ccw\":{",
+              j + 1, iobs[j]->devnum, abswid[iobs[j]->abswitch], iobs[j]->CA_active == TRUE);
+      for (c = 0; c < CA_NCMD; c++) {
+         fprintf(st, "%s\"%s\":{\"count\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"usec\":%" PRIu64
+                     ",\"max_usec\":%" PRIu64 ",\"hist\":[",
+                 c ? "," : "", cas_name[c], s->ccw_cnt[c], s->ccw_bytes[c], s->ccw_usec[c], s->ccw_max[c]);
+         for (b = 0; b < CA_NHIST; b++)
+            fprintf(st, "%s%" PRIu64, b ? "," : "", s->ccw_hist[c][b]);
+         fprintf(st, "]}");
+      }
+      fprintf(st, "},\"chain\":{\"count\":%" PRIu64 ",\"segments\":%" PRIu64 ",\"max_depth\":%u}",
+              s->chain_cnt, s->chain_segs, s->chain_max);
+      fprintf(st, ",\"l3\":{\"count\":%" PRIu64 ",\"usec\":%" PRIu64 "}", s->l3_cnt, s->l3_usec);
+      fprintf(st, ",\"socket\":{\"count\":%" PRIu64 ",\"usec\":%" PRIu64 "}", s->sock_cnt, s->sock_usec);
+      fprintf(st, ",\"pool\":[");
+      for (c = 0; c < CA_NBCLASS; c++)
+         fprintf(st, "%s{\"size\":%u,\"alloc\":%u,\"free\":%u}",
+                 c ? "," : "", capool[c].size, capool[c].alloc, capool[c].nfree);
+      fprintf(st, "]}\n");
+      return SCPE_OK;
+   }
+   if (cptr != NULL)
+      return SCPE_ARG;
+
+   fprintf(st, "CA%d statistics, device %04X, port %c, %s\n", j + 1, iobs[j]->devnum,
+           abswid[iobs[j]->abswitch], (iobs[j]->CA_active == TRUE) ? "active" : "not active");
+   fprintf(st, "CCW           Count           Bytes    Avg usec    Max usec\n");
+   for (c = 0; c < CA_NCMD; c++)
+      fprintf(st, "%-6s %12" PRIu64 " %15" PRIu64 " %11" PRIu64 " %11" PRIu64 "\n", cas_name[c],
+              s->ccw_cnt[c], s->ccw_bytes[c], s->ccw_cnt[c] ? s->ccw_usec[c] / s->ccw_cnt[c] : 0,
+              s->ccw_max[c]);
+   fprintf(st, "Data chains   %12" PRIu64 ", chained CCWs %" PRIu64 ", max depth %u\n",
+           s->chain_cnt, s->chain_segs, s->chain_max);
+   fprintf(st, "NCP L3 waits  %12" PRIu64 ", total %" PRIu64 " usec, avg %" PRIu64 " usec\n",
+           s->l3_cnt, s->l3_usec, s->l3_cnt ? s->l3_usec / s->l3_cnt : 0);
+   fprintf(st, "Socket I/O    %12" PRIu64 ", total %" PRIu64 " usec, avg %" PRIu64 " usec\n",
+           s->sock_cnt, s->sock_usec, s->sock_cnt ? s->sock_usec / s->sock_cnt : 0);
+   fprintf(st, "Buffer pool  ");
+   for (c = 0; c < CA_NBCLASS; c++)
+      fprintf(st, " %uK: %u/%u", capool[c].size / 1024, capool[c].alloc - capool[c].nfree, capool[c].alloc);
+   fprintf(st, " (in use/allocated)\n");
+   fprintf(st, "CCW latency histogram, bucket n counts CCWs taking 2**n to 2**(n+1) usec:\n");
+   for (c = 0; c < CA_NCMD; c++) {
+      if (s->ccw_cnt[c] == 0)
+         continue;
+      fprintf(st, "%-6s", cas_name[c]);
+      for (b = 0; b < CA_NHIST; b++)
+         fprintf(st, " %" PRIu64, s->ccw_hist[c][b]);
+      fprintf(st, "\n");
+   }
+   return SCPE_OK;
 }
 
 // ************************************************************
-// Function to accept TCP connection from host
+// Function to enable TCP keepalive on a host connection
 // ************************************************************
-int host_connect(struct IO3705 *iob, int abport) {
+int ca_keepalive(int sockfd) {
    int alive = 1;     // Enable KEEP_ALIVE
    int idle = 5;      // First  probe after 5 seconds
    int intvl = 3;     // Subsequent probes after 3 seconds
    int cntpkt = 3;    // Timeout after 3 failed probes
-   int timeout = 1000;
-   int rc;
-
-   // Accept the incoming connection
-   iob->addrlen[abport] = sizeof(iob->address[abport]);
 
-   iob->bus_socket[abport] = accept(iob->CA_socket[abport], (struct sockaddr *)&iob->address[abport], (socklen_t*)&iob->addrlen[abport]);
-   if (iob->bus_socket[abport] < 0) {
-      printf("\nCA%c: Host accept failed for bus connection...\r" ,iob->CA_id);
+   if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&alive, sizeof(alive))) {
+      perror("ERROR: setsockopt(), SO_KEEPALIVE");
       return -1;
-   } else {
-      if (setsockopt(iob->bus_socket[abport], SOL_SOCKET, SO_KEEPALIVE, (void *)&alive, sizeof(alive))) {
-         perror("ERROR: setsockopt(), SO_KEEPALIVE");
-         return -1;
-      }
+   }
+   if (setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, (void *)&idle, sizeof(idle))) {
+      perror("ERROR: setsockopt(), SO_KEEPIDLE");
+      return -1;
+   }
+   if (setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, (void *)&intvl, sizeof(intvl))) {
+      perror("ERROR: setsockopt(), SO_KEEPINTVL");
+      return -1;
+   }
+   if (setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, (void *)&cntpkt, sizeof(cntpkt))) {
+      perror("ERROR: setsockopt(), SO_KEEPCNT");
+      return -1;
+   }
+   return 0;
+}
+
+// ************************************************************
+// Function to add, modify or remove a socket in the CA event loop
+// ************************************************************
+void ca_poll(int op, int sockfd, uint32_t events, uint32_t tag) {
+   struct epoll_event ev;
+
+   ev.events = events;
+   ev.data.u32 = tag;
+   if (epoll_ctl(epoll_fd, op, sockfd, &ev) && (op != EPOLL_CTL_DEL))
+      printf("\nCA: Polling event update failed for socket %d with error %s\n\r", sockfd, strerror(errno));
+}
 
-      if (setsockopt(iob->bus_socket[abport], IPPROTO_TCP, TCP_KEEPIDLE, (void *)&idle, sizeof(idle))) {
-         perror("ERROR: setsockopt(), SO_KEEPIDLE");
-         return -1;
+// ************************************************************
+// Function to send data to the host on a non-blocking socket.
+// A host that stops reading is given CA_SNDTMO msec.
+// ************************************************************
+int ca_send(int sockfd, void *buf, int len) {
+   struct pollfd pfd;
+   int rc, sent = 0;
+
+   while (sent < len) {
+      rc = send(sockfd, (char *)buf + sent, len - sent, MSG_NOSIGNAL);
+      if (rc > 0) {
+         sent = sent + rc;
+         continue;
       }
+      if ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+         pfd.fd = sockfd;
+         pfd.events = POLLOUT;
+         if (poll(&pfd, 1, CA_SNDTMO) > 0)
+            continue;
+      }
+      return -1;
+   }
+   return sent;
+}
+
+// ************************************************************
+// Function to close the host connection of a CA.
+// Called with ca_lock held and the adapter thread not busy.
+// ************************************************************
+void ca_close(struct IO3705 *iob) {
+   int k = iob->abswitch;
+
+   for (int p = CAA; p <= CAB; p++) {
+      if (iob->bus_socket[p] > 0)
+         close(iob->bus_socket[p]);
+      if (iob->tag_socket[p] > 0)
+         close(iob->tag_socket[p]);
+      iob->bus_socket[p] = -1;
+      iob->tag_socket[p] = -1;
+   }
+   ca_buf_put(iob->inbuf);                   // Drop a partially received CCW...
+   ca_buf_put(iob->chain);                   // ...and data chain
+   iob->inbuf = NULL;
+   iob->chain = iob->chaint = NULL;
+   iob->chainbl = 0;
+   iob->inlen = 0;
+   iob->stats.chain_depth = 0;
+   iob->closing = 0;
+   iob->ca_state = CA_LISTEN;
+   if (iob->CA_socket[k] > 0)                // Accept the next host connection
+      ca_poll(EPOLL_CTL_MOD, iob->CA_socket[k], EPOLLIN, CAEV(CAEV_LISTEN, (iob->CA_id - '1'), k));
+}
 
-      if (setsockopt(iob->bus_socket[abport], IPPROTO_TCP, TCP_KEEPINTVL, (void *)&intvl, sizeof(intvl))) {
-         perror("ERROR: setsockopt(), SO_KEEPINTVL");
-         return -1;
+// ************************************************************
+// Function to drop the host connection of a CA.
+// If the adapter thread is using the sockets the close is
+// deferred until it is done with them.
+// ************************************************************
+void ca_disconnect(struct IO3705 *iob, char *reason) {
+   int k = iob->abswitch;
+
+   pthread_mutex_lock(&iob->ca_lock);
+   if (iob->ca_state != CA_LISTEN) {
+      printf("\nCA%c: %s, closing channel connection\n\r", iob->CA_id, reason);
+      iob->CA_active = FALSE;
+      if (iob->busy) {
+         for (int p = CAA; p <= CAB; p++) {
+            if (iob->bus_socket[p] > 0) {
+               ca_poll(EPOLL_CTL_DEL, iob->bus_socket[p], 0, 0);
+               shutdown(iob->bus_socket[p], SHUT_RDWR);
+            }
+            if (iob->tag_socket[p] > 0) {
+               ca_poll(EPOLL_CTL_DEL, iob->tag_socket[p], 0, 0);
+               shutdown(iob->tag_socket[p], SHUT_RDWR);
+            }
+         }
+         if (iob->CA_socket[k] > 0)          // No new connection until closed
+            ca_poll(EPOLL_CTL_MOD, iob->CA_socket[k], 0, CAEV(CAEV_LISTEN, (iob->CA_id - '1'), k));
+         iob->closing = 1;
+      } else
+         ca_close(iob);
+   }
+   pthread_mutex_unlock(&iob->ca_lock);
+}
+
+// ************************************************************
+// Functions to reserve and release the host sockets for use by
+// the adapter thread.  ca_hold fails if the CA is not connected.
+// ************************************************************
+int ca_hold(struct IO3705 *iob) {
+   int rc = FALSE;
+
+   pthread_mutex_lock(&iob->ca_lock);
+   if ((iob->CA_active == TRUE) && !iob->closing) {
+      iob->busy++;
+      rc = TRUE;
+   }
+   pthread_mutex_unlock(&iob->ca_lock);
+   return rc;
+}
+
+void ca_release(struct IO3705 *iob) {
+   pthread_mutex_lock(&iob->ca_lock);
+   iob->busy--;
+   if (iob->closing && (iob->busy == 0))
+      ca_close(iob);
+   pthread_mutex_unlock(&iob->ca_lock);
+}
+
+// ************************************************************
+// Function to end a CCW passed to the adapter thread by
+// ca_dispatch and to resume receiving from the host.
+// ************************************************************
+void ca_ccw_done(struct IO3705 *iob) {
+   pthread_mutex_lock(&iob->ca_lock);
+   iob->busy--;
+   iob->ca_state = CA_CCW;
+   iob->inlen = 0;
+   if (iob->closing) {
+      if (iob->busy == 0)
+         ca_close(iob);
+   } else
+      ca_poll(EPOLL_CTL_MOD, iob->bus_socket[iob->abswitch], EPOLLIN | EPOLLRDHUP,
+              CAEV(CAEV_BUS, (iob->CA_id - '1'), 0));
+   pthread_mutex_unlock(&iob->ca_lock);
+}
+
+// ************************************************************
+// Function to wake up the adapter thread of a CA.
+// Used by the CCU when NCP changes the CA registers.
+// ************************************************************
+void ca_wakeup(int j) {
+   if (iobs[j] == NULL)
+      return;
+   pthread_mutex_lock(&iobs[j]->ca_lock);
+   iobs[j]->kick = 1;
+   pthread_cond_signal(&iobs[j]->ca_cond);
+   pthread_mutex_unlock(&iobs[j]->ca_lock);
+}
+
+// ************************************************************
+// Function for the adapter thread to wait for a CCW, a CA register
+// change or the CA_TICK timeout.  Returns TRUE if a CCW is ready.
+// ************************************************************
+int ca_wait_ccw(struct IO3705 *iob) {
+   struct timespec ts;
+   int rc;
+
+   pthread_mutex_lock(&iob->ca_lock);
+   if ((iob->ca_state != CA_EXEC) && !iob->kick) {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ts.tv_nsec += CA_TICK * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000;
       }
+      pthread_cond_timedwait(&iob->ca_cond, &iob->ca_lock, &ts);
+   }
+   iob->kick = 0;
+   rc = (iob->ca_state == CA_EXEC);
+   pthread_mutex_unlock(&iob->ca_lock);
+   return rc;
+}
 
-      if (setsockopt(iob->bus_socket[abport], IPPROTO_TCP, TCP_KEEPCNT, (void *)&cntpkt, sizeof(cntpkt))) {
-         perror("ERROR: setsockopt(), SO_KEEPCNT");
-         return -1;
+// ************************************************************
+// Function to pass a received CCW to the adapter thread.
+// The bus socket is not read again until the CCW is done.
+// ************************************************************
+void ca_dispatch(struct IO3705 *iob) {
+   pthread_mutex_lock(&iob->ca_lock);
+   ca_poll(EPOLL_CTL_MOD, iob->bus_socket[iob->abswitch], EPOLLRDHUP, CAEV(CAEV_BUS, (iob->CA_id - '1'), 0));
+   iob->ca_state = CA_EXEC;
+   iob->busy++;
+   pthread_cond_signal(&iob->ca_cond);
+   pthread_mutex_unlock(&iob->ca_lock);
+}
+
+// ************************************************************
+// Function to accept a bus or tag connection from the host.
+// The host connects the bus socket first, then the tag socket.
+// ************************************************************
+void ca_accept(struct IO3705 *iob, int abport) {
+   socklen_t addrlen;
+   int fd, j;
+
+   j = iob->CA_id - '1';
+   addrlen = sizeof(iob->address[abport]);
+   fd = accept4(iob->CA_socket[abport], (struct sockaddr *)&iob->address[abport], &addrlen, SOCK_NONBLOCK);
+   if (fd < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+         printf("\nCA%c: Host accept failed with errno %d\n\r", iob->CA_id, errno);
+      return;
+   }
+   if (abport != iob->abswitch) {            // Port not selected by the A/B switch
+      close(fd);
+      return;
+   }
+   if (iob->ca_state >= CA_DEVNUM) {         // Connection while connected: host has been restarted
+      ca_disconnect(iob, "New host connection");
+      if (iob->ca_state != CA_LISTEN) {      // Old connection still in use
+         close(fd);
+         return;
       }
+   }
 
+   if (iob->ca_state == CA_LISTEN) {
+      if (ca_keepalive(fd)) {
+         close(fd);
+         return;
+      }
+      iob->bus_socket[abport] = fd;
+      iob->ca_state = CA_TAG;
       printf("\nCA%c: New bus connection on 3705 port %d, socket fd is %d, ip is : %s, port : %d \n\r",
-            iob->CA_id, CAPORTS[(iob->CA_id - '0')-1][abport], iob->bus_socket[abport], inet_ntoa(iob->address[abport].sin_addr),
+            iob->CA_id, CAPORTS[j][abport], fd, inet_ntoa(iob->address[abport].sin_addr),
             (ntohs(iob->address[abport].sin_port)));
+   } else {
+      iob->tag_socket[abport] = fd;
+      iob->ca_state = CA_DEVNUM;
+      iob->inlen = 0;
+      printf("\nCA%c: New tag connection on 3705 port %d, socket fd is %d, ip is : %s, port : %d \n\r",
+            iob->CA_id, CAPORTS[j][abport], fd, inet_ntoa(iob->address[abport].sin_addr),
+            (ntohs(iob->address[abport].sin_port)));
+      ca_poll(EPOLL_CTL_ADD, iob->bus_socket[abport], EPOLLIN | EPOLLRDHUP, CAEV(CAEV_BUS, j, 0));
+      ca_poll(EPOLL_CTL_ADD, iob->tag_socket[abport], EPOLLRDHUP, CAEV(CAEV_TAG, j, 0));
    }
+}
+
+// ************************************************************
+// Function to receive from the bus socket without blocking.
+// Assembles the device number, the 8 byte CCW and the write
+// data of the CCW, then passes the CCW to the adapter thread.
+// ************************************************************
+void ca_bus_input(struct IO3705 *iob, uint32_t events) {
+   uint8_t *dst;
+   uint64_t ts;
+   uint32_t need;
+   uint16_t count;
+   int rc;
 
-   // Get the tag connection
    while (1) {
-      iob->tag_socket[abport] = accept(iob->CA_socket[abport], (struct sockaddr *)&iob->address[abport], (socklen_t*)&iob->addrlen[abport]);
-
-      if (iob->tag_socket[abport] > 0) {
-         printf("\nCA%c: New tag connection on 3705 port %d, socket fd is %d, ip is : %s, port : %d \n\r",
-                  iob->CA_id, CAPORTS[(iob->CA_id - '0')-1][abport], iob->tag_socket[abport], inet_ntoa(iob->address[abport].sin_addr),
-                  (ntohs(iob->address[abport].sin_port)));
-         break;
-      } else {
-         if (errno != EAGAIN)  {
-            printf("\nCA%c: Host accept failed with errno %d for tag connection...\n\r", iob->CA_id, errno);
-            return -1;
-         }
+      switch (iob->ca_state) {
+         case CA_DEVNUM:
+            dst = iob->buffer + iob->inlen;
+            need = 2 - iob->inlen;
+            break;
+         case CA_CCW:
+            dst = iob->buffer + iob->inlen;
+            need = 8 - iob->inlen;
+            break;
+         case CA_DATA:
+            dst = iob->inbuf->data + iob->inlen;
+            need = iob->inbuf->len - iob->inlen;
+            break;
+         default:                            // CCW in progress, only check for hang up
+            if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+               ca_disconnect(iob, "Host disconnected");
+            return;
+      }
+
+      ts = ca_usec();
+      rc = recv(iob->bus_socket[iob->abswitch], dst, need, 0);
+      ca_stats_sock(iob, ts);
+      if (rc == 0) {
+         ca_disconnect(iob, "Host disconnected");
+         return;
+      }
+      if (rc < 0) {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            ca_disconnect(iob, "Error reading CCW");
+         else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            ca_disconnect(iob, "Host disconnected");
+         return;
+      }
+      iob->inlen = iob->inlen + rc;
+      if (rc < need)
+         continue;
+
+      switch (iob->ca_state) {
+         case CA_DEVNUM:                     // Get device number
+            iob->devnum = (iob->buffer[0] << 8) | iob->buffer[1];
+            printf("CA%c: Connected to device %04X\n\r", iob->CA_id, iob->devnum);
+            iob->inlen = 0;
+            iob->ca_state = CA_CCW;
+            iob->CA_active = TRUE;           // Change the CA status to active
+            break;
+         case CA_CCW:                        // All data transfers are preceded by a CCW
+            count = (iob->buffer[6] << 8) | iob->buffer[7];
+            if (((iob->buffer[0] == 0x01) || (iob->buffer[0] == 0x05) || (iob->buffer[0] == 0x09)) && (count > 0)) {
+               iob->inbuf = ca_buf_get(count);   // Write data follows the CCW
+               iob->inbuf->len = count;
+               iob->inlen = 0;
+               iob->ca_state = CA_DATA;
+            } else
+               ca_dispatch(iob);
+            break;
+         case CA_DATA:
+            ca_dispatch(iob);
+            break;
       }
    }
-   return 0;
 }
 
-
 // ************************************************************
 // Function to send CA return status to the host
 // ************************************************************
 void send_carnstat(int sockptr, char *carnstat, uint8_t *ackbuf, int CAid) {
    int rc, retry;                  // Return code
+   uint64_t t0;
 
-   while (Ireg_bit(0x77, 0x0028) == ON)
-      wait();                      // Wait for CA 1 L3 interrupt reset
+   wait_L3(CAid, 0x0028);          // Wait for CA 1 L3 interrupt reset
 
    // If DE and CE and reset Write Break Remember and Channel Active
    if (*carnstat & CSW_DEND) {
@@ -277,7 +859,9 @@ void send_carnstat(int sockptr, char *carnstat, uint8_t *ackbuf, int CAid) {
    if ((Adbg_flag == ON) && (Adbg_reg & 0x01))    // Trace channel adapter activities ?
       fprintf(A_trace, "CA%c: CARNSTAT %02X via socket %d\n\r", iobs[CAid]->CA_id, *carnstat, sockptr);
    if (sockptr != -1) {
-      rc = send(sockptr, carnstat, 1, 0);
+      t0 = ca_usec();
+      rc = ca_send(sockptr, carnstat, 1);
+      ca_stats_sock(iobs[CAid], t0);
    if ((Adbg_flag == ON) && (Adbg_reg & 0x01))    // Trace channel adapter activities ?
          fprintf(A_trace, "CA%c: Send %d bytes on socket %d\n\r", iobs[CAid]->CA_id, rc, sockptr);
    } else
@@ -317,31 +901,14 @@ void send_ack(int sockptr) {
    return;
 }
 
-// ************************************************************
-// Function to read data from TCP socket
-// ************************************************************
-int read_socket(int sockptr, char *buffptr, int buffsize) {
-   int reclen;
-   bzero(buffptr, buffsize);
-   reclen = read(sockptr, buffptr, buffsize);
-   if (reclen < 1)
-      printf("\nCA: Read failed with error %s \n\r", strerror(errno));
-   return reclen;
-}
-
 // ************************************************************
 // Function to close TCP socket
 // ************************************************************
 int close_socket(struct IO3705 *iob, int abchannel) {
 
-   /* First shutdown the sockets to terminate active blocked reads */
-   /* The BUS and TAG sockets are closed by the active CA1/2 thread */
-
-   if (iob->bus_socket[abchannel] > 0)
-   shutdown(iob->bus_socket[abchannel], SHUT_RDWR);
-
-   if (iob->tag_socket[abchannel] > 0)
-      shutdown(iob->tag_socket[abchannel], SHUT_RDWR);
+   /* Drop the host connection. If the CA thread is still using   */
+   /* the BUS and TAG sockets they are closed when it is done      */
+   ca_disconnect(iob, "A/B switch thrown");
 
    if (iob->CA_socket[abchannel] > 0) {
       close(iob->CA_socket[abchannel]);
@@ -357,7 +924,7 @@ int close_socket(struct IO3705 *iob, int abchannel) {
 // ************************************************************
 int send_socket(int sockptr, char *respp, int respsize) {
    int rc;                      /* Return code */
-   rc = send (sockptr, respp, respsize, 0);
+   rc = ca_send(sockptr, respp, respsize);
 
    if (rc < 0) {
       printf("\nCA: Send to host failed...\n\r");
@@ -395,9 +962,9 @@ void start_listen(struct IO3705 *iob, int abport) {
       printf("\nCA%c: Listen failed for port %c\n\r", iob->CA_id, abswid[abport]);
       exit(-1);
    }
-   // Add polling events for the port
-   event.events = EPOLLIN | EPOLLONESHOT;
-   event.data.fd = iob->CA_socket[abport];
+   // Add polling events for the port, unless the previous connection is still being closed
+   event.events = iob->closing ? 0 : EPOLLIN;
+   event.data.u32 = CAEV(CAEV_LISTEN, (iob->CA_id - '1'), abport);
    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, iob->CA_socket[abport], &event)) {
       printf("\nCA%c: Add polling event failed for port %c with error %s \n\r", iob->CA_id, abswid[abport], strerror(errno));
       close(epoll_fd);
@@ -423,17 +990,17 @@ void exec_attn(int j) {
    Eregs_Inp[0x77] |= iobs[j]->CA_mask;              // Set CA1 L3 Interrupt Request
    pthread_mutex_unlock(&r77_lock);
    CA1_IS_req_L3 = ON;
-   while (Ireg_bit(0x77, iobs[j]->CA_mask) == ON)
-      wait();
+   wait_L3(j, iobs[j]->CA_mask);
    iobs[j]->Eregs_Out[0x55] &= ~0x0200;                       // Reset attention request
    print_regs(iobs[j], "ATTN");
    carnstat = (carnstat & 0x00) | CSW_ATTN;           // Set ATTN CA return status
    //carnstat = ((Eregs_Out[0x54] >> 8 ) & 0x00FF);  // Get CA return status
-   if (iobs[j]->CA_active == TRUE) {
+   if (ca_hold(iobs[j]) == TRUE) {                   // Channel active: reserve the tag socket
       if ((Adbg_flag == ON) && (Adbg_reg & 0x01))    // Trace channel adapter activities ?
           fprintf(A_trace, "CA%c: Sending ATTN\n\r", iobs[j]->CA_id);
       // Send CA retun status to host
       send_carnstat(iobs[j]->tag_socket[iobs[j]->abswitch], &carnstat, &ackbuf, j);
+      ca_release(iobs[j]);
    } else {
       printf("CA%c: Channel not active, ATTN not send \n\r", iobs[j]->CA_id);
    }
@@ -446,8 +1013,7 @@ void exec_attn(int j) {
 void exec_pci(int j) {
    int bitsave;
       print_regs(iobs[j], "PCI Request");
-      while (Ireg_bit(0x77, iobs[j]->CA_mask) == ON)
-         wait();
+      wait_L3(j, iobs[j]->CA_mask);
       bitsave = iobs[j]->Eregs_Out[0x55] & 0x3000;   // Save INCWAR and OUTCWAR bits;
       iobs[j]->Eregs_Inp[0x55] |= 0x0800;            // Set Program Requested L3 interrupt
       //iobs[j]->Eregs_Out[0x55] |= 0x3000;            // Set INCWAR and OUTCWAR valid for IPL
@@ -457,7 +1023,7 @@ void exec_pci(int j) {
       CA1_IS_req_L3 = ON;
       if ((Adbg_flag == ON) && (Adbg_reg & 0x01))    // Trace channel adapter activities ?
          fprintf(A_trace, "CA%c: Requested L3 interrupt\n\r", iobs[j]->CA_id);
-      while (Ireg_bit(0x77, iobs[j]->CA_mask) == ON) wait();
+      wait_L3(j, iobs[j]->CA_mask);
          wait();
       Eregs_Out[0x57] &= ~0x0080;                    // Reset L3 request
       print_regs(iobs[j], "PCI Request completed");
@@ -499,7 +1065,9 @@ void exec_diag(int j) {
 // Channel adaptor type 2 thread
 // ********************************************************************
 void *CA_T2_thread(void *arg) {
-   int rc, sig, event_count;
+   int rc, sig, event_count, timer_fd;
+   struct itimerspec tick;
+   uint64_t ticks;
    struct sockaddr_in address;
    typedef union epoll_data {
       void    *ptr;
@@ -524,28 +1092,51 @@ void *CA_T2_thread(void *arg) {
    pthread_t id1, id2, id3;
    args = malloc(sizeof(struct pth_args) * 1);
    /***************************************/
-   /* Allocate the CA IO Blocks           */
-   /***************************************/
-   for (int i = 0; i < MAXCHAN; i++)
-      iobs[i] = malloc(sizeof(struct IO3705) * 1);
-   /***************************************/
-   /* Initialize the CA IO Blocks         */
+   /* Allocate and initialize the CA IO   */
+   /* Blocks                              */
    /***************************************/
    for (int i = 0; i < MAXCHAN; i++) {
-      iobs[i]->CA_id = 0x31 + i;           // First channel id starts with 1
-      iobs[i]->abswitch = 0;               // A/B switch is default set to A
-      iobs[i]->CA_active = FALSE;          // Initial state is not active (No TCP connection yet)
-      iobs[i]->abswhist = CAB;             // This forces a listen on CAx port A
-      iobs[i]->CA_mask = CAMASKS[i];       // Mask to enable port A
-      iobs[i]->chainbl = 0;                // Initial chain data buffer length=0
-      iobs[i]->diag = 0;                   // Diagnostic off
+      struct IO3705 *iob = calloc(1, sizeof(struct IO3705));   // Statistics and buffers start cleared
+      pthread_condattr_t cattr;
+
+      if (iob == NULL) {
+         printf("\nCA%d: IO Block allocation failed\n\r", i + 1);
+         return 0;
+      }
+      iob->CA_id = 0x31 + i;               // First channel id starts with 1
+      iob->abswitch = 0;                   // A/B switch is default set to A
+      iob->CA_active = FALSE;              // Initial state is not active (No TCP connection yet)
+      iob->abswhist = CAB;                 // This forces a listen on CAx port A
+      iob->CA_mask = CAMASKS[i];           // Mask to enable port A
+      iob->diag = 0;                       // Diagnostic off
+      iob->ca_state = CA_LISTEN;           // Waiting for the host
+      for (int k = CAA; k <= CAB; k++)
+         iob->CA_socket[k] = iob->bus_socket[k] = iob->tag_socket[k] = -1;
+      pthread_mutex_init(&iob->ca_lock, NULL);
+      pthread_condattr_init(&cattr);
+      pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+      pthread_cond_init(&iob->ca_cond, &cattr);
+      pthread_condattr_destroy(&cattr);
+      iobs[i] = iob;
    }
 
-   epoll_fd = epoll_create(10);
+   ca_buf_init(4);                         // Preallocate the CA buffer pool
+
+   epoll_fd = epoll_create1(0);
    if (epoll_fd == -1) {
       printf("\nCA_T2: failed to created epoll file descriptor\n\r");
       return 0;
    }
+   // Timer tick to check the A/B switches
+   timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+   if (timer_fd == -1) {
+      printf("\nCA_T2: failed to create timer file descriptor\n\r");
+      return 0;
+   }
+   tick.it_value.tv_sec = tick.it_interval.tv_sec = 0;
+   tick.it_value.tv_nsec = tick.it_interval.tv_nsec = CA_TICK * 1000000;
+   timerfd_settime(timer_fd, 0, &tick, NULL);
+   ca_poll(EPOLL_CTL_ADD, timer_fd, EPOLLIN, CAEV(CAEV_TIMER, 0, 0));
 
    rc = pthread_create(&id1, NULL, CA1_thread, NULL);
    if (rc  != 0) {
@@ -559,60 +1150,46 @@ void *CA_T2_thread(void *arg) {
    }  // End if rc !=0
 
    while(1) {
-      // check if the A/B switch has been thrown
-      for (int i = 0; i < MAXCHAN; i++) {
-         if (iobs[i]->abswhist != iobs[i]->abswitch) {
-            close_socket(iobs[i], iobs[i]->abswhist);     // Close previous port
-            start_listen(iobs[i], iobs[i]->abswitch);     // Listen and add polling
-            iobs[i]->abswhist = iobs[i]->abswitch;
-         }  // End if iobs[i]
-      }  // End for i=0
-
-      for (int i = 0; i < MAXCHAN; i++) {
-         if (!IsSocketConnected(iobs[i]->CA_socket[iobs[i]->abswitch])) {
-            event.events = EPOLLIN | EPOLLONESHOT;
-            event.data.fd = iobs[i]->CA_socket[iobs[i]->abswitch];
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, iobs[i]->CA_socket[iobs[i]->abswitch], &event)) {
-               printf("\nModifying polling event error %d for CA%c-%c\n\r", errno, iobs[i]->CA_id, abswid[iobs[i]->abswitch]);
-               close(epoll_fd);
-               return 0;
-            }  // End if !isSocketConnected
-         }  //End for i = 0
-      }  // End while(1)
-
-
       /*******************************************************************************/
-      /* This section monitors incomming channel connection requests.                */
-      /* If a request is received, it is passed to the connection handler funtion    */
-      /*    followed by the creation of a thread that emulates the CA hardware,       */
+      /* All host socket I/O of both CAs is driven from this loop: connect requests, */
+      /* CCWs and write data are received here without blocking and passed to the   */
+      /* CA thread when complete.  The CA thread only sends status and read data.    */
       /*******************************************************************************/
-      event_count = epoll_wait(epoll_fd, events, MAXCHAN*2, 5000);
+      event_count = epoll_wait(epoll_fd, events, MAXCHAN*4+1, -1);
+      if (event_count < 0) {
+         if (errno != EINTR)
+            printf("\nCA_T2: Polling failed with error %s\n\r", strerror(errno));
+         continue;
+      }
 
       for (int i = 0; i < event_count; i++) {
-         for (int j = 0; j < MAXCHAN; j++) {                    // For evey possibe connected Channel
-            for (int k = 0; k <= CAB; k++) {                    // For port A and B
-
-               if ((events[i].data.fd == iobs[j]->CA_socket[k]) && (iobs[j]->abswitch == k)) {
-                  // Accept the incoming connection
-                  rc = host_connect(iobs[j], k);
-                  if (rc == 0) {
-                     // Get device number
-                     rc = read_socket(iobs[j]->bus_socket[iobs[j]->abswitch], iobs[j]->buffer, sizeof(iobs[j]->buffer));
-                     if (rc != 0) {
-                        iobs[j]->devnum = (iobs[j]->buffer[0] << 8) | iobs[j]->buffer[1];
-                        printf("CA%c: Connected to device %04X\n\r", iobs[j]->CA_id, iobs[j]->devnum);
-                        // Change the CA status to active
-                        iobs[j]->CA_active = TRUE;
-                     } else {
-                        close_socket(iobs[j], k);
-                     }  // End if rc !=0
-                  } else {
-                     close_socket(iobs[j], k);
-                  }  // End if rc ==0
-               }  // End if events[i].data.fd iobs[0] CAA
-            }  // End for k=0 (A/B ports)
-         }  // End for j=0  (Channels)
-
+         uint32_t tag = events[i].data.u32;
+         int j = (tag >> 8) & 0xFF;             // Channel
+         int k = tag & 0xFF;                    // A or B port
+
+         switch (tag & 0xFF0000) {
+            case CAEV_TIMER:
+               rc = read(timer_fd, &ticks, sizeof(ticks));
+               // check if the A/B switch has been thrown
+               for (j = 0; j < MAXCHAN; j++) {
+                  if (iobs[j]->abswhist != iobs[j]->abswitch) {
+                     close_socket(iobs[j], iobs[j]->abswhist);     // Close previous port
+                     start_listen(iobs[j], iobs[j]->abswitch);     // Listen and add polling
+                     iobs[j]->abswhist = iobs[j]->abswitch;
+                  }  // End if iobs[j]
+               }  // End for j=0
+               break;
+            case CAEV_LISTEN:
+               ca_accept(iobs[j], k);
+               break;
+            case CAEV_BUS:
+               ca_bus_input(iobs[j], events[i].events);
+               break;
+            case CAEV_TAG:
+               if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                  ca_disconnect(iobs[j], "Host disconnected");
+               break;
+         }  // End switch tag
       }  // End for event_count
    }  // End While(1)
 
@@ -630,7 +1207,6 @@ void *CA_T2_thread(void *arg) {
    signature: it has one void* parameter and returns void    */
 void *CA1_thread(void *arg) {
 
-   int  pendingrcv;
    int  CAid = 0;
 
    printf("\nCA%d: Adapter thread %d started sucessfully... \n\r", CAid+1, getpid());
@@ -656,6 +1232,10 @@ void *CA1_thread(void *arg) {
       /*  Channel status tests need to be added                      */
       /*                                                             */
       /***************************************************************/
+         if (ca_type == 1) {                // CA1 is a type 1 adapter
+            ca_t1_cycle(iobs[CAid]);
+            continue;
+         }
          // Check for Diagnostic mode
          exec_diag(CAid);
          // Check for PCI request
@@ -669,18 +1249,11 @@ void *CA1_thread(void *arg) {
             // Execute ATTN request
             exec_attn(CAid);
          }
-         // Check for Channel activity
-         if (iobs[CAid]->CA_active == TRUE) {
-            do {
-               pendingrcv = 0;
-               ioctl(iobs[CAid]->bus_socket[iobs[CAid]->abswitch], FIONREAD, &pendingrcv);
-               if (pendingrcv > 0) {
-                  exec_ccw(iobs[CAid],CAid);
-                  }  // End if pendingrcv
-               } // end do while
-
-            while (pendingrcv != 0);
-         }  // End if iobs[j]
+         // Wait for a CCW from the host or a CA register change by the CCU
+         if (ca_wait_ccw(iobs[CAid]) == TRUE) {
+            exec_ccw(iobs[CAid], CAid);
+            ca_ccw_done(iobs[CAid]);
+         }  // End if ca_wait_ccw
    }  // End of while(1)... */
 }
 
@@ -691,7 +1264,6 @@ void *CA1_thread(void *arg) {
    signature: it has one void* parameter and returns void    */
 void *CA2_thread(void *arg) {
 
-   int  pendingrcv;
    int  CAid = 1;
 
    printf("\nCA%d: Adapter thread %d started sucessfully... \n\r", CAid+1, getpid());
@@ -730,17 +1302,11 @@ void *CA2_thread(void *arg) {
             // Execute ATTN request
             exec_attn(CAid);
          }
-         // Check for Channel activity
-         if (iobs[CAid]->CA_active == TRUE) {
-            do {
-               pendingrcv = 0;
-               ioctl(iobs[CAid]->bus_socket[iobs[CAid]->abswitch], FIONREAD, &pendingrcv);
-               if (pendingrcv > 0) {
-                  exec_ccw(iobs[CAid],CAid);
-                  }  // End if pendingrcv
-               }  // end do while
-            while (pendingrcv != 0);
-         }  // End if iobs[j]
+         // Wait for a CCW from the host or a CA register change by the CCU
+         if (ca_wait_ccw(iobs[CAid]) == TRUE) {
+            exec_ccw(iobs[CAid], CAid);
+            ca_ccw_done(iobs[CAid]);
+         }  // End if ca_wait_ccw
    }  // End of while(1)... */
 }
 
@@ -761,39 +1327,29 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
    int cc = 0;
    int sockfc = -1;
    int bufbase, condition;
-   int pendingrcv;
    pthread_t id;
    char carnstat, ackbuf;
-   uint16_t incwar, outcwar, wdcnt, wdcnttmp, wdcnttot, cacw1;
-   uint32_t cacw2;
+   uint16_t incwar, outcwar, wdcnt, wdcnttmp, cacw1;
+   uint32_t cacw2, wdcnttot;
+   int overrun = OFF;          // Read data did not fit in the largest buffer
    uint8_t sense_byte = 0x00;
+   uint64_t t0, ts;            // Statistics time stamps
+   struct CABUF *rbuf, *wbuf, *nbuf;  // Pooled read and write data buffers
+   uint32_t bufoff, n;
+   uint32_t nbytes = 0;        // Statistics data byte count
 
    /***************************************************************/
-   /*    Read channel command from host                           */
+   /*    Execute the channel command received from the host by    */
+   /*    the CA event loop.  Any write data of the CCW has been   */
+   /*    received as well.                                        */
    /*                                                             */
    /*    This is the raw version: it assumes no pending operation */
    /*    Channel status tests need to be added                    */
    /*                                                             */
    /***************************************************************/
-   if (iob->bus_socket[iob->abswitch] < 1) {
+   t0 = ca_usec();
+   if (iob->CA_active == FALSE) {
       printf("\nCA%c: Aborting due to loss of active channel connection...\n\r", iob->CA_id);
-      return;
-   }
-
-   rc = read_socket( iob->bus_socket[iob->abswitch], iob->buffer, sizeof(iob->buffer));
-
-   if (rc == 0) {
-      // Host disconnected, get details and print it
-      printf("\nCA%c: Error reading CCW, closing channel connection\n\r", iob->CA_id);
-      // Change the CA status to inactive
-      iob->CA_active = FALSE;
-
-      // Close the bus and tag socket and mark for reuse
-      close(iob->bus_socket[iob->abswitch]);
-      close(iob->tag_socket[iob->abswitch]);
-
-      iob->bus_socket[iob->abswitch] = -1;
-      iob->tag_socket[iob->abswitch] = -1;
    } else {
       // All data transfers are preceded by a CCW.
       ccw.code  =  0x00;
@@ -836,6 +1392,7 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
                wait();                                   // Wait for OUTCWAR to become valid
             bufbase = 0;                                 // Set buffer base...
             wdcnttot = 0;                                // ... we will need this in case of chaining
+            rbuf = ca_buf_get(ccw.count);                // Pooled buffer for the data to the host
 
             do {   // While condition remains 0
                condition = 0;
@@ -860,14 +1417,22 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
                   fprintf(A_trace, "Fetch starts at %06X, count = %04X\n\r", cacw2, wdcnt);
                }
                wdcnttmp = wdcnt;                         // Bytes to be transferred for this CW
-               wdcnttot = wdcnttot + wdcnt;              // Total byte count
-               for (i = 0; i < wdcnttmp; i++) {
-                  iob->buffer[bufbase + i] = M[cacw2 + i];   // Load data directly into memory
-                  iob->Eregs_Inp[0x59] = iob->Eregs_Inp[0x59] + 1; // Increment cycle steal counter
-                  wdcnt = wdcnt - 1;                     // Decrement byte counter
-                  iob->Eregs_Inp[0x52] = iob->Eregs_Inp[0x52] - 1;
-               }  // End for stmt
-               bufbase = bufbase + i;                    // Point after last byte stored in buffer
+               if ((bufbase + wdcnttmp > rbuf->size) &&  // Buffer too small: move to the next size class
+                   ((nbuf = ca_buf_grow(rbuf, bufbase + wdcnttmp)) != NULL))
+                  rbuf = nbuf;
+               if (bufbase + wdcnttmp > rbuf->size) {    // Never overrun the largest class
+                  if (overrun == OFF)
+                     printf("\nCA%c: Read data exceeds %d bytes, ending with unit check\n\r", iob->CA_id, rbuf->size);
+                  overrun = ON;
+                  wdcnttmp = rbuf->size - bufbase;
+               }
+               wdcnttot = wdcnttot + wdcnttmp;           // Total byte count
+               memcpy(rbuf->data + bufbase, &M[cacw2], wdcnttmp);   // Fetch data directly from memory
+               iob->Eregs_Inp[0x59] += wdcnttmp;         // Increment cycle steal counter
+               wdcnt = wdcnt - wdcnttmp;                 // Decrement byte counter
+               iob->Eregs_Inp[0x52] -= wdcnttmp;
+               bufbase = bufbase + wdcnttmp;             // Point after last byte stored in buffer
+               rbuf->len = bufbase;
 
                if (cacw1 & 0x4000) {                     // If OUT STOP
                   if ((cacw1 & 0x1000) && !(cacw1 & 0x2000))  // Chaining On, Zero Override Off
@@ -876,14 +1441,12 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
                      condition = 1;
                   if ((cacw1 & 0x3000) == 0x3000) {      // Chaning On, Zero Override On
                      condition = 0;
-                     while (Ireg_bit(0x77, iob->CA_mask) == ON)
-                        wait();                          // Wait for CA1 L3 interrupt reset
+                     wait_L3(CAid, iob->CA_mask);        // Wait for CA1 L3 interrupt reset
                      pthread_mutex_lock(&r77_lock);
                      Eregs_Inp[0x77] |= iob->CA_mask;    // Set CA1 L3 interrupt
                      pthread_mutex_unlock(&r77_lock);
                      CA1_IS_req_L3 = ON;                 // Chan Adap Initial Sel request flag
-                     while (Ireg_bit(0x77, iob->CA_mask) == ON)
-                        wait();                          // Wait for initial selection reset
+                     wait_L3(CAid, iob->CA_mask);        // Wait for initial selection reset
                   }
                } else {
                   if ((cacw1 & 0x1000) && !(cacw1 & 0x2000))  // Chaining On, Zero Override Off
@@ -899,24 +1462,28 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
             }  while (condition == 0);     // End of do stmt.
 
             if (condition != 2) {
-               while (Ireg_bit(0x77, iob->CA_mask) == ON)
-                  wait();                                // Wait for CA1 L3 interrupt reset
+               wait_L3(CAid, iob->CA_mask);              // Wait for CA1 L3 interrupt reset
                pthread_mutex_lock(&r77_lock);
                Eregs_Inp[0x77] |= iob->CA_mask;          // Set CA1  L3 interrupt
                pthread_mutex_unlock(&r77_lock);
                CA1_IS_req_L3 = ON;                       // Chan Adap Initial Sel request flag
-               while (Ireg_bit(0x77, iob->CA_mask) == ON)
-                  wait();                                // Wait for initial selection reset
+               wait_L3(CAid, iob->CA_mask);              // Wait for initial selection reset
             }
 
-            rc = send(iob->bus_socket[iob->abswitch], (void*)&iob->buffer, wdcnttot, 0);
+            ts = ca_usec();
+            rc = ca_send(iob->bus_socket[iob->abswitch], (void*)rbuf->data, wdcnttot);
+            ca_stats_sock(iob, ts);
+            nbytes = wdcnttot;
+            ca_buf_put(rbuf);                            // Recycle the read buffer
 
             // Send CA return status to host
             print_regs(iob, "CCW 02 Post");
-            if (condition != 3) {
+            if ((condition != 3) || (overrun == ON)) {
                carnstat = ((iob->Eregs_Out[0x54] >> 8 ) & 0x00FF);  // Get CA return status
                if (condition == 2)
                   carnstat = CSW_DEND;
+               if (overrun == ON)                        // Data was dropped
+                  carnstat |= CSW_CEND | CSW_DEND | CSW_UCHK;
                send_carnstat(iob->bus_socket[iob->abswitch], &carnstat, &ackbuf, CAid);
             }
             break;
@@ -924,8 +1491,7 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
          case 0x03:       // NO-OP ?
             iob->Eregs_Inp[0x5C] |= 0x1000;              // Set CA Command Register
             // Send channel end and device end to host. Sufficient for now (might need to send x00).
-            while (Ireg_bit(0x77, iob->CA_mask) == ON)
-               wait();                                   // Wait for CA1 L3 interrupt request reset
+            wait_L3(CAid, iob->CA_mask);                 // Wait for CA1 L3 interrupt request reset
             carnstat = 0x00;
             carnstat |= CSW_DEND;
             send_carnstat(iob->bus_socket[iob->abswitch], &carnstat, &ackbuf, CAid);
@@ -938,8 +1504,7 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
                iob->buffer[0] = 0x00;
             } else {
                iob->Eregs_Inp[0x5C] |= 0x0800;           // Set CA Command Register
-               while (Ireg_bit(0x77, iob->CA_mask) == ON)
-                  wait();                                // Wait for CA1 L3 reset
+               wait_L3(CAid, iob->CA_mask);              // Wait for CA1 L3 reset
                   // ?????
                //pthread_mutex_lock(&r77_lock);
                //Eregs_Inp[0x77] |= iob->CA_mask;        // Set CA1 L3 interrupt request
@@ -959,7 +1524,10 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
             if ((Adbg_flag == ON) && (Adbg_reg & 0x01))  // Trace channel adapter activities ?
                fprintf(A_trace, "CA%c: Sending sense Byte 0 %02X \n\r", iob->CA_id, iob->buffer[0]);
 
+            ts = ca_usec();
             rc = send_socket(iob->bus_socket[iob->abswitch], (void*)&iob->buffer, 1);
+            ca_stats_sock(iob, ts);
+            nbytes = 1;
 
             // Send CA return status to host
             send_carnstat(iob->bus_socket[iob->abswitch], &carnstat, &ackbuf, CAid);
@@ -981,8 +1549,7 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
                   iob->Eregs_Inp[0x5C] |= 0x0001;        // Set CA Command Register
                   iob->Eregs_Inp[0x55] |= 0x0100;        // Set Channel Active
                   iob->Eregs_Out[0x55] |= 0x3000;             // Set INCWAR and OUTCWAR valid for IPL (MAXIROS doesn't do this)
-                  while (Ireg_bit(0x77, iob->CA_mask) == ON)
-                      wait();                            // Wait for CA1 L3 request reset
+                  wait_L3(CAid, iob->CA_mask);           // Wait for CA1 L3 request reset
                   pthread_mutex_lock(&r77_lock);
                   Eregs_Inp[0x77] |= iob->CA_mask;       // Set CA1 L3 interrupt request
                   pthread_mutex_unlock(&r77_lock);
@@ -995,36 +1562,56 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
                   break;
             }  // End of nested switch ccw.code
 
-            while (Ireg_bit(0x77, iob->CA_mask) == ON)
-                wait();                                  // Wait for CA1 L3 Request reset
+            wait_L3(CAid, iob->CA_mask);                 // Wait for CA1 L3 Request reset
             print_regs(iob, "CCW 05, 09, 01 Entry");
 
-            // Read data from host, but first make sure host has finished writing all data to the TCP buffer
-            pendingrcv = 0;
-            while (pendingrcv != ccw.count)
-               ioctl(iob->bus_socket[iob->abswitch], FIONREAD, &pendingrcv);
-            rc = recv( iob->bus_socket[iob->abswitch], iob->chainbuf + iob->chainbl, sizeof(iob->chainbuf)-iob->chainbl, 0);
+            // The write data has been received with the CCW by the CA event loop.
+            // Each CCW of a data chain gets its own pooled buffer, linked to the chain
+            wbuf = iob->inbuf;
+            iob->inbuf = NULL;
+            if (wbuf == NULL)                            // Zero length write
+               wbuf = ca_buf_get(0);
+            rc = wbuf->len;
+            nbytes = rc;
+            if (iob->chain == NULL)
+               iob->chain = wbuf;
+            else
+               iob->chaint->next = wbuf;
+            iob->chaint = wbuf;
             if ((Adbg_flag == ON) && (Adbg_reg & 0x01))  // Trace channel adapter activities ?
                fprintf(A_trace, "CA%c: received: %d bytes from host\n\r", iob->CA_id, rc);
-            iob->bufferl = rc;
-            iob->chainbl = iob->chainbl + rc;
+            iob->bufferl = wbuf->len;
+            iob->chainbl = iob->chainbl + wbuf->len;
             if (ccw.flags & 0x80) {
                if ((Adbg_flag == ON) && (Adbg_reg & 0x01))   // Trace channel adapter activities ?
                   fprintf(A_trace, "CA%c: data chaining \n\r", iob->CA_id);
+               iob->stats.chain_segs++;
+               iob->stats.chain_depth++;
                carnstat = CSW_CEND | CSW_DEND;   // Set CA return status
                // Send CA return status to host
                send_carnstat(iob->bus_socket[iob->abswitch], &carnstat, &ackbuf, CAid);
+               ca_stats_ccw(iob, ccw.code, t0, nbytes);
                return;
             }
+            if (iob->stats.chain_depth) {                // Last CCW of a data chain
+               iob->stats.chain_segs++;
+               iob->stats.chain_cnt++;
+               if (++iob->stats.chain_depth > iob->stats.chain_max)
+                  iob->stats.chain_max = iob->stats.chain_depth;
+               iob->stats.chain_depth = 0;
+            }
             bufbase = 0;                                 // Set buffer base.
                                                          // We will need this in case of chaining
 
             iob->bufferl = iob->chainbl;                 // save data chain buffer length
             iob->chainbl = 0;                            // Reset data chain buffer length (no chaining or chain end)
+            wbuf = iob->chain;                           // Start with the first buffer of the chain
+            bufoff = 0;
             // ************************************************************
             // Data transfer loop starts here
             // ************************************************************
-            print_hex(iob->chainbuf, iob->bufferl);
+            for (struct CABUF *b = iob->chain; b != NULL; b = b->next)
+               print_hex(b->data, b->len);
 
             while (iob->bufferl) {
                do {   // While condition remains 0
@@ -1069,12 +1656,28 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
                   if ((Adbg_flag == ON) && (Adbg_reg & 0x01))   // Trace channel adapter activities ?
                      fprintf(A_trace, "(1) wdcnttmp=%d, wdcnt=%d, iob->bufferl=%d\n\r", wdcnttmp, wdcnt, iob->bufferl);
 
-                  for (i = 0; i < wdcnttmp; i++) {
-                     M[cacw2 + i] = iob->chainbuf[bufbase + i];  // Load data directly into memory
-                     iob->Eregs_Inp[0x59] = iob->Eregs_Inp[0x59] + 1; // Increment cycle steal counter
-                     wdcnt = wdcnt - 1;                      // Decrement byte counter
+                  for (i = 0; i < wdcnttmp; ) {          // Load data directly into memory...
+                     while ((wbuf != NULL) && (bufoff == wbuf->len)) {   // ...straight from the chained buffers
+                        wbuf = wbuf->next;
+                        bufoff = 0;
+                     }
+                     if (wbuf == NULL) {                 // Count runs past the chained data
+                        printf("\rCA%c: Write data %d bytes short of the count\n", iob->CA_id, wdcnttmp - i);
+                        wdcnttmp = i;
+                        break;
+                     }
+                     n = wdcnttmp - i < wbuf->len - bufoff ? wdcnttmp - i : wbuf->len - bufoff;
+                     memcpy(&M[cacw2 + i], wbuf->data + bufoff, n);
+                     bufoff = bufoff + n;
+                     i = i + n;
                   }  // End For
+                  iob->Eregs_Inp[0x59] += wdcnttmp;      // Increment cycle steal counter
+                  wdcnt = wdcnt - wdcnttmp;              // Decrement byte counter
                   iob->bufferl = iob->bufferl - wdcnttmp;
+                  if (wbuf == NULL) {                    // Short data: end the CCW with the
+                     iob->bufferl = 0;                   // count left, which stops the channel
+                     break;
+                  }
                   bufbase = bufbase + i;                 // Buffer base points to start of remaing data
                   if ((cacw1 & 0x8000) && wdcnt == 0) {  // If IN and count zero
                      if ((cacw1 & 0x2000) == 0x2000)  {  // Zero Override On
@@ -1084,8 +1687,7 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
                         Eregs_Inp[0x77] |= iob->CA_mask; // Set CA1 L3 interrupt request
                         pthread_mutex_unlock(&r77_lock);
                         CA1_IS_req_L3 = ON;              // Chan Adap L3 request flag
-                        while (Ireg_bit(0x77, iob->CA_mask) == ON)
-                           wait();
+                        wait_L3(CAid, iob->CA_mask);
                      } // End Zero override on
                      if ((cacw1 & 0x3000) == 0x0000)     // Chaining Off, Zero Override Off
                         condition = 1;
@@ -1095,6 +1697,8 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
 
                } while (condition == 0);  // End of Do stmt
             }  // End of while iob->bufferl
+            ca_buf_put(iob->chain);                      // Recycle the data chain buffers
+            iob->chain = iob->chaint = NULL;
 
 
             if ((Adbg_flag == ON) && (Adbg_reg & 0x01))  // Trace channel adapter activities ?
@@ -1106,8 +1710,7 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
 
             iob->Eregs_Inp[0x52] &= 0x0000;              // Clear Byte Count Register
             iob->Eregs_Inp[0x52] = wdcnt;                // Load Register with Byte count
-            while (Ireg_bit(0x77, iob->CA_mask) == ON)
-               wait();                                   // Wait for L3 interrupt reset
+            wait_L3(CAid, iob->CA_mask);                 // Wait for L3 interrupt reset
 
             //if (ccw.code == 0x05)
             //   Eregs_Out[0x55] &= ~0x3000;             // Reset INCWAR and OUTCWAR valid after IPL
@@ -1133,8 +1736,7 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
             Eregs_Inp[0x77] |= iob->CA_mask;             // Set CA1 L3 interrupt request
             pthread_mutex_unlock(&r77_lock);
             CA1_IS_req_L3 = ON;
-            while (Ireg_bit(0x77, iob->CA_mask) == ON)
-               wait();                                   // Wait for CA1 L3 Request reset
+            wait_L3(CAid, iob->CA_mask);                 // Wait for CA1 L3 Request reset
             print_regs(iob, "CCW 05, 09, 01 Post");
             if (condition != 2) {                        // If Zero overide is on
                carnstat = ((iob->Eregs_Out[0x54] >> 8 ) & 0x00FF);   // Get CA return status
@@ -1162,14 +1764,12 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
             iob->Eregs_Inp[0x53] &= 0x00FF;              // Reset sense byte (in)
             iob->Eregs_Out[0x53] &= 0x00FF;                   // Reset sense byte (out)
 
-            while (Ireg_bit(0x77, iob->CA_mask) == ON)
-               wait();                                   // Wait for CA1 L3 interrupt request reset
+            wait_L3(CAid, iob->CA_mask);                 // Wait for CA1 L3 interrupt request reset
             pthread_mutex_lock(&r77_lock);
             Eregs_Inp[0x77] |= iob->CA_mask;             // Set CA1 L3 interrupt request
             pthread_mutex_unlock(&r77_lock);
             CA1_IS_req_L3 = ON;                          // Chan Adap L3 interrupt request flag
-            while (Ireg_bit(0x77, iob->CA_mask) == ON)
-               wait();                                   // Wait for L3 iterrupt request reset
+            wait_L3(CAid, iob->CA_mask);                 // Wait for L3 iterrupt request reset
             print_regs(iob, "CCW's 31, 32, etc Post");
             // Send CA return status to host
             carnstat = ((iob->Eregs_Out[0x54] >> 8 ) & 0x00FF); // Get CA return status
@@ -1193,6 +1793,7 @@ void exec_ccw(struct IO3705 *iob, int CAid) {
             break;
 
       }  // End of switch (ccw.code)
+      ca_stats_ccw(iob, ccw.code, t0, nbytes);
    }  // End of if - else
    return;
 }
@@ -161,20 +161,29 @@
 
 extern void Get_ICW(int abar);                          /* CS2: ICW ===> Inp_Eregs 44, 45, 46, 47 rtn */
 extern int abar;                                        /* CS2: scanner interface addr 0x0840 */
-extern int8 icw_scf[];                                  /* CS2: sdf */
-extern int8 icw_pdf[];                                  /* CS2: pdf */
-extern int8 icw_lcd[];                                  /* CS2: lcd */
-extern int8 icw_pcf[];                                  /* CS2: pcf */
-extern int8 icw_sdf[];                                  /* CS2: sdf */
-extern int8 icw_Rflags[];                               /* CS2: Rflags */
-extern int8 icw_pdf_reg;                                /* CS2: pdf is filled or empty state */
-extern int8 icw_pcf_new;                                /* CS2: new pdf */
-extern int8 icw_pcf_mod;                                /* CS2: modified pdf flag */
+extern uint8_t icw_scf[];                               /* CS2: sdf */
+extern uint8_t icw_pdf[];                               /* CS2: pdf */
+extern uint8_t icw_lcd[];                               /* CS2: lcd */
+extern uint8_t icw_pcf[];                               /* CS2: pcf */
+extern uint8_t icw_sdf[];                               /* CS2: sdf */
+extern uint16_t icw_Rflags[];                           /* CS2: Rflags */
+extern int8 icw_pdf_reg[];                              /* CS2: pdf is filled or empty state */
+extern uint8_t icw_pcf_new[];                           /* CS2: new pdf */
+extern uint8_t icw_pcf_mod[];                           /* CS2: modified pdf flag */
+extern uint32_t icw_active;                             /* CS2: lines to be scanned */
+extern int CS2_L2_abar;                                 /* CS2: abar of line with L2 interrupt */
+extern uint32_t line_smd_addr[];                        /* CS2: PSA address per line (block mode) */
+extern int cs2_type;                                    /* CS2: scanner type 2 or 3 */
+extern void CS2_wakeup(void);                           /* CS2: NCP has serviced a line */
+extern int cs2_kick;                                    /* CS2: scanner wakeup pending */
+extern pthread_cond_t cs2_cond;                         /* CS2: scanner wakeup */
 extern int8 shwpanel;                                   /* Show Front Panel */
 extern pthread_mutex_t icw_lock;                        /* CS2: ICW update lock */
 extern uint16_t Sdbg_reg;                               /* SCANNER debug flags register */
 extern uint16_t Adbg_reg;                               /* Channel Adapter debug flags register */
 extern struct IO3705*  iobs[MAXCHAN];                   /* IBM 3705 I/O Block pointer array */
+extern void ca_wakeup(int j);                           /* CA: Wake up the adapter thread */
+extern int ca_type;                                     /* CA: CA1 adapter type */
 pthread_mutex_t r77_lock;                               /* CA2/CS2: Reg77 update lock */
 pthread_mutex_t r7f_lock;                               /* CCU: Reg7F update lock */
 
@@ -231,6 +240,9 @@ int32 debug_reg = 0x00;                                 /* Bit flags for debug/t
 int32 debug_flag = OFF;                                 /* 1 when trace.log open */
 FILE  *trace;
 int   tbar;                                             /* ICW table pointer */
+int   icwt;                                             /* ICW table pointer of current level */
+int   l2_abar = -1;                                     /* ABAR set by OUT X'40' in level 2, -1 if none */
+#define L2_ABAR ((l2_abar >= 0) ? l2_abar : CS2_L2_abar) /* ABAR used in level 2 */
 int   CAid = 0;                                         /* Selected Channel Adapter */
 int32 cc = 1;
 int32 val[4] = { 0x00, 0x00, 0x00, 0x00 };              /* Used for printing mnem */
@@ -610,6 +622,8 @@ while (reason == 0) {                          /* Loop until halted */
                int_lvl_ent[i] = ON;
                lvl = i;                        // Set new pgm level
                Grp = RegGrp(lvl);              // Set new reg group
+               if (lvl == 2)
+                  l2_abar = -1;                // Address the interrupting line
                if (debug_reg & 0x02) {         // Trace CCU interrupt levels
                   if (lvl == 1)
                      fprintf(trace, "\n>>> Entering lvl=1 -- IPL=%d; OPchk=%d; IOchk=%d; AEchk=%d \n",
@@ -1982,7 +1996,8 @@ while (reason == 0) {                          /* Loop until halted */
          } else {
             // An Input x'40' will reset L2 req
             if ((Efld == 0x40) && (lvl == 2)) {
-               Eregs_Inp[0x40] = abar;         /* Moved - Echo abar */
+               Eregs_Inp[0x40] = CS2_L2_abar;  /* Abar of interrupting line */
+               l2_abar = -1;                   /* Address that line until OUT X'40' */
                pthread_mutex_lock(&r77_lock);
                Eregs_Inp[0x77] &= ~0x4000;     /* Reset L2 flag */
                svc_req_L2 = OFF;               /* Reset L2 request flag */
@@ -1990,12 +2005,14 @@ while (reason == 0) {                          /* Loop until halted */
             }
             if ((Efld >= 0x40) && Efld <= 0x47) {   // Addressing CS2 ICW regs ?
                // ICW Input register ===> Eregs_Out 44, 45, 46, 47
-               Get_ICW(abar);                       // update ICW inpur regs
+               Get_ICW((lvl == 2) ? L2_ABAR : abar);   // update ICW inpur regs
             }
 
             if (Efld == 0x44) {                     // NCP has read received byte
-               if (icw_pcf[0] == 0x07)              // TEMP PDF is now empty for next rx
-                  icw_pdf_reg = EMPTY;
+               icwt = (lvl == 2) ? (L2_ABAR - 0x0840) >> 1 : tbar;
+               if ((icwt >= 0) && (icwt < MAX_TBAR) && (icw_pcf[icwt] == 0x07))
+                  icw_pdf_reg[icwt] = EMPTY;        // PDF is now empty for next rx
+               CS2_wakeup();                        // Scanner may go on with the line
             }
             if (Efld == 0x50) {                     // Get INCWAR ?
                iobs[CAid]->Eregs_Inp[0x50] = iobs[CAid]->Eregs_Out[0x50];   // Load INCWAR as used by CA
@@ -2029,6 +2046,8 @@ while (reason == 0) {                          /* Loop until halted */
             Eregs_Inp[0x79]  = 0x0000;              // Reset all bits in reg 0x79
             Eregs_Inp[0x79] |= 0x0008;              // Fet storage installed
 // ***      Eregs_Inp[0x79] |= 0x0004;              // 0 = 3705, 1 = 3704
+            if (ca_type == 1)
+               Eregs_Inp[0x79] |= 0x0002;           // CA type 1 installed
             Eregs_Inp[0x79] |= 0x0001;              // CE IPL escape jumper NOT installed
             if (CL_C[3] == ON) Eregs_Inp[0x79] |= 0x0200;  // L5 C & Z flags
             if (CL_Z[3] == ON) Eregs_Inp[0x79] |= 0x0100;
@@ -2094,40 +2113,53 @@ while (reason == 0) {                          /* Loop until halted */
                   tbar = (abar - 0x0840) >> 1; // Get ICW table ptr from abar
                   //debug_reg = 0x63;                 // Very very very temp HJS
                }
-               if (Efld == 0x44) {             // ICW SCF & PDF
-                  if (Eregs_Out[0x44] & 0x8000) {
-                     icw_scf[tbar] &= 0x7f;         // Abort RESETR
-                  }
-                  if (Eregs_Out[0x44] & 0x4000) {
-                     icw_scf[tbar] &= 0xbf;    // Service Interlock RESET
-                  }
-                  if (Eregs_Out[0x44] & 0x2000) {
-                     icw_scf[tbar] &= 0xdf;    // Character overrrun/Underrun flag RESE
+               if ((Efld == 0x40) && (lvl == 2))
+                  l2_abar = Eregs_Out[0x40];   // Level 2 addresses another line
+               // In level 2 the ICW of the interrupting line is addressed,
+               // unless an OUT X'40' selected another one
+               icwt = (lvl == 2) ? (L2_ABAR - 0x0840) >> 1 : tbar;
+               if ((icwt >= 0) && (icwt < MAX_TBAR)) {   // Scanner line ?
+                  if (Efld == 0x44) {             // ICW SCF & PDF
+                     if (Eregs_Out[0x44] & 0x8000) {
+                        icw_scf[icwt] &= 0x7f;         // Abort RESETR
+                     }
+                     if (Eregs_Out[0x44] & 0x4000) {
+                        icw_scf[icwt] &= 0xbf;    // Service Interlock RESET
+                     }
+                     if (Eregs_Out[0x44] & 0x2000) {
+                        icw_scf[icwt] &= 0xdf;    // Character overrrun/Underrun flag RESE
+                     }
+                     if (Eregs_Out[0x44] & 0x1000) {
+                        icw_scf[icwt] &= 0xef;    // Modem Check RESET
+                     }
+                     if (Eregs_Out[0x44] & 0x0800) {
+                        icw_scf[icwt] &= 0xf7;    // Unknown flag RESET
+                     }
+                     if (Eregs_Out[0x44] & 0x0400) {
+                        icw_scf[icwt] &= 0xfb;    // Zero-insert remembrance flag RESET
+                      }
+                     //icw_scf[icwt] = (Eregs_Out[0x44] >> 8) & 0x4E;   // Only Serv Req, DCD & Pgm Flag
+                     icw_scf[icwt] |= (Eregs_Out[0x44] >> 8) & 0x03;   // Only Serv Req, DCD & Pgm Flag
+                     icw_pdf[icwt] =  Eregs_Out[0x44] & 0x00FF;
+                     if (icw_pcf[icwt] != 0x07)
+                        icw_pdf_reg[icwt] = FILLED;   // PDF is filled for tx
                   }
-                  if (Eregs_Out[0x44] & 0x1000) {
-                     icw_scf[tbar] &= 0xef;    // Modem Check RESET
+                  if (Efld == 0x45) {             // ICW LCD & PCF
+                     icw_lcd[icwt] = (Eregs_Out[0x45] >> 4) & 0x0F;
+                     icw_pcf_new[icwt] = Eregs_Out[0x45] & 0x0F;
+                     icw_pcf_mod[icwt] = 0x01;    // indicate pcf updated
+                     icw_active |= 1u << icwt;    // Line must be scanned
                   }
-                  if (Eregs_Out[0x44] & 0x0800) {
-                     icw_scf[tbar] &= 0xf7;    // Unknown flag RESET
+                  if ((Efld == 0x44) || (Efld == 0x45)) {
+                     cs2_kick = 1;                // Scanner may go on with the line
+                     pthread_cond_signal(&cs2_cond);
                   }
-                  if (Eregs_Out[0x44] & 0x0400) {
-                     icw_scf[tbar] &= 0xfb;    // Zero-insert remembrance flag RESET
-                   }
-                  //icw_scf[tbar] = (Eregs_Out[0x44] >> 8) & 0x4E;   // Only Serv Req, DCD & Pgm Flag
-                  icw_scf[tbar] |= (Eregs_Out[0x44] >> 8) & 0x03;   // Only Serv Req, DCD & Pgm Flag
-                  icw_pdf[tbar] =  Eregs_Out[0x44] & 0x00FF;
-                  if (icw_pcf[0] != 0x07)               // TEMP
-                     icw_pdf_reg = FILLED;     // PDF is filled for tx
+                                                  // ICW SDF or block mode PSA address
+                  if ((Efld == 0x46) && (cs2_type == 3)) line_smd_addr[icwt] = Eregs_Out[0x46] & AMASK;
+                  else if (Efld == 0x46) icw_sdf[icwt] = (Eregs_Out[0x46] >> 2) & 0xFF;
+                                                  // ICW 34 - 45
+                  if (Efld == 0x47) icw_Rflags[icwt] = (Eregs_Out[0x47] << 4) & 0x0070;
                }
-               if (Efld == 0x45) {             // ICW LCD & PCF
-                  icw_lcd[tbar] = (Eregs_Out[0x45] >> 4) & 0x0F;
-                  icw_pcf_new =  Eregs_Out[0x45] & 0x0F;
-                  icw_pcf_mod = 0x01;          // indicate pcf updated
-               }
-                                               // ICW SDF
-               if (Efld == 0x46) icw_sdf[tbar]    = (Eregs_Out[0x46] >> 2) & 0xFF;
-                                               // ICW 34 - 45
-               if (Efld == 0x47) icw_Rflags[tbar] = (Eregs_Out[0x47] << 4) & 0x0070;
                // Release ICW update lock.
                pthread_mutex_unlock(&icw_lock);
             }
@@ -2147,6 +2179,7 @@ while (reason == 0) {                          /* Loop until halted */
                   iobs[CAid]->Eregs_Inp[0x55] |= 0x2000;      // Set INCWAR valid in IN
                if (iobs[CAid]->Eregs_Out[0x55] & 0x1000)
                   iobs[CAid]->Eregs_Inp[0x55] |= 0x1000;      // Set OUTCWAR valid in IN
+               ca_wakeup(CAid);                               // ATTN request may be set
                }
             if (Efld == 0x56) {                               // Reset Channel Adapter Control Register
                if (iobs[CAid]->Eregs_Out[0x56] & 0x2000) {
@@ -2229,6 +2262,8 @@ while (reason == 0) {                          /* Loop until halted */
                //   iobs[CAid]->Eregs_Inp[0x55] &= ~0x8000; // Diagnostic wrap mode off
                //   iobs[CAid]->Eregs_Inp[0x55] |= 0x0100;  // CA active
                //}
+               ca_wakeup(0);                               // PCI request or diagnostic mode
+               ca_wakeup(1);                               //   may have changed
             }
 
             //********************************************************
@@ -2260,6 +2295,8 @@ while (reason == 0) {                          /* Loop until halted */
                else
                   Eregs_Inp[0x62] &= ~0x0800;  // Reset NSC Final status
             }
+            if (Efld == 0x67)
+               ca_wakeup(0);                   // ATTN request may be set
 
             //********************************************************
             //          CCU updates
@@ -2414,6 +2451,9 @@ while (reason == 0) {                          /* Loop until halted */
       if (lvl == 5) {                          /* An EXIT while in L5 triggers SVC L4 */
          svc_req_L4 = ON;
       }
+      if (lvl == 2) {                          /* Scanner may issue the next L2 int */
+         CS2_wakeup();
+      }
       if (debug_reg & 0x02)
          fprintf(trace, "\n>>> Leaving lvl=%d \n", lvl);
    }
@@ -2579,7 +2619,7 @@ t_stat cpu_boot (int32 unitno, DEVICE *dptr) {    /* LOAD pressed */
    "\xD6\x58\xA8\xA9\xA8\x00\xA8\x00\xFF\x2F\x8F\xF8\x04\x00\x04\x04"
    };
 
-   if (Eregs_Inp[0x79] & 0x0002) {
+   if ((Eregs_Inp[0x79] & 0x0002) || (ca_type == 1)) {
       /* If CA Type 1 or 4 Load miniROS at location 0x0000 */
       printf("CPU: Loading MiniROS...\n\r");
       for (addr = 0x0000; addr < 0x0200; addr++) {
@@ -97,6 +97,78 @@ struct opdef {
 
 #define MAXHOSTS 2
 #define MAXCHAN  2                                      /* Max channels */
+#define MAX_TBAR 32                                     /* CS2 ICW table size (lines 0x20-0x3F) */
+
+/* Channel adapter data buffers, pooled in size classes of 1K, 4K, 16K and 64K */
+#define CA_NBCLASS 4                                    /* Buffer size classes */
+
+struct CABUF {
+   struct CABUF *next;                       // Next buffer in chain or free list
+   uint32_t size;                            // Buffer capacity
+   uint32_t len;                             // Data length
+   uint8_t  cls;                             // Size class
+   uint8_t  data[];                          // Data area
+};
+
+/* Channel adapter statistics */
+#define CA_NCMD   8                                     /* CCW classes counted */
+#define CA_NHIST 16                                     /* log2 usec latency buckets */
+
+struct CASTATS {
+   uint64_t ccw_cnt[CA_NCMD];                // CCWs executed
+   uint64_t ccw_bytes[CA_NCMD];              // Data bytes transferred
+   uint64_t ccw_usec[CA_NCMD];               // Total CCW execution time
+   uint64_t ccw_max[CA_NCMD];                // Longest CCW execution time
+   uint64_t ccw_hist[CA_NCMD][CA_NHIST];     // CCW execution time histogram
+   uint64_t chain_cnt;                       // Data chains completed
+   uint64_t chain_segs;                      // Data chained CCWs received
+   uint32_t chain_depth;                     // CCWs in current data chain
+   uint32_t chain_max;                       // Deepest data chain seen
+   uint64_t l3_cnt;                          // Waits for NCP L3 acknowledgement
+   uint64_t l3_usec;                         // Time waiting for NCP L3 acknowledgement
+   uint64_t sock_cnt;                        // Socket transfers
+   uint64_t sock_usec;                       // Time blocked in socket I/O
+};
+
+/* Channel adapter host connection states */
+#define CA_LISTEN  0                                    /* Waiting for BUS connect */
+#define CA_TAG     1                                    /* Waiting for TAG connect */
+#define CA_DEVNUM  2                                    /* Receiving device number */
+#define CA_CCW     3                                    /* Receiving CCW */
+#define CA_DATA    4                                    /* Receiving CCW write data */
+#define CA_EXEC    5                                    /* CCW handed to CA thread */
+
+/* Scanner line frame queues. Each ring has one producer and one
+   consumer: tx is filled by the scanner and emptied by the line driver
+   (SDLC/BSC thread), rx the other way around. A frame is owned by the
+   producer until it is put and by the consumer until it is got.     */
+#define LFRM_SIZE  16384                                /* Max frame (BLU) length */
+#define LFRM_RING  4                                    /* Frames per ring, power of 2 */
+#define LDRV_SDLC  1                                    /* Frame is for the SDLC driver */
+#define LDRV_BSC   2                                    /* Frame is for the BSC driver */
+#define LFRM_NFRM  16                                   /* SDLC frames per BLU or response */
+
+struct LFRAME {
+   int32_t  len;                             // Frame length, -1 line not connected
+   uint32_t ptr;                             // Next byte for the consumer
+   uint8_t  drv;                             // Line driver of a tx frame
+   uint16_t nfrm;                            // SDLC frames in data
+   uint16_t cfrm;                            // SDLC frame the consumer is in
+   uint32_t fend[LFRM_NFRM];                 // End of each SDLC frame, past its EFlag
+   uint8_t  data[LFRM_SIZE];                 // DLC header + TH + RH + RU + DLC trailer
+};
+
+struct LRING {
+   uint32_t head;                            // Frames put, written by producer only
+   uint32_t tail;                            // Frames got, written by consumer only
+   int      open;                            // Producer is filling frm[head]
+   struct LFRAME frm[LFRM_RING];
+};
+
+struct LINEQ {
+   struct LRING tx;                          // Scanner ---> line driver
+   struct LRING rx;                          // Line driver ---> scanner
+};
 
 /* IBM 3705 I/O structure   */
 struct IO3705 {
@@ -113,12 +185,22 @@ struct IO3705 {
    int abswhist;             // A/B switch history
    int diag;                 // Diagnostic status
    uint16_t devnum;
-   uint8_t buffer[1024];     // Input buffer of 1K
+   uint8_t buffer[1024];     // CCW and sense buffer of 1K
    uint32_t bufferl;         // Received data length
-   uint8_t  chainbuf[4096];  // Data chaining buffer of 4K
-   uint32_t chainbl;         // Data chain buffer length
+   struct CABUF *chain;      // Data chain: first pooled buffer
+   struct CABUF *chaint;     // Data chain: last pooled buffer
+   uint32_t chainbl;         // Data chain length
    uint8_t carnstat;         // CA return status
    uint8_t IPL_exception;    // IPL exception ON or OFF
    struct sockaddr_in address[2];
    pthread_t CA_tid;
+   struct CASTATS stats;     // Adapter statistics
+   int ca_state;             // Host connection state
+   uint32_t inlen;           // Bytes of devnum, CCW or data received so far
+   struct CABUF *inbuf;      // Write data of the CCW being received
+   int busy;                 // CA thread is using the BUS/TAG sockets
+   int closing;              // Connection close pending until not busy
+   int kick;                 // CCU has work for the CA thread
+   pthread_mutex_t ca_lock;  // Protects connection state
+   pthread_cond_t ca_cond;   // Wakes the CA thread
 };
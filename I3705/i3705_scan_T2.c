@@ -30,8 +30,38 @@
       - a ICW input register and is implemented in Ereg_Out[0x44/45/47]
    2) The 2 bits in SDF for Business Clock Osc selection bits are
       not implemented.  Reason: for programming simplicity.
-   3) This code is pre-positined for multiple lines, but correctly only
-      suitable for only ONE line.
+   3) Each scan cycle services all active lines (ICW 0x20-0x3F). A line
+      is active from the moment NCP sets its PCF until it is back in
+      PCF 0 with no L2 interrupt pending. Only one line at a time can
+      have a L2 interrupt outstanding; its ABAR is presented to NCP in
+      CMBARIN (0x40) while in level 2.
+   4) SET CS2 TYPE=3 selects block mode, modelled on the type 3 scanner.
+      Instead of a L2 interrupt per character the scanner moves whole
+      BLUs between NCP buffer chains and the line, using a parameter/
+      status area (PSA, see i3705_scanner.h) per line:
+      - OUT X'46' loads the PSA address of the line (instead of SDF).
+      - OUT X'45' with a non-zero PCF starts the command in PSA TTC:
+        TX: transmit the buffer chain at buf_T_W2 and receive the
+            response into the buffer chain at buf_R_W4 (count byte
+            cnt_R_W4 = data bytes per receive buffer).
+        RX: receive pending data into the buffer chain at buf_R_W4.
+      - On completion the scanner stores CCMD, SCF (0x40 done, 0x20
+        receive chain overrun, 0x10 line not connected), the count and
+        address of the last receive buffer in res_cnt/buf_last and the
+        total received count in RA1/RC1, clears TTC, sets PCF 0 and
+        issues one L2 interrupt.
+   5) The scanner is event paced. It sleeps until the CCU signals that NCP
+      has serviced a line (IN/OUT X'44', OUT X'45', EXIT from level 2) or
+      a line is due, and polls at most every CS2_POLL usec for line input.
+      SET CS2 SPEED=bps or SET CS2 SPEED=line:bps (line 20-3F hex) paces
+      each character at the emulated line speed; 0 or UNLIMITED moves
+      characters as fast as NCP services them.
+   6) BLUs (SDLC) and texts (BSC) are passed to and from the line drivers
+      through a pair of single producer/single consumer frame rings per
+      line (lineq, see i3705_defs.h). The scanner queues a frame at
+      transmit turnaround and rings the SDLC or BSC thread, which does
+      the socket I/O and queues the response; neither side takes the
+      ICW lock for it.
 
    *** Input to CS2 (CCU output) Eregs ***
    Label      Ereg         Function
@@ -112,8 +142,6 @@
 #include <sys/types.h>
 #include <sys/syscall.h>
 
-#define MAX_TBAR   3                   /* ICW table size (4 line sets) */
-
 extern int32 debug_reg;
 extern int32 Eregs_Inp[];
 extern int32 Eregs_Out[];
@@ -121,16 +149,14 @@ extern int8  svc_req_L2;               /* SVC L2 request flag */
 extern FILE *trace;
 extern int32 lvl;
 extern int32 cc;
+extern uint8 M[];
 
 extern int Ireg_bit(int reg, int bit_mask);
 extern void wait();
 
-int8 icw_pdf_reg = EMPTY;              /* Status ICW PDF reg: NCP FILLED pdf for Tx   */
+int8 icw_pdf_reg[MAX_TBAR];            /* Status ICW PDF reg: NCP FILLED pdf for Tx   */
                                        /*                     NCP EMPTY pdf during Rx */
 
-
-int8 Eflg_rvcd;                        /* Eflag received */
-
 /* ICW Local Store Registers */
 int     abar;
 uint8_t icw_scf[MAX_TBAR];             /* ICW[ 0- 7] SCF - Secondary Control Field  */
@@ -143,51 +169,323 @@ uint16_t icw_Rflags[MAX_TBAR];         /* ICW[34-47] flags
 uint8_t icw_pcf_prev[MAX_TBAR];        /* Previous icw_pcf                          */
 uint8_t icw_lne_stat[MAX_TBAR];        /* Line state: RESET, TX, RX                 */
 
-uint8_t icw_pcf_new = 0x0;
-uint8_t icw_pcf_mod = 0x00;
-int8 CS2_req_L2_int = OFF;
+uint8_t icw_pcf_new[MAX_TBAR];         /* Next PCF, set by NCP or scanner           */
+uint8_t icw_pcf_mod[MAX_TBAR];         /* PCF modified by NCP                       */
+int8 CS2_req_L2_int[MAX_TBAR];         /* L2 interrupt pending for line             */
+uint32_t icw_active = 0;               /* Active lines, one bit per ICW             */
+int     CS2_L2_abar = 0x0840;          /* ABAR of line with L2 interrupt            */
 pthread_mutex_t icw_lock;              // ICW lock (0 - 45)
-extern pthread_mutex_t r77_lock;       // I/O reg x'77' lock
 
 // Trace variables
 uint16_t Sdbg_reg = 0x00;              // Bit flags for debug/trace
 uint16_t Sdbg_flag = OFF;              // 1 when Strace.log open
 FILE  *S_trace;                        // Scanner trace file fd
 
-// This table contains the SMD area addresses of each scanner line.
-int8 line_smd_addr[48];
-
-// Host ---> PU request buffer
-uint8 BLU_req_buf[16384];              // DLC header + TH + RH + RU + DLC trailer
-int   BLU_req_ptr = 0;                 // Offset pointer to BLU
-int   BLU_req_len = 0;                 // Length of BLU request
-int   BLU_req_stat = 0;                // State of BLU TX buffer
-// PU ---> Host response buffer
-uint8 BLU_rsp_buf[16384];              // DLC header + TH + RH + RU + DLC trailer
-int   BLU_rsp_ptr = 0;                 // Offset pointer to BLU
-int   BLU_rsp_len = 0;                 // Length of BLU response
-int   BLU_rsp_stat = 0;                // State of BLU Rx buffer
-int   PIU_rsp_ptr = 0;                 // Offset pointer to PIU
-int   PIU_rsp_len = 0;                 // Length of PIU response
-// Saved RH from 1st or only segment
-uint8 saved_FD2_RH_0;                  // Saved RH for building a response later
-uint8 saved_FD2_RH_1;                  // after a segmented PIU
-
-
-void prt_BLU_buf(int reqorrsp);
-int  proc_BLU(char *BLU_req_buf, int BLU_req_len);
-void proc_BSCtdata(char transmitChar, uint8_t state);
-int  proc_BSCrdata(char *receivedChar);
+// Scanner pacing
+#define CS2_POLL   1000                // Max usec between scans of active lines
+uint32_t cs2_speed[MAX_TBAR];          // Emulated line speed in bps, 0 is unlimited
+uint64_t cs2_due[MAX_TBAR];            // Line may not move next char before (nsec)
+int      cs2_kick = 0;                 // CCU has serviced a line since last scan
+pthread_cond_t cs2_cond = PTHREAD_COND_INITIALIZER;   // Wakes the scanner thread
+
+// This table contains the SMD area (PSA) addresses of each scanner line.
+uint32_t line_smd_addr[MAX_TBAR];
+
+int cs2_type = 2;                      // Scanner type 2 or 3 (block mode), SET CS2 TYPE=n
+
+// Host <---> PU frame queues per line, shared with the line drivers
+struct LINEQ lineq[MAX_TBAR];
+int8  cs3_wait[MAX_TBAR];              // Block mode: TX sent, waiting for response
+uint8 cs3_buf[LFRM_SIZE];              // Block mode: BSC transmit chain data
+
+
+void prt_BLU_buf(uint8 *buf, int len, int reqorrsp);
+void proc_BSCtdata(int line, char transmitChar, uint8_t state);
+int  proc_BSCrdata(int line, char *receivedChar);
+void SDLC_kick(void);
+void BSC_kick(void);
 void Put_ICW(int i);
 void Get_ICW(int i);
+t_stat cs2_set_type(UNIT *uptr, int32 val, char *cptr, void *desc);
+t_stat cs2_show_type(FILE *st, UNIT *uptr, int32 val, void *desc);
+t_stat cs2_set_speed(UNIT *uptr, int32 val, char *cptr, void *desc);
+t_stat cs2_show_speed(FILE *st, UNIT *uptr, int32 val, void *desc);
+t_stat cs2_set_sdlc(UNIT *uptr, int32 val, char *cptr, void *desc);
+t_stat cs2_show_sdlc(FILE *st, UNIT *uptr, int32 val, void *desc);
+t_stat cs2_set_spoof(UNIT *uptr, int32 val, char *cptr, void *desc);
+t_stat cs2_show_spoof(FILE *st, UNIT *uptr, int32 val, void *desc);
+
+// SCP device giving access to the scanner options
+UNIT cs2_unit;                         // No unit data: all fields zero
+
+MTAB cs2_mod[] = {
+   { .mask = MTAB_XTD | MTAB_VDV, .pstring = "TYPE", .mstring = "TYPE",
+     .valid = &cs2_set_type, .disp = &cs2_show_type },
+   { .mask = MTAB_XTD | MTAB_VDV, .pstring = "SPEED", .mstring = "SPEED",
+     .valid = &cs2_set_speed, .disp = &cs2_show_speed },
+   { .mask = MTAB_XTD | MTAB_VDV | MTAB_NMO, .pstring = "SDLC", .mstring = "SDLC",
+     .valid = &cs2_set_sdlc, .disp = &cs2_show_sdlc },
+   { .mask = MTAB_XTD | MTAB_VDV, .pstring = "SPOOF", .mstring = "SPOOF",
+     .valid = &cs2_set_spoof, .disp = &cs2_show_spoof },
+   { 0 }
+};
+
+DEVICE cs2_dev = {
+   .name = "CS2", .units = &cs2_unit, .modifiers = cs2_mod,
+   .numunits = 1, .aradix = 16, .awidth = 16, .aincr = 1, .dradix = 16, .dwidth = 8
+};
+
+// *******************************************************************
+// Present a L2 interrupt for line t to NCP. Only one line at a time
+// can interrupt; the request stays pending while level 2 is busy.
+// Called with the ICW lock held.
+// *******************************************************************
+static int CS2_L2_issue(int t) {
+   if ((svc_req_L2 == ON) || (lvl == 2))
+      return 0;                        // Level 2 busy, retry next scan
+
+   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))  // Trace scanner activities ?
+      fprintf(S_trace, "\n>>> CS2[%1X]: SVCL2 interrupt issued for line %02X \n\r",
+              icw_pcf[t], 0x20 + t);
+
+   CS2_L2_abar = 0x0840 + (t << 1);    // Line address for CMBARIN
+   //Eregs_Inp[0x77] |= 0x4000;        // Indicate L2 scanner interrupt
+   svc_req_L2 = ON;                    // Issue a level 2 interrrupt
+   CS2_req_L2_int[t] = OFF;         // Reset int req flag
+   return 1;
+}
+
+// *******************************************************************
+// Wake the scanner: called by the CCU when NCP has serviced a line.
+// *******************************************************************
+void CS2_wakeup(void) {
+   pthread_mutex_lock(&icw_lock);
+   cs2_kick = 1;
+   pthread_cond_signal(&cs2_cond);
+   pthread_mutex_unlock(&icw_lock);
+}
+
+static uint64_t CS2_now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Time to move n characters on line t at its emulated speed (nsec).
+static uint64_t CS2_char_time(int t, int n) {
+   if (cs2_speed[t] == 0)
+      return 0;
+   return (uint64_t)n * 8 * 1000000000 / cs2_speed[t];
+}
+
+// *******************************************************************
+// Line frame queues. The producer fills the frame returned by lq_slot
+// and hands it over with lq_put; the consumer takes the oldest frame
+// with lq_peek and releases it with lq_get. Only head and tail are
+// shared, so neither side takes a lock.
+// *******************************************************************
+struct LFRAME *lq_slot(struct LRING *r) {
+   struct LFRAME *f;
+
+   if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LFRM_RING)
+      return NULL;                     // Ring full
+   f = &r->frm[r->head & (LFRM_RING - 1)];
+   if (r->open == 0) {                 // Start a new frame
+      f->len = 0;
+      f->ptr = 0;
+      f->nfrm = 0;
+      f->cfrm = 0;
+      r->open = 1;
+   }
+   return f;
+}
+
+void lq_put(struct LRING *r) {
+   r->open = 0;
+   __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+struct LFRAME *lq_peek(struct LRING *r) {
+   if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail)
+      return NULL;                     // Ring empty
+   return &r->frm[r->tail & (LFRM_RING - 1)];
+}
+
+void lq_get(struct LRING *r) {
+   __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Record where the SDLC frames of a BLU from NCP end. NCP writes the
+// trailer 470F7E itself, so it only ends a frame when the BLU ends
+// there or the next frame starts with its BFlag (after an optional
+// modem clocking byte); the same bytes in an I-field do not.
+void lq_frames(struct LFRAME *f) {
+   uint32_t i, n;
+
+   f->nfrm = 0;
+   for (i = 3; (i < f->len) && (f->nfrm < LFRM_NFRM); i++) {
+      if ((f->data[i - 3] != 0x47) || (f->data[i - 2] != 0x0F) || (f->data[i - 1] != 0x7E))
+         continue;
+      n = ((f->data[i] == 0x00) || (f->data[i] == 0xAA)) ? i + 1 : i;
+      if ((n < f->len) && (f->data[n] != 0x7E))
+         continue;                     // Trailer bytes inside an I-field
+      f->fend[f->nfrm++] = i;
+   }
+   if ((f->len >= 3) && (f->nfrm < LFRM_NFRM) &&   // Trailer at the end of the BLU
+       (f->data[f->len - 3] == 0x47) && (f->data[f->len - 2] == 0x0F) && (f->data[f->len - 1] == 0x7E))
+      f->fend[f->nfrm++] = f->len;
+}
+
+// Release the oldest received frame of line t; its driver may refill it.
+static void CS2_rx_done(int t) {
+   lq_get(&lineq[t].rx);
+   if (icw_lcd[t] == 0xC) BSC_kick();
+   else SDLC_kick();
+}
+
+// *******************************************************************
+// Block mode helpers. Addresses in the PSA and NCP buffer headers are
+// 18 bit, in bytes +1, +2 and +3 of a fullword (as CA control words).
+// *******************************************************************
+static uint32_t CS3_addr(uint32_t a) {
+   return ((M[a + 1] & 0x03) << 16) | (M[a + 2] << 8) | M[a + 3];
+}
+
+// Gather the data of a NCP buffer chain into buf.
+static int CS3_get_chain(uint32_t bh, uint8 *buf, int max) {
+   int len = 0, n, i;
+
+   for (i = 0; (bh != 0) && (i < MAXMEMSIZE / BH_len); i++) {
+      if (bh + BH_len + 256 > MAXMEMSIZE)
+         break;                                   // Chain points outside storage
+      n = M[bh + BH_dat_cnt];
+      if (len + n > max) n = max - len;
+      memcpy(buf + len, &M[bh + M[bh + BH_dat_off]], n);
+      len += n;
+      bh = CS3_addr(bh + BH_buf_chn);             // Next buffer in chain
+   }
+   return len;
+}
+
+// Scatter buf over the receive buffer chain of the PSA.
+// Returns the SCF overrun flag if the chain was too short.
+static int CS3_put_chain(uint32_t psa, uint8 *buf, int len) {
+   uint32_t bh = CS3_addr(psa + buf_R_W4), last = 0;
+   int bsize = M[psa + cnt_R_W4];               // Data bytes per buffer
+   int ptr = 0, n = 0, i;
+
+   if (bsize == 0) bsize = 256 - BH_len;
+   for (i = 0; (ptr < len) && (bh != 0) && (i < MAXMEMSIZE / BH_len); i++) {
+      if (bh + BH_len + bsize > MAXMEMSIZE)
+         break;                                   // Chain points outside storage
+      n = (len - ptr > bsize) ? bsize : len - ptr;
+      memcpy(&M[bh + BH_len], buf + ptr, n);
+      M[bh + BH_dat_off] = BH_len;
+      M[bh + BH_dat_cnt] = n;
+      ptr += n;
+      last = bh;
+      bh = CS3_addr(bh + BH_buf_chn);
+   }
+   M[psa + res_cnt]      = n;                   // Count in last buffer used
+   M[psa + buf_last + 1] = (last >> 16) & 0x03;
+   M[psa + buf_last + 2] = (last >> 8) & 0xFF;
+   M[psa + buf_last + 3] = last & 0xFF;
+   M[psa + RA1] = (ptr >> 8) & 0xFF;            // Total received count
+   M[psa + RC1] = ptr & 0xFF;
+   return (ptr < len) ? 0x20 : 0x00;
+}
+
+// *******************************************************************
+// Block mode service of line t: execute the PSA command as a whole
+// and issue one L2 interrupt when done. Called with the ICW lock held.
+// Returns the number of characters moved on the line.
+// *******************************************************************
+static int CS3_block(int t) {
+   uint32_t psa = line_smd_addr[t];
+   struct LFRAME *f, *r = NULL;
+   int cmd, i, len = 0;
+   int scf = 0x40;                              // Command complete
+
+   if (icw_pcf[t] == 0x0)                       // No command started
+      return 0;
+   if ((psa == 0) || (psa + 32 > MAXMEMSIZE)) { // No PSA for this line
+      icw_pcf_new[t] = 0x0;
+      return 0;
+   }
+   cmd = M[psa + TTC];
+   if ((cmd != TX) && (cmd != RX)) {            // No or unknown command
+      icw_pcf_new[t] = 0x0;
+      return 0;
+   }
+   if ((cmd == TX) && (cs3_wait[t] == OFF)) {   // Transmit not started yet ?
+      if ((f = lq_slot(&lineq[t].tx)) == NULL)
+         return 0;                              // Driver still busy, try again next scan
+      icw_lne_stat[t] = TX;
+      if ((icw_lcd[t] == 0x8) || (icw_lcd[t] == 0x9)) {   // SDLC
+         f->len = len = CS3_get_chain(CS3_addr(psa + buf_T_W2), f->data, LFRM_SIZE);
+         prt_BLU_buf(f->data, len, REQ);        // Trace it ?
+         lq_frames(f);
+         f->drv = LDRV_SDLC;
+         lq_put(&lineq[t].tx);                  // Hand the BLU to the SDLC driver
+         SDLC_kick();
+         cs3_wait[t] = ON;
+      }
+      if (icw_lcd[t] == 0xC) {                  // BSC EBCDIC
+         len = CS3_get_chain(CS3_addr(psa + buf_T_W2), cs3_buf, LFRM_SIZE);
+         prt_BLU_buf(cs3_buf, len, REQ);        // Trace it ?
+         proc_BSCtdata(t, 0xAA, 0x8);           // Start of transmission
+         for (i = 0; i < len; i++)
+            proc_BSCtdata(t, cs3_buf[i], 0x9);
+         proc_BSCtdata(t, 0x00, 0xC);           // Send it to the BSC driver
+         cs3_wait[t] = ON;
+      }
+      if (cs3_wait[t] == ON)                    // Response comes on a next scan
+         return len;
+   } else {
+      if ((r = lq_peek(&lineq[t].rx)) == NULL)  // Nothing received yet...
+         return 0;                              // ...try again next scan
+      if ((cmd == RX) && (r->len <= 0)) {       // No data in frame
+         CS2_rx_done(t);
+         return 0;
+      }
+      cs3_wait[t] = OFF;
+      if (r->len < 0)                           // Line not connected
+         scf |= 0x10;
+      else
+         len = r->len - r->ptr;
+   }
+   if (r != NULL) {
+      prt_BLU_buf(r->data + r->ptr, len, RSP);  // Trace it ?
+      scf |= CS3_put_chain(psa, r->data + r->ptr, len);
+      CS2_rx_done(t);
+   } else
+      len = 0;                                  // No line driver for this LCD
+   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))  // Trace scanner activities ?
+      fprintf(S_trace, "\n>>> CS3[%02X]: Block command %d done, received %d, SCF %02X \n\r",
+              0x20 + t, cmd, len, scf);
+   M[psa + CCMD] = cmd;                         // Ending status
+   M[psa + SCF]  = scf;
+   M[psa + TTC]  = 0x00;                        // Command done
+   icw_lne_stat[t] = RX;
+   icw_pcf_new[t] = 0x0;                        // Line back to idle...
+   CS2_req_L2_int[t] = ON;                      // ...and one L2 int for the block
+   return len;
+}
 
 /* Function to be run as a thread always must have the same signature:
    it has one void* parameter and returns void                        */
 
 void *CS2_thread(void *arg) {
    int t;                              // ICW table index pointer
-   int j = 0;                          // Tx/Rx buffer index pointer
+   struct LFRAME *f, *r;               // Tx frame being filled, Rx frame being read
    int i, c;
+   int8 Eflg_rvcd;                     // Eflag received
+   uint32_t active;                    // Lines to service this scan cycle
+   int progress;                       // A line changed state this scan cycle
+   int moved;                          // Characters moved by the line
+   uint64_t now, due;                  // Pacing times (nsec)
+   struct timespec ts;
+   pthread_condattr_t cattr;
    register char *s;
    unsigned char receivedChar, transmitChar;
    int ret;
@@ -207,25 +505,50 @@ void *CS2_thread(void *arg) {
       Sdbg_flag = ON;
    }
    Sdbg_reg = 0x00;
+   for (t = 0; t < MAX_TBAR; t++)
+      icw_scf[t] |= 0x08;                  // Turn DCD always on.
+   pthread_condattr_init(&cattr);          // Pacing uses the monotonic clock
+   pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+   pthread_cond_init(&cs2_cond, &cattr);
+
    while(1) {
-//    for (i = 0; i < MAX_TBAR; i++) {     // Pending multiple line support !!!
-         t = 0;                            // Temp for ONE SDLC line set.
+      pthread_mutex_lock(&icw_lock);
+      active = icw_active;                 // Snapshot of lines set up by NCP
+      pthread_mutex_unlock(&icw_lock);
+      progress = 0;
+      now = CS2_now();
+      due = now + CS2_POLL * 1000;         // Next scan at the latest
+
+      for (t = 0; t < MAX_TBAR; t++) {
+         if ((active & (1u << t)) == 0)    // Line not active ?
+            continue;
+         if (cs2_due[t] > now) {           // Previous char still on the line ?
+            if (cs2_due[t] < due) due = cs2_due[t];
+            continue;
+         }
          icw_scf[t] |= 0x08;               // Turn DCD always on.
 
          // Obtain ICW lock to avoid sync issues with NCP coding
 
          pthread_mutex_lock(&icw_lock);
-         if (icw_pcf[t] != icw_pcf_new) {  // pcf changed by NCP ?
+         if ((CS2_req_L2_int[t]) && (CS2_L2_issue(t) == 0)) {
+            pthread_mutex_unlock(&icw_lock);   // Previous L2 int still pending...
+            continue;                          // ...keep line as it is
+         }
+         moved = 0;
+         if (icw_pcf[t] != icw_pcf_new[t]) { // pcf changed by NCP ?
             if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))   // Trace scanner activities ?
                fprintf(S_trace, "\n>>> CS2[%1X]: NCP changed PCF to %1X \n\r",
-                       icw_pcf[t], icw_pcf_new);
-            if (icw_pcf_new == 0x0)        // NCP changed PCF = 0 ?
+                       icw_pcf[t], icw_pcf_new[t]);
+            if (icw_pcf_new[t] == 0x0)     // NCP changed PCF = 0 ?
                icw_lne_stat[t] = RESET;    // Line state = RESET
             icw_pcf_prev[t] = icw_pcf[t];  // Save current pcf and
-            icw_pcf[t] = icw_pcf_new;      // set new current pcf
+            icw_pcf[t] = icw_pcf_new[t];   // set new current pcf
          }
 
-         switch (icw_pcf[t]) {
+         if (cs2_type == 3)                // Block mode ?
+            moved = CS3_block(t);
+         else switch (icw_pcf[t]) {
             case 0x0:                      // NO-OP
                if (icw_pcf_prev[t] != icw_pcf[t]) {
                   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))    // Trace scanner activities ?
@@ -239,8 +562,8 @@ void *CS2_thread(void *arg) {
                   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))  // Trace scanner activities ?
                      fprintf(S_trace, "\n>>> CS2[%1X]: PCF = 1 entered, next PCF will be 0 \n\r", icw_pcf[t]);
                   icw_scf[t] |= 0x40;      // Set norm char serv flag
-                  icw_pcf_new = 0x0;       // Goto PCF = 0...
-                  CS2_req_L2_int = ON;     // ...and issue a L2 int
+                  icw_pcf_new[t] = 0x0;    // Goto PCF = 0...
+                  CS2_req_L2_int[t] = ON;  // ...and issue a L2 int
                }
                break;
 
@@ -249,8 +572,8 @@ void *CS2_thread(void *arg) {
                   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))   // Trace scanner activities ?
                      fprintf(S_trace, "\n>>> CS2[%1X]: PCF = 2 entered, next PCF will be set by NCP \n\r", icw_pcf[t]);
                   icw_scf[t] |= 0x40;      // Set norm char serv flag
-                  icw_pcf_new = 0x0;       // Goto PCF = 4... (Via PCF = 0)
-                  CS2_req_L2_int = ON;     // ...and issue a L2 int
+                  icw_pcf_new[t] = 0x0;    // Goto PCF = 4... (Via PCF = 0)
+                  CS2_req_L2_int[t] = ON;  // ...and issue a L2 int
                }
                break;
 
@@ -259,8 +582,8 @@ void *CS2_thread(void *arg) {
                   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))  // Trace scanner activities ?
                      fprintf(S_trace, "\n>>> CS2[%1X]: PCF = 3 entered, next PCF will be 0 \n\r", icw_pcf[t]);
                   icw_scf[t] |= 0x40;      // Set norm char serv flag
-                  icw_pcf_new = 0x0;       // Goto PCF = 0...
-                  CS2_req_L2_int = ON;     // ...and issue a L2 int
+                  icw_pcf_new[t] = 0x0;    // Goto PCF = 0...
+                  CS2_req_L2_int[t] = ON;  // ...and issue a L2 int
                }
                break;
 
@@ -269,16 +592,15 @@ void *CS2_thread(void *arg) {
                if (icw_pcf_prev[t] != icw_pcf[t]) {  // First entry ?
                   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {  // Trace scanner activities ?
                      fprintf(S_trace, "\n>>> CS2[%1X]: PCF = 5 entered, next PCF will be 6 or 7\n\r", icw_pcf[t]);
-                     fprintf(S_trace, "\n<<< CS2[%1X]: Receiving PDF = *** %02X ***, j = %d \n\r", icw_pcf[t], icw_pdf[t], j-1);
+                     fprintf(S_trace, "\n<<< CS2[%1X]: Receiving PDF = *** %02X *** \n\r", icw_pcf[t], icw_pdf[t]);
                   }
                }
-               j = 0;                          // Reset buffer pointer
                if (icw_lne_stat[t] == RESET)   // Line is silent. Wait for NCP time out.
                   break;
                if (icw_lne_stat[t] == TX)      // Line is silent. Wait for NCP action.
                   break;
                if (icw_lcd[t] == 0xC) {        // BSC EBCDIC
-                  ret = proc_BSCrdata(&receivedChar);
+                  ret = proc_BSCrdata(t, &receivedChar);
                   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))
                      fprintf (trace, "Read ret=%d, ch=%02X\n", ret, receivedChar);
                   if (ret != 1) break;
@@ -286,20 +608,28 @@ void *CS2_thread(void *arg) {
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))
                         fprintf(S_trace, "Received SYN! - goto state 7\n");
                      icw_pdf[t] = receivedChar;
-                     icw_pcf_new  = 0x7;       // Goto PCF = 7
+                     icw_pcf_new[t]  = 0x7;    // Goto PCF = 7
                      icw_sdf[t] |= 0x04;       // Set SYNC flag
                   }  // End if receivedChar
                }  // end BSC
 
                if ((icw_lcd[t] == 0x8) || (icw_lcd[t] == 0x9)) {   // SDLC
                   icw_scf[t] &= 0xFB;          // Reset 7E detected flag
+                  r = lq_peek(&lineq[t].rx);
+                  if ((r != NULL) && (r->len <= 0)) {  // No response or no PU ?
+                     CS2_rx_done(t);           // Drop it
+                     r = NULL;
+                  }
 
                   // Line state is receiving, wait for BFlag...
-                  if ((BLU_rsp_stat == FILLED) && (BLU_rsp_buf[j] == 0x7E)) {       // x'7E' Bflag received ?
+                  if ((r != NULL) && (r->data[0] == 0x7E)) {    // x'7E' Bflag received ?
+                     r->ptr = 0;               // Start of BLU
+                     r->cfrm = 0;
+                     prt_BLU_buf(r->data, r->len, RSP);   // Trace it ?
                      icw_scf[t]  |= 0x04;      // Set flag detected. (NO Serv bit)
                      icw_lcd[t]   = 0x9;       // LCD = 9 (SDLC 8-bit)
-                     icw_pcf_new  = 0x6;       // Goto PCF = 6...
-                     CS2_req_L2_int = ON;      // ...and issue a L2 int
+                     icw_pcf_new[t]  = 0x6;    // Goto PCF = 6...
+                     CS2_req_L2_int[t] = ON;   // ...and issue a L2 int
                   }
                }  // end SDLC
                break;
@@ -311,18 +641,21 @@ void *CS2_thread(void *arg) {
                   break;                       // Loop till inactive...
                }
 
-               icw_pdf[t] = BLU_rsp_buf[j++];
+               if ((r = lq_peek(&lineq[t].rx)) == NULL)   // No BLU received ?
+                  break;
+
+               icw_pdf[t] = r->data[r->ptr++];
                if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {  // Trace scanner activities ?
                   fprintf(S_trace, "\n>>> CS2[%1X]: PCF = 6 entered, next PCF will be 7 \n\r", icw_pcf[t]);
-                  fprintf(S_trace, "\n<<< CS2[%1X]: Receiving PDF = *** %02X ***, j = %d \n\r", icw_pcf[t], icw_pdf[t], j-1);
+                  fprintf(S_trace, "\n<<< CS2[%1X]: Receiving PDF = *** %02X ***, ptr = %d \n\r", icw_pcf[t], icw_pdf[t], r->ptr-1);
                }
                if (icw_pdf[t] == 0x7E)         // Flag ?  Skip it.
                   break ;
                icw_scf[t] |= 0x40;             // Set norm char serv flag
                icw_scf[t] &= 0xFB;             // Reset 7E detected flag
-               icw_pdf_reg = FILLED;
-               icw_pcf_new = 0x7;              // Goto PCF = 7...
-               CS2_req_L2_int = ON;            // ...and issue a L2 int
+               icw_pdf_reg[t] = FILLED;
+               icw_pcf_new[t] = 0x7;           // Goto PCF = 7...
+               CS2_req_L2_int[t] = ON;         // ...and issue a L2 int
                break;
 
             case 0x7:                          // Receive info-allow data interrupt
@@ -330,43 +663,46 @@ void *CS2_thread(void *arg) {
                   break;                              // Loop till inactive...
                if (icw_lcd[t] == 0xC) {        // BSC
                   if ((icw_scf[t]&0x40) == 0) {   // NCP has read pdf ?
-                     ret = proc_BSCrdata(&receivedChar);
+                     ret = proc_BSCrdata(t, &receivedChar);
                      if (ret != 1) receivedChar = 0xFF;
                      icw_pdf[t] = receivedChar;
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {    // Trace scanner activities ?
                         fprintf(S_trace, "State 7 ch = %02X\n", icw_pdf[t]);
                      }
-                     //icw_pdf_reg = FILLED;   // Signal NCP to read pdf.
+                     //icw_pdf_reg[t] = FILLED;   // Signal NCP to read pdf.
                      icw_scf[t] |= 0x40;       // Set norm char serv flag
-                     icw_pcf_new = 0x7;        // Stay in PCF = 7...
-                     CS2_req_L2_int = ON;      // Issue a L2 interrupt
+                     icw_pcf_new[t] = 0x7;     // Stay in PCF = 7...
+                     CS2_req_L2_int[t] = ON;   // Issue a L2 interrupt
                   } // End if icw_lcd[t]
                } // End BSC
 
                if (icw_lcd[t] == 0x9) {        //SDLC
-                  if (icw_pdf_reg == EMPTY) {  // NCP has read pdf ?
-                     // Check for Eflag (for transparency x'470F7E' CRC + EFlag)
-                     if ((BLU_rsp_buf[j - 2] == 0x47) &&    // CRC high
-                        (BLU_rsp_buf[j - 1] == 0x0F) &&    // CRC low
-                        (BLU_rsp_buf[j - 0] == 0x7E))  Eflg_rvcd = ON;
-                        else Eflg_rvcd = OFF;  // No Eflag
-
-                     icw_pdf[t] = BLU_rsp_buf[j++]; // Get received byte
+                  r = lq_peek(&lineq[t].rx);
+                  if ((r != NULL) && (icw_pdf_reg[t] == EMPTY)) { // NCP has read pdf ?
+                     // Check for Eflag: the last byte of the frame, by its length
+                     if ((r->cfrm < r->nfrm) && (r->ptr + 1 == r->fend[r->cfrm])) {
+                        r->cfrm++;
+                        Eflg_rvcd = ON;
+                     } else
+                        Eflg_rvcd = OFF;       // No Eflag
+
+                     icw_pdf[t] = r->data[r->ptr++];   // Get received byte
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {  // Trace scanner activities ?
                         fprintf(S_trace, "\n<<< CS2[%1X]: PCF = 7 (re-)entered \n\r", icw_pcf[t]);
-                        fprintf(S_trace, "\n<<< CS2[%1X]: Receiving PDF = *** %02X ***, j = %d \n\r", icw_pcf[t], icw_pdf[t], j-1);
+                        fprintf(S_trace, "\n<<< CS2[%1X]: Receiving PDF = *** %02X ***, ptr = %d \n\r", icw_pcf[t], icw_pdf[t], r->ptr-1);
                      }
                      if (Eflg_rvcd == ON) {    // EFlag received ?
-                        BLU_rsp_stat = EMPTY;
+                        if (r->ptr >= r->len)  // Last frame of the response ?
+                           CS2_rx_done(t);     // BLU done, release it
                         icw_lne_stat[t] = TX;  // Line turnaround to transmitting...
                         icw_scf[t] |= 0x44;    // Set char serv and flag det bit
-                        icw_pcf_new = 0x6;     // Go back to PCF = 6...
-                        CS2_req_L2_int = ON;   // Issue a L2 interrupt
+                        icw_pcf_new[t] = 0x6;  // Go back to PCF = 6...
+                        CS2_req_L2_int[t] = ON; // Issue a L2 interrupt
                      } else {
-                        icw_pdf_reg = FILLED;  // Signal NCP to read pdf.
+                        icw_pdf_reg[t] = FILLED; // Signal NCP to read pdf.
                         icw_scf[t] |= 0x40;    // Set norm char serv flag
-                        icw_pcf_new = 0x7;     // Stay in PCF = 7...
-                        CS2_req_L2_int = ON;   // Issue a L2 interrupt
+                        icw_pcf_new[t] = 0x7;  // Stay in PCF = 7...
+                        CS2_req_L2_int[t] = ON; // Issue a L2 interrupt
                      }
                   }
                }  // end SDLC
@@ -389,18 +725,18 @@ void *CS2_thread(void *arg) {
                         fprintf(S_trace, "SCAN: State 8 ch=%02X \n", transmitChar);
                      }
                   }
-                  proc_BSCtdata(transmitChar, icw_pcf[t]);
+                  proc_BSCtdata(t, transmitChar, icw_pcf[t]);
                   // Next byte please...
-                  icw_pdf_reg = EMPTY;         // Ask NCP for next byte
+                  icw_pdf_reg[t] = EMPTY;      // Ask NCP for next byte
                   icw_scf[t] |= 0x40;          // Set norm char serv flag
-                  icw_pcf_new = 0x9;           // Go to PCF = 9...
-                  CS2_req_L2_int = ON;         // Issue a L2 interrupt
+                  icw_pcf_new[t] = 0x9;        // Go to PCF = 9...
+                  CS2_req_L2_int[t] = ON;      // Issue a L2 interrupt
                } // End BSC
 
                if (icw_lcd[t] == 0x9) {        // SDLC
                   icw_scf[t] &= 0xFB;          // Reset flag detected flag
                   // CTS is now on.
-                  icw_pcf_new = 0x9;           // Goto PCF = 9
+                  icw_pcf_new[t] = 0x9;        // Goto PCF = 9
                   // NO CS2_req_L2_int !
                }  // End SDLC
                break;
@@ -416,29 +752,31 @@ void *CS2_thread(void *arg) {
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {   // Trace scanner activities ?
                         fprintf(S_trace, "State 9 ch=%02X \n", transmitChar);
                      }
-                     proc_BSCtdata(transmitChar, icw_pcf[t]);
+                     proc_BSCtdata(t, transmitChar, icw_pcf[t]);
 
                      // Next byte please...
-                     icw_pdf_reg = EMPTY;      // Ask NCP for next byte
+                     icw_pdf_reg[t] = EMPTY;   // Ask NCP for next byte
                      icw_scf[t] |= 0x40;       // Set norm char serv flag
-                     icw_pcf_new = 0x9;        // Stay in PCF = 9...
-                     CS2_req_L2_int = ON;      // Issue a L2 interrupt
+                     icw_pcf_new[t] = 0x9;     // Stay in PCF = 9...
+                     CS2_req_L2_int[t] = ON;   // Issue a L2 interrupt
                   }
                } // End BSC
 
 
                if (icw_lcd[t] == 0x9) {        // SDLC
-                  if (icw_pdf_reg == FILLED) { // New char avail to xmit ?
+                  if ((icw_pdf_reg[t] == FILLED) &&   // New char avail to xmit...
+                      ((f = lq_slot(&lineq[t].tx)) != NULL)) {   // ...and room to queue it ?
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {  // Trace scanner activities ?
                         fprintf(S_trace, "\n>>> CS2[%1X]: PCF = 9 (re-)entered \n\r", icw_pcf[t]);
-                        fprintf(S_trace, "\n>>> CS2[%1X]: Transmitting PDF = *** %02X ***, BLU_req_len = %d \n\r", icw_pcf[t], icw_pdf[t], BLU_req_len);
+                        fprintf(S_trace, "\n>>> CS2[%1X]: Transmitting PDF = *** %02X ***, BLU length = %d \n\r", icw_pcf[t], icw_pdf[t], f->len);
                      }
-                     BLU_req_buf[BLU_req_len++] = icw_pdf[t];
+                     if (f->len < LFRM_SIZE)
+                        f->data[f->len++] = icw_pdf[t];
                      // Next byte please...
-                     icw_pdf_reg = EMPTY;      // Ask NCP for next byte
+                     icw_pdf_reg[t] = EMPTY;   // Ask NCP for next byte
                      icw_scf[t] |= 0x40;       // Set norm char serv flag
-                     icw_pcf_new = 0x9;        // Stay in PCF = 9...
-                     CS2_req_L2_int = ON;      // Issue a L2 interrupt
+                     icw_pcf_new[t] = 0x9;     // Stay in PCF = 9...
+                     CS2_req_L2_int[t] = ON;   // Issue a L2 interrupt
                      //ccount = 0;
                   }
                } // END SDLC
@@ -455,13 +793,13 @@ void *CS2_thread(void *arg) {
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {   // Trace scanner activities ?
                         fprintf(S_trace, "State 9 ch=%02X \n", transmitChar);
                      }
-                     proc_BSCtdata(transmitChar, icw_pcf[t]);
+                     proc_BSCtdata(t, transmitChar, icw_pcf[t]);
 
                      // Next byte please...
-                     icw_pdf_reg = EMPTY;      // Ask NCP for next byte
+                     icw_pdf_reg[t] = EMPTY;   // Ask NCP for next byte
                      icw_scf[t] |= 0x40;       // Set norm char serv flag
-                     icw_pcf_new = 0xA;        // Stay in PCF = 9...
-                     CS2_req_L2_int = ON;      // Issue a L2 interrupt
+                     icw_pcf_new[t] = 0xA;     // Stay in PCF = 9...
+                     CS2_req_L2_int[t] = ON;   // Issue a L2 interrupt
                   }
                } // End BSC
                break;
@@ -473,14 +811,14 @@ void *CS2_thread(void *arg) {
                    if (icw_pcf_prev[t] != icw_pcf[t]) {  // First entry ?
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))
                         fprintf(S_trace, "We got into state C.\n");
-                     //icw_pdf_reg = EMPTY;
+                     //icw_pdf_reg[t] = EMPTY;
                      transmitChar = icw_pdf[t];                 // Will not be used.
-                     proc_BSCtdata(transmitChar, icw_pcf[t]);    //Signal line we are done
+                     proc_BSCtdata(t, transmitChar, icw_pcf[t]);    //Signal line we are done
 
                      icw_lne_stat[t] = RX;     // Line turnaround to receiving...
                      icw_scf[t] |= 0x40;       // Set norm char serv flag
-                     icw_pcf_new = 0x5;        // Goto PCF = 5...
-                     CS2_req_L2_int = ON;      // ...and issue a L2 int
+                     icw_pcf_new[t] = 0x5;     // Goto PCF = 5...
+                     CS2_req_L2_int[t] = ON;   // ...and issue a L2 int
                   }
                } //end BSC
 
@@ -489,20 +827,19 @@ void *CS2_thread(void *arg) {
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))   // Trace scanner activities ?
                         fprintf(S_trace, "\n>>> CS2[%1X]: PCF = C entered, next PCF will be set by NCP \n\r", icw_pcf[t]);
 
-                     prt_BLU_buf(REQ);                         // Trace it ?
-
-                     // ******************************************************************
-                     BLU_rsp_len = proc_BLU(BLU_req_buf, BLU_req_len);   // Process received BLU request and wait for response
-                     // ******************************************************************
+                     if ((f = lq_slot(&lineq[t].tx)) != NULL) {
+                        prt_BLU_buf(f->data, f->len, REQ);   // Trace it ?
+                        lq_frames(f);  // Where its frames end
+                        f->drv = LDRV_SDLC;
+                        lq_put(&lineq[t].tx);  // Hand the BLU to the SDLC driver...
+                        SDLC_kick();           // ...the response comes in PCF 5
+                     }
 
                      icw_lne_stat[t] = RX;     // Line turnaround to receiving...
-                     BLU_req_len = 0;          // Reset Rx buffer pointer.
-
-                     prt_BLU_buf(RSP);         // Trace it ?
 
                      icw_scf[t] |= 0x40;       // Set norm char serv flag
-                     icw_pcf_new = 0x5;        // Goto PCF = 5...
-                     CS2_req_L2_int = ON;      // ...and issue a L2 int
+                     icw_pcf_new[t] = 0x5;     // Goto PCF = 5...
+                     CS2_req_L2_int[t] = ON;   // ...and issue a L2 int
                   }
                }  // end SDLC
                break;
@@ -513,8 +850,8 @@ void *CS2_thread(void *arg) {
                      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))    // Trace scanner activities ?
                         fprintf(S_trace, "\n>>> CS2[%1X]: PCF = D entered, next PCF will be set by NCP \n\r", icw_pcf[t]);
                   }
-                     icw_pcf_new = 0x5;        // Goto PCF = 5...
-                     CS2_req_L2_int = ON;      // ...and issue a L2 int
+                     icw_pcf_new[t] = 0x5;     // Goto PCF = 5...
+                     CS2_req_L2_int[t] = ON;   // ...and issue a L2 int
                                                // ==>????NO CS2_req_L2_int !
                } // End BSC
 
@@ -537,41 +874,131 @@ void *CS2_thread(void *arg) {
                      fprintf(S_trace, "\n>>> CS2[%1X]: PCF = F entered, next PCF will be set by NCP \n\r", icw_pcf[t]);
                }
                icw_scf[t] |= 0x40;             // Set norm char serv flag
-               icw_pcf_new = 0x0;              // Goto PCF = 0...
-               CS2_req_L2_int = ON;            // ...and issue a L2 int
+               icw_pcf_new[t] = 0x0;           // Goto PCF = 0...
+               CS2_req_L2_int[t] = ON;         // ...and issue a L2 int
                break;
 
          }     // End of switch (icw_pcf[t])
 
          // =========  POST-PROCESSING SCAN CYCLE  =========
 
-         if (CS2_req_L2_int) {                 // CS2 L2 interrupt request ?
-            if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02))  // Trace scanner activities ?
-               fprintf(S_trace, "\n>>> CS2[%1X]: SVCL2 interrupt issued for PCF = %1X \n\r",
-                       icw_pcf[t], icw_pcf[t]);
-
-            pthread_mutex_lock(&r77_lock);
-            //Eregs_Inp[0x77] |= 0x4000;       // Indicate L2 scanner interrupt
-            pthread_mutex_unlock(&r77_lock);
-            svc_req_L2 = ON;                   // Issue a level 2 interrrupt
-            CS2_req_L2_int = OFF;              // Reset int req flag
+         if ((cs2_type == 2) && (CS2_req_L2_int[t]) &&
+             (icw_pcf[t] >= 0x6) && (icw_pcf[t] <= 0xA))
+            moved = 1;                         // Character service: one char per L2 int
+         if (moved > 0) {                      // Pace the line
+            if (cs2_due[t] + CS2_char_time(t, 1) < now)
+               cs2_due[t] = now;               // Line was idle, restart its clock
+            cs2_due[t] += CS2_char_time(t, moved);
+         }
+         if (CS2_req_L2_int[t]) {              // CS2 L2 interrupt request ?
+            CS2_L2_issue(t);                   // Issue it now or on a next scan
+            progress = 1;
          }
          icw_pcf_prev[t] = icw_pcf[t];         // Save current pcf
-         if (icw_pcf[t] != icw_pcf_new) {      // pcf state changed ?
-            icw_pcf[t] = icw_pcf_new;          // set new current pcf
+         if (icw_pcf[t] != icw_pcf_new[t]) {   // pcf state changed ?
+            icw_pcf[t] = icw_pcf_new[t];       // set new current pcf
+            progress = 1;
          }
          if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {  // Trace scanner activities ?
             fprintf(S_trace, "\n>>> CS2[%1X]: Next PCF = %1X \n\r",
                   icw_pcf_prev[t], icw_pcf[t]);
          }
+         // Line back to idle ?
+         if ((icw_pcf[t] == 0x0) && (icw_pcf_new[t] == 0x0) && (!CS2_req_L2_int[t]))
+            icw_active &= ~(1u << t);          // Stop scanning it till NCP sets a PCF
          // Release the ICW lock
          pthread_mutex_unlock(&icw_lock);
-         usleep(1000);                         // Time window for NCP to set PCF.
-//    }                                        // Pending multiple line support !!!
+      }  // End of for t...
+
+      // Sleep till NCP services a line, a line is due or the poll time is over.
+      pthread_mutex_lock(&icw_lock);
+      if ((progress == 0) && (cs2_kick == 0)) {
+         if (icw_active == 0) {                // No active lines ?
+            pthread_cond_wait(&cs2_cond, &icw_lock);
+         } else {
+            ts.tv_sec  = due / 1000000000;
+            ts.tv_nsec = due % 1000000000;
+            pthread_cond_timedwait(&cs2_cond, &icw_lock, &ts);
+         }
+      }
+      cs2_kick = 0;
+      pthread_mutex_unlock(&icw_lock);
    }  // End of while(1)...
    return (0);
 }
 
+// *******************************************************************
+// SET CS2 TYPE=2|3: character service or block mode scanner
+// *******************************************************************
+t_stat cs2_set_type(UNIT *uptr, int32 val, char *cptr, void *desc) {
+   if (cptr == NULL)
+      return SCPE_ARG;
+   if (strcmp(cptr, "2") == 0)
+      cs2_type = 2;
+   else if (strcmp(cptr, "3") == 0)
+      cs2_type = 3;
+   else
+      return SCPE_ARG;
+   return SCPE_OK;
+}
+
+t_stat cs2_show_type(FILE *st, UNIT *uptr, int32 val, void *desc) {
+   fprintf(st, "type %d", cs2_type);
+   return SCPE_OK;
+}
+
+// *******************************************************************
+// SET CS2 SPEED=bps|UNLIMITED or SPEED=line:bps|UNLIMITED
+// *******************************************************************
+t_stat cs2_set_speed(UNIT *uptr, int32 val, char *cptr, void *desc) {
+   char *sptr;
+   int line = -1;
+   uint32_t bps;
+   t_stat r;
+
+   if (cptr == NULL)
+      return SCPE_ARG;
+   if ((sptr = strchr(cptr, ':')) != NULL) {   // Line address given ?
+      *sptr++ = 0;
+      line = (int) get_uint(cptr, 16, 0x20 + MAX_TBAR - 1, &r);
+      if ((r != SCPE_OK) || (line < 0x20))
+         return SCPE_ARG;
+      line -= 0x20;
+      cptr = sptr;
+   }
+   if (strcmp(cptr, "UNLIMITED") == 0)
+      bps = 0;
+   else {
+      bps = (uint32_t) get_uint(cptr, 10, 10000000, &r);
+      if (r != SCPE_OK)
+         return SCPE_ARG;
+   }
+   for (int t = 0; t < MAX_TBAR; t++)
+      if ((line < 0) || (line == t)) {
+         cs2_speed[t] = bps;
+         cs2_due[t] = 0;
+      }
+   return SCPE_OK;
+}
+
+t_stat cs2_show_speed(FILE *st, UNIT *uptr, int32 val, void *desc) {
+   int t, n = 0;
+
+   for (t = 1; t < MAX_TBAR; t++)
+      if (cs2_speed[t] != cs2_speed[0]) break;
+   if (t == MAX_TBAR) {                        // All lines the same ?
+      if (cs2_speed[0] == 0) fprintf(st, "speed unlimited");
+      else fprintf(st, "speed %d bps", cs2_speed[0]);
+      return SCPE_OK;
+   }
+   fprintf(st, "speed");
+   for (t = 0; t < MAX_TBAR; t++) {
+      if (cs2_speed[t] == 0) fprintf(st, "%s%02X:unlimited", (n++ % 8) ? " " : "\n   ", 0x20 + t);
+      else fprintf(st, "%s%02X:%d", (n++ % 8) ? " " : "\n   ", 0x20 + t, cs2_speed[t]);
+   }
+   return SCPE_OK;
+}
+
 /* Copy output regs to ICW[ABAR] */
 #if 0
 void Put_ICW(int abar) {                       // See 3705 CE manauls for details.
@@ -590,6 +1017,8 @@ void Put_ICW(int abar) {                       // See 3705 CE manauls for detail
 /* Copy ICW[ABAR] to input regs */
 void Get_ICW(int abar) {                       // See 3705 CE manauls for details.
    int tbar = (abar - 0x0840) >> 1;            // Get ICW table ptr from abar
+   if ((tbar < 0) || (tbar >= MAX_TBAR))       // Not a scanner line ?
+      return;
    Eregs_Inp[0x44]  = (icw_scf[tbar] << 8)  | icw_pdf[tbar];
    Eregs_Inp[0x45]  = (icw_lcd[tbar] << 12) | (icw_pcf[tbar] << 8) | icw_sdf[tbar];
    Eregs_Inp[0x46]  =  0xF0A5;                 // Display reg (tbd)
@@ -602,24 +1031,18 @@ void Get_ICW(int abar) {                       // See 3705 CE manauls for detail
 // *******************************************************************
 // Function to print the BLU request or respons buffer content.
 // *******************************************************************
-void prt_BLU_buf(int reqorrsp) {
+void prt_BLU_buf(uint8 *buf, int len, int reqorrsp) {
    int i;
 
    if ((Sdbg_flag == ON) && (Sdbg_reg & 0x02)) {  // Trace scanner activities ?
-      if (reqorrsp == REQ) {
-         fprintf(S_trace, "\nSCAN: BLU Request buffer, length = %d \nSCAN: ", BLU_req_len);
-         for (i = 0; i < BLU_req_len; i++) {
-            fprintf(S_trace, "%02X ", BLU_req_buf[i] );
-            if ((i + 1) % 16 == 0)
-               fprintf(S_trace, " \nSCAN: ");
-         }
-      } else {
-         fprintf(S_trace, "\nSCAN: BLU Response buffer, length = %d \nSCAN: ", BLU_rsp_len);
-         for (i = 0; i < BLU_rsp_len; i++) {
-            fprintf(S_trace, "%02X ", BLU_rsp_buf[i]);
-            if ((i + 1) % 16 == 0)
-               fprintf(S_trace, " \nSCAN: ");
-         }
+      if (reqorrsp == REQ)
+         fprintf(S_trace, "\nSCAN: BLU Request buffer, length = %d \nSCAN: ", len);
+      else
+         fprintf(S_trace, "\nSCAN: BLU Response buffer, length = %d \nSCAN: ", len);
+      for (i = 0; i < len; i++) {
+         fprintf(S_trace, "%02X ", buf[i]);
+         if ((i + 1) % 16 == 0)
+            fprintf(S_trace, " \nSCAN: ");
       }
       fprintf(S_trace, " \n ");
    }
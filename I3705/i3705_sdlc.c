@@ -30,111 +30,254 @@
 */
 
 #include <stdbool.h>
+#include <inttypes.h>
 #include "sim_defs.h"
 #include "i3705_defs.h"
-#include "../Include/i327x_sdlc.h"
+#include "../i327x_sdlc.h"
 #include <ifaddrs.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #define MAXSDLCLINES     2             /* Maximum of lines          */
 #define LINEBASE        20             /* SDLC lines start at 20    */
-
+#define SDLC_WINDOW      7             /* Modulo 8 I-frame window   */
+#define SDLC_POLLTMO  1000             /* Poll reply timeout (msec) */
+#define PU_TAG        0x100            /* epoll tag of a PU socket  */
+
+
+struct SDLCStats {
+   uint64_t blu_cnt;                   // BLUs sent to the PU
+   uint64_t polls;                     // BLUs with the poll bit on
+   uint64_t nopu;                      // BLUs for the line without a PU
+   uint64_t tx_frames;                 // Frames sent to the PU
+   uint64_t tx_bytes;                  // Link record bytes sent to the PU
+   uint64_t rsp_cnt;                   // Responses queued for the scanner
+   uint64_t rx_frames;                 // Frames received from the PU
+   uint64_t rx_bytes;                  // Link record bytes received from the PU
+   uint64_t fcs_err;                   // Frames received with an FCS error
+   uint64_t drops;                     // Frames dropped, response too long
+   uint64_t connects;                  // PU connections accepted
+   uint64_t spoofed;                   // RR polls answered by the 3705
+   uint64_t attn;                      // Attention records from the PU
+   uint64_t timeouts;                  // Polls completed as no response
+};
 
 struct SDLCLine {
    int      line_fd;
    int      linenum;
    int      d3274_fd;
-   int      epoll_fd;
-   uint8_t  SDLC_rbuf[BUFLEN_3274];    // Received data buffer
-   uint8_t  SDLC_tbuf[BUFLEN_3274];    // Transmit data buffer
-   uint16_t SDLCrlen;                  // Size of received data in buffer
-   uint16_t SDLCtlen;                  // Size of transmit data in buffer
+   int      poll;                      // Poll sent, waiting for the final frame
+   uint8_t  poll_addr;                 // Station polled
+   uint64_t poll_end;                  // Poll reply timeout (msec)
+   int      unacked;                   // I-frames sent since the last final frame
+   uint32_t SDLCrlen;                  // Size of received data in buffer
+   uint8_t  SDLC_rbuf[BUFLEN_3274];    // Link records received from the PU
+   uint8_t  SDLC_tbuf[2 * LFRM_SIZE];  // Link records to send to the PU
+   struct SDLCStats stats;             // Line statistics
+   uint8_t  idle[256];                 // Per station: control byte of its last RR final, 0 if busy
+   uint8_t  late[256];                 // Per station: finals still owed for timed out polls
 } *sdlcline[MAXSDLCLINES];
 
+int sdlc_epfd;                         // Polls the line listen sockets and sdlc_evfd
+int sdlc_evfd = -1;                    // Scanner has queued BLUs
+int sdlc_spoof = OFF;                  // Answer RR polls of idle stations locally
+
 extern FILE *S_trace;
 extern uint16_t Sdbg_reg;
 extern uint16_t Sdbg_flag;
+extern struct LINEQ lineq[];           // Scanner line frame queues
 
-// Host ---> PU request buffer
-extern uint8 BLU_req_buf[BUFLEN_3274]; // DLC header + TH + RH + RU + DLC trailer
-extern int   BLU_req_ptr;              // Offset pointer to BLU
-extern int   BLU_req_len;              // Length of BLU request
-extern int   BLU_req_stat;             // BLU buffer state
-// PU ---> Host response buffer
-extern uint8 BLU_rsp_buf[BUFLEN_3274]; // DLC header + TH + RH + RU + DLC trailer
-extern int   BLU_rsp_ptr;              // Offset pointer to BLU
-extern int   BLU_rsp_len;              // Length of BLU response
-extern int   BLU_rsp_stat;             // BLU buffer state
+extern struct LFRAME *lq_slot(struct LRING *r);
+extern void lq_put(struct LRING *r);
+extern struct LFRAME *lq_peek(struct LRING *r);
+extern void lq_get(struct LRING *r);
+extern void CS2_wakeup(void);
 
 int8 stat_mode = NDM;
 int8 rxtx_dir = RX;                    // Rx or Tx flag
 int8 station;                          // Station #
 
-int proc_BLU(unsigned char BLU_req_buf[], int Blen);   // SDLC frame handler
+int proc_BLU(int line, struct LFRAME *f);   // SDLC frame handler
 int proc_frame(unsigned char BLU_req_buf[], int Blen); // Process frame header
 int proc_PIU(unsigned char PIU_buf[], int Blen, int Ftype);   // PIU handler
 void trace_Fbuf(unsigned char BLU_buf[], int Blen, int rxtx_dir);   // Print trace records
-void prt_BLU_buf(int reqorrsp);
 
 //*********************************************************************
-// Function to check if socket is (still) connected                   *
+//   Monotonic time in msec, for the poll reply timeout.              *
 //*********************************************************************
-static bool IsSocketConnected(int sockfd) {
-   int rc;
-   struct sockaddr_in peer_addr;
-   int addrlen = sizeof(peer_addr);
-   if (sockfd < 1) {
-      return false;
+static uint64_t SDLC_msec(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+//*********************************************************************
+//   PU connection lost: stop polling it and, if the scanner waits    *
+//   for the final frame of a poll, complete it as not connected.     *
+//*********************************************************************
+static int SDLC_close(int k) {
+   struct SDLCLine *sl = sdlcline[k];
+   struct LFRAME *r;
+   int n = 0;
+
+   epoll_ctl(sdlc_epfd, EPOLL_CTL_DEL, sl->d3274_fd, NULL);
+   close(sl->d3274_fd);
+   sl->d3274_fd = 0;
+   sl->SDLCrlen = 0;
+   sl->unacked = 0;
+   memset(sl->idle, 0, sizeof(sl->idle));
+   memset(sl->late, 0, sizeof(sl->late));
+   if ((sl->poll == ON) && ((r = lq_slot(&lineq[k].rx)) != NULL)) {
+      r->len = -1;
+      lq_put(&lineq[k].rx);
+      n++;
    }
-   rc = getpeername(sockfd, (struct sockaddr*)&peer_addr, &addrlen);
-   if (rc != 0) {
-      return false;
+   sl->poll = OFF;
+   printf("\rSDLC: PU disconnected from line-%d\n", k);
+   return n;
+}
+
+//*********************************************************************
+//   Move the complete link records received from the PU to the       *
+//   scanner line queue as BLU frames. All frames up to and including *
+//   the one with the final bit on form one response.                 *
+//   Returns the responses queued, or -1 if the link is out of sync.  *
+//*********************************************************************
+static int SDLC_frames(int k) {
+   struct SDLCLine *sl = sdlcline[k];
+   struct LFRAME *r;
+   int Rptr = 0, Rlen, frame_len, n = 0;
+   uint8_t *rec, *frame;
+
+   while (Rptr < sl->SDLCrlen) {
+      if ((r = lq_slot(&lineq[k].rx)) == NULL)
+         break;                                          // Scanner still reading, retry on next kick
+      rec = &sl->SDLC_rbuf[Rptr];
+      if ((sl->SDLCrlen - Rptr >= SLNK_HDR) &&           // Rebuilt frame would not fit ?
+          (r->len + SLNK_HDR + ((rec[2] << 8) | rec[3]) > LFRM_SIZE)) {
+         if (sl->SDLCrlen - Rptr < SLNK_HDR + ((rec[2] << 8) | rec[3]))
+            break;                                       // Rest of record still underway
+         printf("\rSDLC: line-%d response exceeds %d bytes, frame dropped\n", k, LFRM_SIZE);
+         sl->stats.drops++;
+         Rptr += SLNK_HDR + ((rec[2] << 8) | rec[3]);
+         continue;
+      }
+      frame = &r->data[r->len];
+      frame_len = slnk_get(rec, sl->SDLCrlen - Rptr, frame, &Rlen);
+      if (frame_len == SLNK_SHORT)
+         break;                                          // Rest of record still underway
+      if (frame_len == SLNK_GOTATTN) {                   // PU has work, stop spoofing its polls
+         Rptr += Rlen;
+         memset(sl->idle, 0, sizeof(sl->idle));
+         sl->stats.attn++;
+         continue;
+      }
+      if (frame_len == SLNK_BADHDR) {
+         printf("\rSDLC: line-%d link protocol error, record header %02X %02X\n", k, rec[0], rec[1]);
+         return -1;
+      }
+      Rptr += Rlen;
+      if (frame_len == SLNK_BADFCS) {                    // Frame is lost, as on a real line
+         sl->stats.fcs_err++;
+         if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04))     // Trace BLU activities ?
+            fprintf(S_trace, "\nSDLC: line-%d FCS error, frame of %d bytes dropped\n", k, Rlen);
+         continue;
+      }
+      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04))        // Trace BLU activities ?
+         trace_Fbuf(frame, frame_len, RX);               // Print trace records
+      if (r->nfrm == LFRM_NFRM) {                        // No room to delimit one more frame
+         printf("\rSDLC: line-%d response exceeds %d frames, frame dropped\n", k, LFRM_NFRM);
+         sl->stats.drops++;
+         continue;
+      }
+      if (sl->late[frame[FAddr]] > 0) {                  // Answer to a poll that timed out
+         if (frame[FCntl] & CFinal)
+            sl->late[frame[FAddr]]--;
+         sl->stats.rx_frames++;
+         continue;
+      }
+      r->len += frame_len;
+      r->fend[r->nfrm++] = r->len;                       // The scanner ends the frame here
+      sl->stats.rx_frames++;
+      if (frame[FCntl] & CFinal) {                       // Last frame of the response ?
+         // A response of just an RR final means the station has nothing to send
+         if ((r->len == frame_len) && (frame_len == 6) && ((frame[FCntl] & 0x0F) == RR))
+            sl->idle[frame[FAddr]] = frame[FCntl];
+         lq_put(&lineq[k].rx);
+         sl->poll = OFF;
+         sl->unacked = 0;
+         sl->stats.rsp_cnt++;
+         n++;
+      }
+   }
+   if (Rptr > 0) {                                       // Shift unprocessed data to the front
+      memmove(sl->SDLC_rbuf, &sl->SDLC_rbuf[Rptr], sl->SDLCrlen - Rptr);
+      sl->SDLCrlen -= Rptr;
    }
-   return true;
+   return n;
 }
 
 //*********************************************************************
-// Receive data from the 3274                                         *
-// If an error occurs, the connection will be closed                  *
+//   Receive data from the 3274. Called when the PU socket is         *
+//   readable; a read of 0 bytes or an error closes the connection.   *
 //*********************************************************************
-int  ReadSDLC(int k, unsigned char *BLU_buf) {
+static int ReadSDLC(int k) {
+   struct SDLCLine *sl = sdlcline[k];
    int rc;
-   if (sdlcline[k]->d3274_fd > 0) {                      // Should we have a connection?
-      if (IsSocketConnected(sdlcline[k]->d3274_fd)) {
-         sdlcline[k]->SDLCrlen = read(sdlcline[k]->d3274_fd, BLU_buf, BUFLEN_3274);
-         //******
-         if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04) && (sdlcline[k]->SDLCrlen > 0)) {
-            fprintf(S_trace, "\nSDLC: PU response Read Buffer: ");
-            for (int i = 0; i < sdlcline[k]->SDLCrlen; i++) {
-               fprintf(S_trace, "%02X ", BLU_buf[i]);
-            }
-            fprintf(S_trace, "\n\r");
-         }  // End if debug_reg
-         return sdlcline[k]->SDLCrlen;
-      } else {
-         close (sdlcline[k]->d3274_fd);
-         sdlcline[k]->d3274_fd = 0;
-         printf("\rSDLC: PU disconnected from line-%d\n", k);
-      }  // End if IsSocketConnected
-   }  // End  if (sdlcline[k]->d3274_fd > 0)
-   return -1;
+
+   if (sl->SDLCrlen == BUFLEN_3274)                      // Full buffer without a complete record ?
+      return SDLC_close(k);
+   rc = read(sl->d3274_fd, &sl->SDLC_rbuf[sl->SDLCrlen], BUFLEN_3274 - sl->SDLCrlen);
+   if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+      return 0;
+   if (rc <= 0)
+      return SDLC_close(k);
+   //******
+   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04)) {
+      fprintf(S_trace, "\nSDLC: PU response Read Buffer: ");
+      for (int i = 0; i < rc; i++) {
+         fprintf(S_trace, "%02X ", sl->SDLC_rbuf[sl->SDLCrlen + i]);
+      }
+      fprintf(S_trace, "\n\r");
+   }  // End if debug_reg
+   sl->stats.rx_bytes += rc;
+   sl->SDLCrlen += rc;
+   if ((rc = SDLC_frames(k)) < 0)
+      return SDLC_close(k);
+   return rc;
 }
 
 //*********************************************************************
-//   Incomming SDLC frame (BLU) handler
+//   Outgoing SDLC frame (BLU) handler                                *
+//   The scanner line number selects the PU connection. All frames of *
+//   the BLU, as delimited by the scanner in f->fend, are sent        *
+//   back-to-back as link records in one write                        *
+//   without waiting for the PU; the response is collected by the     *
+//   SDLC thread when it arrives.                                     *
+//   Returns ON if a frame had the poll bit on (a response follows),  *
+//   OFF if not, or -1 if no PU is connected to the line.             *
 //*********************************************************************
-//int proc_BLU (unsigned char BLU_req_buf[], int BLU_req_len, int8 CS_line_addr, int8 CS_line_LCD) {
-int proc_BLU (unsigned char BLU_req_buf[], int BLU_req_len) {
-   register char *s;
-   int Pflag = FALSE;                  // SDLC Poll bit flag
-   int direction = TX;                 // TX or RX
-   int Fptr, frame_len;
-   int i, rc;
+int proc_BLU (int line, struct LFRAME *f) {
+   struct SDLCLine *sl;
+   unsigned char *BLU_req_buf = f->data;
+   int BLU_req_len = f->len;
+   int Pflag = OFF;                    // SDLC Poll bit flag
+   int Fptr, Tlen = 0, frame_len;
+   int i, k, rc;
+
+   if ((line >= MAXSDLCLINES) || (sdlcline[line] == NULL))
+      return -1;                       // Not an SDLC line
+   sl = sdlcline[line];
+   if (sl->d3274_fd <= 0) {
+      sl->stats.nopu++;
+      return -1;                       // No PU connected to this line
+   }
 
    if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04)) {         // Trace BLU activities ?
       fprintf(S_trace, "\nSDLC: Received %d bytes from scanner.\nSDLC: Request Buffer: ", BLU_req_len);
@@ -142,49 +285,212 @@ int proc_BLU (unsigned char BLU_req_buf[], int BLU_req_len) {
          fprintf(S_trace, "%02X ", (int) BLU_req_buf[i] & 0xFF);
       fprintf(S_trace, "\n");
    }
-   // Search for SDLC frames, process it and when Poll bit found: return.
-   Pflag = FALSE;
+   // Send the SDLC frames to the PU.
    Fptr = 0;
    if ((BLU_req_buf[Fptr] == 0x00) || (BLU_req_buf[Fptr] == 0xAA)) Fptr = 1;  // If modem clocking is used skip first char
-   if ((BLU_req_buf[Fptr] == 0x7E) && (BLU_req_buf[Fptr+1] == 0x7E) && (BLU_req_buf[Fptr+2] == 0x7E)) return 0; // Consequtive 7E's. Ignore.
-   do {                                // Do till Poll bit found...
-      frame_len = 0;                   //
-      // Find end of SDLC frame...
-      while (!((BLU_req_buf[Fptr + frame_len + 0] == 0x47) &&
-               (BLU_req_buf[Fptr + frame_len + 1] == 0x0F) &&
-               (BLU_req_buf[Fptr + frame_len + 2] == 0x7E))) {
-         frame_len++;
-      } // End while
-      frame_len = frame_len + 3;              // Correction length LT
+   if ((BLU_req_buf[Fptr] == 0x7E) && (BLU_req_buf[Fptr+1] == 0x7E) && (BLU_req_buf[Fptr+2] == 0x7E)) return OFF; // Consequtive 7E's. Ignore.
+   for (k = 0; (k < f->nfrm) && (f->fend[k] > Fptr); k++) {
+      frame_len = f->fend[k] - Fptr;
       if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04)) {  // Trace BLU activities ?
          fprintf(S_trace, "\nSDLC: sending request to PU: Frame Length=%d \nSDLC: Request Buffer:  ", frame_len);
          for (i = 0; i < frame_len; i++)
             fprintf(S_trace, "%02X ", (int) BLU_req_buf[Fptr + i] & 0xFF);
          fprintf(S_trace, "\n");
-      }
-      // ******************************************************************
-      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04))        // Trace BLU activities ?
          trace_Fbuf(BLU_req_buf + Fptr, frame_len, TX);  // Print trace records
-      rc = send(sdlcline[0]->d3274_fd, &BLU_req_buf[Fptr], frame_len, 0);
-      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04))        // Trace BLU activities ?
-         fprintf(S_trace, "\nSDLC: Sent %d bytes to PU, rc=%d\n ", frame_len, rc);
-      BLU_rsp_len = ReadSDLC(0, BLU_rsp_buf);
-      if (BLU_req_buf[Fptr + 2] & 0x10) {                // if Poll bit on we should have an answer
-         if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04))     // Trace BLU activities ?
-            trace_Fbuf(BLU_rsp_buf, BLU_rsp_len, RX);    // Print trace records
-      }  else {
-         BLU_rsp_len = 0;                                // If poll bit not on, we received a single sync byte which can be ignored
       }
-      // ******************************************************************
+      if ((BLU_req_buf[Fptr + FCntl] & 0x01) == IFRAME)
+         sl->unacked++;                // I-frame, counts against the window
+      if (BLU_req_buf[Fptr + FCntl] & CPoll) {
+         Pflag = ON;                   // PU will answer with the final bit on
+         sl->poll_addr = BLU_req_buf[Fptr + FAddr];
+      }
+      sl->idle[BLU_req_buf[Fptr + FAddr]] = 0;   // Station state unknown until it answers
+      Tlen += slnk_put(&sl->SDLC_tbuf[Tlen], &BLU_req_buf[Fptr], frame_len);
+      sl->stats.tx_frames++;
       Fptr = Fptr + frame_len;
-      if ((BLU_req_buf[Fptr] == 0x00) || (BLU_req_buf[Fptr] == 0xAA)) Fptr++; // If modem clocking is used skip first char
-   }  // End Do
-   while (Fptr < BLU_req_len);
+      if ((Fptr < BLU_req_len) && ((BLU_req_buf[Fptr] == 0x00) || (BLU_req_buf[Fptr] == 0xAA))) Fptr++; // If modem clocking is used skip first char
+   }  // End for k
+   if (Tlen > 0) {
+      rc = send(sl->d3274_fd, sl->SDLC_tbuf, Tlen, 0);
+      if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04))        // Trace BLU activities ?
+         fprintf(S_trace, "\nSDLC: Sent %d bytes to PU, rc=%d\n ", Tlen, rc);
+      if (rc > 0) sl->stats.tx_bytes += rc;
+   }
+   sl->stats.blu_cnt++;
+   if (Pflag == ON) sl->stats.polls++;
+   sl->poll = Pflag;
+   sl->poll_end = SDLC_msec() + SDLC_POLLTMO;
+   return Pflag;
+}
 
+//*********************************************************************
+//   A PU that does not answer a poll in time: complete the poll as   *
+//   no response and release the line. The final frame, should it    *
+//   still come, is dropped. Returns 1 if a response was queued.      *
+//*********************************************************************
+static int SDLC_polltmo(int k) {
+   struct SDLCLine *sl = sdlcline[k];
+   struct LFRAME *r;
+
+   if ((sl->poll == OFF) || (SDLC_msec() < sl->poll_end))
+      return 0;
+   if ((r = lq_slot(&lineq[k].rx)) == NULL)
+      return 0;                        // Scanner still reading, retry on next kick
+   r->len = 0;                         // Frames of a partial response are dropped too
+   lq_put(&lineq[k].rx);
+   sl->poll = OFF;
+   sl->unacked = 0;
+   sl->late[sl->poll_addr]++;
+   sl->stats.timeouts++;
    if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04))           // Trace BLU activities ?
-      fprintf(S_trace, "\nSDLC: Returning %d bytes to scanner ", BLU_rsp_len);
-   if (BLU_rsp_len > 0) BLU_rsp_stat = FILLED;           // Indicate there is data in the response buffer
-   return BLU_rsp_len;                                   // With response in BLU
+      fprintf(S_trace, "\nSDLC: line-%d poll of station %02X timed out\n", k, sl->poll_addr);
+   return 1;
+}
+
+//*********************************************************************
+//   Poll spoofing: if the BLU is just an RR poll for a station that  *
+//   had nothing to send on its last poll and has not signalled new   *
+//   work since, build its RR final response in r and return ON.      *
+//   The station's N(r) cannot have changed: no I-frames were sent.   *
+//*********************************************************************
+static int SDLC_spoof(int line, struct LFRAME *f, struct LFRAME *r) {
+   struct SDLCLine *sl = sdlcline[line];
+   uint8_t *frame;
+   int Fptr = 0;
+
+   if ((f->data[Fptr] == 0x00) || (f->data[Fptr] == 0xAA)) Fptr = 1;  // If modem clocking is used skip first char
+   frame = &f->data[Fptr];
+   if ((f->nfrm != 1) || (f->fend[0] != Fptr + 6) || (Fptr + 6 < f->len) ||
+       ((frame[FCntl] & 0x0F) != RR) || !(frame[FCntl] & CPoll) ||
+       (sl->idle[frame[FAddr]] == 0))
+      return OFF;
+   r->data[BFlag] = 0x7E;
+   r->data[FAddr] = frame[FAddr];
+   r->data[FCntl] = sl->idle[frame[FAddr]];
+   r->data[Hfcs]  = 0x47;
+   r->data[Lfcs]  = 0x0F;
+   r->data[EFlag] = 0x7E;
+   r->len = 6;
+   r->nfrm = 1;
+   r->fend[0] = 6;
+   sl->stats.spoofed++;
+   if ((Sdbg_flag == ON) && (Sdbg_reg & 0x04))           // Trace BLU activities ?
+      fprintf(S_trace, "\nSDLC: line-%d RR poll for station %02X answered locally\n", line, frame[FAddr]);
+   return ON;
+}
+
+//*********************************************************************
+//   Ring the SDLC thread: the scanner has queued a BLU or has taken  *
+//   a response off a line queue.                                     *
+//*********************************************************************
+void SDLC_kick(void) {
+   uint64_t one = 1;
+   int rc;
+
+   if (sdlc_evfd < 0)
+      return;
+   rc = write(sdlc_evfd, &one, sizeof(one));
+   if ((rc < 0) && (errno != EAGAIN))          // EAGAIN: counter full, thread is awake anyway
+      printf("\nSDLC: Scanner doorbell write failed with error %s \n\r", strerror(errno));
+}
+
+//*********************************************************************
+//   Send the BLUs queued by the scanner to the PU of their line.     *
+//   BLUs go out back-to-back until a poll is outstanding or the      *
+//   modulo 8 window is full; the final frame of the PU response      *
+//   reopens the line. A BLU without poll, or for a line without PU,  *
+//   is completed at once with an empty resp. not connected frame.    *
+//*********************************************************************
+static void SDLC_drain(void) {
+   struct LFRAME *f, *r;
+   int t, rc, n = 0;
+
+   for (t = 0; t < MAX_TBAR; t++) {
+      if (t < MAXSDLCLINES && sdlcline[t]->d3274_fd > 0) {
+         n += SDLC_frames(t);          // Responses held back by a full queue
+         n += SDLC_polltmo(t);         // PU did not answer its poll
+      }
+      while (((f = lq_peek(&lineq[t].tx)) != NULL) && (f->drv == LDRV_SDLC)) {
+         if (t < MAXSDLCLINES && (sdlcline[t]->poll == ON || sdlcline[t]->unacked >= SDLC_WINDOW))
+            break;                     // Wait for the final frame from the PU
+         if ((r = lq_slot(&lineq[t].rx)) == NULL)
+            break;                     // Scanner still reading, retry on next kick
+         if ((sdlc_spoof == ON) && (t < MAXSDLCLINES) && (sdlcline[t]->d3274_fd > 0) &&
+             (SDLC_spoof(t, f, r) == ON)) {
+            lq_get(&lineq[t].tx);
+            lq_put(&lineq[t].rx);
+            n++;
+            continue;
+         }
+         rc = proc_BLU(t, f);
+         lq_get(&lineq[t].tx);
+         if (rc != ON) {               // No response follows
+            r->len = rc;
+            lq_put(&lineq[t].rx);
+            n++;
+         }
+      }
+   }
+   if (n > 0)
+      CS2_wakeup();                    // Responses for the scanner
+}
+
+// ************************************************************
+// SET CS2 SDLC=RESET: clear the SDLC line statistics
+// ************************************************************
+t_stat cs2_set_sdlc(UNIT *uptr, int32 val, char *cptr, void *desc) {
+   if ((cptr == NULL) || strcmp(cptr, "RESET"))
+      return SCPE_ARG;
+   for (int k = 0; k < MAXSDLCLINES; k++)
+      if (sdlcline[k] != NULL)
+         memset(&sdlcline[k]->stats, 0, sizeof(struct SDLCStats));
+   return SCPE_OK;
+}
+
+// ************************************************************
+// SET CS2 SPOOF=ON|OFF: answer RR polls of idle stations in
+// the 3705 instead of passing them to the 3274
+// ************************************************************
+t_stat cs2_set_spoof(UNIT *uptr, int32 val, char *cptr, void *desc) {
+   if (cptr == NULL)
+      return SCPE_ARG;
+   if (strcmp(cptr, "ON") == 0)
+      sdlc_spoof = ON;
+   else if (strcmp(cptr, "OFF") == 0)
+      sdlc_spoof = OFF;
+   else
+      return SCPE_ARG;
+   return SCPE_OK;
+}
+
+t_stat cs2_show_spoof(FILE *st, UNIT *uptr, int32 val, void *desc) {
+   fprintf(st, "poll spoofing %s", (sdlc_spoof == ON) ? "on" : "off");
+   return SCPE_OK;
+}
+
+// ************************************************************
+// SHOW CS2 SDLC: display the state and statistics of each
+// SDLC line
+// ************************************************************
+t_stat cs2_show_sdlc(FILE *st, UNIT *uptr, int32 val, void *desc) {
+   struct SDLCStats *s;
+
+   fprintf(st, "Poll spoofing %s\n", (sdlc_spoof == ON) ? "on" : "off");
+   fprintf(st, "Line Port  PU  BLUs     Polls    No PU    Frames out  Bytes out   "
+               "Responses Frames in   Bytes in    FCS err  Dropped  Connects Spoofed  Attn     Timeouts\n");
+   for (int k = 0; k < MAXSDLCLINES; k++) {
+      if (sdlcline[k] == NULL)
+         continue;                     // SDLC thread not started yet
+      s = &sdlcline[k]->stats;
+      fprintf(st, "%02X   %5d %-3s %-8" PRIu64 " %-8" PRIu64 " %-8" PRIu64 " %-11" PRIu64 " %-11" PRIu64
+                  " %-9" PRIu64 " %-11" PRIu64 " %-11" PRIu64 " %-8" PRIu64 " %-8" PRIu64 " %-8" PRIu64
+                  " %-8" PRIu64 " %-8" PRIu64 " %" PRIu64 "\n",
+              0x20 + k, 37500 + LINEBASE + k, (sdlcline[k]->d3274_fd > 0) ? "yes" : "no",
+              s->blu_cnt, s->polls, s->nopu, s->tx_frames, s->tx_bytes,
+              s->rsp_cnt, s->rx_frames, s->rx_bytes, s->fcs_err, s->drops, s->connects,
+              s->spoofed, s->attn, s->timeouts);
+   }
+   return SCPE_OK;
 }
 
 //*********************************************************************
@@ -265,7 +571,6 @@ void trace_Fbuf(uint8_t BLU_req_buf[], int Flen, int rxtx_dir) {
                  (BLU_req_buf[FCntl] >> 5) & 0x7,
                  (BLU_req_buf[FCntl] >> 4) & 0x1,
                  (BLU_req_buf[FCntl] >> 1) & 0x7 );
-         prt_BLU_buf(1);
          for (s = (char *) BLU_req_buf, i = 0; i < Flen; ++i, ++s)
             fprintf(S_trace, "%02X ", (int) *s & 0xFF);
          fprintf(S_trace, "\n");
@@ -282,19 +587,27 @@ void *SDLC_thread(void *arg) {
    int    sockopt;                 /* Used for setsocketoption          */
    int    pendingrcv;              /* pending data on the socket        */
    int    event_count;             /* # events received                 */
+   int    tmo;                     /* epoll timeout, a poll is pending  */
+   uint64_t now, left;
    int    rc, rc1;                 /* return code from various rtns     */
    struct sockaddr_in  sin, *sin2; /* bind socket address structure     */
    struct ifaddrs *nwaddr, *ifa;   /* interface address structure       */
    char   *ipaddr;
-   struct epoll_event event, events[MAXSDLCLINES];
+   uint64_t kicks;
+   struct epoll_event event, events[2 * MAXSDLCLINES + 1];
 
    printf("\rSDLC: Thread %ld started succesfully... \n", syscall(SYS_gettid));
 
    for (int j = 0; j < MAXSDLCLINES; j++) {
       sdlcline[j] = malloc(sizeof(struct SDLCLine));
       sdlcline[j]->linenum = j;
+      sdlcline[j]->d3274_fd = 0;
+      sdlcline[j]->poll = OFF;
+      sdlcline[j]->unacked = 0;
       sdlcline[j]->SDLCrlen = 0;
-      sdlcline[j]->SDLCtlen = 0;
+      memset(&sdlcline[j]->stats, 0, sizeof(struct SDLCStats));
+      memset(sdlcline[j]->idle, 0, sizeof(sdlcline[j]->idle));
+      memset(sdlcline[j]->late, 0, sizeof(sdlcline[j]->late));
    }  // End for j = 0
    getifaddrs(&nwaddr);      /* get network address */
    for (ifa = nwaddr; ifa != NULL; ifa = ifa->ifa_next) {
@@ -306,6 +619,20 @@ void *SDLC_thread(void *arg) {
    }
    printf("\rSDLC: Using network Address %s on %s for PU connections\n", ipaddr, ifa->ifa_name);
 
+   // All lines and the scanner doorbell are polled by one epoll set
+   sdlc_epfd = epoll_create(1);
+   if (sdlc_epfd == -1) {
+      printf("\nSDLC: Failed to created the epoll file descriptor\n\r");
+      exit(-2);
+   }
+   sdlc_evfd = eventfd(0, EFD_NONBLOCK);
+   event.events = EPOLLIN;
+   event.data.u32 = MAXSDLCLINES;      // Doorbell tag
+   if ((sdlc_evfd == -1) || (epoll_ctl(sdlc_epfd, EPOLL_CTL_ADD, sdlc_evfd, &event) == -1)) {
+      printf("\nSDLC: Scanner doorbell creation failed with error %s \n\r", strerror(errno));
+      exit(-3);
+   }
+
    for (int j = 0; j < MAXSDLCLINES; j++) {
       if ((sdlcline[j]->line_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
          printf("\nSDLC: Endpoint creation for 3274 failed with error %s ", strerror(errno));
@@ -329,38 +656,58 @@ void *SDLC_thread(void *arg) {
          exit(-1);
       }
       // Add polling events for the port
-      sdlcline[j]->epoll_fd = epoll_create(1);
-      if (sdlcline[j]->epoll_fd == -1) {
-         printf("\nSDLC: Failed to created the line-%d epoll file descriptor\n\r", j);
-         free(sdlcline[j]);
-         exit(-2);
-      }
       event.events = EPOLLIN;
-      event.data.fd = sdlcline[j]->line_fd;
-      if (epoll_ctl(sdlcline[j]->epoll_fd, EPOLL_CTL_ADD, sdlcline[j]->line_fd, &event) == -1) {
+      event.data.u32 = j;              // Line tag
+      if (epoll_ctl(sdlc_epfd, EPOLL_CTL_ADD, sdlcline[j]->line_fd, &event) == -1) {
          printf("\nSDLC: Add polling event failed for line-%d with error %s \n\r", j, strerror(errno));
-         close(sdlcline[j]->epoll_fd);
          free(sdlcline[j]);
          exit(-3);
       }
       printf("\rSDLC: line-%d ready, waiting for connection on TCP port %d\n\r", j, 37500 + LINEBASE + j );
    }
    //
-   //  Poll briefly for connect requests. If a connect request is received, proceed with connect/accept the request.
-   //  Next, check all active connection for input data.
+   //  Send the BLUs queued by the scanner, then wait for the scanner doorbell, PU data or a connect request.
+   //  If a connect request is received, proceed with connect/accept the request.
    //
    while (1) {
-      for (int k = 0; k < MAXSDLCLINES; k++) {
-         event_count = epoll_wait(sdlcline[k]->epoll_fd, events, 1, 50);
-         for (int i = 0; i < event_count; i++) {
-            sdlcline[k]->d3274_fd = accept(sdlcline[k]->line_fd, NULL, 0);
-            if (sdlcline[k]->d3274_fd < 1) {
-               printf("\nSDLC: accept failed for line-%d %s\n", k, strerror(errno));
-             } else {
-               printf("\rSDLC: PU connected to line-%d\n", k);
-            }  // End if sdlcline[k]->d3274_fd
-         }  // End for int i
-      }  // End for int k
+      SDLC_drain();
+      tmo = -1;                        // Wake up for the earliest poll timeout
+      now = SDLC_msec();
+      for (int j = 0; j < MAXSDLCLINES; j++) {
+         if (sdlcline[j]->poll == OFF)
+            continue;
+         left = (sdlcline[j]->poll_end > now) ? sdlcline[j]->poll_end - now : 0;
+         if ((tmo < 0) || (left < tmo))
+            tmo = left;
+      }
+      event_count = epoll_wait(sdlc_epfd, events, 2 * MAXSDLCLINES + 1, tmo);
+      for (int i = 0; i < event_count; i++) {
+         int k = events[i].data.u32;
+         if (k == MAXSDLCLINES) {      // Scanner doorbell ?
+            rc = read(sdlc_evfd, &kicks, sizeof(kicks));
+            continue;
+         }
+         if (k & PU_TAG) {             // Data from a PU ?
+            k &= ~PU_TAG;
+            if ((sdlcline[k]->d3274_fd > 0) && (ReadSDLC(k) > 0))
+               CS2_wakeup();           // Response for the scanner
+            continue;
+         }
+         rc = accept(sdlcline[k]->line_fd, NULL, 0);
+         if (rc < 1) {
+            printf("\nSDLC: accept failed for line-%d %s\n", k, strerror(errno));
+            continue;
+         }
+         if (sdlcline[k]->d3274_fd > 0)
+            if (SDLC_close(k) > 0)     // New PU replaces the old one
+               CS2_wakeup();
+         sdlcline[k]->d3274_fd = rc;
+         sdlcline[k]->stats.connects++;
+         event.events = EPOLLIN | EPOLLRDHUP;
+         event.data.u32 = PU_TAG | k;  // PU tag
+         epoll_ctl(sdlc_epfd, EPOLL_CTL_ADD, sdlcline[k]->d3274_fd, &event);
+         printf("\rSDLC: PU connected to line-%d\n", k);
+      }  // End for int i
    }  // End while(1)
 
    return NULL;
@@ -26,6 +26,9 @@
 #include "i3705_defs.h"
 
 extern DEVICE cpu_dev;
+extern DEVICE ca1_dev;
+extern DEVICE ca2_dev;
+extern DEVICE cs2_dev;
 extern UNIT cpu_unit;
 extern REG cpu_reg[];
 extern FILE *trace;        // DEBUG HJS
@@ -65,6 +68,9 @@ REG  *sim_PC = &cpu_reg[0];
 int32 sim_emax = 4;
 DEVICE *sim_devices[] = {
      &cpu_dev,
+     &ca1_dev,
+     &ca2_dev,
+     &cs2_dev,
      NULL };
 const char *sim_stop_messages[] = {
     "Unknown error",
@@ -23,6 +23,9 @@
 */
 
 /* General */
+#ifndef BUFLEN_3274
+#define BUFLEN_3274    65536           // SDLC line buffer, BLU or link records
+#endif
 #define RX             0       // Rx = client -> 3705
 #define TX             1       // Tx = 3705 -> client
 #define RESET          9       // Line in idle state
@@ -102,3 +105,84 @@
 #define FD2_RU_1     PIU+10
 #define FD2_RU_2     PIU+11
 
+/* SDLC line link protocol (TCP port 37500 + line number)
+   Every SDLC frame travels between the 3705 and the 3274 as one link
+   record. Flags are not sent: the length gives the end of the record.
+   |---0---+---1---+---2---+---3---|---4---//---n---|--n+1--+--n+2--|
+   |  Ver  | Type  | Length (H, L) | FAddr FCntl .. | FCS 1 | FCS 2 |
+   |-------+-------+-------+-------|------//--------|-------+-------|
+   Length counts the bytes after the header. The FCS is the SDLC
+   CRC-CCITT over address, control and information field, sent low
+   order byte first. Inside the 3705 and the 3274 a frame keeps its
+   BLU layout (7E .. 47 0F 7E), as shown above.
+   An attention record (type 02, length 0) is sent by the 3274 when it
+   has new work for the host: the 3705 then stops answering RR polls
+   on its behalf (poll spoofing).
+*/
+#define SLNK_VER       1               // Link protocol version
+#define SLNK_HDR       4               // Link record header length
+#define SLNK_FRAME     0x01            // Record type: SDLC frame
+#define SLNK_ATTN      0x02            // Record type: secondary has work
+#define SLNK_SHORT    -1               // Record not complete yet
+#define SLNK_BADFCS   -2               // FCS error, record skipped
+#define SLNK_BADHDR   -3               // Unknown version or type, link out of sync
+#define SLNK_GOTATTN  -4               // Attention record, no frame
+
+/* Frame check sequence (CRC-CCITT, x**16 + x**12 + x**5 + 1) */
+static inline uint16_t slnk_fcs(uint8_t *buf, int len) {
+   uint16_t fcs = 0xFFFF;
+
+   while (len-- > 0) {
+      fcs ^= *buf++;
+      for (int i = 0; i < 8; i++)
+         fcs = (fcs & 1) ? (fcs >> 1) ^ 0x8408 : fcs >> 1;
+   }
+   return ~fcs;
+}
+
+/* Build the link record for a BLU frame (7E .. 47 0F 7E) of Flen
+   bytes at rec. Returns the record length.                         */
+static inline int slnk_put(uint8_t *rec, uint8_t *frame, int Flen) {
+   int Dlen = Flen - 4;                // Address, control and I-field
+   uint16_t fcs = slnk_fcs(&frame[FAddr], Dlen);
+
+   rec[0] = SLNK_VER;
+   rec[1] = SLNK_FRAME;
+   rec[2] = (Dlen + 2) >> 8;
+   rec[3] = (Dlen + 2) & 0xFF;
+   memcpy(&rec[SLNK_HDR], &frame[FAddr], Dlen);
+   rec[SLNK_HDR + Dlen] = fcs & 0xFF;
+   rec[SLNK_HDR + Dlen + 1] = fcs >> 8;
+   return SLNK_HDR + Dlen + 2;
+}
+
+/* Take the link record from the avail bytes at rec and rebuild its
+   BLU frame (7E .. 47 0F 7E) at frame. *Rlen is set to the record
+   length. Returns the frame length or one of the SLNK_ codes. The
+   trailer bytes may occur in the I-field too, so the frame ends by
+   this length, never by searching for 47 0F 7E.                   */
+static inline int slnk_get(uint8_t *rec, int avail, uint8_t *frame, int *Rlen) {
+   int Dlen;
+
+   if (avail < SLNK_HDR)
+      return SLNK_SHORT;
+   if ((rec[0] == SLNK_VER) && (rec[1] == SLNK_ATTN) && (rec[2] == 0) && (rec[3] == 0)) {
+      *Rlen = SLNK_HDR;
+      return SLNK_GOTATTN;
+   }
+   Dlen = ((rec[2] << 8) | rec[3]) - 2;
+   if ((rec[0] != SLNK_VER) || (rec[1] != SLNK_FRAME) || (Dlen < 2))
+      return SLNK_BADHDR;
+   if (avail < SLNK_HDR + Dlen + 2)
+      return SLNK_SHORT;
+   *Rlen = SLNK_HDR + Dlen + 2;
+   if (slnk_fcs(&rec[SLNK_HDR], Dlen) != (rec[SLNK_HDR + Dlen] | (rec[SLNK_HDR + Dlen + 1] << 8)))
+      return SLNK_BADFCS;
+   frame[BFlag] = 0x7E;
+   memcpy(&frame[FAddr], &rec[SLNK_HDR], Dlen);
+   frame[FAddr + Dlen + 0] = 0x47;     // BLU trailer: FCS and EFlag
+   frame[FAddr + Dlen + 1] = 0x0F;
+   frame[FAddr + Dlen + 2] = 0x7E;
+   return Dlen + 4;
+}
+